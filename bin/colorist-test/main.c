@@ -79,7 +79,9 @@ int main(int argc, char * argv[])
     silentSystem.error = clContextSilentLogError;
 
     RUN_TESTS(test_coverage, "coverage", "Coverage");
+    RUN_TESTS(test_image, "image", "Image");
     RUN_TESTS(test_strings, "strings", "Image Strings");
+    RUN_TESTS(test_transform, "transform", "Transform");
 
     return 0;
 }
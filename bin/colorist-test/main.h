@@ -25,4 +25,6 @@ extern clContextSystem silentSystem;
 
 // Test suites, named after their associated .c file
 int test_coverage(void);
+int test_image(void);
 int test_strings(void);
+int test_transform(void);
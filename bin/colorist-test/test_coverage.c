@@ -7,6 +7,8 @@
 
 #include "main.h"
 
+#include "zlib.h"
+
 // ------------------------------------------------------------------------------------------------
 // The tests in here are to attempt to hit 100% code coverage (when running scripts/coverage.sh).
 // colorist-test shouldn't have to run any other test suites but test_coverage() to achieve this.
@@ -262,7 +264,7 @@ static void test_clContextParseArgs(void)
             // if (!filterNames[i])
             //     continue;
 
-            char description[128];
+            char description[256];
             char buffer[128];
             sprintf(buffer, "5,5,%s", filterNames[i]);
             sprintf(description, "Resize with %s", buffer);
@@ -336,6 +338,29 @@ static void test_clContextParseArgs(void)
         TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(argv)));
     }
 
+    {
+        // composite layers: options apply to the latest layer and the ones after it
+        const char * argv[] = { "colorist", "convert", "input.png", "output.png", "--composite-gamma", "1.5", "--composite", "a.png",
+                                "--composite", "b.png", "--composite-premultiplied", "--composite", "c.png", "--composite-gamma", "2.4" };
+        TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(argv)));
+        TEST_ASSERT_EQUAL_INT(3, C->params.compositeCount);
+        TEST_ASSERT_EQUAL_STRING("b.png", C->params.compositeFilenames[1]);
+        TEST_ASSERT_EQUAL_FLOAT(1.5f, C->params.compositeParams[0].gamma);
+        TEST_ASSERT_FALSE(C->params.compositeParams[0].premultiplied);
+        TEST_ASSERT_EQUAL_FLOAT(1.5f, C->params.compositeParams[1].gamma);
+        TEST_ASSERT_TRUE(C->params.compositeParams[1].premultiplied);
+        TEST_ASSERT_EQUAL_FLOAT(2.4f, C->params.compositeParams[2].gamma);
+        TEST_ASSERT_TRUE(C->params.compositeParams[2].premultiplied);
+    }
+
+    {
+        // too many composite layers
+        const char * argv[] = { "colorist", "convert", "input.png", "output.png", "--composite", "a.png", "--composite", "a.png",
+                                "--composite", "a.png", "--composite", "a.png", "--composite", "a.png", "--composite", "a.png",
+                                "--composite", "a.png", "--composite", "a.png", "--composite", "a.png" };
+        TEST_ASSERT_FALSE(clContextParseArgs(C, ARGS(argv)));
+    }
+
     {
         // unknown format
         const char * argv[] = { "colorist", "convert", "input.png", "output.png", "-f", "txt" };
@@ -607,6 +632,110 @@ static void test_clTask(void)
     clContextDestroy(C);
 }
 
+typedef struct ParallelForInfo
+{
+    clContext * C;
+    int * visits;
+    int nestedCount;
+} ParallelForInfo;
+
+static void parallelForVisit(void * userData, int start, int end)
+{
+    ParallelForInfo * info = (ParallelForInfo *)userData;
+    for (int i = start; i < end; ++i) {
+        ++info->visits[i];
+    }
+}
+
+static void parallelForNestedTask(void * userData)
+{
+    ParallelForInfo * info = (ParallelForInfo *)userData;
+    clTaskParallelFor(info->C, 4, info->nestedCount, 3, parallelForVisit, info);
+}
+
+static void parallelForNested(void * userData, int start, int end)
+{
+    ParallelForInfo * outer = (ParallelForInfo *)userData;
+    clContext * C = outer->C;
+    for (int i = start; i < end; ++i) {
+        int visits[50] = { 0 };
+        ParallelForInfo inner;
+        inner.C = C;
+        inner.visits = visits;
+        inner.nestedCount = 50;
+
+        // Waiting on work from inside a pool job must never deadlock
+        clTask * task = clTaskCreate(C, parallelForNestedTask, &inner);
+        clTaskDestroy(C, task);
+        int ok = 1;
+        for (int j = 0; j < 50; ++j) {
+            if (visits[j] != 1)
+                ok = 0;
+        }
+        outer->visits[i] += ok;
+    }
+}
+
+static void test_clTaskParallelFor(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // Force real worker threads even on single core machines
+    C->taskPool = clTaskPoolCreate(C, 3);
+
+    static const int counts[] = { 0, 1, 7, 1000, 100003 };
+    static const int chunkSizes[] = { 0, 1, 16, 4096, 1000000 };
+    static const int threadCounts[] = { 1, 2, 4, 64 };
+    int * visits = clAllocate(sizeof(int) * 100003);
+    for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); ++c) {
+        for (int k = 0; k < (int)(sizeof(chunkSizes) / sizeof(chunkSizes[0])); ++k) {
+            for (int t = 0; t < (int)(sizeof(threadCounts) / sizeof(threadCounts[0])); ++t) {
+                ParallelForInfo info;
+                info.C = C;
+                info.visits = visits;
+                info.nestedCount = 0;
+                memset(visits, 0, sizeof(int) * 100003);
+                clTaskParallelFor(C, threadCounts[t], counts[c], chunkSizes[k], parallelForVisit, &info);
+                for (int i = 0; i < counts[c]; ++i) {
+                    TEST_ASSERT_EQUAL_INT(1, visits[i]);
+                }
+            }
+        }
+    }
+
+    // Nested parallel work and tasks from inside pool jobs
+    {
+        ParallelForInfo info;
+        info.C = C;
+        info.visits = visits;
+        info.nestedCount = 0;
+        memset(visits, 0, sizeof(int) * 64);
+        clTaskParallelFor(C, 4, 64, 1, parallelForNested, &info);
+        for (int i = 0; i < 64; ++i) {
+            TEST_ASSERT_EQUAL_INT(1, visits[i]);
+        }
+    }
+    clFree(visits);
+
+    // A pool without workers runs everything on the calling thread
+    clTaskPoolDestroy(C, C->taskPool);
+    C->taskPool = clTaskPoolCreate(C, 0);
+    {
+        int smallVisits[10] = { 0 };
+        ParallelForInfo info;
+        info.C = C;
+        info.visits = smallVisits;
+        info.nestedCount = 0;
+        clTaskParallelFor(C, 8, 10, 1, parallelForVisit, &info);
+        for (int i = 0; i < 10; ++i) {
+            TEST_ASSERT_EQUAL_INT(1, smallVisits[i]);
+        }
+    }
+
+    clContextDestroy(C);
+}
+
 static void test_types(void)
 {
     clContext * C = clContextCreate(&silentSystem);
@@ -662,10 +791,202 @@ static void test_raw(void)
 
     clRawWriteFile(C, &raw, "test_raw.bin");
     clRawReadFile(C, &raw, "test_raw.bin");
+    TEST_ASSERT_FALSE(raw.mapped); // too small to be worth mapping
     clFileSize("test_raw.bin");
 
+    // Large files are mapped, and turn into ordinary allocations as soon as they are resized
+    clRawRealloc(C, &raw, 300 * 1024);
+    for (size_t i = 0; i < raw.size; ++i) {
+        raw.ptr[i] = (uint8_t)(i * 13);
+    }
+    clRawWriteFile(C, &raw, "test_raw.bin");
+    clRawFree(C, &raw);
+    TEST_ASSERT_TRUE(clRawReadFile(C, &raw, "test_raw.bin"));
+    TEST_ASSERT_TRUE(raw.mapped);
+    TEST_ASSERT_EQUAL_INT(300 * 1024, raw.size);
+    TEST_ASSERT_EQUAL_INT(13 * 1000 % 256, raw.ptr[1000]);
+    clRawDeflate(C, &deflated, &raw);
+    TEST_ASSERT_TRUE(deflated.size > 0);
+    clRawFree(C, &deflated);
+    TEST_ASSERT_TRUE(clRawReadFile(C, &raw, "test_raw.bin")); // replaces the existing mapping
+    TEST_ASSERT_TRUE(raw.mapped);
+    clRawRealloc(C, &raw, 400 * 1024);
+    TEST_ASSERT_FALSE(raw.mapped);
+    TEST_ASSERT_EQUAL_INT((13 * ((300 * 1024) - 1)) % 256, raw.ptr[(300 * 1024) - 1]);
+    raw.ptr[(400 * 1024) - 1] = 1; // writable now
+    clRawFree(C, &raw);
+    TEST_ASSERT_TRUE(clRawReadFile(C, &raw, "test_raw.bin"));
     clRawFree(C, &raw);
+    TEST_ASSERT_FALSE(raw.mapped);
+    TEST_ASSERT_NULL(raw.ptr);
+    TEST_ASSERT_FALSE(clRawReadFile(C, &raw, "test_raw_missing.bin"));
+
+    clContextDestroy(C);
+}
+
+// Plain byte-at-a-time Base64, to check the vectorized encoder against
+static char * referenceBase64(const uint8_t * in, size_t len)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char * out = malloc(((len + 2) / 3) * 4 + 1);
+    char * pos = out;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t group = (uint32_t)in[i] << 16;
+        if ((i + 1) < len)
+            group |= (uint32_t)in[i + 1] << 8;
+        if ((i + 2) < len)
+            group |= in[i + 2];
+        *pos++ = table[(group >> 18) & 63];
+        *pos++ = table[(group >> 12) & 63];
+        *pos++ = ((i + 1) < len) ? table[(group >> 6) & 63] : '=';
+        *pos++ = ((i + 2) < len) ? table[group & 63] : '=';
+    }
+    *pos = 0;
+    return out;
+}
+
+// Reads back everything written to f
+static char * readStream(FILE * f)
+{
+    long size = ftell(f);
+    char * text = malloc((size_t)size + 1);
+    rewind(f);
+    TEST_ASSERT_EQUAL_INT(size, (long)fread(text, 1, (size_t)size, f));
+    text[size] = 0;
+    return text;
+}
+
+static void test_rawStream(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+    C->taskPool = clTaskPoolCreate(C, 3);
+
+    // Every tail length, plus enough to span several deflate chunks and batches
+    static const size_t sizes[] = { 0, 1, 2, 3, 4, 5, 15, 16, 17, 200003, (32 * 128 * 1024) + 5000 };
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); ++i) {
+        clRaw raw = CL_RAW_EMPTY;
+        if (sizes[i]) {
+            clRawRealloc(C, &raw, sizes[i]);
+        }
+        for (size_t j = 0; j < raw.size; ++j) {
+            raw.ptr[j] = (uint8_t)((j * 7) ^ (j >> 5) ^ ((j * j) >> 11));
+        }
 
+        // Vectorized (if this CPU has it) and scalar Base64 both match the plain encoding, in memory and streamed
+        char * expected = referenceBase64(raw.ptr, raw.size);
+        for (int simd = 0; simd < 2; ++simd) {
+            C->base64SIMD = simd ? clRawBase64SIMDSupported() : clFalse;
+            char * b64 = clRawToBase64(C, &raw);
+            TEST_ASSERT_EQUAL_STRING(expected, b64);
+            clFree(b64);
+            FILE * f = tmpfile();
+            TEST_ASSERT_NOT_NULL(f);
+            TEST_ASSERT_TRUE(clRawWriteBase64(C, f, &raw));
+            char * streamed = readStream(f);
+            TEST_ASSERT_EQUAL_STRING(expected, streamed);
+            free(streamed);
+            fclose(f);
+        }
+        free(expected);
+
+        // Chunked deflate is a valid zlib stream, and doesn't depend on the task count
+        clRaw deflated = CL_RAW_EMPTY;
+        TEST_ASSERT_TRUE(clRawDeflate(C, &deflated, &raw));
+        for (int level = 0; level <= 9; level += 3) {
+            clRaw parallel = CL_RAW_EMPTY;
+            TEST_ASSERT_TRUE(clRawDeflateParallel(C, &parallel, &raw, (level == 6) ? CL_DEFLATE_LEVEL_DEFAULT : level, 4));
+            if (level == 6) {
+                TEST_ASSERT_EQUAL_INT(deflated.size, parallel.size);
+                TEST_ASSERT_EQUAL_MEMORY(deflated.ptr, parallel.ptr, deflated.size);
+            }
+            uLongf inflatedSize = (uLongf)raw.size + 1;
+            uint8_t * inflated = malloc(inflatedSize);
+            TEST_ASSERT_EQUAL_INT(Z_OK, uncompress(inflated, &inflatedSize, parallel.ptr, (uLong)parallel.size));
+            TEST_ASSERT_EQUAL_INT(raw.size, inflatedSize);
+            if (raw.size) {
+                TEST_ASSERT_EQUAL_MEMORY(raw.ptr, inflated, raw.size);
+            }
+            free(inflated);
+            clRawFree(C, &parallel);
+        }
+
+        // Streamed deflate + Base64 matches the in-memory version
+        expected = clRawToBase64(C, &deflated);
+        FILE * f = tmpfile();
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_TRUE(clRawWriteDeflatedBase64(C, f, &raw, CL_DEFLATE_LEVEL_DEFAULT, 4));
+        char * streamed = readStream(f);
+        TEST_ASSERT_EQUAL_STRING(expected, streamed);
+        free(streamed);
+        clFree(expected);
+        fclose(f);
+
+        clRawFree(C, &deflated);
+        clRawFree(C, &raw);
+    }
+
+    clContextDestroy(C);
+}
+
+static void test_rawStructArrayTiles(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+    C->taskPool = clTaskPoolCreate(C, 3);
+
+    static clStructArraySchema schema[] = { { "u16", "a" }, { "u16", "b" } };
+    const int width = 70;
+    const int height = 45;
+    const int tileSize = 32;
+    clRaw raw = CL_RAW_EMPTY;
+    clRawRealloc(C, &raw, (size_t)width * height * 4);
+    for (size_t i = 0; i < raw.size; ++i) {
+        raw.ptr[i] = (uint8_t)((i * 7) ^ (i >> 5));
+    }
+
+    // Build the expected tiles by hand: row-major tiles, each holding its own elements row-major
+    size_t expectedSize = 4096;
+    char * expected = malloc(expectedSize);
+    size_t expectedLen = (size_t)sprintf(expected, "{\"width\": %d, \"height\": %d, \"tileSize\": %d, \"tiles\": [", width, height, tileSize);
+    for (int tileY = 0; tileY < height; tileY += tileSize) {
+        for (int tileX = 0; tileX < width; tileX += tileSize) {
+            int columns = ((width - tileX) < tileSize) ? (width - tileX) : tileSize;
+            int rows = ((height - tileY) < tileSize) ? (height - tileY) : tileSize;
+            clRaw tile = CL_RAW_EMPTY;
+            clRaw deflated = CL_RAW_EMPTY;
+            clRawRealloc(C, &tile, (size_t)columns * rows * 4);
+            for (int j = 0; j < rows; ++j) {
+                memcpy(tile.ptr + ((size_t)j * columns * 4), raw.ptr + ((((size_t)(tileY + j) * width) + tileX) * 4), (size_t)columns * 4);
+            }
+            TEST_ASSERT_TRUE(clRawDeflate(C, &deflated, &tile));
+            char * b64 = clRawToBase64(C, &deflated);
+            size_t b64Len = strlen(b64);
+            while ((expectedLen + b64Len + 64) > expectedSize) {
+                expectedSize *= 2;
+                expected = realloc(expected, expectedSize);
+            }
+            expectedLen += (size_t)sprintf(expected + expectedLen, "%s\"%s\"", (tileX || tileY) ? ", " : "", b64);
+            clFree(b64);
+            clRawFree(C, &deflated);
+            clRawFree(C, &tile);
+        }
+    }
+    sprintf(expected + expectedLen, "], \"schema\": [{\"format\": \"u16\", \"name\": \"a\"}, {\"format\": \"u16\", \"name\": \"b\"}]}");
+
+    // Same tiles whether they are deflated on one task or several
+    for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+        FILE * f = tmpfile();
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_TRUE(clRawWriteStructArray(C, f, &raw, width, height, schema, 2, tileSize, CL_DEFLATE_LEVEL_DEFAULT, taskCount));
+        char * streamed = readStream(f);
+        TEST_ASSERT_EQUAL_STRING(expected, streamed);
+        free(streamed);
+        fclose(f);
+    }
+
+    free(expected);
+    clRawFree(C, &raw);
     clContextDestroy(C);
 }
 
@@ -684,9 +1005,12 @@ int test_coverage(void)
     RUN_TEST(test_debugDump);
     RUN_TEST(test_resize);
     RUN_TEST(test_clTask);
+    RUN_TEST(test_clTaskParallelFor);
     RUN_TEST(test_types);
     RUN_TEST(test_floorRound);
     RUN_TEST(test_raw);
+    RUN_TEST(test_rawStream);
+    RUN_TEST(test_rawStructArrayTiles);
 
     return UNITY_END();
 }
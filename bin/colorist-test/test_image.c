@@ -0,0 +1,1305 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "main.h"
+
+#include "colorist/transform.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A 4x4x4 Hald CLUT (8x8 image) that rotates the channels and darkens a bit
+static clImage * createHald(clContext * C)
+{
+    clImage * hald = clImageCreate(C, 8, 8, 16, NULL);
+    for (int i = 0; i < 64; ++i) {
+        int r = i % 4;
+        int g = (i / 4) % 4;
+        int b = i / 16;
+        hald->pixelsU16[(i * 4) + 0] = (uint16_t)(g * 20000);
+        hald->pixelsU16[(i * 4) + 1] = (uint16_t)(b * 20000);
+        hald->pixelsU16[(i * 4) + 2] = (uint16_t)(r * 20000);
+        hald->pixelsU16[(i * 4) + 3] = 65535;
+    }
+    return hald;
+}
+
+static clImage * runPipeline(clContext * C, clImage * srcImage, clProfile * dstProfile, clImage * compositeImage, clImage * hald, int bandHeight, int taskCount)
+{
+    clBlendParams blendParams;
+    clBlendParamsSetDefaults(C, &blendParams);
+
+    clImagePipeline * pipeline = clImagePipelineCreate(C, srcImage, 16, dstProfile, CL_TONEMAP_AUTO);
+    if (bandHeight > 0) {
+        pipeline->bandHeight = bandHeight;
+    }
+    TEST_ASSERT_TRUE(clImagePipelineAddComposite(C, pipeline, compositeImage, &blendParams));
+    clImagePipelineAddHALD(C, pipeline, hald, 4);
+    clImage * dstImage = clImagePipelineRun(C, pipeline, taskCount);
+    clImagePipelineDestroy(C, pipeline);
+    return dstImage;
+}
+
+static void test_pipeline_matches_stages(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries primaries = { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.329f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.4f };
+    clProfile * dstProfile = clProfileCreate(C, &primaries, &curve, 500, NULL);
+    clImage * srcImage = clImageParseString(C, "73x41,#ff000080..#00ff00ff,#0000ff..#ffffff", 16, NULL);
+    clImage * compositeImage = clImageParseString(C, "73x41,#ffffff00..#204060c0", 16, NULL);
+    clImage * hald = createHald(C);
+    clBlendParams blendParams;
+    clBlendParamsSetDefaults(C, &blendParams);
+
+    // One full-size stage after another
+    clImage * converted = clImageConvert(C, srcImage, 1, 16, dstProfile, CL_TONEMAP_AUTO);
+    clImage * blended = clImageBlend(C, converted, compositeImage, 1, &blendParams);
+    clImage * expected = clImageApplyHALD(C, blended, hald, 4);
+    clImageDestroy(C, blended);
+    clImageDestroy(C, converted);
+
+    // Any band height and thread count must produce the same pixels
+    static const int bandHeights[] = { 0, 1, 3, 7, 41, 1000 };
+    C->taskPool = clTaskPoolCreate(C, 3);
+    for (int i = 0; i < (int)(sizeof(bandHeights) / sizeof(bandHeights[0])); ++i) {
+        for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+            clImage * actual = runPipeline(C, srcImage, dstProfile, compositeImage, hald, bandHeights[i], taskCount);
+            TEST_ASSERT_EQUAL_INT(expected->depth, actual->depth);
+            TEST_ASSERT_TRUE(clProfileMatches(C, expected->profile, actual->profile));
+            TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(expected), CL_IMAGE_PIXELS(actual), expected->size);
+            clImageDestroy(C, actual);
+        }
+    }
+
+    // Mismatched composite dimensions are refused
+    {
+        clImage * small = clImageParseString(C, "10x10,#ffffff", 16, NULL);
+        clImagePipeline * pipeline = clImagePipelineCreate(C, srcImage, 16, dstProfile, CL_TONEMAP_AUTO);
+        TEST_ASSERT_FALSE(clImagePipelineAddComposite(C, pipeline, small, &blendParams));
+        clImagePipelineDestroy(C, pipeline);
+        clImageDestroy(C, small);
+    }
+
+    // No destination profile means sRGB, just like clImageCreate()
+    {
+        clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+        clImage * wide = clImageConvert(C, srcImage, 1, 16, dstProfile, CL_TONEMAP_AUTO);
+        clImage * explicitSRGB = clImageConvert(C, wide, 1, 8, srgb, CL_TONEMAP_AUTO);
+        clImage * defaultSRGB = clImageConvert(C, wide, 1, 8, NULL, CL_TONEMAP_AUTO);
+        TEST_ASSERT_EQUAL_INT(8, defaultSRGB->depth);
+        TEST_ASSERT_TRUE(clProfileMatches(C, srgb, defaultSRGB->profile));
+        TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(explicitSRGB), CL_IMAGE_PIXELS(defaultSRGB), explicitSRGB->size);
+        clImageDestroy(C, defaultSRGB);
+        clImageDestroy(C, explicitSRGB);
+        clImageDestroy(C, wide);
+        clProfileDestroy(C, srgb);
+    }
+
+    // Empty images have no bands to run
+    for (int i = 0; i < 2; ++i) {
+        clImage * empty = clImageCreate(C, i ? 5 : 0, i ? 0 : 5, 16, NULL);
+        clImage * emptyConverted = clImageConvert(C, empty, 4, 16, dstProfile, CL_TONEMAP_AUTO);
+        TEST_ASSERT_EQUAL_INT(empty->width, emptyConverted->width);
+        TEST_ASSERT_EQUAL_INT(empty->height, emptyConverted->height);
+        clImageDestroy(C, emptyConverted);
+        clImageDestroy(C, empty);
+    }
+
+    clImageDestroy(C, expected);
+    clImageDestroy(C, hald);
+    clImageDestroy(C, compositeImage);
+    clImageDestroy(C, srcImage);
+    clProfileDestroy(C, dstProfile);
+    clContextDestroy(C);
+}
+
+static void test_color_grade_histogram(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    static const char * imageStrings[] = {
+        "67x45,#000000..#ffffff,#ff0000..#0000ff",
+        "64x64,(0,0,0)..(4000,9000,12000)",
+        "31x7,#102030",
+    };
+    static const int depths[] = { 8, 10, 16 };
+    C->taskPool = clTaskPoolCreate(C, 3);
+    for (int i = 0; i < (int)(sizeof(imageStrings) / sizeof(imageStrings[0])); ++i) {
+        for (int j = 0; j < (int)(sizeof(depths) / sizeof(depths[0])); ++j) {
+            clImage * image = clImageParseString(C, imageStrings[i], depths[j], NULL);
+            TEST_ASSERT_NOT_NULL(image);
+            int pixelCount = image->width * image->height;
+            float * floatPixels = clAllocate(4 * sizeof(float) * pixelCount);
+            clImageRowsToFloat(C, image, 0, image->height, floatPixels);
+
+            for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+                int expectedLuminance = 0;
+                float expectedGamma = 0.0f;
+                clPixelMathColorGrade(C, taskCount, image->profile, floatPixels, pixelCount, image->width, 300, 10, &expectedLuminance, &expectedGamma, clFalse);
+
+                int luminance = 0;
+                float gamma = 0.0f;
+                clPixelMathColorGradeUNorm(C, taskCount, image->profile, CL_IMAGE_PIXELS(image), image->depth, pixelCount, image->width, 300, 10, &luminance, &gamma, clFalse);
+                TEST_ASSERT_EQUAL_INT(expectedLuminance, luminance);
+                TEST_ASSERT_EQUAL_FLOAT(expectedGamma, gamma);
+            }
+
+            clFree(floatPixels);
+            clImageDestroy(C, image);
+        }
+    }
+
+    // The same gradient at a few sizes: gammas 1.1 and 1.2 land within float rounding of each other here, so
+    // summing the error terms in any other order than clPixelMathColorGrade() does flips some of these picks
+    static const char * nearTieStrings[] = {
+        "596x423,(6,52,70)..(240,171,235)",
+        "512x512,(6,52,70)..(240,171,235)",
+        "640x360,(6,52,70)..(240,171,235)",
+    };
+    for (int i = 0; i < (int)(sizeof(nearTieStrings) / sizeof(nearTieStrings[0])); ++i) {
+        clImage * image = clImageParseString(C, nearTieStrings[i], 8, NULL);
+        TEST_ASSERT_NOT_NULL(image);
+        int pixelCount = image->width * image->height;
+        float * floatPixels = clAllocate(4 * sizeof(float) * pixelCount);
+        clImageRowsToFloat(C, image, 0, image->height, floatPixels);
+
+        int expectedLuminance = 0;
+        float expectedGamma = 0.0f;
+        clPixelMathColorGrade(C, 4, image->profile, floatPixels, pixelCount, image->width, 300, 10, &expectedLuminance, &expectedGamma, clFalse);
+        for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+            int luminance = 0;
+            float gamma = 0.0f;
+            clPixelMathColorGradeUNorm(C, taskCount, image->profile, CL_IMAGE_PIXELS(image), image->depth, pixelCount, image->width, 300, 10, &luminance, &gamma, clFalse);
+            TEST_ASSERT_EQUAL_INT(expectedLuminance, luminance);
+            TEST_ASSERT_EQUAL_FLOAT(expectedGamma, gamma);
+        }
+
+        clFree(floatPixels);
+        clImageDestroy(C, image);
+    }
+
+    // Codes past a 10-bit image's range (0xFFFF is what clImageCreate() leaves behind) grade as full scale
+    clImage * garbage = clImageParseString(C, "64x64,(0,0,0)..(400,900,1023)", 10, NULL);
+    clImage * clamped = clImageParseString(C, "64x64,(0,0,0)..(400,900,1023)", 10, NULL);
+    for (int i = 0; i < 64; ++i) {
+        uint16_t * pixel = &garbage->pixelsU16[i * 37 * 4];
+        pixel[i % 3] = (i & 1) ? 0xffff : 1024 + i;
+        clamped->pixelsU16[(i * 37 * 4) + (i % 3)] = 1023;
+    }
+    for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+        int expectedLuminance = 0;
+        float expectedGamma = 0.0f;
+        clPixelMathColorGradeUNorm(C, taskCount, clamped->profile, clamped->pixelsU16, 10, 64 * 64, 64, 300, 10, &expectedLuminance, &expectedGamma, clFalse);
+        int luminance = 0;
+        float gamma = 0.0f;
+        clPixelMathColorGradeUNorm(C, taskCount, garbage->profile, garbage->pixelsU16, 10, 64 * 64, 64, 300, 10, &luminance, &gamma, clFalse);
+        TEST_ASSERT_EQUAL_INT(expectedLuminance, luminance);
+        TEST_ASSERT_EQUAL_FLOAT(expectedGamma, gamma);
+    }
+    clImageDestroy(C, clamped);
+    clImageDestroy(C, garbage);
+
+    clContextDestroy(C);
+}
+
+static void test_depth_native_storage(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * image8 = clImageParseString(C, "37x11,#ff000080..#00ff00ff,#0000ff..#ffffff", 8, NULL);
+    clImage * image16 = clImageParseString(C, "37x11,#ff000080..#00ff00ff,#0000ff..#ffffff", 16, NULL);
+    TEST_ASSERT_EQUAL_INT(CL_PIXELFORMAT_U8, image8->pixelFormat);
+    TEST_ASSERT_EQUAL_INT(CL_PIXELFORMAT_U16, image16->pixelFormat);
+    TEST_ASSERT_NOT_NULL(image8->pixelsU8);
+    TEST_ASSERT_NULL(image8->pixelsU16);
+    TEST_ASSERT_EQUAL_INT(4, image8->pixelBytes);
+    TEST_ASSERT_EQUAL_INT(37 * 4, image8->stride);
+    TEST_ASSERT_EQUAL_INT(image16->size / 2, image8->size);
+
+    // Float round trips are lossless at either depth
+    int pixelCount = image8->width * image8->height;
+    float * floatPixels = clAllocate(4 * sizeof(float) * pixelCount);
+    clImage * copy8 = clImageCreate(C, image8->width, image8->height, 8, NULL);
+    clImageRowsToFloat(C, image8, 0, image8->height, floatPixels);
+    clImageRowsFromFloat(C, copy8, 0, copy8->height, floatPixels);
+    TEST_ASSERT_EQUAL_MEMORY(image8->pixelsU8, copy8->pixelsU8, image8->size);
+
+    // Pixel access goes through the 8-bit buffer
+    {
+        uint16_t pixel[4];
+        clImageGetPixel(C, image8, 0, 0, pixel);
+        TEST_ASSERT_EQUAL_INT(255, pixel[0]);
+        TEST_ASSERT_EQUAL_INT(0, pixel[1]);
+        TEST_ASSERT_EQUAL_INT(0, pixel[2]);
+        TEST_ASSERT_EQUAL_INT(128, pixel[3]);
+        clImageSetPixel(C, copy8, 3, 2, 1, 2, 3, 4);
+        TEST_ASSERT_EQUAL_UINT8(4, copy8->pixelsU8[(2 * copy8->stride) + (3 * 4) + 3]);
+    }
+
+    // Widening to 16 bits and narrowing back is lossless too
+    clImage * wide = clImageConvert(C, image8, 1, 16, image8->profile, CL_TONEMAP_OFF);
+    clImage * narrow = clImageConvert(C, wide, 1, 8, image8->profile, CL_TONEMAP_OFF);
+    TEST_ASSERT_EQUAL_INT(CL_PIXELFORMAT_U8, narrow->pixelFormat);
+    TEST_ASSERT_EQUAL_MEMORY(image8->pixelsU8, narrow->pixelsU8, image8->size);
+
+    clImageDestroy(C, narrow);
+    clImageDestroy(C, wide);
+    clImageDestroy(C, copy8);
+    clFree(floatPixels);
+    clImageDestroy(C, image16);
+    clImageDestroy(C, image8);
+    clContextDestroy(C);
+}
+
+static void test_image_views(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries primaries = { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.329f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.4f };
+    clProfile * dstProfile = clProfileCreate(C, &primaries, &curve, 500, NULL);
+    static const int depths[] = { 8, 16 };
+    for (int d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); ++d) {
+        clImage * image = clImageParseString(C, "64x48,#ff000080..#00ff00ff,#0000ff..#ffffff", depths[d], NULL);
+        clImage * view = clImageCreateView(C, image, 20, 10, 9, 7);
+        clImage * copy = clImageCrop(C, image, 20, 10, 9, 7, clTrue);
+        TEST_ASSERT_NOT_NULL(view);
+        TEST_ASSERT_EQUAL_INT(9, view->width);
+        TEST_ASSERT_EQUAL_INT(7, view->height);
+        TEST_ASSERT_EQUAL_INT(image->stride, view->stride);
+        TEST_ASSERT_FALSE(CL_IMAGE_IS_PACKED(view));
+        TEST_ASSERT_TRUE(CL_IMAGE_IS_PACKED(copy));
+        TEST_ASSERT_EQUAL_PTR(CL_IMAGE_ROW(image, 10) + (20 * image->pixelBytes), CL_IMAGE_PIXELS(view));
+
+        // A packed view copies, a packed image doesn't
+        clImage * packed = clImagePack(C, view);
+        TEST_ASSERT_TRUE(packed != view);
+        TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(copy), CL_IMAGE_PIXELS(packed), copy->size);
+        clImageDestroy(C, packed);
+        TEST_ASSERT_EQUAL_PTR(copy, clImagePack(C, copy));
+
+        // Stages read views exactly like the equivalent copy
+        clImage * expected = clImageConvert(C, copy, 1, 16, dstProfile, CL_TONEMAP_AUTO);
+        clImage * actual = clImageConvert(C, view, 1, 16, dstProfile, CL_TONEMAP_AUTO);
+        TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(expected), CL_IMAGE_PIXELS(actual), expected->size);
+        clImageDestroy(C, actual);
+        clImageDestroy(C, expected);
+
+        expected = clImageResize(C, copy, 13, 5, CL_FILTER_MITCHELL);
+        actual = clImageResize(C, view, 13, 5, CL_FILTER_MITCHELL);
+        TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(expected), CL_IMAGE_PIXELS(actual), expected->size);
+        clImageDestroy(C, actual);
+        clImageDestroy(C, expected);
+
+        static const char * formatNames[] = { "bmp", "jpg", "png", "tiff", "webp" }; // apg output differs run to run
+        for (int f = 0; f < (int)(sizeof(formatNames) / sizeof(formatNames[0])); ++f) {
+            clFormat * format = clContextFindFormat(C, formatNames[f]);
+            clWriteParams writeParams;
+            clRaw expectedRaw = CL_RAW_EMPTY;
+            clRaw actualRaw = CL_RAW_EMPTY;
+            TEST_ASSERT_NOT_NULL(format);
+            if ((depths[d] != 8) && !strcmp(formatNames[f], "bmp")) {
+                continue;
+            }
+            clWriteParamsSetDefaults(C, &writeParams);
+            TEST_ASSERT_TRUE(format->writeFunc(C, copy, formatNames[f], &expectedRaw, &writeParams));
+            TEST_ASSERT_TRUE(format->writeFunc(C, view, formatNames[f], &actualRaw, &writeParams));
+            TEST_ASSERT_EQUAL_INT_MESSAGE(expectedRaw.size, actualRaw.size, formatNames[f]);
+            TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expectedRaw.ptr, actualRaw.ptr, expectedRaw.size, formatNames[f]);
+            clRawFree(C, &actualRaw);
+            clRawFree(C, &expectedRaw);
+        }
+
+        clImageDestroy(C, copy);
+        clImageDestroy(C, view);
+
+        // Cropping without keeping the source hands the source to the view
+        clImage * cropped = clImageCrop(C, image, 1, 2, 3, 4, clFalse);
+        TEST_ASSERT_EQUAL_PTR(image, cropped->parent);
+        TEST_ASSERT_TRUE(cropped->ownsParent);
+        clImageDestroy(C, cropped);
+    }
+
+    clProfileDestroy(C, dstProfile);
+    clContextDestroy(C);
+}
+
+static void test_resize_bands(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    static const int depths[] = { 8, 12, 16 };
+    static const clFilter filters[] = { CL_FILTER_AUTO, CL_FILTER_BOX, CL_FILTER_TRIANGLE, CL_FILTER_CUBICBSPLINE, CL_FILTER_CATMULLROM, CL_FILTER_MITCHELL, CL_FILTER_NEAREST };
+    static const int sizes[][2] = { { 150, 90 }, { 31, 17 }, { 200, 7 }, { 1, 1 }, { 67, 45 } };
+    C->taskPool = clTaskPoolCreate(C, 3);
+    for (int d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); ++d) {
+        clImage * image = clImageParseString(C, "67x45,#ff000080..#00ff00ff,#0000ff..#ffffff", depths[d], NULL);
+        for (int f = 0; f < (int)(sizeof(filters) / sizeof(filters[0])); ++f) {
+            clResizeBuffer src;
+            src.pixels = CL_IMAGE_PIXELS(image);
+            src.stride = image->stride;
+            src.depth = image->depth;
+
+            for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s) {
+                // Any thread count must produce the same pixels
+                clImage * expected = clImageCreate(C, sizes[s][0], sizes[s][1], image->depth, image->profile);
+                clImage * actual = clImageCreate(C, sizes[s][0], sizes[s][1], image->depth, image->profile);
+                clResizePlan * plan = clPixelMathResizePlanCreate(C, image->width, image->height, sizes[s][0], sizes[s][1], filters[f]);
+                clResizeBuffer dst;
+                dst.pixels = CL_IMAGE_PIXELS(expected);
+                dst.stride = expected->stride;
+                dst.depth = expected->depth;
+                clPixelMathResizeRun(C, plan, 1, &src, &dst);
+                dst.pixels = CL_IMAGE_PIXELS(actual);
+                clPixelMathResizeRun(C, plan, 4, &src, &dst);
+                clPixelMathResizePlanDestroy(C, plan);
+                TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(expected), CL_IMAGE_PIXELS(actual), expected->size);
+
+                // Resizing to the same size is exact for filters without negative lobes
+                if ((sizes[s][0] == image->width) && (sizes[s][1] == image->height) &&
+                    ((filters[f] == CL_FILTER_BOX) || (filters[f] == CL_FILTER_TRIANGLE) || (filters[f] == CL_FILTER_NEAREST))) {
+                    TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(image), CL_IMAGE_PIXELS(actual), image->size);
+                }
+                clImageDestroy(C, actual);
+                clImageDestroy(C, expected);
+            }
+        }
+        clImageDestroy(C, image);
+    }
+
+    // A flat color stays flat in both directions
+    {
+        clImage * flat = clImageParseString(C, "40x30,#336699", 16, NULL);
+        clImage * up = clImageResize(C, flat, 97, 61, CL_FILTER_AUTO);
+        clImage * down = clImageResize(C, flat, 9, 5, CL_FILTER_AUTO);
+        uint16_t expected[4];
+        uint16_t pixel[4];
+        clImageGetPixel(C, flat, 0, 0, expected);
+        for (int j = 0; j < up->height; ++j) {
+            for (int i = 0; i < up->width; ++i) {
+                clImageGetPixel(C, up, i, j, pixel);
+                TEST_ASSERT_EQUAL_MEMORY(expected, pixel, sizeof(pixel));
+            }
+        }
+        for (int j = 0; j < down->height; ++j) {
+            for (int i = 0; i < down->width; ++i) {
+                clImageGetPixel(C, down, i, j, pixel);
+                TEST_ASSERT_EQUAL_MEMORY(expected, pixel, sizeof(pixel));
+            }
+        }
+        clImageDestroy(C, down);
+        clImageDestroy(C, up);
+        clImageDestroy(C, flat);
+    }
+
+    clContextDestroy(C);
+}
+
+static void test_hald_tetrahedral(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // An identity lattice reproduces any color, and alpha passes through
+    {
+        static const int dims = 5;
+        float * haldPixels = clAllocate(4 * sizeof(float) * dims * dims * dims);
+        for (int i = 0; i < (dims * dims * dims); ++i) {
+            haldPixels[(i * 4) + 0] = (float)(i % dims) / (dims - 1);
+            haldPixels[(i * 4) + 1] = (float)((i / dims) % dims) / (dims - 1);
+            haldPixels[(i * 4) + 2] = (float)(i / (dims * dims)) / (dims - 1);
+            haldPixels[(i * 4) + 3] = 1.0f;
+        }
+        clHaldCLUT * clut = clHaldCLUTCreate(C, haldPixels, dims);
+        clFree(haldPixels);
+
+        static const float colors[][4] = {
+            { 0.0f, 0.0f, 0.0f, 1.0f }, { 1.0f, 1.0f, 1.0f, 0.5f }, { 0.1f, 0.7f, 0.3f, 0.25f },
+            { 0.9f, 0.2f, 0.6f, 0.0f }, { 0.5f, 0.5f, 0.1f, 1.0f }, { 0.33f, 0.12f, 0.81f, 0.75f },
+        };
+        int colorCount = (int)(sizeof(colors) / sizeof(colors[0]));
+        float pixels[sizeof(colors) / sizeof(colors[0])][4];
+        memcpy(pixels, colors, sizeof(colors));
+        clPixelMathHaldCLUTApply(C, clut, &pixels[0][0], &pixels[0][0], colorCount);
+        for (int i = 0; i < colorCount; ++i) {
+            for (int c = 0; c < 4; ++c) {
+                TEST_ASSERT_FLOAT_WITHIN(0.00001f, colors[i][c], pixels[i][c]);
+            }
+        }
+        clHaldCLUTDestroy(C, clut);
+    }
+
+    // Colors on lattice points come out exactly as stored
+    {
+        clImage * hald = createHald(C);
+        float * haldPixels = clAllocate(4 * sizeof(float) * 64);
+        clImageRowsToFloat(C, hald, 0, hald->height, haldPixels);
+        clHaldCLUT * clut = clHaldCLUTCreate(C, haldPixels, 4);
+        for (int i = 0; i < 64; ++i) {
+            float src[4] = { (float)(i % 4) / 3, (float)((i / 4) % 4) / 3, (float)(i / 16) / 3, 1.0f };
+            float dst[4];
+            clPixelMathHaldCLUTApply(C, clut, src, dst, 1);
+            TEST_ASSERT_EQUAL_FLOAT(haldPixels[(i * 4) + 0], dst[0]);
+            TEST_ASSERT_EQUAL_FLOAT(haldPixels[(i * 4) + 1], dst[1]);
+            TEST_ASSERT_EQUAL_FLOAT(haldPixels[(i * 4) + 2], dst[2]);
+        }
+        clHaldCLUTDestroy(C, clut);
+        clFree(haldPixels);
+        clImageDestroy(C, hald);
+    }
+
+    clContextDestroy(C);
+}
+
+static void test_blend_kernel(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // The blend kernel matches the SourceOver formulas exactly
+    {
+        static const int pixelCount = 37;
+        float srcPixels[37 * 4];
+        float cmpPixels[37 * 4];
+        float dstPixels[37 * 4];
+        for (int i = 0; i < (pixelCount * 4); ++i) {
+            srcPixels[i] = (float)((i * 7919) % 1000) / 999.0f;
+            cmpPixels[i] = (float)((i * 104729) % 1000) / 999.0f;
+        }
+        for (int premultiplied = 0; premultiplied < 2; ++premultiplied) {
+            clPixelMathBlend(C, srcPixels, cmpPixels, dstPixels, pixelCount, premultiplied ? clTrue : clFalse);
+            for (int i = 0; i < pixelCount; ++i) {
+                const float * s = &srcPixels[i * 4];
+                const float * c = &cmpPixels[i * 4];
+                for (int ch = 0; ch < 3; ++ch) {
+                    float expected = premultiplied ? (c[ch] + (s[ch] * (1 - c[3]))) : ((c[ch] * c[3]) + (s[ch] * s[3] * (1 - c[3])));
+                    TEST_ASSERT_EQUAL_FLOAT(expected, dstPixels[(i * 4) + ch]);
+                }
+                TEST_ASSERT_EQUAL_FLOAT(c[3] + (s[3] * (1 - c[3])), dstPixels[(i * 4) + 3]);
+            }
+        }
+    }
+
+    // Bands under a fully opaque part of the composite skip the source, with identical results
+    {
+        clImage * srcImage = clImageParseString(C, "40x20,#ff000080..#00ff00ff,#0000ff..#ffffff", 16, NULL);
+        clImage * compositeImage = clImageParseString(C, "40x20,#204060ff..#c08040ff", 16, NULL);
+        for (int y = 15; y < 20; ++y) {
+            for (int x = 0; x < 40; ++x) {
+                clImageSetPixel(C, compositeImage, x, y, 1000 * x, 3000 * y, 20000, 30000);
+            }
+        }
+        clBlendParams blendParams;
+        clBlendParamsSetDefaults(C, &blendParams);
+        clImage * expected = NULL;
+        for (int bandHeight = 1; bandHeight <= 20; bandHeight += 19) {
+            clImagePipeline * pipeline = clImagePipelineCreateCopy(C, srcImage);
+            pipeline->bandHeight = bandHeight;
+            TEST_ASSERT_TRUE(clImagePipelineAddComposite(C, pipeline, compositeImage, &blendParams));
+            clImage * actual = clImagePipelineRun(C, pipeline, 1);
+            clImagePipelineDestroy(C, pipeline);
+            if (expected) {
+                TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(expected), CL_IMAGE_PIXELS(actual), expected->size);
+                clImageDestroy(C, actual);
+            } else {
+                expected = actual;
+            }
+        }
+        clImageDestroy(C, expected);
+        clImageDestroy(C, compositeImage);
+        clImageDestroy(C, srcImage);
+    }
+
+    clContextDestroy(C);
+}
+
+static void test_blend_layers(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * srcImage = clImageParseString(C, "53x29,#ff000080..#00ff00ff,#0000ff..#ffffff", 16, NULL);
+    clImage * compositeImages[3];
+    compositeImages[0] = clImageParseString(C, "53x29,#ffffff00..#204060c0", 16, NULL);
+    compositeImages[1] = clImageParseString(C, "53x29,#80808080", 8, NULL);
+    compositeImages[2] = clImageParseString(C, "53x29,#00000000..#ff00ff40,#40ff0060..#ffffffff", 16, NULL);
+    clBlendParams blendParams[3];
+    for (int i = 0; i < 3; ++i) {
+        clBlendParamsSetDefaults(C, &blendParams[i]);
+    }
+    blendParams[1].gamma = 1.0f;
+    blendParams[2].premultiplied = clTrue;
+
+    // One pass over every layer matches blending them one at a time
+    clImage * expected = clImageBlend(C, srcImage, compositeImages[0], 1, &blendParams[0]);
+    for (int i = 1; i < 3; ++i) {
+        clImage * blended = clImageBlend(C, expected, compositeImages[i], 1, &blendParams[i]);
+        clImageDestroy(C, expected);
+        expected = blended;
+    }
+    C->taskPool = clTaskPoolCreate(C, 3);
+    for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+        clImage * actual = clImageBlendLayers(C, srcImage, 3, compositeImages, blendParams, taskCount);
+        TEST_ASSERT_NOT_NULL(actual);
+        TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_PIXELS(expected), CL_IMAGE_PIXELS(actual), expected->size);
+        clImageDestroy(C, actual);
+    }
+
+    // There's a limit to how many layers a pipeline holds
+    {
+        clImagePipeline * pipeline = clImagePipelineCreateCopy(C, srcImage);
+        for (int i = 0; i < CL_MAX_COMPOSITE_LAYERS; ++i) {
+            TEST_ASSERT_TRUE(clImagePipelineAddComposite(C, pipeline, compositeImages[i % 3], &blendParams[i % 3]));
+        }
+        TEST_ASSERT_FALSE(clImagePipelineAddComposite(C, pipeline, compositeImages[0], &blendParams[0]));
+        clImagePipelineDestroy(C, pipeline);
+    }
+
+    clImageDestroy(C, expected);
+    for (int i = 0; i < 3; ++i) {
+        clImageDestroy(C, compositeImages[i]);
+    }
+    clImageDestroy(C, srcImage);
+    clContextDestroy(C);
+}
+
+static void test_image_compare(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    C->taskPool = clTaskPoolCreate(C, 3);
+    static const int depths[] = { 8, 16 };
+    for (int d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); ++d) {
+        clImage * image1 = clImageParseString(C, "61x50,#ff000080..#00ff00ff,#0000ff..#ffffff", depths[d], NULL);
+        clImage * image2 = clImageParseString(C, "61x50,#ff000080..#00ff00ff,#0000ff..#ffffff", depths[d], NULL);
+        clImage * other = clImageParseString(C, "61x49,#000000", depths[d], NULL);
+        int small = 2;
+        int large = 40;
+        clImageSetPixel(C, image2, 3, 1, 0, 0, 0, 255); // far over any threshold below
+        clImageSetPixel(C, image2, 60, 49, 0, 0, 0, 0);  // also over
+        uint16_t pixel[4];
+        clImageGetPixel(C, image1, 30, 20, pixel);
+        clImageSetPixel(C, image2, 30, 20, pixel[0], pixel[1], pixel[2] + small, pixel[3]);
+        clImageGetPixel(C, image1, 10, 45, pixel);
+        clImageSetPixel(C, image2, 10, 45, pixel[0], pixel[1] + large, pixel[2], pixel[3]);
+
+        for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+            clImageCompareStats stats;
+            TEST_ASSERT_TRUE(clImageCompare(C, image1, image2, taskCount, small, &stats));
+            TEST_ASSERT_EQUAL_INT(61 * 50, stats.pixelCount);
+            TEST_ASSERT_EQUAL_INT(1, stats.underThresholdCount);
+            TEST_ASSERT_EQUAL_INT(stats.pixelCount - 4, stats.matchCount);
+            TEST_ASSERT_EQUAL_INT(3, stats.overThresholdCount);
+
+            // The visualization path agrees with the counts
+            clImageDiff * diff = clImageDiffCreate(C, image1, image2, taskCount, 0.1f, small);
+            TEST_ASSERT_NOT_NULL(diff);
+            TEST_ASSERT_EQUAL_INT(stats.matchCount, diff->matchCount);
+            TEST_ASSERT_EQUAL_INT(stats.underThresholdCount, diff->underThresholdCount);
+            TEST_ASSERT_EQUAL_INT(stats.overThresholdCount, diff->overThresholdCount);
+            TEST_ASSERT_EQUAL_INT(stats.largestChannelDiff, diff->largestChannelDiff);
+            clImageDiffDestroy(C, diff);
+
+            TEST_ASSERT_TRUE(clImageIdentical(C, image1, image1, taskCount, 0));
+            TEST_ASSERT_FALSE(clImageIdentical(C, image1, image2, taskCount, large));
+            TEST_ASSERT_FALSE(clImageIdentical(C, image1, other, taskCount, 65535));
+            TEST_ASSERT_FALSE(clImageCompare(C, image1, other, taskCount, 0, &stats));
+        }
+
+        clImageDestroy(C, other);
+        clImageDestroy(C, image2);
+        clImageDestroy(C, image1);
+    }
+
+    clContextDestroy(C);
+}
+
+static void test_signals(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * srcImage = clImageParseString(C, "96x80,#ff0000..#0000ff,#00ff00..#ffffff", 16, NULL);
+
+    // Round trip through an in-memory encode
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    writeParams.quality = 30;
+    clRaw output = CL_RAW_EMPTY;
+    TEST_ASSERT_TRUE(clContextWriteRaw(C, srcImage, "jpg", &writeParams, &output));
+    clImage * dstImage = clContextReadRaw(C, &output, "jpg");
+    TEST_ASSERT_NOT_NULL(dstImage);
+    clRawFree(C, &output);
+
+    C->taskPool = clTaskPoolCreate(C, 3);
+    clImageSignals expected;
+    TEST_ASSERT_TRUE(clImageCalcSignalsSSIM(C, 1, srcImage, dstImage, &expected));
+    TEST_ASSERT_TRUE(expected.mseLinear > 0.0f);
+    TEST_ASSERT_TRUE(expected.psnrG22 > 10.0f);
+    TEST_ASSERT_TRUE(expected.psnrG22 < 60.0f);
+    TEST_ASSERT_TRUE((expected.ssim > 0.5f) && (expected.ssim < 1.0f));
+    TEST_ASSERT_TRUE((expected.msssim > 0.5f) && (expected.msssim < 1.0f));
+
+    // Per-slice sums are combined in a fixed order, so any thread count gives the same answer
+    clImageSignals signals;
+    TEST_ASSERT_TRUE(clImageCalcSignalsSSIM(C, 4, srcImage, dstImage, &signals));
+    TEST_ASSERT_EQUAL_MEMORY(&expected, &signals, sizeof(signals));
+
+    // Without SSIM, the same pass leaves it out
+    TEST_ASSERT_TRUE(clImageCalcSignals(C, 4, srcImage, dstImage, &signals));
+    TEST_ASSERT_EQUAL_FLOAT(expected.mseLinear, signals.mseLinear);
+    TEST_ASSERT_EQUAL_FLOAT(expected.psnrG22, signals.psnrG22);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, signals.ssim);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, signals.msssim);
+
+    // Identical images are a perfect match
+    TEST_ASSERT_TRUE(clImageCalcSignalsSSIM(C, 4, srcImage, srcImage, &signals));
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, signals.mseG22);
+    TEST_ASSERT_TRUE(isinf(signals.psnrG22));
+    TEST_ASSERT_FLOAT_WITHIN(0.0001f, 1.0f, signals.ssim);
+    TEST_ASSERT_FLOAT_WITHIN(0.0001f, 1.0f, signals.msssim);
+
+    clImageDestroy(C, dstImage);
+    clImageDestroy(C, srcImage);
+    clContextDestroy(C);
+}
+
+static void test_srgb_highlight(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries primaries = { { 0.708f, 0.292f }, { 0.170f, 0.797f }, { 0.131f, 0.046f }, { 0.3127f, 0.329f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.2f };
+    clProfile * profile = clProfileCreate(C, &primaries, &curve, 1000, NULL);
+    clImage * srcImage = clImageParseString(C, "67x45,#ff0000..#00ff00,#000000..#ffffff", 16, profile);
+    clImageSetPixel(C, srcImage, 0, srcImage->height - 1, 0, 0, 0, 65535);
+
+    clImageSRGBHighlightStats expected;
+    clImageSRGBHighlightPixelInfo * pixelInfo = clImageSRGBHighlightPixelInfoCreate(C, srcImage->width * srcImage->height);
+    C->params.jobs = 1;
+    clImage * expectedHighlight = clImageCreateSRGBHighlight(C, srcImage, 100, &expected, pixelInfo, NULL);
+    TEST_ASSERT_EQUAL_INT(srcImage->width * srcImage->height, expected.pixelCount);
+    TEST_ASSERT_TRUE(expected.overbrightPixelCount + expected.bothPixelCount > 0);
+    TEST_ASSERT_TRUE(expected.outOfGamutPixelCount + expected.bothPixelCount > 0);
+    TEST_ASSERT_EQUAL_INT(expected.overbrightPixelCount + expected.outOfGamutPixelCount + expected.bothPixelCount, expected.hdrPixelCount);
+    TEST_ASSERT_TRUE(expected.brightestPixelNits > 100.0f);
+
+    // The top left pixel is the red primary, which peaks at the red row of the RGB -> XYZ matrix
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.708f, pixelInfo->pixels[0].x);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.292f, pixelInfo->pixels[0].y);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, 26.27f, pixelInfo->pixels[0].maxNits);
+    TEST_ASSERT_EQUAL_FLOAT(1.0f, pixelInfo->pixels[0].outOfGamut);
+
+    // Black has no chromaticity and reports the white point
+    clImageSRGBHighlightPixel * black = &pixelInfo->pixels[(srcImage->height - 1) * srcImage->width];
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, black->nits);
+    TEST_ASSERT_EQUAL_FLOAT(0.3127f, black->x);
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, black->outOfGamut);
+
+    // Slices are independent, so threading doesn't change the highlight
+    C->taskPool = clTaskPoolCreate(C, 3);
+    C->params.jobs = 4;
+    clImageSRGBHighlightStats stats;
+    clImage * highlight = clImageCreateSRGBHighlight(C, srcImage, 100, &stats, NULL, NULL);
+    TEST_ASSERT_EQUAL_MEMORY(&expected, &stats, sizeof(stats));
+    TEST_ASSERT_EQUAL_MEMORY(expectedHighlight->pixelsU8, highlight->pixelsU8, (size_t)srcImage->width * srcImage->height * 4);
+    clImageDestroy(C, highlight);
+
+    // Nothing in an sRGB image is outside of sRGB
+    clImage * srgbImage = clImageParseString(C, "67x45,#ff0000..#00ff00,#000000..#ffffff", 16, NULL);
+    highlight = clImageCreateSRGBHighlight(C, srgbImage, C->defaultLuminance, &stats, NULL, NULL);
+    TEST_ASSERT_EQUAL_INT(0, stats.hdrPixelCount);
+    clImageDestroy(C, highlight);
+    clImageDestroy(C, srgbImage);
+
+    clImageDestroy(C, expectedHighlight);
+    clImageSRGBHighlightPixelInfoDestroy(C, pixelInfo);
+    clImageDestroy(C, srcImage);
+    clProfileDestroy(C, profile);
+    clContextDestroy(C);
+}
+
+// Streams image through a format's writer and reader in bands of bandHeight rows, checking the encoded
+// bytes and decoded pixels against the whole-image writer and reader
+static void checkStreaming(clContext * C, clImage * image, const char * formatName, int bandHeight)
+{
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    clRaw expected = CL_RAW_EMPTY;
+    TEST_ASSERT_TRUE(clContextWriteRaw(C, image, formatName, &writeParams, &expected));
+    clImage * expectedImage = clContextReadRaw(C, &expected, formatName);
+    TEST_ASSERT_NOT_NULL(expectedImage);
+
+    clImage * band = clImageCreate(C, image->width, bandHeight, image->depth, image->profile);
+    size_t rowBytes = (size_t)image->width * image->pixelBytes;
+
+    FILE * f = tmpfile();
+    TEST_ASSERT_NOT_NULL(f);
+    clFormatWriter * writer = clContextWriteBegin(C, formatName, image->width, image->height, image->depth, image->profile, f, &writeParams);
+    TEST_ASSERT_NOT_NULL(writer);
+    for (int y = 0; y < image->height; y += bandHeight) {
+        int rowCount = ((image->height - y) < bandHeight) ? (image->height - y) : bandHeight;
+        for (int j = 0; j < rowCount; ++j) {
+            memcpy(CL_IMAGE_ROW(band, j), CL_IMAGE_ROW(image, y + j), rowBytes);
+        }
+        TEST_ASSERT_TRUE(writer->writeRows(C, writer, band, rowCount));
+    }
+    TEST_ASSERT_TRUE(writer->finish(C, writer));
+    writer->destroy(C, writer);
+
+    clRaw streamed = CL_RAW_EMPTY;
+    fseek(f, 0, SEEK_END);
+    clRawRealloc(C, &streamed, (size_t)ftell(f));
+    rewind(f);
+    TEST_ASSERT_EQUAL_INT(1, (int)fread(streamed.ptr, streamed.size, 1, f));
+    fclose(f);
+    TEST_ASSERT_EQUAL_INT(expected.size, streamed.size);
+    TEST_ASSERT_EQUAL_MEMORY(expected.ptr, streamed.ptr, expected.size);
+
+    clFormat * format = clContextFindFormat(C, formatName);
+    clFormatReader * reader = format->readBeginFunc(C, formatName, NULL, &streamed, NULL);
+    TEST_ASSERT_NOT_NULL(reader);
+    TEST_ASSERT_EQUAL_INT(image->width, reader->width);
+    TEST_ASSERT_EQUAL_INT(image->height, reader->height);
+    TEST_ASSERT_EQUAL_INT(expectedImage->depth, reader->depth);
+    for (int y = 0; y < image->height; y += bandHeight) {
+        int rowCount = ((image->height - y) < bandHeight) ? (image->height - y) : bandHeight;
+        TEST_ASSERT_TRUE(reader->readRows(C, reader, band, rowCount));
+        for (int j = 0; j < rowCount; ++j) {
+            TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_ROW(expectedImage, y + j), CL_IMAGE_ROW(band, j), rowBytes);
+        }
+    }
+    reader->destroy(C, reader);
+
+    clRawFree(C, &streamed);
+    clRawFree(C, &expected);
+    clImageDestroy(C, band);
+    clImageDestroy(C, expectedImage);
+}
+
+// The brightest Y at a chromaticity, straight from the primaries: Y / max(R, G, B) of its linear RGB
+static float referenceMaxY(clContext * C, clProfilePrimaries * primaries, float x, float y)
+{
+    gbMat3 toXYZ, fromXYZ;
+    clTransformDeriveXYZMatrix(C, primaries, &toXYZ);
+    gb_mat3_inverse(&fromXYZ, &toXYZ);
+    gb_mat3_transpose(&fromXYZ);
+
+    const float xyz[3] = { x / y, 1.0f, (1.0f - x - y) / y };
+    float maxChannel = 0.0f;
+    for (int row = 0; row < 3; ++row) {
+        const float * m = &fromXYZ.e[row * 3];
+        float channel = (m[0] * xyz[0]) + (m[1] * xyz[1]) + (m[2] * xyz[2]);
+        maxChannel = (maxChannel > channel) ? maxChannel : channel;
+    }
+    return 1.0f / maxChannel;
+}
+
+static void test_srgb_highlight_max_y(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries gamuts[3] = {
+        { { 0.64f, 0.33f }, { 0.30f, 0.60f }, { 0.15f, 0.06f }, { 0.3127f, 0.329f } },    // sRGB
+        { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.329f } },   // P3
+        { { 0.708f, 0.292f }, { 0.170f, 0.797f }, { 0.131f, 0.046f }, { 0.3127f, 0.329f } } // BT.2020
+    };
+    clProfileCurve gamma1 = { CL_PCT_GAMMA, 1.0f, 1.0f };
+    for (int g = 0; g < 3; ++g) {
+        clProfile * profile = clProfileCreate(C, &gamuts[g], &gamma1, 100, NULL);
+        clProfile * linearProfile = clProfileCreate(C, &gamuts[g], &gamma1, 1, NULL);
+        clTransform * linearToXYZ = clTransformCreate(C, linearProfile, CL_XF_RGB, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+        clTransform * linearFromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, linearProfile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
+
+        clImage * srcImage = clImageParseString(C, "24x24,#ff0000..#00ff00,#0000ff..#ffffff", 16, profile);
+        int pixelCount = srcImage->width * srcImage->height;
+        clImageSRGBHighlightStats stats;
+        clImageSRGBHighlightPixelInfo * pixelInfo = clImageSRGBHighlightPixelInfoCreate(C, pixelCount);
+        clImage * highlight = clImageCreateSRGBHighlight(C, srcImage, 100, &stats, pixelInfo, NULL);
+
+        // The closed form matches the primaries everywhere; the old clTransformCalcMaxY() path clamped its
+        // intermediate RGB to [0, 1], which overstates max Y away from the primaries and the white point
+        float worstOldRatio = 1.0f;
+        for (int i = 0; i < pixelCount; ++i) {
+            clImageSRGBHighlightPixel * pixel = &pixelInfo->pixels[i];
+            float expected = referenceMaxY(C, &gamuts[g], pixel->x, pixel->y) * 100.0f;
+            TEST_ASSERT_FLOAT_WITHIN(expected * 0.001f, expected, pixel->maxNits);
+
+            float old = clTransformCalcMaxY(C, linearFromXYZ, linearToXYZ, pixel->x, pixel->y) * 100.0f;
+            if (worstOldRatio < (old / expected)) {
+                worstOldRatio = old / expected;
+            }
+        }
+        TEST_ASSERT_TRUE(worstOldRatio > 1.1f);
+
+        // Both agree on the exact primaries and the white point, which is all the APG encoder asks for
+        const float * points[4] = { gamuts[g].red, gamuts[g].green, gamuts[g].blue, gamuts[g].white };
+        for (int p = 0; p < 4; ++p) {
+            float expected = referenceMaxY(C, &gamuts[g], points[p][0], points[p][1]);
+            float old = clTransformCalcMaxY(C, linearFromXYZ, linearToXYZ, points[p][0], points[p][1]);
+            TEST_ASSERT_FLOAT_WITHIN(0.001f, expected, old);
+        }
+
+        clImageDestroy(C, highlight);
+        clImageSRGBHighlightPixelInfoDestroy(C, pixelInfo);
+        clImageDestroy(C, srcImage);
+        clTransformDestroy(C, linearFromXYZ);
+        clTransformDestroy(C, linearToXYZ);
+        clProfileDestroy(C, linearProfile);
+        clProfileDestroy(C, profile);
+    }
+
+    // AP0's blue primary is imaginary, with a negative Y. Like black, it has no chromaticity: it reports zero nits
+    // (never a negative luminance) and D65's max Y, which AP0's D60 white point puts off the white point, so the
+    // old path overstates it like everywhere else
+    clProfilePrimaries ap0 = { { 0.7347f, 0.2653f }, { 0.0f, 1.0f }, { 0.0001f, -0.077f }, { 0.32168f, 0.33767f } };
+    clProfile * ap0Profile = clProfileCreate(C, &ap0, &gamma1, 100, NULL);
+    clProfile * ap0LinearProfile = clProfileCreate(C, &ap0, &gamma1, 1, NULL);
+    clTransform * ap0ToXYZ = clTransformCreate(C, ap0LinearProfile, CL_XF_RGB, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    clTransform * ap0FromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, ap0LinearProfile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
+    clProfilePrimaries ap0Stored; // as the highlight sees them, after the round trip through the ICC profile
+    clProfileQuery(C, ap0Profile, &ap0Stored, NULL, NULL);
+    clImage * blueImage = clImageParseString(C, "3x1,#0000ff,#000000,#0000ff", 16, ap0Profile);
+    clImageSRGBHighlightStats blueStats;
+    clImageSRGBHighlightPixelInfo * bluePixelInfo = clImageSRGBHighlightPixelInfoCreate(C, 3);
+    clImage * blueHighlight = clImageCreateSRGBHighlight(C, blueImage, 100, &blueStats, bluePixelInfo, NULL);
+    float expectedMaxNits = referenceMaxY(C, &ap0Stored, 0.3127f, 0.329f) * 100.0f;
+    float oldMaxNits = clTransformCalcMaxY(C, ap0FromXYZ, ap0ToXYZ, 0.3127f, 0.329f) * 100.0f;
+    TEST_ASSERT_TRUE(expectedMaxNits > 0.0f);
+    TEST_ASSERT_TRUE(oldMaxNits > expectedMaxNits);
+    for (int i = 0; i < 3; ++i) {
+        clImageSRGBHighlightPixel * pixel = &bluePixelInfo->pixels[i];
+        TEST_ASSERT_EQUAL_FLOAT(0.0f, pixel->nits);
+        TEST_ASSERT_EQUAL_FLOAT(0.0f, pixel->Y);
+        TEST_ASSERT_FLOAT_WITHIN(expectedMaxNits * 0.001f, expectedMaxNits, pixel->maxNits);
+    }
+    clImageDestroy(C, blueHighlight);
+    clImageSRGBHighlightPixelInfoDestroy(C, bluePixelInfo);
+    clImageDestroy(C, blueImage);
+    clTransformDestroy(C, ap0FromXYZ);
+    clTransformDestroy(C, ap0ToXYZ);
+    clProfileDestroy(C, ap0LinearProfile);
+    clProfileDestroy(C, ap0Profile);
+    clContextDestroy(C);
+}
+
+static void test_streaming(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * image16 = clImageParseString(C, "70x45,#ff000080..#00ff00ff,#0000ff..#ffffff", 16, NULL);
+    clImage * image8 = clImageParseString(C, "70x45,#ff0000..#00ff00,#0000ff..#ffffff", 8, NULL);
+    checkStreaming(C, image16, "png", 16);
+    checkStreaming(C, image8, "png", 45);
+    checkStreaming(C, image16, "tiff", 7);
+    checkStreaming(C, image8, "tiff", 1);
+    checkStreaming(C, image8, "jpg", 16);
+    clImageDestroy(C, image16);
+    clImageDestroy(C, image8);
+    clContextDestroy(C);
+}
+
+// Counts the bytes allocated through clAllocate() (tests run these with -j 1, so there are no races)
+static size_t countedBytes = 0;
+static size_t countedPeakBytes = 0;
+static void * countingAlloc(clContext * C, size_t bytes)
+{
+    COLORIST_UNUSED(C);
+
+    size_t * header = (size_t *)calloc(1, bytes + (2 * sizeof(size_t))); // zeroed like clContextDefaultAlloc(); two words keep the payload 16-byte aligned
+    header[0] = bytes;
+    countedBytes += bytes;
+    if (countedPeakBytes < countedBytes) {
+        countedPeakBytes = countedBytes;
+    }
+    return header + 2;
+}
+static void countingFree(clContext * C, void * ptr)
+{
+    COLORIST_UNUSED(C);
+
+    if (ptr) {
+        size_t * header = (size_t *)ptr - 2;
+        countedBytes -= header[0];
+        free(header);
+    }
+}
+
+// Converts filename to out.png and returns the peak bytes allocated by the conversion itself
+static size_t convertPeakBytes(const char * filename, const char * extraArg, const char * extraValue)
+{
+    clContextSystem countingSystem = silentSystem;
+    countingSystem.alloc = countingAlloc;
+    countingSystem.free = countingFree;
+    clContext * C = clContextCreate(&countingSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    const char * argv[] = { "colorist", "convert", filename, "test_peak_out.png", "-j", "1", extraArg, extraValue };
+    TEST_ASSERT_TRUE(clContextParseArgs(C, extraArg ? 8 : 6, argv));
+    size_t baseline = countedBytes;
+    countedPeakBytes = countedBytes;
+    TEST_ASSERT_EQUAL_INT(0, clContextConvert(C));
+    size_t peak = countedPeakBytes - baseline;
+
+    clContextDestroy(C);
+    TEST_ASSERT_EQUAL_INT(0, (int)countedBytes);
+    remove("test_peak_out.png");
+    return peak;
+}
+
+// The streaming convert path holds a few bands at a time; other paths hold the whole source and destination
+static void test_pipeline_peak_memory(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    const char * filename = "test_peak.png";
+    clImage * image = clImageParseString(C, "2048x1024,#ff0000..#00ff00,#0000ff..#ffffff", 16, NULL);
+    size_t imageBytes = (size_t)image->size;
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    TEST_ASSERT_TRUE(clContextWrite(C, image, filename, "png", &writeParams));
+    clImageDestroy(C, image);
+    clContextDestroy(C);
+
+    size_t streamedPeak = convertPeakBytes(filename, NULL, NULL);
+    size_t wholePeak = convertPeakBytes(filename, "-z", "0,0,2048,1024"); // a crop can't stream
+    TEST_ASSERT_TRUE(streamedPeak < (imageBytes / 8));
+    TEST_ASSERT_TRUE(wholePeak >= (2 * imageBytes));
+
+    remove(filename);
+}
+
+// Converting a file onto itself must not stream: the encoder would truncate the (mapped) input under the reader
+static void test_streaming_in_place(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    const char * filename = "test_in_place.tiff";
+    clImage * image = clImageCreate(C, 256, 128, 16, NULL);
+    for (int j = 0; j < image->height; ++j) {
+        for (int i = 0; i < image->width; ++i) {
+            clImageSetPixel(C, image, i, j, i * 257, j * 513, (i * j) & 0xffff, 65535);
+        }
+    }
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    TEST_ASSERT_TRUE(clContextWrite(C, image, filename, "tiff", &writeParams));
+    TEST_ASSERT_TRUE(clFileSize(filename) >= (64 * 1024)); // large enough to be mapped
+    TEST_ASSERT_TRUE(clFileSame(filename, filename));
+    TEST_ASSERT_TRUE(clFileSame(filename, "./test_in_place.tiff"));
+    TEST_ASSERT_FALSE(clFileSame(filename, "test_in_place_missing.tiff"));
+
+    const char * argv[] = { "colorist", "convert", filename, filename, "-b", "8" };
+    TEST_ASSERT_TRUE(clContextParseArgs(C, sizeof(argv) / sizeof(argv[0]), argv));
+    TEST_ASSERT_EQUAL_INT(0, clContextConvert(C));
+
+    clImage * converted = clContextRead(C, filename, NULL, NULL, NULL);
+    TEST_ASSERT_NOT_NULL(converted);
+    TEST_ASSERT_EQUAL_INT(image->width, converted->width);
+    TEST_ASSERT_EQUAL_INT(image->height, converted->height);
+    TEST_ASSERT_EQUAL_INT(8, converted->depth);
+    uint16_t rgba[4];
+    clImageGetPixel(C, converted, 255, 127, rgba);
+    TEST_ASSERT_EQUAL_INT(255, rgba[0]);
+
+    clImageDestroy(C, converted);
+    clImageDestroy(C, image);
+    remove(filename);
+    clContextDestroy(C);
+}
+
+// Decodes image's encoding in formatName with a hint of target x 0 (keep aspect ratio) and filter
+static void checkDecodeHint(clContext * C, clImage * image, const char * formatName, int target, clFilter filter, int expectedW, int expectedH)
+{
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    clRaw encoded = CL_RAW_EMPTY;
+    TEST_ASSERT_TRUE(clContextWriteRaw(C, image, formatName, &writeParams, &encoded));
+
+    clDecodeHint hint;
+    memset(&hint, 0, sizeof(hint));
+    hint.width = target;
+    hint.filter = filter;
+    clFormat * format = clContextFindFormat(C, formatName);
+    clImage * decoded = format->readFunc(C, formatName, NULL, &encoded, &hint);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_EQUAL_INT(expectedW, decoded->width);
+    TEST_ASSERT_EQUAL_INT(expectedH, decoded->height);
+    if (decoded->width != image->width) {
+        TEST_ASSERT_EQUAL_INT(image->width, hint.fullWidth);
+        TEST_ASSERT_EQUAL_INT(image->height, hint.fullHeight);
+    }
+
+    // A flat color survives any amount of decoder scaling
+    uint16_t rgba[4];
+    TEST_ASSERT_EQUAL_INT(8, decoded->depth);
+    clImageGetPixel(C, decoded, expectedW / 2, expectedH / 2, rgba);
+    TEST_ASSERT_INT_WITHIN(2, 255, rgba[0]);
+    TEST_ASSERT_INT_WITHIN(2, 0, rgba[1]);
+    TEST_ASSERT_INT_WITHIN(2, 255, rgba[2]);
+
+    clImageDestroy(C, decoded);
+    clRawFree(C, &encoded);
+}
+
+static void test_decode_hint(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clDecodeHint hint;
+    memset(&hint, 0, sizeof(hint));
+    TEST_ASSERT_EQUAL_INT(0, clDecodeHintChooseShift(C, NULL, 4000, 3000, 3));
+    TEST_ASSERT_EQUAL_INT(0, clDecodeHintChooseShift(C, &hint, 4000, 3000, 3)); // no target
+    TEST_ASSERT_EQUAL_INT(4000, hint.fullWidth);
+    TEST_ASSERT_EQUAL_INT(3000, hint.fullHeight);
+    hint.width = 500;
+    hint.filter = CL_FILTER_BOX;
+    TEST_ASSERT_EQUAL_INT(3, clDecodeHintChooseShift(C, &hint, 4000, 3000, 3)); // exactly 500x375
+    TEST_ASSERT_EQUAL_INT(2, clDecodeHintChooseShift(C, &hint, 4000, 3000, 2)); // capped
+    TEST_ASSERT_EQUAL_INT(2, clDecodeHintChooseShift(C, &hint, 3991, 3000, 3)); // 1/8 would be 499 wide
+    hint.filter = CL_FILTER_MITCHELL;
+    TEST_ASSERT_EQUAL_INT(2, clDecodeHintChooseShift(C, &hint, 4000, 3000, 3)); // kernel wants 1000x750
+    hint.width = 0;
+    hint.height = 2000;
+    TEST_ASSERT_EQUAL_INT(0, clDecodeHintChooseShift(C, &hint, 4000, 3000, 3));
+    hint.width = 4000;
+    hint.height = 10;
+    TEST_ASSERT_EQUAL_INT(0, clDecodeHintChooseShift(C, &hint, 4000, 3000, 3)); // either dimension can stop it
+
+    clImage * image = clImageParseString(C, "200x120,#ff00ff", 8, NULL);
+    checkDecodeHint(C, image, "jpg", 40, CL_FILTER_BOX, 50, 30);
+    checkDecodeHint(C, image, "jpg", 40, CL_FILTER_AUTO, 100, 60);
+    checkDecodeHint(C, image, "jpg", 190, CL_FILTER_AUTO, 200, 120);
+    checkDecodeHint(C, image, "jp2", 40, CL_FILTER_BOX, 50, 30);
+    checkDecodeHint(C, image, "webp", 25, CL_FILTER_NEAREST, 25, 15);
+    checkDecodeHint(C, image, "png", 25, CL_FILTER_NEAREST, 200, 120); // no decoder scaling
+    clImageDestroy(C, image);
+    clContextDestroy(C);
+}
+
+// Decodes image's encoding in formatName with a hint asking for rect, whole and (when the format can
+// stream) a band of rows at a time, checking both against a crop of the full decode
+static void checkDecodeRect(clContext * C, clImage * image, const char * formatName, int x, int y, int w, int h, clBool expectCropped)
+{
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    clRaw encoded = CL_RAW_EMPTY;
+    TEST_ASSERT_TRUE(clContextWriteRaw(C, image, formatName, &writeParams, &encoded));
+    clImage * full = clContextReadRaw(C, &encoded, formatName);
+    TEST_ASSERT_NOT_NULL(full);
+
+    clDecodeHint hint;
+    memset(&hint, 0, sizeof(hint));
+    hint.rect[0] = x;
+    hint.rect[1] = y;
+    hint.rect[2] = w;
+    hint.rect[3] = h;
+    clFormat * format = clContextFindFormat(C, formatName);
+    clImage * decoded = format->readFunc(C, formatName, NULL, &encoded, &hint);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_EQUAL_INT(expectCropped, hint.cropped);
+    if (!expectCropped) {
+        TEST_ASSERT_EQUAL_INT(image->width, decoded->width);
+        clImageDestroy(C, decoded);
+        clImageDestroy(C, full);
+        clRawFree(C, &encoded);
+        return;
+    }
+    TEST_ASSERT_EQUAL_INT(image->width, hint.fullWidth);
+    TEST_ASSERT_EQUAL_INT(image->height, hint.fullHeight);
+
+    clImage * expected = clImageCrop(C, full, hint.rect[0], hint.rect[1], hint.rect[2], hint.rect[3], clTrue);
+    TEST_ASSERT_EQUAL_INT(expected->width, decoded->width);
+    TEST_ASSERT_EQUAL_INT(expected->height, decoded->height);
+    size_t rowBytes = (size_t)expected->width * expected->pixelBytes;
+    for (int j = 0; j < expected->height; ++j) {
+        TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_ROW(expected, j), CL_IMAGE_ROW(decoded, j), rowBytes);
+    }
+
+    if (format->readBeginFunc) {
+        memset(&hint, 0, sizeof(hint));
+        hint.rect[0] = x;
+        hint.rect[1] = y;
+        hint.rect[2] = w;
+        hint.rect[3] = h;
+        clFormatReader * reader = format->readBeginFunc(C, formatName, NULL, &encoded, &hint);
+        TEST_ASSERT_NOT_NULL(reader);
+        TEST_ASSERT_EQUAL_INT(expected->width, reader->width);
+        TEST_ASSERT_EQUAL_INT(expected->height, reader->height);
+        clImage * band = clImageCreate(C, reader->width, 3, reader->depth, reader->profile);
+        for (int by = 0; by < reader->height; by += 3) {
+            int rowCount = ((reader->height - by) < 3) ? (reader->height - by) : 3;
+            TEST_ASSERT_TRUE(reader->readRows(C, reader, band, rowCount));
+            for (int j = 0; j < rowCount; ++j) {
+                TEST_ASSERT_EQUAL_MEMORY(CL_IMAGE_ROW(expected, by + j), CL_IMAGE_ROW(band, j), rowBytes);
+            }
+        }
+        clImageDestroy(C, band);
+        reader->destroy(C, reader);
+    }
+
+    clImageDestroy(C, expected);
+    clImageDestroy(C, decoded);
+    clImageDestroy(C, full);
+    clRawFree(C, &encoded);
+}
+
+static void test_decode_rect(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clDecodeHint hint;
+    memset(&hint, 0, sizeof(hint));
+    TEST_ASSERT_FALSE(clDecodeHintChooseRect(C, NULL, 70, 45));
+    TEST_ASSERT_FALSE(clDecodeHintChooseRect(C, &hint, 70, 45)); // no rect
+    TEST_ASSERT_FALSE(hint.cropped);
+    hint.rect[0] = 60;
+    hint.rect[1] = 50;
+    hint.rect[2] = 20;
+    hint.rect[3] = 5;
+    TEST_ASSERT_TRUE(clDecodeHintChooseRect(C, &hint, 70, 45));
+    TEST_ASSERT_EQUAL_INT(60, hint.rect[0]);
+    TEST_ASSERT_EQUAL_INT(44, hint.rect[1]); // clamped like clImageAdjustRect()
+    TEST_ASSERT_EQUAL_INT(10, hint.rect[2]);
+    TEST_ASSERT_EQUAL_INT(1, hint.rect[3]);
+    TEST_ASSERT_EQUAL_INT(70, hint.fullWidth);
+    TEST_ASSERT_EQUAL_INT(45, hint.fullHeight);
+    hint.width = 10;
+    TEST_ASSERT_EQUAL_INT(0, clDecodeHintChooseShift(C, &hint, 4000, 3000, 3)); // never scale a region
+
+    clImage * image16 = clImageParseString(C, "70x45,#ff000080..#00ff00ff,#0000ff..#ffffff", 16, NULL);
+    clImage * image8 = clImageParseString(C, "70x45,#ff0000..#00ff00,#0000ff..#ffffff", 8, NULL);
+    checkDecodeRect(C, image16, "png", 5, 7, 20, 11, clTrue);
+    checkDecodeRect(C, image8, "png", 0, 30, 70, 30, clTrue); // full width, clamped to the bottom
+    checkDecodeRect(C, image8, "jpg", 13, 9, 33, 17, clTrue);
+    checkDecodeRect(C, image16, "tiff", 21, 3, 40, 20, clTrue);
+    checkDecodeRect(C, image8, "tiff", 69, 44, 1, 1, clTrue);
+    checkDecodeRect(C, image8, "jp2", 10, 20, 30, 15, clTrue);
+    checkDecodeRect(C, image8, "bmp", 10, 20, 30, 15, clFalse); // cropped after decoding instead
+    clImageDestroy(C, image16);
+    clImageDestroy(C, image8);
+    clContextDestroy(C);
+}
+
+// Probes image's encoding in formatName, checking the result against a full decode
+static void checkProbe(clContext * C, clImage * image, const char * formatName, clBool expectAlpha)
+{
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    clRaw encoded = CL_RAW_EMPTY;
+    TEST_ASSERT_TRUE(clContextWriteRaw(C, image, formatName, &writeParams, &encoded));
+    clImage * decoded = clContextReadRaw(C, &encoded, formatName);
+    TEST_ASSERT_NOT_NULL(decoded);
+
+    clFormat * format = clContextFindFormat(C, formatName);
+    TEST_ASSERT_NOT_NULL(format->probeFunc);
+    clProbeInfo info;
+    TEST_ASSERT_TRUE(clContextProbeRaw(C, &encoded, formatName, NULL, &info));
+    TEST_ASSERT_EQUAL_INT(decoded->width, info.width);
+    TEST_ASSERT_EQUAL_INT(decoded->height, info.height);
+    TEST_ASSERT_EQUAL_INT(decoded->depth, info.depth);
+    TEST_ASSERT_EQUAL_INT(expectAlpha, info.hasAlpha);
+    TEST_ASSERT_NOT_NULL(info.profile);
+    TEST_ASSERT_TRUE(clProfileMatches(C, decoded->profile, info.profile));
+    clProbeInfoFree(C, &info);
+    TEST_ASSERT_NULL(info.profile);
+
+    // A truncated header is rejected rather than guessed at
+    clRaw truncated = CL_RAW_EMPTY;
+    clRawSet(C, &truncated, encoded.ptr, 12);
+    TEST_ASSERT_FALSE(clContextProbeRaw(C, &truncated, formatName, NULL, &info));
+    TEST_ASSERT_NULL(info.profile);
+    clRawFree(C, &truncated);
+
+    clImageDestroy(C, decoded);
+    clRawFree(C, &encoded);
+}
+
+static void test_probe(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries primaries = { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.329f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.2f };
+    clProfile * profile = clProfileCreate(C, &primaries, &curve, 300, "probe");
+    clImage * image16 = clImageParseString(C, "70x45,#ff000080..#00ff00ff,#0000ff..#ffffff", 16, profile);
+    clImage * image8 = clImageParseString(C, "70x45,#ff0000..#00ff00,#0000ff..#ffffff", 8, profile);
+    checkProbe(C, image16, "png", clTrue); // the PNG, TIFF and JP2 writers always store alpha
+    checkProbe(C, image8, "png", clTrue);
+    checkProbe(C, image8, "jpg", clFalse);
+    checkProbe(C, image16, "tiff", clTrue);
+    checkProbe(C, image8, "jp2", clTrue);
+    checkProbe(C, image8, "webp", clFalse); // libwebp drops an opaque alpha plane
+
+    // Signatures are checked against what was already read
+    clRaw encoded = CL_RAW_EMPTY;
+    clWriteParams writeParams;
+    clWriteParamsSetDefaults(C, &writeParams);
+    TEST_ASSERT_TRUE(clContextWriteRaw(C, image8, "png", &writeParams, &encoded));
+    TEST_ASSERT_EQUAL_STRING("png", clFormatDetectRaw(C, "not_a_file", &encoded));
+    TEST_ASSERT_EQUAL_STRING("jpg", clFormatDetectRaw(C, "not_a_file.jpg", &encoded));
+    clRawFree(C, &encoded);
+
+    clProbeInfo info;
+    const char * formatName = NULL;
+    TEST_ASSERT_TRUE(clContextProbe(C, "../test/red_png_no_ext", NULL, &info, &formatName));
+    TEST_ASSERT_EQUAL_STRING("png", formatName);
+    TEST_ASSERT_EQUAL_INT(1, info.width);
+    TEST_ASSERT_EQUAL_INT(1, info.height);
+    clProbeInfoFree(C, &info);
+    TEST_ASSERT_FALSE(clContextProbe(C, "../test/not_a_file", NULL, &info, &formatName));
+    TEST_ASSERT_NULL(formatName);
+
+    clImageDestroy(C, image16);
+    clImageDestroy(C, image8);
+    clProfileDestroy(C, profile);
+    clContextDestroy(C);
+}
+
+int test_image(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_pipeline_matches_stages);
+    RUN_TEST(test_color_grade_histogram);
+    RUN_TEST(test_depth_native_storage);
+    RUN_TEST(test_image_views);
+    RUN_TEST(test_resize_bands);
+    RUN_TEST(test_hald_tetrahedral);
+    RUN_TEST(test_blend_kernel);
+    RUN_TEST(test_blend_layers);
+    RUN_TEST(test_image_compare);
+    RUN_TEST(test_signals);
+    RUN_TEST(test_srgb_highlight);
+    RUN_TEST(test_srgb_highlight_max_y);
+    RUN_TEST(test_streaming);
+    RUN_TEST(test_streaming_in_place);
+    RUN_TEST(test_pipeline_peak_memory);
+    RUN_TEST(test_decode_hint);
+    RUN_TEST(test_decode_rect);
+    RUN_TEST(test_probe);
+
+    return UNITY_END();
+}
@@ -0,0 +1,513 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "main.h"
+
+#include "colorist/transform.h"
+
+#include <math.h>
+
+// Enough pixels to cover a few full spans plus a ragged tail
+#define TEST_PIXEL_COUNT ((CL_TRANSFORM_SPAN_SIZE * 2) + 7)
+
+static clProfile * createProfile(clContext * C, const float primaries[8], clProfileCurveType curveType, float gamma, int maxLuminance)
+{
+    clProfilePrimaries p;
+    clProfileCurve curve;
+    p.red[0] = primaries[0];
+    p.red[1] = primaries[1];
+    p.green[0] = primaries[2];
+    p.green[1] = primaries[3];
+    p.blue[0] = primaries[4];
+    p.blue[1] = primaries[5];
+    p.white[0] = primaries[6];
+    p.white[1] = primaries[7];
+    curve.type = curveType;
+    curve.implicitScale = 1.0f;
+    curve.gamma = gamma;
+    return clProfileCreate(C, &p, &curve, maxLuminance, NULL);
+}
+
+static void fillPixels(uint8_t * pixels, clBool isFloat, int channels, int depth, int pixelCount)
+{
+    uint32_t seed = 12345;
+    int maxChannel = (depth == 32) ? 0 : (1 << depth) - 1;
+    for (int i = 0; i < pixelCount * channels; ++i) {
+        seed = (seed * 1103515245) + 12345;
+        uint32_t r = (seed >> 8) & 0xffff;
+        if (isFloat) {
+            // Include a few out-of-range values to exercise the clamps
+            ((float *)pixels)[i] = ((float)r / 65535.0f * 1.2f) - 0.1f;
+        } else if (depth == 8) {
+            pixels[i] = (uint8_t)(r % (maxChannel + 1));
+        } else {
+            ((uint16_t *)pixels)[i] = (uint16_t)(r % (maxChannel + 1));
+        }
+    }
+}
+
+// Runs the same transform with the scalar kernels and every SIMD level this CPU supports; all must match exactly
+static void compareKernels(clContext * C, clProfile * srcProfile, clTransformFormat srcFormat, int srcDepth, clProfile * dstProfile, clTransformFormat dstFormat, int dstDepth, clTonemap tonemap)
+{
+    clTransform * transform = clTransformCreate(C, srcProfile, srcFormat, srcDepth, dstProfile, dstFormat, dstDepth, tonemap);
+    int srcPixelBytes = clTransformFormatToPixelBytes(C, srcFormat, srcDepth);
+    int dstPixelBytes = clTransformFormatToPixelBytes(C, dstFormat, dstDepth);
+    clBool srcIsFloat = clTransformFormatIsFloat(C, srcFormat, srcDepth);
+    int srcChannels = srcPixelBytes / (srcIsFloat ? 4 : ((srcDepth == 8) ? 1 : 2));
+    uint8_t * srcPixels = clAllocate(srcPixelBytes * TEST_PIXEL_COUNT);
+    uint8_t * expected = clAllocate(dstPixelBytes * TEST_PIXEL_COUNT);
+    uint8_t * actual = clAllocate(dstPixelBytes * TEST_PIXEL_COUNT);
+
+    fillPixels(srcPixels, srcIsFloat, srcChannels, srcDepth, TEST_PIXEL_COUNT);
+
+    transform->kernels = clTransformKernelsGet(CL_XSIMD_NONE);
+    TEST_ASSERT_NOT_NULL(transform->kernels);
+    clTransformRun(C, transform, 1, srcPixels, expected, TEST_PIXEL_COUNT);
+
+    for (int simd = CL_XSIMD_NONE + 1; simd < CL_XSIMD_COUNT; ++simd) {
+        const clTransformKernels * kernels = clTransformKernelsGet((clTransformSIMD)simd);
+        if (!kernels) {
+            continue;
+        }
+        transform->kernels = kernels;
+        memset(actual, 0xff, dstPixelBytes * TEST_PIXEL_COUNT);
+        clTransformRun(C, transform, 1, srcPixels, actual, TEST_PIXEL_COUNT);
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, actual, dstPixelBytes * TEST_PIXEL_COUNT, kernels->name);
+    }
+
+    clFree(actual);
+    clFree(expected);
+    clFree(srcPixels);
+    clTransformDestroy(C, transform);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Transform kernel tests
+// ------------------------------------------------------------------------------------------------
+
+static void test_kernels_available(void)
+{
+    const clTransformKernels * best = clTransformKernelsBest();
+    TEST_ASSERT_NOT_NULL(best);
+    TEST_ASSERT_NOT_NULL(clTransformKernelsGet(CL_XSIMD_NONE));
+    TEST_ASSERT_NULL(clTransformKernelsGet(CL_XSIMD_COUNT));
+}
+
+static void test_kernels_match_scalar(void)
+{
+    static const float bt709[8] = { 0.64f, 0.33f, 0.30f, 0.60f, 0.15f, 0.06f, 0.3127f, 0.3290f };
+    static const float bt2020[8] = { 0.708f, 0.292f, 0.170f, 0.797f, 0.131f, 0.046f, 0.3127f, 0.3290f };
+    static const float p3[8] = { 0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.3127f, 0.3290f };
+
+    clContext * C = clContextCreate(&silentSystem);
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    clProfile * pq = createProfile(C, bt2020, CL_PCT_PQ, 1.0f, 10000);
+    clProfile * hlg = createProfile(C, bt2020, CL_PCT_HLG, 1.0f, CL_LUMINANCE_UNSPECIFIED);
+    clProfile * p3g26 = createProfile(C, p3, CL_PCT_GAMMA, 2.6f, 300);
+    clProfile * linear = createProfile(C, bt709, CL_PCT_GAMMA, 1.0f, 80);
+    clProfile * profiles[] = { srgb, pq, hlg, p3g26, linear, NULL }; // NULL is XYZ
+    const int profileCount = (int)(sizeof(profiles) / sizeof(profiles[0]));
+
+    for (int s = 0; s < profileCount; ++s) {
+        for (int d = 0; d < profileCount; ++d) {
+            if (s == d) {
+                continue;
+            }
+            clTransformFormat srcFormat = profiles[s] ? CL_XF_RGBA : CL_XF_XYZ;
+            clTransformFormat dstFormat = profiles[d] ? CL_XF_RGBA : CL_XF_XYZ;
+            int srcDepth = profiles[s] ? 16 : 32;
+            int dstDepth = profiles[d] ? 8 : 32;
+            compareKernels(C, profiles[s], srcFormat, srcDepth, profiles[d], dstFormat, dstDepth, CL_TONEMAP_AUTO);
+        }
+    }
+
+    // Various pixel formats
+    compareKernels(C, pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 8, CL_TONEMAP_ON);
+    compareKernels(C, pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 8, CL_TONEMAP_OFF);
+    compareKernels(C, pq, CL_XF_RGB, 10, srgb, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    compareKernels(C, srgb, CL_XF_RGBA, 8, pq, CL_XF_RGB, 12, CL_TONEMAP_AUTO);
+    compareKernels(C, srgb, CL_XF_RGBA, 32, p3g26, CL_XF_RGBA, 32, CL_TONEMAP_AUTO);
+    compareKernels(C, srgb, CL_XF_RGB, 32, hlg, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    compareKernels(C, hlg, CL_XF_RGBA, 16, linear, CL_XF_RGB, 32, CL_TONEMAP_AUTO);
+
+    clProfileDestroy(C, linear);
+    clProfileDestroy(C, p3g26);
+    clProfileDestroy(C, hlg);
+    clProfileDestroy(C, pq);
+    clProfileDestroy(C, srgb);
+    clContextDestroy(C);
+}
+
+// Every output of the signal errors kernel: [src, dst, squaredLinear, squaredG22]
+static void runSignalErrors(const clTransformKernels * kernels, const float * input, float * output, const float * lut, int lutSize, int count)
+{
+    memcpy(output, input, sizeof(float) * count * 2);
+    kernels->signalErrors(&output[0], &output[count], &output[count * 2], &output[count * 3], lut, lutSize, 1.0f / 300.0f, count);
+}
+
+static void test_kernels_signal_errors_match_scalar(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    const int lutSize = 1024;
+    const int count = TEST_PIXEL_COUNT * 3;
+    float * lut = clAllocate(sizeof(float) * (lutSize + 1));
+    for (int i = 0; i <= lutSize; ++i) {
+        lut[i] = powf((float)i / lutSize, 1.0f / 2.2f);
+    }
+
+    // src and dst values, spanning a bit past [0, 300 nits] on either side
+    float * input = clAllocate(sizeof(float) * count * 2);
+    fillPixels((uint8_t *)input, clTrue, 1, 32, count * 2);
+    for (int i = 0; i < count * 2; ++i) {
+        input[i] *= 300.0f;
+    }
+    input[1] = 300.0f; // exactly the last LUT sample
+    input[count + 2] = 300.0f;
+
+    float * expected = clAllocate(sizeof(float) * count * 4);
+    float * actual = clAllocate(sizeof(float) * count * 4);
+    runSignalErrors(clTransformKernelsGet(CL_XSIMD_NONE), input, expected, lut, lutSize, count);
+    TEST_ASSERT_EQUAL_FLOAT(1.0f, expected[1]);
+    TEST_ASSERT_EQUAL_FLOAT(1.0f, expected[count + 2]);
+
+    for (int simd = CL_XSIMD_NONE + 1; simd < CL_XSIMD_COUNT; ++simd) {
+        const clTransformKernels * kernels = clTransformKernelsGet((clTransformSIMD)simd);
+        if (!kernels) {
+            continue;
+        }
+        runSignalErrors(kernels, input, actual, lut, lutSize, count);
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, actual, sizeof(float) * count * 4, kernels->name);
+    }
+
+    clFree(actual);
+    clFree(expected);
+    clFree(input);
+    clFree(lut);
+    clContextDestroy(C);
+}
+
+// Runs a transform with its prepared transfer function tables, then again with them discarded
+static void runWithAndWithoutTables(clContext * C, clTransform * transform, void * srcPixels, void * withTables, void * withoutTables)
+{
+    clTransformRun(C, transform, 1, srcPixels, withTables, TEST_PIXEL_COUNT);
+    if (transform->ccmmSrcEOTFTable) {
+        clFree(transform->ccmmSrcEOTFTable);
+        transform->ccmmSrcEOTFTable = NULL;
+    }
+    if (transform->ccmmDstOETFTable) {
+        clFree(transform->ccmmDstOETFTable);
+        transform->ccmmDstOETFTable = NULL;
+    }
+    clTransformRun(C, transform, 1, srcPixels, withoutTables, TEST_PIXEL_COUNT);
+}
+
+static void test_transfer_function_tables(void)
+{
+    static const float bt2020[8] = { 0.708f, 0.292f, 0.170f, 0.797f, 0.131f, 0.046f, 0.3127f, 0.3290f };
+
+    clContext * C = clContextCreate(&silentSystem);
+    clProfile * pq = createProfile(C, bt2020, CL_PCT_PQ, 1.0f, 10000);
+    clProfile * hlg = createProfile(C, bt2020, CL_PCT_HLG, 1.0f, CL_LUMINANCE_UNSPECIFIED);
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    uint16_t * srcPixels = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    float * expectedXYZ = clAllocate(sizeof(float) * 3 * TEST_PIXEL_COUNT);
+    float * actualXYZ = clAllocate(sizeof(float) * 3 * TEST_PIXEL_COUNT);
+    uint16_t * expected16 = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    uint16_t * actual16 = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+
+    // EOTF tables are indexed by code value, and must be exact
+    fillPixels((uint8_t *)srcPixels, clFalse, 4, 10, TEST_PIXEL_COUNT);
+    clTransform * toXYZ = clTransformCreate(C, pq, CL_XF_RGBA, 10, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    clTransformPrepare(C, toXYZ);
+    TEST_ASSERT_NOT_NULL(toXYZ->ccmmSrcEOTFTable);
+    TEST_ASSERT_NULL(toXYZ->ccmmDstOETFTable);
+    runWithAndWithoutTables(C, toXYZ, srcPixels, actualXYZ, expectedXYZ);
+    TEST_ASSERT_EQUAL_MEMORY(expectedXYZ, actualXYZ, sizeof(float) * 3 * TEST_PIXEL_COUNT);
+    clTransformDestroy(C, toXYZ);
+
+    // OETF tables are interpolated, and must stay within a code value at 16 bits
+    clProfile * dstProfiles[] = { pq, hlg, srgb };
+    for (int p = 0; p < 3; ++p) {
+        fillPixels((uint8_t *)srcPixels, clFalse, 4, 16, TEST_PIXEL_COUNT);
+        clTransform * transform = clTransformCreate(C, (p == 2) ? pq : srgb, CL_XF_RGBA, 16, dstProfiles[p], CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+        clTransformPrepare(C, transform);
+        TEST_ASSERT_NOT_NULL(transform->ccmmDstOETFTable);
+        runWithAndWithoutTables(C, transform, srcPixels, actual16, expected16);
+        for (int i = 0; i < 4 * TEST_PIXEL_COUNT; ++i) {
+            TEST_ASSERT_INT_WITHIN(1, expected16[i], actual16[i]);
+        }
+        clTransformDestroy(C, transform);
+    }
+
+    clFree(actual16);
+    clFree(expected16);
+    clFree(actualXYZ);
+    clFree(expectedXYZ);
+    clFree(srcPixels);
+    clProfileDestroy(C, srgb);
+    clProfileDestroy(C, hlg);
+    clProfileDestroy(C, pq);
+    clContextDestroy(C);
+}
+
+static void test_plans(void)
+{
+    static const float bt2020[8] = { 0.708f, 0.292f, 0.170f, 0.797f, 0.131f, 0.046f, 0.3127f, 0.3290f };
+    static const float bt709Primaries[8] = { 0.64f, 0.33f, 0.30f, 0.60f, 0.15f, 0.06f, 0.3127f, 0.3290f };
+    static const float ap0Primaries[8] = { 0.7347f, 0.2653f, 0.0f, 1.0f, 0.0001f, -0.0770f, 0.32168f, 0.33767f };
+
+    clContext * C = clContextCreate(&silentSystem);
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    clProfile * pq = createProfile(C, bt2020, CL_PCT_PQ, 1.0f, 10000);
+    clTransform * transform;
+
+    // SDR -> HDR: a plain luminance scale, folded into one matrix
+    transform = clTransformCreate(C, srgb, CL_XF_RGBA, 8, pq, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_TRUE(transform->luminanceScaleEnabled);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_MATRIX, transform->plan);
+    clTransformDestroy(C, transform);
+
+    // HDR -> SDR: tonemapped
+    transform = clTransformCreate(C, pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 8, CL_TONEMAP_AUTO);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_LUMINANCE, transform->plan);
+    clTransformDestroy(C, transform);
+
+    // HDR -> SDR: clipped
+    transform = clTransformCreate(C, pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 8, CL_TONEMAP_OFF);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_MATRIX, transform->plan);
+    clTransformDestroy(C, transform);
+
+    // AP0's blue primary has a negative y, so pure blue has Y < 0. Scaling luminance turns it black, which
+    // one matrix can't do.
+    clProfile * ap0 = createProfile(C, ap0Primaries, CL_PCT_GAMMA, 1.0f, 80);
+    clProfile * bt709 = createProfile(C, bt709Primaries, CL_PCT_GAMMA, 1.0f, 300);
+    clProfile * bt2020g1 = createProfile(C, bt2020, CL_PCT_GAMMA, 1.0f, 100);
+    clProfile * dstProfiles[2] = { bt709, bt2020g1 };
+    for (int i = 0; i < 2; ++i) {
+        transform = clTransformCreate(C, ap0, CL_XF_RGBA, 16, dstProfiles[i], CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+        clTransformPrepare(C, transform);
+        TEST_ASSERT_TRUE(transform->luminanceScaleEnabled);
+        TEST_ASSERT_EQUAL_INT(CL_XPLAN_LUMINANCE, transform->plan);
+        uint16_t blue[4] = { 0, 0, 65535, 65535 };
+        uint16_t dst[4];
+        clTransformRun(C, transform, 1, blue, dst, 1);
+        TEST_ASSERT_EQUAL_INT(0, dst[0]);
+        TEST_ASSERT_EQUAL_INT(0, dst[1]);
+        TEST_ASSERT_EQUAL_INT(0, dst[2]);
+        TEST_ASSERT_EQUAL_INT(65535, dst[3]);
+        clTransformDestroy(C, transform);
+    }
+
+    // Without a luminance scale there is no blackout, so the matrix is still exact
+    clProfile * ap0Bright = createProfile(C, ap0Primaries, CL_PCT_GAMMA, 1.0f, 300);
+    transform = clTransformCreate(C, ap0Bright, CL_XF_RGBA, 16, bt709, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_FALSE(transform->luminanceScaleEnabled);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_MATRIX, transform->plan);
+    clTransformDestroy(C, transform);
+
+    // XYZ sources can have Y <= 0 too
+    transform = clTransformCreate(C, NULL, CL_XF_XYZ, 32, pq, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_TRUE(transform->luminanceScaleEnabled);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_LUMINANCE, transform->plan);
+    clTransformDestroy(C, transform);
+
+    clProfileDestroy(C, ap0Bright);
+    clProfileDestroy(C, bt2020g1);
+    clProfileDestroy(C, bt709);
+    clProfileDestroy(C, ap0);
+    clProfileDestroy(C, pq);
+    clProfileDestroy(C, srgb);
+    clContextDestroy(C);
+}
+
+static void test_lcms_combined(void)
+{
+    static const float p3[8] = { 0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.3127f, 0.3290f };
+    static const float bt709Primaries[8] = { 0.64f, 0.33f, 0.30f, 0.60f, 0.15f, 0.06f, 0.3127f, 0.3290f };
+    static const float ap0Primaries[8] = { 0.7347f, 0.2653f, 0.0f, 1.0f, 0.0001f, -0.0770f, 0.32168f, 0.33767f };
+
+    clContext * C = clContextCreate(&silentSystem);
+    C->ccmmAllowed = clFalse;
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    clProfile * p3g26 = createProfile(C, p3, CL_PCT_GAMMA, 2.6f, CL_LUMINANCE_UNSPECIFIED);
+    uint16_t * srcPixels = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    uint16_t * expected = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    uint16_t * actual = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    fillPixels((uint8_t *)srcPixels, clFalse, 4, 16, TEST_PIXEL_COUNT);
+
+    // Matching luminance: a single LittleCMS call per span
+    clTransform * transform = clTransformCreate(C, srgb, CL_XF_RGBA, 16, p3g26, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_FALSE(transform->luminanceScaleEnabled);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_LCMS, transform->plan);
+    clTransformRun(C, transform, 1, srcPixels, actual, TEST_PIXEL_COUNT);
+
+    // Going through XYZ (with a no-op luminance scale) must agree
+    transform->luminanceScaleEnabled = clTrue;
+    transform->plan = CL_XPLAN_LUMINANCE;
+    clTransformRun(C, transform, 1, srcPixels, expected, TEST_PIXEL_COUNT);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_LUMINANCE, transform->plan); // a prepared plan isn't recompiled per run
+    for (int i = 0; i < 4 * TEST_PIXEL_COUNT; ++i) {
+        TEST_ASSERT_INT_WITHIN(2, expected[i], actual[i]);
+    }
+    clTransformDestroy(C, transform);
+
+    // Matching luminance, but AP0's blue has Y < 0 and must still go through XYZ to be blacked out
+    clProfile * ap0 = createProfile(C, ap0Primaries, CL_PCT_GAMMA, 1.0f, 300);
+    clProfile * bt709 = createProfile(C, bt709Primaries, CL_PCT_GAMMA, 1.0f, 300);
+    transform = clTransformCreate(C, ap0, CL_XF_RGBA, 16, bt709, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_FALSE(transform->luminanceScaleEnabled);
+    TEST_ASSERT_EQUAL_INT(CL_XPLAN_LUMINANCE, transform->plan);
+    uint16_t blue[4] = { 0, 0, 65535, 65535 };
+    uint16_t dst[4];
+    clTransformRun(C, transform, 1, blue, dst, 1);
+    TEST_ASSERT_EQUAL_INT(0, dst[0]);
+    TEST_ASSERT_EQUAL_INT(0, dst[1]);
+    TEST_ASSERT_EQUAL_INT(0, dst[2]);
+    TEST_ASSERT_EQUAL_INT(65535, dst[3]);
+    clTransformDestroy(C, transform);
+    clProfileDestroy(C, bt709);
+    clProfileDestroy(C, ap0);
+
+    clFree(actual);
+    clFree(expected);
+    clFree(srcPixels);
+    clProfileDestroy(C, p3g26);
+    clProfileDestroy(C, srgb);
+    clContextDestroy(C);
+}
+
+static void test_engine_switch(void)
+{
+    static const float p3[8] = { 0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.3127f, 0.3290f };
+
+    clContext * C = clContextCreate(&silentSystem);
+    clProfile * pq = clProfileRead(C, "../docs/profiles/HDR_P3_D65_ST2084.icc"); // 100 nits, curve scale 100
+    clProfile * p3g1 = createProfile(C, p3, CL_PCT_GAMMA, 1.0f, 100);
+    TEST_ASSERT_NOT_NULL(pq);
+    uint16_t srcPixels[4 * 16];
+    uint16_t expected[4 * 16];
+    uint16_t actual[4 * 16];
+    fillPixels((uint8_t *)srcPixels, clFalse, 4, 16, 16);
+
+    clTransform * fresh = clTransformCreate(C, pq, CL_XF_RGBA, 16, p3g1, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+    clTransformRun(C, fresh, 1, srcPixels, expected, 16);
+    TEST_ASSERT_TRUE(fresh->luminanceScaleEnabled);
+
+    // CCMM sees 10000 vs 100 nits, LCMS sees 100 vs 100 and lets the profiles scale
+    clTransform * transform = clTransformCreate(C, pq, CL_XF_RGBA, 16, p3g1, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_TRUE(transform->planUsesCCMM);
+    TEST_ASSERT_TRUE(transform->luminanceScaleEnabled);
+    C->ccmmAllowed = clFalse;
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_FALSE(transform->planUsesCCMM);
+    TEST_ASSERT_FALSE(transform->luminanceScaleEnabled);
+    C->ccmmAllowed = clTrue;
+    clTransformPrepare(C, transform);
+    TEST_ASSERT_TRUE(transform->planUsesCCMM);
+    TEST_ASSERT_TRUE(transform->luminanceScaleEnabled);
+    clTransformRun(C, transform, 1, srcPixels, actual, 16);
+    TEST_ASSERT_EQUAL_UINT16_ARRAY(expected, actual, 4 * 16);
+
+    clTransformDestroy(C, transform);
+    clTransformDestroy(C, fresh);
+    clProfileDestroy(C, p3g1);
+    clProfileDestroy(C, pq);
+    clContextDestroy(C);
+}
+
+static void test_transform_cache(void)
+{
+    static const float p3[8] = { 0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.3127f, 0.3290f };
+
+    clContext * C = clContextCreate(&silentSystem);
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    clProfile * p3pq = createProfile(C, p3, CL_PCT_PQ, 1.0f, 10000);
+    uint16_t * srcPixels = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    uint16_t * expected = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    uint16_t * actual = clAllocate(sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    fillPixels((uint8_t *)srcPixels, clFalse, 4, 16, TEST_PIXEL_COUNT);
+
+    clTransform * uncached = clTransformCreate(C, p3pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    clTransformRun(C, uncached, 1, srcPixels, expected, TEST_PIXEL_COUNT);
+    clTransformDestroy(C, uncached);
+
+    // Same key (even through a different but identical profile) shares one prepared transform
+    clTransform * a = clTransformAcquire(C, p3pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    clProfile * srgbCopy = clProfileClone(C, srgb);
+    clTransform * b = clTransformAcquire(C, p3pq, CL_XF_RGBA, 16, srgbCopy, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    TEST_ASSERT_TRUE(a == b);
+    TEST_ASSERT_TRUE(a->ccmmReady);
+    clProfileDestroy(C, srgbCopy);
+    clTransformRelease(C, b);
+
+    // Any part of the key changing is a different transform
+    clTransform * c = clTransformAcquire(C, p3pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+    TEST_ASSERT_TRUE(a != c);
+    clTransformRelease(C, c);
+    c = clTransformAcquire(C, p3pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 8, CL_TONEMAP_AUTO);
+    TEST_ASSERT_TRUE(a != c);
+    clTransformRelease(C, c);
+    int defaultLuminance = C->defaultLuminance;
+    C->defaultLuminance = defaultLuminance + 100;
+    c = clTransformAcquire(C, p3pq, CL_XF_RGBA, 16, srgb, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    TEST_ASSERT_TRUE(a != c);
+    clTransformRelease(C, c);
+    C->defaultLuminance = defaultLuminance;
+
+    // Cached transforms keep working after the caller's profiles are gone
+    clProfile * srgbTemp = clProfileClone(C, srgb);
+    clProfile * p3pqTemp = clProfileClone(C, p3pq);
+    clTransformRelease(C, a);
+    clProfileDestroy(C, srgb);
+    clProfileDestroy(C, p3pq);
+    a = clTransformAcquire(C, p3pqTemp, CL_XF_RGBA, 16, srgbTemp, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    clProfileDestroy(C, srgbTemp);
+    clProfileDestroy(C, p3pqTemp);
+    clTransformRun(C, a, 1, srcPixels, actual, TEST_PIXEL_COUNT);
+    TEST_ASSERT_EQUAL_MEMORY(expected, actual, sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+
+    // Held transforms are never evicted; releasing everything leaves at most CL_TRANSFORM_CACHE_SIZE behind
+    clTransform * held[CL_TRANSFORM_CACHE_SIZE + 4];
+    for (int i = 0; i < CL_TRANSFORM_CACHE_SIZE + 4; ++i) {
+        held[i] = clTransformAcquire(C, NULL, CL_XF_XYZ, 32, NULL, CL_XF_RGBA, 9 + (i % 8), (clTonemap)(i / 8));
+    }
+    clTransformRun(C, a, 1, srcPixels, actual, TEST_PIXEL_COUNT);
+    TEST_ASSERT_EQUAL_MEMORY(expected, actual, sizeof(uint16_t) * 4 * TEST_PIXEL_COUNT);
+    clTransformRelease(C, a);
+    for (int i = 0; i < CL_TRANSFORM_CACHE_SIZE + 4; ++i) {
+        clTransformRelease(C, held[i]);
+    }
+
+    clFree(actual);
+    clFree(expected);
+    clFree(srcPixels);
+    clContextDestroy(C);
+}
+
+int test_transform(void)
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_kernels_available);
+    RUN_TEST(test_kernels_match_scalar);
+    RUN_TEST(test_kernels_signal_errors_match_scalar);
+    RUN_TEST(test_transfer_function_tables);
+    RUN_TEST(test_plans);
+    RUN_TEST(test_lcms_combined);
+    RUN_TEST(test_engine_switch);
+    RUN_TEST(test_transform_cache);
+
+    return UNITY_END();
+}
@@ -16,6 +16,9 @@ struct _cmsContext_struct;
 // for va_list
 #include <stdarg.h>
 
+// for FILE
+#include <stdio.h>
+
 struct clContext;
 struct clImage;
 struct clProfile;
@@ -39,10 +42,49 @@ typedef enum clAction
 clAction clActionFromString(struct clContext * C, const char * str);
 const char * clActionToString(struct clContext * C, clAction action);
 
+struct clDecodeHint;
 struct clWriteParams;
-typedef struct clImage * (* clFormatReadFunc)(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+typedef struct clImage * (* clFormatReadFunc)(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 typedef clBool (* clFormatWriteFunc)(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
 
+// Formats whose libraries work a scanline at a time can also decode and encode an image in bands of rows,
+// top to bottom, so a conversion never has to hold a whole image. Each format embeds one of these as the
+// first member of its own state. Rows are always passed in the top rowCount rows of a clImage at least
+// as wide as the image; the rows image's depth and profile match the reader's (or the writer's).
+typedef struct clFormatReader
+{
+    int width;
+    int height;
+    int depth;
+    struct clProfile * profile; // owned by the reader, NULL if the file has none
+    clBool (* readRows)(struct clContext * C, struct clFormatReader * reader, struct clImage * rows, int rowCount); // decodes the next rowCount rows
+    void (* destroy)(struct clContext * C, struct clFormatReader * reader);
+} clFormatReader;
+
+typedef struct clFormatWriter
+{
+    clBool (* writeRows)(struct clContext * C, struct clFormatWriter * writer, struct clImage * rows, int rowCount); // encodes the next rowCount rows
+    clBool (* finish)(struct clContext * C, struct clFormatWriter * writer);                                       // call once every row is written
+    void (* destroy)(struct clContext * C, struct clFormatWriter * writer);
+} clFormatWriter;
+
+// input must outlive the reader. Both return NULL (having logged why) on failure.
+typedef struct clFormatReader * (* clFormatReadBeginFunc)(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
+typedef struct clFormatWriter * (* clFormatWriteBeginFunc)(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams);
+
+// What a format can tell about an image from its headers alone, without decoding any pixels
+typedef struct clProbeInfo
+{
+    int width;
+    int height;
+    int depth;                  // as the format's reader would decode it
+    clBool hasAlpha;
+    struct clProfile * profile; // owned by the caller (see clProbeInfoFree()), NULL if the file has none
+} clProbeInfo;
+
+// Fills info, returning clFalse (having logged why) if the headers can't be parsed or the reader would reject them
+typedef clBool (* clFormatProbeFunc)(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
+
 typedef enum clFormatDepth
 {
     CL_FORMAT_DEPTH_8 = 0,
@@ -68,12 +110,16 @@ typedef struct clFormat
     clBool usesYUVFormat;
     clFormatReadFunc readFunc;
     clFormatWriteFunc writeFunc;
+    clFormatReadBeginFunc readBeginFunc;   // optional, see clFormatReader
+    clFormatWriteBeginFunc writeBeginFunc; // optional, see clFormatWriter
+    clFormatProbeFunc probeFunc;           // optional, see clProbeInfo
 } clFormat;
 
 clBool clFormatExists(struct clContext * C, const char * formatName);
 int clFormatMaxDepth(struct clContext * C, const char * formatName);
 int clFormatBestDepth(struct clContext * C, const char * formatName, int reqDepth);
 const char * clFormatDetect(struct clContext * C, const char * filename);
+const char * clFormatDetectRaw(struct clContext * C, const char * filename, struct clRaw * input); // like clFormatDetect(), but checks signatures against input instead of reopening the file
 
 typedef enum clTonemap
 {
@@ -103,6 +149,30 @@ typedef enum clFilter
 clFilter clFilterFromString(struct clContext * C, const char * str);
 const char * clFilterToString(struct clContext * C, clFilter filter);
 
+// Passed to a reader when only part of the image, or a smaller one, is wanted. Readers that can
+// decode just a region (rect) skip what lies outside it. Otherwise, readers whose codec can decode
+// at a reduced size cheaply (JPEG DCT scaling, JPEG 2000 resolution levels, WebP scaled decoding)
+// may do so, but never below what filter needs to finish the resize. Readers that can do neither
+// ignore the hint, and the caller crops or resizes as usual.
+typedef struct clDecodeHint
+{
+    int rect[4];     // x, y, w, h as with --rect; w or h <= 0 for the whole image
+    int width;       // target size, as with --resize (a dimension <= 0 follows the aspect ratio)
+    int height;
+    clFilter filter; // the filter clImageResize() will finish with
+    int fullWidth;   // set by clDecodeHintChoose*(): the size before any cropping or scaling (0 if ignored)
+    int fullHeight;
+    clBool cropped;  // set by clDecodeHintChooseRect(): the image is just rect (clamped to the image)
+} clDecodeHint;
+
+// Returns the largest power-of-two reduction (1 << shift, shift <= maxShift) that keeps a
+// width x height image at or above what hint needs; 0 when hint is NULL or asks for a rect.
+int clDecodeHintChooseShift(struct clContext * C, clDecodeHint * hint, int width, int height, int maxShift);
+
+// Clamps hint->rect to a width x height image (as clImageAdjustRect() would) and returns clTrue if
+// the reader should decode just that region, which it then must.
+clBool clDecodeHintChooseRect(struct clContext * C, clDecodeHint * hint, int width, int height);
+
 typedef enum clYUVFormat
 {
     CL_YUVFORMAT_AUTO,
@@ -154,12 +224,15 @@ typedef struct clBlendParams
 } clBlendParams;
 void clBlendParamsSetDefaults(struct clContext * C, clBlendParams * blendParams);
 
+#define CL_MAX_COMPOSITE_LAYERS 8
+
 typedef struct clConversionParams
 {
     clBool autoGrade;               // -a
     int bpc;                        // -b
     const char * copyright;         // -c
     const char * description;       // -d
+    int deflateLevel;               // --deflate
     const char * formatName;        // -f
     uint32_t curveType;             // -g
     float gamma;                    // -g
@@ -172,12 +245,14 @@ typedef struct clConversionParams
     int resizeH;                    // --resize
     clFilter resizeFilter;          // --resize
     const char * stripTags;         // -s
-    clBool stats;                   // --stats
+    clBool stats;                   // --stats, --ssim
+    clBool ssim;                    // --ssim
     clTonemap tonemap;              // -t
     clWriteParams writeParams;      // -q, -r, --yuv
     int rect[4];                    // -z
-    const char * compositeFilename; // --composite
-    clBlendParams compositeParams;  // --composite-gamma, --composite-premultiplied
+    const char * compositeFilenames[CL_MAX_COMPOSITE_LAYERS]; // --composite, bottom layer first
+    clBlendParams compositeParams[CL_MAX_COMPOSITE_LAYERS];   // --composite-gamma, --composite-premultiplied, --composite-tonemap
+    int compositeCount;                                        // --composite
 } clConversionParams;
 
 void clConversionParamsSetDefaults(struct clContext * C, clConversionParams * params);
@@ -208,6 +283,12 @@ typedef struct clContext
     const char * inputFilename;  // index 0
     const char * outputFilename; // index 1
     int defaultLuminance;
+    clBool base64SIMD; // SSSE3 Base64 encoding, see clRawBase64SIMDSupported()
+
+    struct clTaskPool * taskPool;             // worker threads, created on first use (see task.h)
+    struct clTransformCache * transformCache; // prepared transforms, created on first use (see transform.h)
+    struct clHaldCLUT * haldCLUT;             // lattice of the last --hald file, reused while it stays the same
+    char * haldCLUTFilename;
 } clContext;
 
 struct clImage;
@@ -231,8 +312,19 @@ void clContextPrintVersions(clContext * C);
 void clContextPrintArgs(clContext * C);
 clBool clContextParseArgs(clContext * C, int argc, const char * argv[]);
 
-struct clImage * clContextRead(clContext * C, const char * filename, const char * iccOverride, const char ** outFormatName);
+struct clImage * clContextRead(clContext * C, const char * filename, const char * iccOverride, clDecodeHint * hint, const char ** outFormatName); // hint may be NULL
+struct clImage * clContextReadRaw(clContext * C, struct clRaw * input, const char * formatName); // decodes an in-memory file
+const char * clContextReadInput(clContext * C, const char * filename, struct clRaw * input); // reads filename once and returns its format, or NULL (input left empty)
+struct clImage * clContextReadImage(clContext * C, struct clRaw * input, const char * formatName, const char * iccOverride, clDecodeHint * hint); // decodes what clContextReadInput() read
+clBool clContextProbe(clContext * C, const char * filename, const char * iccOverride, clProbeInfo * info, const char ** outFormatName); // headers only, when the format has a probeFunc
+clBool clContextProbeRaw(clContext * C, struct clRaw * input, const char * formatName, const char * iccOverride, clProbeInfo * info);
+void clProbeInfoFree(clContext * C, clProbeInfo * info);
 clBool clContextWrite(clContext * C, struct clImage * image, const char * filename, const char * formatName, clWriteParams * writeParams);
+clBool clContextWriteRaw(clContext * C, struct clImage * image, const char * formatName, clWriteParams * writeParams, struct clRaw * output); // encodes to memory
+struct clFormatReader * clContextReadBegin(clContext * C, const char * filename, const char * iccOverride, clDecodeHint * hint, struct clRaw * input); // input must outlive the reader
+struct clFormatWriter * clContextWriteBegin(clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, clWriteParams * writeParams);
+struct clImage * clFormatReaderReadImage(struct clContext * C, struct clFormatReader * reader); // decodes every row into a new image, then destroys reader
+struct clFormatReader * clFormatReaderCrop(struct clContext * C, struct clFormatReader * reader, clDecodeHint * hint); // narrows reader to hint->rect (see clDecodeHintChooseRect()), or returns it as is
 char * clContextWriteURI(struct clContext * C, struct clImage * image, const char * formatName, clWriteParams * writeParams);
 void clContextLogWrite(clContext * C, const char * filename, const char * formatName, clWriteParams * writeParams);
 
@@ -11,30 +11,59 @@
 #include "colorist/context.h"
 #include "colorist/types.h"
 
+#include <stdio.h>
+
 #define CL_CHANNELS_PER_PIXEL 4 // R, G, B, A
-#define CL_BYTES_PER_CHANNEL 2
-#define CL_BYTES_PER_PIXEL (CL_CHANNELS_PER_PIXEL * CL_BYTES_PER_CHANNEL)
 
 struct clProfile;
 struct clRaw;
 struct cJSON;
 
+// How a clImage stores its pixels. This always follows the image's depth (see clPixelFormatFromDepth()),
+// which is also how clTransform lays out integer pixels, so image rows can be handed straight to transforms.
+typedef enum clPixelFormat
+{
+    CL_PIXELFORMAT_U8 = 0, // RGBA, 1 byte per channel (depth 8)
+    CL_PIXELFORMAT_U16     // RGBA, 2 bytes per channel (depth 9-16)
+} clPixelFormat;
+
+clPixelFormat clPixelFormatFromDepth(int depth);
+int clPixelFormatBytesPerChannel(clPixelFormat pixelFormat);
+
 typedef struct clImage
 {
     int width;
     int height;
     int depth;
-    int size;
-    uint16_t * pixels; // always RGBA
+    int size;                  // bytes of pixel data (width * height * pixelBytes), not counting any stride padding
+    clPixelFormat pixelFormat; // follows depth
+    int pixelBytes;            // bytes per RGBA pixel
+    int stride;                // bytes from the start of one row to the next
+    uint8_t * pixelsU8;        // RGBA, only set for CL_PIXELFORMAT_U8
+    uint16_t * pixelsU16;      // RGBA, only set for CL_PIXELFORMAT_U16
     struct clProfile * profile;
+
+    // Views (see clImageCreateView()) borrow their pixels from a parent image
+    struct clImage * parent; // NULL unless this is a view
+    clBool ownsParent;       // destroying this view also destroys its parent
 } clImage;
 
+// Row access for code that doesn't care about the pixel format
+#define CL_IMAGE_PIXELS(IMAGE) (((IMAGE)->pixelFormat == CL_PIXELFORMAT_U8) ? (IMAGE)->pixelsU8 : (uint8_t *)(IMAGE)->pixelsU16)
+#define CL_IMAGE_ROW(IMAGE, Y) (CL_IMAGE_PIXELS(IMAGE) + ((size_t)(Y) * (IMAGE)->stride))
+
+// True when rows follow each other with no gap, so all of CL_IMAGE_PIXELS() can be treated as one span of pixels.
+// Views are packed only when they span the full width of their parent.
+#define CL_IMAGE_IS_PACKED(IMAGE) ((IMAGE)->stride == ((IMAGE)->width * (IMAGE)->pixelBytes))
+
 typedef struct clImageSignals
 {
     float mseLinear;
     float psnrLinear;
     float mseG22;
     float psnrG22;
+    float ssim;   // on 2.2 gamma luminance, clImageCalcSignalsSSIM() only
+    float msssim; // on 2.2 gamma luminance, clImageCalcSignalsSSIM() only
 } clImageSignals;
 
 typedef struct clImagePixelInfo
@@ -77,6 +106,16 @@ typedef struct clImageDiff
     int largestChannelDiff;
 } clImageDiff;
 
+// Per-pixel comparison counts, without the visualization clImageDiff builds
+typedef struct clImageCompareStats
+{
+    int pixelCount;
+    int matchCount;          // pixels whose channels are all identical
+    int underThresholdCount; // pixels whose largest channel difference is within the threshold
+    int overThresholdCount;  // pixels whose largest channel difference is over the threshold
+    int largestChannelDiff;
+} clImageCompareStats;
+
 typedef struct clImageSRGBHighlightPixel
 {
     float x;
@@ -94,6 +133,7 @@ typedef struct clImageSRGBHighlightPixelInfo
 } clImageSRGBHighlightPixelInfo;
 clImageSRGBHighlightPixelInfo * clImageSRGBHighlightPixelInfoCreate(struct clContext * C, int pixelCount);
 void clImageSRGBHighlightPixelInfoDestroy(struct clContext * C, clImageSRGBHighlightPixelInfo * pixelInfo);
+clBool clImageSRGBHighlightPixelInfoWrite(struct clContext * C, clImageSRGBHighlightPixelInfo * pixelInfo, int width, int height, int tileSize, FILE * f); // streams highlightInfoJSON, see clRawWriteStructArray()
 
 typedef struct clImageSRGBHighlightStats
 {
@@ -107,28 +147,83 @@ typedef struct clImageSRGBHighlightStats
     float brightestPixelNits;
 } clImageSRGBHighlightStats;
 
+// clImagePipeline runs the per-pixel stages of a conversion (convert -> composite -> HALD) over bands of
+// rows instead of whole images. Each band passes through every stage in band-sized scratch buffers and
+// lands directly in the destination image, and bands are spread across C's task pool. Peak memory is the
+// source, the destination and a few bands' worth of scratch per thread, and the output matches running
+// clImageConvert(), clImageBlend() (once per layer) and clImageApplyHALD() one after another.
+#define CL_IMAGE_PIPELINE_BAND_PIXELS (64 * 1024) // default band size; bands are always whole rows
+
+typedef struct clImagePipelineLayer
+{
+    clImage * image; // not owned
+    clBool premultiplied;
+    struct clProfile * blendProfile;
+    struct clTransform * srcBlendTransform;
+    struct clTransform * cmpBlendTransform;
+    struct clTransform * dstBlendTransform;
+} clImagePipelineLayer;
+
+typedef struct clImagePipeline
+{
+    clImage * srcImage; // not owned, must outlive clImagePipelineRun()
+    clImage * dstImage; // owned until returned by clImagePipelineRun()
+    int bandHeight;
+
+    // Convert (NULL: dstImage matches srcImage's depth and profile, pixels are copied as-is)
+    struct clTransform * convertTransform;
+
+    // Composite layers (optional), blended bottom to top
+    clImagePipelineLayer layers[CL_MAX_COMPOSITE_LAYERS];
+    int layerCount;
+
+    // HALD CLUT (optional, either ownedHald or borrowed from the caller)
+    const struct clHaldCLUT * hald;
+    struct clHaldCLUT * ownedHald;
+} clImagePipeline;
+
+clImagePipeline * clImagePipelineCreate(struct clContext * C, clImage * srcImage, int depth, struct clProfile * dstProfile, clTonemap tonemap); // NULL dstProfile converts to sRGB
+clImagePipeline * clImagePipelineCreateCopy(struct clContext * C, clImage * srcImage); // no convert stage; keeps srcImage's depth and profile
+clBool clImagePipelineAddComposite(struct clContext * C, clImagePipeline * pipeline, clImage * compositeImage, clBlendParams * blendParams); // call once per layer, bottom first
+void clImagePipelineAddHALD(struct clContext * C, clImagePipeline * pipeline, clImage * hald, int haldDims);
+void clImagePipelineAddHALDCLUT(struct clContext * C, clImagePipeline * pipeline, const struct clHaldCLUT * clut); // clut is not owned, must outlive clImagePipelineRun()
+clImage * clImagePipelineRun(struct clContext * C, clImagePipeline * pipeline, int taskCount); // caller owns the returned image
+void clImagePipelineRunRows(struct clContext * C, clImagePipeline * pipeline, int rowCount, int taskCount); // top rowCount rows only, and dstImage stays in the pipeline (for streaming, see clFormatReader)
+void clImagePipelineDestroy(struct clContext * C, clImagePipeline * pipeline);
+
 clImage * clImageCreate(struct clContext * C, int width, int height, int depth, struct clProfile * profile);
 clImage * clImageRotate(struct clContext * C, clImage * image, int cwTurns);
 clImage * clImageConvert(struct clContext * C, clImage * srcImage, int taskCount, int depth, struct clProfile * dstProfile, clTonemap tonemap);
-clImage * clImageCrop(struct clContext * C, clImage * srcImage, int x, int y, int w, int h, clBool keepSrc);
+clImage * clImageCreateView(struct clContext * C, clImage * image, int x, int y, int w, int h); // shares image's pixels; image must outlive the view
+clImage * clImageCrop(struct clContext * C, clImage * srcImage, int x, int y, int w, int h, clBool keepSrc); // returns a view when !keepSrc, a copy otherwise
+clImage * clImagePack(struct clContext * C, clImage * image); // image itself if CL_IMAGE_IS_PACKED(), otherwise a packed copy the caller destroys
 clImage * clImageApplyHALD(struct clContext * C, clImage * image, clImage * hald, int haldDims);
 clImage * clImageResize(struct clContext * C, clImage * image, int width, int height, clFilter resizeFilter);
 clImage * clImageBlend(struct clContext * C, clImage * image, clImage * compositeImage, int taskCount, clBlendParams * blendParams);
+clImage * clImageBlendLayers(struct clContext * C, clImage * image, int layerCount, clImage ** compositeImages, clBlendParams * blendParams, int taskCount); // compositeImages and blendParams are bottom layer first
 clImage * clImageCreateSRGBHighlight(clContext * C, clImage * srcImage, int srgbLuminance, clImageSRGBHighlightStats * stats, clImageSRGBHighlightPixelInfo * outPixelInfo, struct cJSON ** highlightInfoJSON);
 clBool clImageAdjustRect(struct clContext * C, clImage * image, int * x, int * y, int * w, int * h);
 void clImageColorGrade(struct clContext * C, clImage * image, int taskCount, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose);
 void clImageSetPixel(struct clContext * C, clImage * image, int x, int y, int r, int g, int b, int a);
+void clImageGetPixel(struct clContext * C, clImage * image, int x, int y, uint16_t outRGBA[4]);
+void clImageRowsToFloat(struct clContext * C, clImage * image, int y, int rowCount, float * outPixels);         // normalized RGBA floats
+void clImageRowsFromFloat(struct clContext * C, clImage * image, int y, int rowCount, const float * inPixels); // normalized RGBA floats
 void clImageDebugDump(struct clContext * C, clImage * image, int x, int y, int w, int h, int extraIndent);
 void clImageDebugDumpJSON(struct clContext * C, struct cJSON * jsonOutput, clImage * image, int x, int y, int w, int h);
+void clImageDebugDumpRegion(struct clContext * C, clImage * image, const clDecodeHint * hint, int extraIndent);          // image is hint->rect of the file (hint->cropped), dumped in file coordinates
+void clImageDebugDumpRegionJSON(struct clContext * C, struct cJSON * jsonOutput, clImage * image, const clDecodeHint * hint); // same, for JSON
 void clImageDebugDumpPixel(struct clContext * C, clImage * image, int x, int y, clImagePixelInfo * pixelInfo);
 void clImageDestroy(struct clContext * C, clImage * image);
 void clImageLogCreate(struct clContext * C, int width, int height, int depth, struct clProfile * profile);
 clImage * clImageParseString(struct clContext * C, const char * str, int depth, struct clProfile * profile);
 clBool clImageCalcSignals(struct clContext * C, int taskCount, clImage * srcImage, clImage * dstImage, clImageSignals * signals);
+clBool clImageCalcSignalsSSIM(struct clContext * C, int taskCount, clImage * srcImage, clImage * dstImage, clImageSignals * signals); // adds SSIM and MS-SSIM, gathered in the same pass
 
 clImageDiff * clImageDiffCreate(struct clContext * C, clImage * image1, clImage * image2, int taskCount, float minIntensity, int threshold);
 void clImageDiffUpdate(struct clContext * C, clImageDiff * diff, int threshold);
 void clImageDiffDestroy(struct clContext * C, clImageDiff * diff);
+clBool clImageCompare(struct clContext * C, clImage * image1, clImage * image2, int taskCount, int threshold, clImageCompareStats * stats); // clFalse if dimensions, depth or profile differ
+clBool clImageIdentical(struct clContext * C, clImage * image1, clImage * image2, int taskCount, int threshold); // clTrue if comparable and no channel differs by more than threshold; stops at the first difference found
 
 void clImageToRGB8(struct clContext * C, clImage * image, uint8_t * outPixels);
 void clImageFromRGB8(struct clContext * C, clImage * image, uint8_t * inPixels);
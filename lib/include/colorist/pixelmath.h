@@ -20,9 +20,59 @@ clBool clPixelMathEqualsf(float a, float b);
 float clPixelMathRoundNormalized(float normalizedValue, float factor); // Clamps normalizedValue int [0,1], then scales by factor, then rounds. Used in unorm conversion
 void clPixelMathUNormToFloat(struct clContext * C, uint16_t * inPixels, int inDepth, float * outPixels, int pixelCount);
 void clPixelMathFloatToUNorm(struct clContext * C, float * inPixels, uint16_t * outPixels, int outDepth, int pixelCount);
+void clPixelMathUNorm8ToFloat(struct clContext * C, const uint8_t * inPixels, float * outPixels, int pixelCount);
+void clPixelMathFloatToUNorm8(struct clContext * C, const float * inPixels, uint8_t * outPixels, int pixelCount);
 void clPixelMathScaleLuminance(struct clContext * C, float * pixels, int pixelCount, float luminanceScale, clBool tonemap);
 void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile * pixelProfile, float * pixels, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose);
+void clPixelMathColorGradeUNorm(struct clContext * C, int taskCount, struct clProfile * pixelProfile, const void * pixels, int depth, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose); // pixels are RGBA uint8_t for depth 8, uint16_t otherwise. Same result as clPixelMathColorGrade() on the float-converted pixels, via per code error term tables
 void clPixelMathResize(struct clContext * C, int srcW, int srcH, float * srcPixels, int dstW, int dstH, float * dstPixels, clFilter filter);
-void clPixelMathHaldCLUTLookup(struct clContext * C, float * haldData, int haldDims, const float src[4], float dst[4]);
+void clPixelMathBlend(struct clContext * C, const float * srcPixels, const float * cmpPixels, float * dstPixels, int pixelCount, clBool premultiplied); // SourceOver, cmp on top of src
+
+// Hald CLUT lattice, expanded to floats once and shareable by any number of images and threads.
+// Entry (r, g, b) is at lattice[((b * dims + g) * dims + r) * CL_HALD_LATTICE_STRIDE], red varying fastest
+// as in the Hald image; the unused fourth float lets an entry load as one vector.
+#define CL_HALD_LATTICE_STRIDE 4
+typedef struct clHaldCLUT
+{
+    int dims;
+    float * lattice;
+} clHaldCLUT;
+
+clHaldCLUT * clHaldCLUTCreate(struct clContext * C, const float * haldPixels, int haldDims); // haldPixels: haldDims^3 RGBA float pixels
+void clHaldCLUTDestroy(struct clContext * C, clHaldCLUT * clut);
+void clPixelMathHaldCLUTApply(struct clContext * C, const clHaldCLUT * clut, const float * srcPixels, float * dstPixels, int pixelCount); // tetrahedral interpolation, alpha passes through. src and dst may be the same
+
+// Separable resampling. A clResizePlan holds the filter taps for each axis, computed once up front;
+// clPixelMathResizeRun() then filters bands of destination rows in parallel, reading and writing rows
+// of RGBA channels directly (see clResizeBuffer), so integer images never need a full float copy.
+// Kernels, edge clamping and alpha weighting follow stb_image_resize.
+typedef struct clResizeTaps
+{
+    int srcSize;
+    int dstSize;
+    int maxTaps;     // stride of weights
+    int * first;     // per destination pixel: first source pixel read
+    int * count;     // per destination pixel: number of source pixels read
+    float * weights; // per destination pixel: maxTaps weights, summing to 1
+} clResizeTaps;
+
+typedef struct clResizePlan
+{
+    clFilter filter;
+    clBool premultiply; // filter color weighted by alpha (everything except nearest)
+    clResizeTaps horizontal;
+    clResizeTaps vertical;
+} clResizePlan;
+
+typedef struct clResizeBuffer
+{
+    uint8_t * pixels; // first row
+    int stride;       // bytes from one row to the next
+    int depth;        // 8: uint8_t channels, 9-16: uint16_t channels, 32: float channels
+} clResizeBuffer;
+
+clResizePlan * clPixelMathResizePlanCreate(struct clContext * C, int srcW, int srcH, int dstW, int dstH, clFilter filter);
+void clPixelMathResizeRun(struct clContext * C, clResizePlan * plan, int taskCount, const clResizeBuffer * src, clResizeBuffer * dst); // integer destinations are clamped, float destinations are not
+void clPixelMathResizePlanDestroy(struct clContext * C, clResizePlan * plan);
 
 #endif
@@ -10,13 +10,16 @@
 
 #include "colorist/types.h"
 
+#include <stdio.h>
+
 typedef struct clRaw
 {
     uint8_t * ptr;
     size_t size;
+    clBool mapped; // ptr is a read-only view of a file (see clRawReadFile()), released by clRawFree()
 } clRaw;
 
-#define CL_RAW_EMPTY { NULL, 0 }
+#define CL_RAW_EMPTY { NULL, 0, clFalse }
 
 typedef struct clStructArraySchema
 {
@@ -28,13 +31,27 @@ struct clContext;
 
 void clRawRealloc(struct clContext * C, clRaw * raw, size_t newSize);
 void clRawClone(struct clContext * C, clRaw * dst, const clRaw * src);
-clBool clRawDeflate(struct clContext * C, clRaw * dst, const clRaw * src);
+#define CL_DEFLATE_LEVEL_DEFAULT -1 // zlib's default (6)
+
+clBool clRawDeflate(struct clContext * C, clRaw * dst, const clRaw * src); // clRawDeflateParallel() at the default level on one task
+clBool clRawDeflateParallel(struct clContext * C, clRaw * dst, const clRaw * src, int level, int taskCount); // output is independent of taskCount
 char * clRawToBase64(struct clContext * C, clRaw * src);
+clBool clRawBase64SIMDSupported(void); // CPU check behind C->base64SIMD, run once by clContextCreate()
 void clRawSet(struct clContext * C, clRaw * raw, const uint8_t * data, size_t len);
 void clRawFree(struct clContext * C, clRaw * raw);
-clBool clRawReadFile(struct clContext * C, clRaw * raw, const char * filename);
+clBool clRawReadFile(struct clContext * C, clRaw * raw, const char * filename); // maps large regular files instead of copying them
 clBool clRawReadFileHeader(struct clContext * C, clRaw * raw, const char * filename, size_t bytes);
 clBool clRawWriteFile(struct clContext * C, clRaw * raw, const char * filename);
 struct cJSON * clRawToStructArray(struct clContext * C, clRaw * raw, int width, int height, clStructArraySchema * schema, int schemaCount);
 
+// Streaming variants of the above for large payloads: these encode a chunk at a time straight into f, so
+// neither the deflated bytes nor the Base64 text ever exist in memory all at once.
+clBool clRawWriteBase64(struct clContext * C, FILE * f, const clRaw * src); // no quotes or prefix
+clBool clRawWriteDeflatedBase64(struct clContext * C, FILE * f, const clRaw * src, int level, int taskCount);
+
+// Writes the JSON of clRawToStructArray() into f. A tileSize > 0 splits the elements into tileSize x tileSize
+// tiles (right and bottom edges may be smaller), each deflated on its own and listed row by row in a "tiles"
+// array of Base64 strings, in place of the single "data" string.
+clBool clRawWriteStructArray(struct clContext * C, FILE * f, clRaw * raw, int width, int height, clStructArraySchema * schema, int schemaCount, int tileSize, int level, int taskCount);
+
 #endif
@@ -13,11 +13,37 @@
 struct clContext;
 
 typedef void (* clTaskFunc)(void * userData);
+typedef void (* clTaskRangeFunc)(void * userData, int start, int end);
+
+// All tasks run on a persistent pool of worker threads owned by the clContext (C->taskPool), created
+// on first use and destroyed by clContextDestroy(). Each worker owns a deque of jobs: it pushes and pops
+// its own work at one end, and idle workers steal from the other end. Threads waiting on a task help
+// run its jobs, so tasks may safely create and wait on other tasks.
+struct clTaskPool;
+struct clTaskPool * clTaskPoolCreate(struct clContext * C, int workerCount);
+void clTaskPoolDestroy(struct clContext * C, struct clTaskPool * pool);
+
+// Calls func(userData, start, end) over [0, count) in pieces of at most chunkSize, using up to
+// maxThreads threads (including the calling thread), and returns when all pieces are finished.
+// Ranges that fit in a single chunk (or maxThreads of 1) run directly on the calling thread.
+void clTaskParallelFor(struct clContext * C, int maxThreads, int count, int chunkSize, clTaskRangeFunc func, void * userData);
+
+// A flag any thread running a task may raise for the others to poll, e.g. so the rest of a
+// clTaskParallelFor() can skip work once its answer is known. It orders no other memory, so it can only
+// ever be a hint: results still come back through the task's own data once the task is finished.
+typedef struct clTaskFlag
+{
+    long raised;
+} clTaskFlag;
+
+void clTaskFlagClear(clTaskFlag * flag); // call before starting the tasks that share it
+void clTaskFlagRaise(clTaskFlag * flag);
+clBool clTaskFlagIsRaised(clTaskFlag * flag);
 
 typedef struct clTask
 {
     clTaskFunc func;
-    void * nativeData;
+    void * nativeData; // the task's pool batch, or NULL once it has been joined (or if it ran inline)
     void * userData;
     clBool joined;
 } clTask;
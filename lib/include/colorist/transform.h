@@ -38,6 +38,56 @@ typedef enum clTransformTransferFunction
     CL_XTF_PQ
 } clTransformTransferFunction;
 
+// clTransformRun() works on spans of pixels: each span is unpacked into planar floats, all color
+// math is performed on the planar data, and the span is packed into the destination format.
+#define CL_TRANSFORM_SPAN_SIZE 256
+
+typedef struct clTransformSpan
+{
+    float ch[4][CL_TRANSFORM_SPAN_SIZE]; // planar R,G,B,A (or X,Y,Z,A)
+} clTransformSpan;
+
+typedef enum clTransformSIMD
+{
+    CL_XSIMD_NONE = 0,
+    CL_XSIMD_SSE41,
+    CL_XSIMD_AVX2,
+
+    CL_XSIMD_COUNT
+} clTransformSIMD;
+
+// Span kernels (see transform_simd.c). Every SIMD implementation is bit-exact with the scalar one:
+// they perform the same IEEE float operations in the same order (no FMA contraction, no approximations).
+typedef struct clTransformKernels
+{
+    const char * name;
+    void (* unpackFloat)(clTransformSpan * span, const float * src, int srcChannels, int count);
+    void (* unpackUNorm)(clTransformSpan * span, const uint16_t * src, int srcChannels, float srcRescale, int count);
+    void (* packFloat)(float * dst, int dstChannels, const clTransformSpan * span, int count);
+    void (* packUNorm)(uint16_t * dst, int dstChannels, const clTransformSpan * span, float dstRescale, int count);
+    void (* matrix)(clTransformSpan * span, const gbMat3 * m, clBool clamp, int count); // in-place on ch[0-2]
+
+    // clImageCalcSignals(): scales src and dst by scale and clamps them to [0, 1], writes their squared differences
+    // to squaredLinear, replaces both with their 2.2 gamma from gammaLUT (gammaLUTSize + 1 samples), and writes
+    // those squared differences to squaredG22
+    void (* signalErrors)(float * src, float * dst, float * squaredLinear, float * squaredG22, const float * gammaLUT, int gammaLUTSize, float scale, int count);
+} clTransformKernels;
+
+const clTransformKernels * clTransformKernelsGet(clTransformSIMD simd); // returns NULL if unsupported by this CPU / build
+const clTransformKernels * clTransformKernelsBest(void);                // runtime CPU dispatch
+
+// How clTransformPrepare() decided to execute a transform's color math, from fastest to slowest
+typedef enum clTransformPlan
+{
+    CL_XPLAN_MATRIX = 0, // CCMM: EOTF, one src->dst matrix (with any plain luminance scale folded in), OETF
+    CL_XPLAN_LCMS,       // LCMS: no luminance scaling required, one src->dst call (lcmsCombined)
+    CL_XPLAN_LUMINANCE   // src->XYZ, luminance scale / tonemap applied to Y as a ratio, XYZ->dst
+} clTransformPlan;
+
+// Integer destinations apply the OETF by linearly interpolating a table sampled evenly over the fourth
+// root of linear light, which spends most of the samples where the curves are steepest (near black).
+#define CL_TRANSFORM_OETF_TABLE_SIZE 4096
+
 // clTransform does not own either clProfile and it is expected that both will outlive the clTransform that uses them
 typedef struct clTransform
 {
@@ -56,6 +106,11 @@ typedef struct clTransform
     clTonemap tonemap;
     clBool tonemapEnabled;        // calculated from incoming tonemap value
     clBool luminanceScaleEnabled; // optimization; if false, avoid all luminance scaling math
+    clTransformPlan plan;
+    clBool planUsesCCMM;      // which engine plan and the luminance scales below were compiled for
+    float luminanceScale;     // Y multiplier prior to any tonemap (CL_XPLAN_LUMINANCE)
+    float luminancePostScale; // Y multiplier after any tonemap (CL_XPLAN_LUMINANCE)
+    const clTransformKernels * kernels; // chosen at creation via clTransformKernelsBest()
 
     // Cache for CCMM objects
     clTransformTransferFunction ccmmSrcEOTF;
@@ -65,7 +120,10 @@ typedef struct clTransform
     gbMat3 ccmmSrcToXYZ;
     gbMat3 ccmmXYZToDst;
     gbMat3 ccmmCombined;
+    gbMat3 ccmmPlanMatrix; // src->dst including luminance scale (CL_XPLAN_MATRIX)
     float ccmmHLGLuminance;
+    float * ccmmSrcEOTFTable; // (1 << srcDepth) linear values indexed by source code value, or NULL for float sources
+    float * ccmmDstOETFTable; // CL_TRANSFORM_OETF_TABLE_SIZE+1 samples over sqrt(sqrt(x)), or NULL for float destinations
     clBool ccmmReady;
 
     // Cache for LittleCMS objects
@@ -83,6 +141,22 @@ clBool clTransformUsesCCMM(struct clContext * C, clTransform * transform);
 const char * clTransformCMMName(struct clContext * C, clTransform * transform);    // Convenience function
 float clTransformGetLuminanceScale(struct clContext * C, clTransform * transform); // Convenience function
 void clTransformRun(struct clContext * C, clTransform * transform, int taskCount, void * srcPixels, void * dstPixels, int pixelCount);
+// Runs an already prepared transform on the calling thread without touching the transform itself, so
+// any number of threads may run the same transform at once (clTransformRun() re-prepares it first).
+void clTransformRunPrepared(struct clContext * C, clTransform * transform, void * srcPixels, void * dstPixels, int pixelCount);
+
+// Prepared transforms are expensive to build (profile queries, matrix derivation, LittleCMS pipelines), so
+// clContext keeps an LRU cache of them keyed by both profile signatures, formats, depths, tonemap and the
+// context settings that affect preparation (defaultLuminance, ccmmAllowed). clTransformAcquire() returns a
+// prepared transform (from the cache when possible) that must be handed back with clTransformRelease().
+// Cached transforms own copies of their profiles, so the profiles passed in only need to outlive this call.
+// Acquired transforms are shared: treat them as read-only.
+#define CL_TRANSFORM_CACHE_SIZE 16
+
+struct clTransformCache;
+clTransform * clTransformAcquire(struct clContext * C, struct clProfile * srcProfile, clTransformFormat srcFormat, int srcDepth, struct clProfile * dstProfile, clTransformFormat dstFormat, int dstDepth, clTonemap tonemap);
+void clTransformRelease(struct clContext * C, clTransform * transform);
+void clTransformCacheDestroy(struct clContext * C, struct clTransformCache * cache);
 
 clBool clTransformFormatIsFloat(struct clContext * C, clTransformFormat format, int depth);
 int clTransformFormatToPixelBytes(struct clContext * C, clTransformFormat format, int depth);
@@ -41,6 +41,8 @@ typedef int clBool;
 #define clFalse 0
 #define clTrue 1
 
+clBool clFileSame(const char * filename1, const char * filename2); // same file on disk, however it is named
+
 typedef struct Timer
 {
     double start;
@@ -7,7 +7,9 @@
 
 #include "colorist/context.h"
 
+#include "colorist/pixelmath.h"
 #include "colorist/profile.h"
+#include "colorist/raw.h"
 #include "colorist/task.h"
 #include "colorist/transform.h"
 
@@ -80,27 +82,42 @@ const char * clActionToString(struct clContext * C, clAction action)
 // ------------------------------------------------------------------------------------------------
 // clFormat
 
-static char const * clFormatDetectHeader(struct clContext * C, const char * filename)
+static char const * clFormatDetectSignature(struct clContext * C, const uint8_t * ptr, size_t size)
 {
-    clRaw raw = CL_RAW_EMPTY;
-    if (clRawReadFileHeader(C, &raw, filename, 12)) {
-        for (clFormatRecord * record = C->formats; record != NULL; record = record->next) {
-            int signatureIndex;
-            for (signatureIndex = 0; signatureIndex < CL_FORMAT_MAX_SIGNATURES; ++signatureIndex) {
-                const unsigned char * signature = record->format.signatures[signatureIndex];
-                size_t signatureLength = record->format.signatureLengths[signatureIndex];
-                if (signature && !memcmp(signature, raw.ptr, signatureLength)) {
-                    clRawFree(C, &raw);
-                    return record->format.name;
-                }
+    for (clFormatRecord * record = C->formats; record != NULL; record = record->next) {
+        int signatureIndex;
+        for (signatureIndex = 0; signatureIndex < CL_FORMAT_MAX_SIGNATURES; ++signatureIndex) {
+            const unsigned char * signature = record->format.signatures[signatureIndex];
+            size_t signatureLength = record->format.signatureLengths[signatureIndex];
+            if (signature && (signatureLength <= size) && !memcmp(signature, ptr, signatureLength)) {
+                return record->format.name;
             }
         }
     }
-    clRawFree(C, &raw);
     return NULL;
 }
 
+static char const * clFormatDetectHeader(struct clContext * C, const char * filename, clRaw * input)
+{
+    if (input) {
+        return clFormatDetectSignature(C, input->ptr, input->size);
+    }
+
+    const char * formatName = NULL;
+    clRaw raw = CL_RAW_EMPTY;
+    if (clRawReadFileHeader(C, &raw, filename, 12)) {
+        formatName = clFormatDetectSignature(C, raw.ptr, raw.size);
+    }
+    clRawFree(C, &raw);
+    return formatName;
+}
+
 const char * clFormatDetect(struct clContext * C, const char * filename)
+{
+    return clFormatDetectRaw(C, filename, NULL);
+}
+
+const char * clFormatDetectRaw(struct clContext * C, const char * filename, clRaw * input)
 {
     // If either slash is AFTER the last period in the filename, there is no extension
     const char * lastBackSlash = strrchr(filename, '\\');
@@ -110,7 +127,7 @@ const char * clFormatDetect(struct clContext * C, const char * filename)
         (lastBackSlash && (lastBackSlash > ext)) ||
         (lastSlash && (lastSlash > ext)))
     {
-        ext = clFormatDetectHeader(C, filename);
+        ext = clFormatDetectHeader(C, filename, input);
         if (ext)
             return ext;
 
@@ -133,7 +150,7 @@ const char * clFormatDetect(struct clContext * C, const char * filename)
         }
     }
 
-    ext = clFormatDetectHeader(C, filename);
+    ext = clFormatDetectHeader(C, filename, input);
     if (ext)
         return ext;
 
@@ -345,6 +362,7 @@ void clConversionParamsSetDefaults(clContext * C, clConversionParams * params)
 {
     clConversionParamsSetOutputProfileDefaults(C, params);
     params->bpc = 0;
+    params->deflateLevel = CL_DEFLATE_LEVEL_DEFAULT;
     params->formatName = NULL;
     params->hald = NULL;
     params->jobs = clTaskLimit();
@@ -358,10 +376,14 @@ void clConversionParamsSetDefaults(clContext * C, clConversionParams * params)
     params->resizeFilter = CL_FILTER_AUTO;
     params->stripTags = NULL;
     params->stats = clFalse;
+    params->ssim = clFalse;
     params->tonemap = CL_TONEMAP_AUTO;
-    params->compositeFilename = NULL;
+    params->compositeCount = 0;
     clWriteParamsSetDefaults(C, &params->writeParams);
-    clBlendParamsSetDefaults(C, &params->compositeParams);
+    for (int i = 0; i < CL_MAX_COMPOSITE_LAYERS; ++i) {
+        params->compositeFilenames[i] = NULL;
+        clBlendParamsSetDefaults(C, &params->compositeParams[i]);
+    }
 }
 
 void clWriteParamsSetDefaults(struct clContext * C, clWriteParams * writeParams)
@@ -417,6 +439,12 @@ clContext * clContextCreate(clContextSystem * system)
     // to fully honor the chad tags in the profiles (if any).
     cmsSetAdaptationStateTHR(C->lcms, 0);
 
+    C->taskPool = NULL;
+    C->transformCache = NULL;
+    C->haldCLUT = NULL;
+    C->haldCLUTFilename = NULL;
+    C->base64SIMD = clRawBase64SIMDSupported();
+
     clContextSetDefaultArgs(C);
     clContextRegisterBuiltinFormats(C);
     return C;
@@ -424,6 +452,21 @@ clContext * clContextCreate(clContextSystem * system)
 
 void clContextDestroy(clContext * C)
 {
+    if (C->transformCache) {
+        clTransformCacheDestroy(C, C->transformCache);
+        C->transformCache = NULL;
+    }
+    if (C->taskPool) {
+        clTaskPoolDestroy(C, C->taskPool);
+        C->taskPool = NULL;
+    }
+    if (C->haldCLUT) {
+        clHaldCLUTDestroy(C, C->haldCLUT);
+        clFree(C->haldCLUTFilename);
+        C->haldCLUT = NULL;
+        C->haldCLUTFilename = NULL;
+    }
+
     clFormatRecord * record = C->formats;
     while (record != NULL) {
         clFormatRecord * freeme = record;
@@ -642,6 +685,20 @@ static clBool parseResize(clContext * C, clConversionParams * params, const char
 
 static clBool validateArgs(clContext * C);
 
+// --composite-* options apply to the most recent --composite (if any) and every one after it, so
+// returns the params of the last layer so far and of the next one
+static int editableCompositeParams(clContext * C, clBlendParams * editable[2])
+{
+    int count = 0;
+    if (C->params.compositeCount > 0) {
+        editable[count++] = &C->params.compositeParams[C->params.compositeCount - 1];
+    }
+    if (C->params.compositeCount < CL_MAX_COMPOSITE_LAYERS) {
+        editable[count++] = &C->params.compositeParams[C->params.compositeCount];
+    }
+    return count;
+}
+
 clBool clContextParseArgs(clContext * C, int argc, const char * argv[])
 {
     clContextSetDefaultArgs(C); // Reset to all defaults
@@ -690,6 +747,13 @@ clBool clContextParseArgs(clContext * C, int argc, const char * argv[])
                     C->params.curveType = CL_PCT_GAMMA;
                     C->params.gamma = (float)strtod(arg, NULL);
                 }
+            } else if (!strcmp(arg, "--deflate")) {
+                NEXTARG();
+                C->params.deflateLevel = atoi(arg);
+                if ((C->params.deflateLevel < 0) || (C->params.deflateLevel > 9)) {
+                    clContextLogError(C, "--deflate requires a level from 0 to 9");
+                    return clFalse;
+                }
             } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
                 C->help = clTrue;
             } else if (!strcmp(arg, "--hald")) {
@@ -733,24 +797,48 @@ clBool clContextParseArgs(clContext * C, int argc, const char * argv[])
                 C->params.stripTags = arg;
             } else if (!strcmp(arg, "--stats")) {
                 C->params.stats = clTrue;
+            } else if (!strcmp(arg, "--ssim")) {
+                C->params.stats = clTrue;
+                C->params.ssim = clTrue;
             } else if (!strcmp(arg, "-t") || !strcmp(arg, "--tonemap")) {
                 NEXTARG();
                 C->params.tonemap = clTonemapFromString(C, arg);
             } else if (!strcmp(arg, "--composite")) {
                 NEXTARG();
-                C->params.compositeFilename = arg;
+                if (C->params.compositeCount == CL_MAX_COMPOSITE_LAYERS) {
+                    clContextLogError(C, "Too many composite layers (max %d)", CL_MAX_COMPOSITE_LAYERS);
+                    return clFalse;
+                }
+                C->params.compositeFilenames[C->params.compositeCount] = arg;
+                ++C->params.compositeCount;
+                if (C->params.compositeCount < CL_MAX_COMPOSITE_LAYERS) {
+                    C->params.compositeParams[C->params.compositeCount] = C->params.compositeParams[C->params.compositeCount - 1];
+                }
             } else if (!strcmp(arg, "--composite-gamma")) {
                 NEXTARG();
-                C->params.compositeParams.gamma = (float)atof(arg);
-                if (C->params.compositeParams.gamma <= 0.0f) {
+                float gamma = (float)atof(arg);
+                if (gamma <= 0.0f) {
                     clContextLogError(C, "Invalid composite gamma: %s", arg);
                     return clFalse;
                 }
+                clBlendParams * editable[2];
+                int editableCount = editableCompositeParams(C, editable);
+                for (int i = 0; i < editableCount; ++i) {
+                    editable[i]->gamma = gamma;
+                }
             } else if (!strcmp(arg, "--composite-tonemap")) {
                 NEXTARG();
-                C->params.compositeParams.cmpTonemap = clTonemapFromString(C, arg);
+                clBlendParams * editable[2];
+                int editableCount = editableCompositeParams(C, editable);
+                for (int i = 0; i < editableCount; ++i) {
+                    editable[i]->cmpTonemap = clTonemapFromString(C, arg);
+                }
             } else if (!strcmp(arg, "--composite-premultiplied")) {
-                C->params.compositeParams.premultiplied = clTrue;
+                clBlendParams * editable[2];
+                int editableCount = editableCompositeParams(C, editable);
+                for (int i = 0; i < editableCount; ++i) {
+                    editable[i]->premultiplied = clTrue;
+                }
             } else if (!strcmp(arg, "-v") || !strcmp(arg, "--verbose")) {
                 C->verbose = clTrue;
             } else if (!strcmp(arg, "--yuv")) {
@@ -924,10 +1012,15 @@ void clContextPrintArgs(clContext * C)
         clContextLog(C, "syntax", 1, "bpc         : %d", C->params.bpc);
     else
         clContextLog(C, "syntax", 1, "bpc         : auto");
-    clContextLog(C, "syntax", 1, "composite   : %s", C->params.compositeFilename ? C->params.compositeFilename : "--");
-    clContextLog(C, "syntax", 1, "cmp. gamma  : %f", C->params.compositeParams.gamma);
-    clContextLog(C, "syntax", 1, "cmp. tonemap: %s", clTonemapToString(C, C->params.compositeParams.cmpTonemap));
-    clContextLog(C, "syntax", 1, "cmp. premul : %s", C->params.compositeParams.premultiplied ? "true" : "false");
+    if (C->params.compositeCount == 0) {
+        clContextLog(C, "syntax", 1, "composite   : --");
+    }
+    for (int i = 0; i < C->params.compositeCount; ++i) {
+        clContextLog(C, "syntax", 1, "composite   : %s", C->params.compositeFilenames[i]);
+        clContextLog(C, "syntax", 1, "cmp. gamma  : %f", C->params.compositeParams[i].gamma);
+        clContextLog(C, "syntax", 1, "cmp. tonemap: %s", clTonemapToString(C, C->params.compositeParams[i].cmpTonemap));
+        clContextLog(C, "syntax", 1, "cmp. premul : %s", C->params.compositeParams[i].premultiplied ? "true" : "false");
+    }
     clContextLog(C, "syntax", 1, "copyright   : %s", C->params.copyright ? C->params.copyright : "--");
     clContextLog(C, "syntax", 1, "description : %s", C->params.description ? C->params.description : "--");
     clContextLog(C, "syntax", 1, "format      : %s", C->params.formatName ? C->params.formatName : "auto");
@@ -969,6 +1062,7 @@ void clContextPrintArgs(clContext * C)
     clContextLog(C, "syntax", 1, "rect        : (%d,%d) %dx%d", C->params.rect[0], C->params.rect[1], C->params.rect[2], C->params.rect[3]);
     clContextLog(C, "syntax", 1, "stripTags   : %s", C->params.stripTags ? C->params.stripTags : "--");
     clContextLog(C, "syntax", 1, "stats       : %s", C->params.stats ? "true" : "false");
+    clContextLog(C, "syntax", 1, "ssim        : %s", C->params.ssim ? "true" : "false");
     clContextLog(C, "syntax", 1, "tonemap     : %s", clTonemapToString(C, C->params.tonemap));
     clContextLog(C, "syntax", 1, "yuvFormat   : %s", clYUVFormatToString(C, C->params.writeParams.yuvFormat));
     clContextLog(C, "syntax", 1, "verbose     : %s", C->verbose ? "enabled" : "disabled");
@@ -1028,17 +1122,21 @@ void clContextPrintSyntax(clContext * C)
     clContextLog(C, NULL, 0, "Convert Options:");
     clContextLog(C, NULL, 0, "    --resize w,h,filter      : Resize dst image to WxH. Use optional filter (auto (default), box, triangle, cubic, catmullrom, mitchell, nearest)");
     clContextLog(C, NULL, 0, "    -z,--rect,--crop x,y,w,h : Crop source image to rect (before conversion). x,y,w,h");
-    clContextLog(C, NULL, 0, "    --composite FILENAME     : Composite FILENAME on top of input. Must be identical dimensions to input.");
+    clContextLog(C, NULL, 0, "    --composite FILENAME     : Composite FILENAME on top of input. Must be identical dimensions to input. Repeatable (bottom layer first)");
     clContextLog(C, NULL, 0, "    --composite-gamma GAMMA  : When compositing, perform sourceover blend using this gamma (default: 2.2)");
     clContextLog(C, NULL, 0, "    --composite-premultiplied: When compositing, assume composite image's alpha is premultiplied (default: false)");
     clContextLog(C, NULL, 0, "    --composite-tonemap TM   : When compositing, determines if composite image is tonemapped before blend. auto (default), on, or off");
     clContextLog(C, NULL, 0, "    --hald FILENAME          : Image containing valid Hald CLUT to be used after color conversion");
     clContextLog(C, NULL, 0, "    --stats                  : Enable post-conversion stats (MSE, PSNR, etc)");
+    clContextLog(C, NULL, 0, "    --ssim                   : Enable post-conversion stats, adding SSIM and MS-SSIM (slower)");
     clContextLog(C, NULL, 0, "");
     clContextLog(C, NULL, 0, "Identify / Calc Options:");
-    clContextLog(C, NULL, 0, "    -z,--rect x,y,w,h        : Pixels to dump. x,y,w,h");
+    clContextLog(C, NULL, 0, "    -z,--rect x,y,w,h        : Pixels to dump. x,y,w,h (0,0,0,0 reads just the headers)");
     clContextLog(C, NULL, 0, "    --json                   : Output valid JSON description instead of standard log output");
     clContextLog(C, NULL, 0, "");
+    clContextLog(C, NULL, 0, "Report Options:");
+    clContextLog(C, NULL, 0, "    --deflate LEVEL          : zlib level (0-9) used to compress pixel data embedded in the report (default: 6)");
+    clContextLog(C, NULL, 0, "");
     clContextLog(C, NULL, 0, "Modify Options:");
     clContextLog(C, NULL, 0, "    -s,--striptags TAG,...   : Strips ICC tags from profile");
     clContextLog(C, NULL, 0, "");
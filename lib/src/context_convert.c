@@ -10,6 +10,7 @@
 #include "colorist/image.h"
 #include "colorist/pixelmath.h"
 #include "colorist/profile.h"
+#include "colorist/raw.h"
 #include "colorist/task.h"
 
 #include <string.h>
@@ -27,6 +28,45 @@ struct ImageInfo
     int luminance;
 };
 
+// Rows can go from decoder through the pipeline to encoder a band at a time, never holding the whole
+// image, when both formats can stream and no stage needs to see the whole image at once.
+static clBool convertCanStream(clContext * C, clConversionParams * params)
+{
+    if ((params->resizeW > 0) || (params->resizeH > 0) || (params->compositeCount > 0) || params->autoGrade || params->stats) {
+        return clFalse;
+    }
+    if ((params->rect[0] >= 0) && (params->rect[1] >= 0) && (params->rect[2] > 0) && (params->rect[3] > 0)) {
+        return clFalse; // crop
+    }
+    if (clFileSame(C->inputFilename, C->outputFilename)) {
+        return clFalse; // the encoder would truncate the (possibly mapped) input while it is still being read
+    }
+
+    const char * srcFormatName = clFormatDetect(C, C->inputFilename);
+    clFormat * srcFormat = srcFormatName ? clContextFindFormat(C, srcFormatName) : NULL;
+    clFormat * dstFormat = clContextFindFormat(C, params->formatName);
+    return (srcFormat && srcFormat->readBeginFunc && dstFormat && dstFormat->writeBeginFunc) ? clTrue : clFalse;
+}
+
+// When cropping, the source reader may decode just the crop rect. Otherwise, when shrinking, it may use
+// its codec's cheap downscale and leave clImageResize() less to do.
+static clDecodeHint * convertDecodeHint(clConversionParams * params, clDecodeHint * hint)
+{
+    memset(hint, 0, sizeof(clDecodeHint));
+    if ((params->rect[0] >= 0) && (params->rect[1] >= 0) && (params->rect[2] > 0) && (params->rect[3] > 0)) {
+        memcpy(hint->rect, params->rect, sizeof(hint->rect));
+        return hint;
+    }
+    if ((params->resizeW <= 0) && (params->resizeH <= 0)) {
+        return NULL;
+    }
+
+    hint->width = params->resizeW;
+    hint->height = params->resizeH;
+    hint->filter = params->resizeFilter;
+    return hint;
+}
+
 int clContextConvert(clContext * C)
 {
     Timer overall, t;
@@ -45,6 +85,24 @@ int clContextConvert(clContext * C)
     clImage * haldImage = NULL;
     int haldDims = 0;
 
+    // Band pipeline (convert -> composite -> HALD)
+    clImagePipeline * pipeline = NULL;
+    clImage * compositeImages[CL_MAX_COMPOSITE_LAYERS];
+    int compositeImageCount = 0;
+
+    // Encoded output, kept for --stats
+    clRaw output = CL_RAW_EMPTY;
+
+    // Streaming (see convertCanStream()): srcImage holds one band of rows at a time
+    clRaw input = CL_RAW_EMPTY;
+    clFormatReader * reader = NULL;
+    clFormatWriter * writer = NULL;
+    FILE * outputFile = NULL;
+
+    // Filled in by the source reader if it decodes at a reduced size (see convertDecodeHint())
+    clDecodeHint decodeHint;
+    memset(&decodeHint, 0, sizeof(decodeHint));
+
     clConversionParams params;
     memcpy(&params, &C->params, sizeof(params));
 
@@ -63,9 +121,33 @@ int clContextConvert(clContext * C)
 
     clContextLog(C, "decode", 0, "Reading: %s (%d bytes)", C->inputFilename, clFileSize(C->inputFilename));
     timerStart(&t);
-    srcImage = clContextRead(C, C->inputFilename, C->iccOverrideIn, NULL);
-    if (srcImage == NULL) {
-        return 1;
+    if (convertCanStream(C, &params)) {
+        reader = clContextReadBegin(C, C->inputFilename, C->iccOverrideIn, NULL, &input);
+        if (reader == NULL) {
+            clRawFree(C, &input);
+            return 1;
+        }
+
+        // Enough rows for every job to get a pipeline band
+        int bandHeight = CL_IMAGE_PIPELINE_BAND_PIXELS / reader->width;
+        if (bandHeight < 1) {
+            bandHeight = 1;
+        }
+        int streamRows = bandHeight * params.jobs;
+        if (streamRows > reader->height) {
+            streamRows = reader->height;
+        }
+        srcImage = clImageCreate(C, reader->width, streamRows, reader->depth, reader->profile);
+    } else {
+        srcImage = clContextRead(C, C->inputFilename, C->iccOverrideIn, convertDecodeHint(&params, &decodeHint), NULL);
+        if (srcImage == NULL) {
+            return 1;
+        }
+        if (decodeHint.cropped) {
+            clContextLog(C, "decode", 1, "Decoded just +%d+%d %dx%d of %dx%d", decodeHint.rect[0], decodeHint.rect[1], decodeHint.rect[2], decodeHint.rect[3], decodeHint.fullWidth, decodeHint.fullHeight);
+        } else if (decodeHint.fullWidth && ((decodeHint.fullWidth != srcImage->width) || (decodeHint.fullHeight != srcImage->height))) {
+            clContextLog(C, "decode", 1, "Decoder downscaled %dx%d -> %dx%d", decodeHint.fullWidth, decodeHint.fullHeight, srcImage->width, srcImage->height);
+        }
     }
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
@@ -81,9 +163,11 @@ int clContextConvert(clContext * C)
         goto convertCleanup;
     }
 
-    // Load HALD, if any
-    if (params.hald) {
-        haldImage = clContextRead(C, params.hald, NULL, NULL);
+    // Load HALD, if any. Its lattice stays on C, so converting a batch with the same look reads it once.
+    if (params.hald && C->haldCLUT && !strcmp(C->haldCLUTFilename, params.hald)) {
+        clContextLog(C, "hald", 0, "Reusing %dx%dx%d Hald CLUT: %s", C->haldCLUT->dims, C->haldCLUT->dims, C->haldCLUT->dims, params.hald);
+    } else if (params.hald) {
+        haldImage = clContextRead(C, params.hald, NULL, NULL, NULL);
         if (!haldImage) {
             clContextLogError(C, "Can't read Hald CLUT: %s", params.hald);
             FAIL();
@@ -110,11 +194,23 @@ int clContextConvert(clContext * C)
 
             clContextLog(C, "hald", 0, "Loaded %dx%dx%d Hald CLUT: %s", haldDims, haldDims, haldDims, params.hald);
         }
+
+        float * haldPixels = clAllocate(4 * sizeof(float) * haldImage->width * haldImage->height);
+        clImageRowsToFloat(C, haldImage, 0, haldImage->height, haldPixels);
+        if (C->haldCLUT) {
+            clHaldCLUTDestroy(C, C->haldCLUT);
+            clFree(C->haldCLUTFilename);
+        }
+        C->haldCLUT = clHaldCLUTCreate(C, haldPixels, haldDims);
+        C->haldCLUTFilename = clContextStrdup(C, params.hald);
+        clFree(haldPixels);
+        clImageDestroy(C, haldImage);
+        haldImage = NULL;
     }
 
     int crop[4];
     memcpy(crop, C->params.rect, 4 * sizeof(int));
-    if (clImageAdjustRect(C, srcImage, &crop[0], &crop[1], &crop[2], &crop[3])) {
+    if (!decodeHint.cropped && clImageAdjustRect(C, srcImage, &crop[0], &crop[1], &crop[2], &crop[3])) {
         timerStart(&t);
         clContextLog(C, "crop", 0, "Cropping source image from %dx%d to: +%d+%d %dx%d", srcImage->width, srcImage->height, crop[0], crop[1], crop[2], crop[3]);
         srcImage = clImageCrop(C, srcImage, crop[0], crop[1], crop[2], crop[3], clFalse);
@@ -124,9 +220,13 @@ int clContextConvert(clContext * C)
     // -----------------------------------------------------------------------
     // Parse source image and conversion params, make decisions about dst
 
-    // Populate srcInfo
+    // Populate srcInfo (sized as the file is, so the decoder's downscale doesn't shift the aspect ratio)
     srcInfo.width = srcImage->width;
-    srcInfo.height = srcImage->height;
+    srcInfo.height = reader ? reader->height : srcImage->height;
+    if (decodeHint.fullWidth && !decodeHint.cropped) {
+        srcInfo.width = decodeHint.fullWidth;
+        srcInfo.height = decodeHint.fullHeight;
+    }
     srcInfo.depth = srcImage->depth;
     clProfileQuery(C, srcImage->profile, &srcInfo.primaries, &srcInfo.curve, &srcInfo.luminance);
     if ((srcInfo.curve.type == CL_PCT_COMPLEX) && (srcInfo.curve.gamma > 0.0f)) {
@@ -223,8 +323,9 @@ int clContextConvert(clContext * C)
     // -----------------------------------------------------------------------
     // Resize, if necessary
 
-    if (((dstInfo.width != srcInfo.width) || (dstInfo.height != srcInfo.height))) {
-        clContextLog(C, "resize", 0, "Resizing %dx%d -> [filter:%s] -> %dx%d", srcInfo.width, srcInfo.height, clFilterToString(C, params.resizeFilter), dstInfo.width, dstInfo.height);
+    // srcImage may already be smaller than srcInfo says (see convertDecodeHint()). Streaming never resizes.
+    if (!reader && ((dstInfo.width != srcImage->width) || (dstInfo.height != srcImage->height))) {
+        clContextLog(C, "resize", 0, "Resizing %dx%d -> [filter:%s] -> %dx%d", srcImage->width, srcImage->height, clFilterToString(C, params.resizeFilter), dstInfo.width, dstInfo.height);
         timerStart(&t);
 
         clImage * resizedImage = clImageResize(C, srcImage, dstInfo.width, dstInfo.height, params.resizeFilter);
@@ -317,88 +418,148 @@ int clContextConvert(clContext * C)
         }
     }
 
-    dstImage = clImageConvert(C, srcImage, params.jobs, dstInfo.depth, dstProfile, params.autoGrade ? CL_TONEMAP_OFF : params.tonemap);
-    if (!dstImage) {
-        FAIL();
-    }
+    // -----------------------------------------------------------------------
+    // Convert, composite and apply the Hald CLUT band by band
 
-    if (C->params.compositeFilename) {
-        clContextLog(C, "composite", 0, "Composition enabled. Reading: %s (%d bytes)", C->params.compositeFilename, clFileSize(C->params.compositeFilename));
+    pipeline = clImagePipelineCreate(C, srcImage, dstInfo.depth, dstProfile, params.autoGrade ? CL_TONEMAP_OFF : params.tonemap);
+
+    // Every layer is blended within the same pass over the bands
+    for (int i = 0; i < params.compositeCount; ++i) {
+        const char * compositeFilename = params.compositeFilenames[i];
+        clBlendParams * compositeParams = &params.compositeParams[i];
+        clContextLog(C, "composite", 0, "Composition enabled. Reading: %s (%d bytes)", compositeFilename, clFileSize(compositeFilename));
         timerStart(&t);
-        clImage * compositeImage = clContextRead(C, params.compositeFilename, NULL, NULL);
+        clImage * compositeImage = clContextRead(C, compositeFilename, NULL, NULL, NULL);
         if (compositeImage == NULL) {
             clContextLogError(C, "Can't load composite image, bailing out");
             FAIL();
         }
+        compositeImages[compositeImageCount++] = compositeImage;
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
-        if ((dstImage->width != compositeImage->width) || (dstImage->height != compositeImage->height)) {
-            clContextLogError(C, "Composite image dimensions don't match: image:%dx%d vs comp:%dx%d", dstImage->width, dstImage->height, compositeImage->width, compositeImage->height);
-            clImageDestroy(C, compositeImage);
+        if ((pipeline->dstImage->width != compositeImage->width) || (pipeline->dstImage->height != compositeImage->height)) {
+            clContextLogError(C, "Composite image dimensions don't match: image:%dx%d vs comp:%dx%d", pipeline->dstImage->width, pipeline->dstImage->height, compositeImage->width, compositeImage->height);
             FAIL();
         }
 
         clContextLog(C, "composite", 0, "Blending composite on top (%.2g gamma, %s)...",
-            params.compositeParams.gamma, params.compositeParams.premultiplied ? "premultiplied" : "not premultiplied");
-        timerStart(&t);
-        clImage * blendedImage = clImageBlend(C, dstImage, compositeImage, params.jobs, &params.compositeParams);
-        if (!blendedImage) {
+            compositeParams->gamma, compositeParams->premultiplied ? "premultiplied" : "not premultiplied");
+        if (!clImagePipelineAddComposite(C, pipeline, compositeImage, compositeParams)) {
             clContextLogError(C, "Image blend failed, bailing out");
-            clImageDestroy(C, blendedImage);
             FAIL();
         }
-        clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
-
-        clImageDestroy(C, dstImage);
-        dstImage = blendedImage;
     }
 
-    if (haldImage) {
+    if (params.hald) {
         clContextLog(C, "hald", 0, "Performing Hald CLUT postprocessing...");
-        timerStart(&t);
+        clImagePipelineAddHALDCLUT(C, pipeline, C->haldCLUT);
+    }
 
-        clImage * appliedImage = clImageApplyHALD(C, dstImage, haldImage, haldDims);
-        if (!appliedImage) {
-            clContextLogError(C, "Failed to apply HALD");
+    if (reader) {
+        clContextLogWrite(C, C->outputFilename, params.formatName, &params.writeParams);
+        clContextLog(C, "encode", 0, "Streaming %d rows at a time...", srcImage->height);
+        timerStart(&t);
+        outputFile = fopen(C->outputFilename, "w+b"); // read access too, for encoders that revisit what they wrote
+        if (!outputFile) {
+            clContextLogError(C, "Failed to open file for write: %s", C->outputFilename);
+            FAIL();
+        }
+        writer = clContextWriteBegin(C, params.formatName, srcInfo.width, srcInfo.height, dstInfo.depth, pipeline->dstImage->profile, outputFile, &params.writeParams);
+        if (!writer) {
             FAIL();
         }
+        for (int y = 0; y < srcInfo.height; y += srcImage->height) {
+            int rowCount = srcInfo.height - y;
+            if (rowCount > srcImage->height) {
+                rowCount = srcImage->height;
+            }
+            if (!reader->readRows(C, reader, srcImage, rowCount)) {
+                FAIL();
+            }
+            clImagePipelineRunRows(C, pipeline, rowCount, params.jobs);
+            if (!writer->writeRows(C, writer, pipeline->dstImage, rowCount)) {
+                FAIL();
+            }
+        }
+        if (!writer->finish(C, writer) || fflush(outputFile) || fseek(outputFile, 0, SEEK_END)) {
+            FAIL();
+        }
+        clContextLog(C, "encode", 1, "Wrote %ld bytes.", ftell(outputFile));
+        clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+        goto convertCleanup;
+    }
 
-        clImageDestroy(C, dstImage);
-        dstImage = appliedImage;
+    timerStart(&t);
+    dstImage = clImagePipelineRun(C, pipeline, params.jobs);
+    clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
-        clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+    // Everything below only needs the finished image
+    clImagePipelineDestroy(C, pipeline);
+    pipeline = NULL;
+    for (int i = 0; i < compositeImageCount; ++i) {
+        clImageDestroy(C, compositeImages[i]);
     }
+    compositeImageCount = 0;
 
     timerStart(&t);
     clContextLogWrite(C, C->outputFilename, params.formatName, &params.writeParams);
-    if (!clContextWrite(C, dstImage, C->outputFilename, params.formatName, &params.writeParams)) {
+    if (!clContextWriteRaw(C, dstImage, params.formatName, &params.writeParams, &output) || !clRawWriteFile(C, &output, C->outputFilename)) {
         FAIL();
     }
-    clContextLog(C, "encode", 1, "Wrote %d bytes.", clFileSize(C->outputFilename));
+    clContextLog(C, "encode", 1, "Wrote %d bytes.", (int)output.size);
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
     if (params.stats) {
         clContextLog(C, "stats", 0, "Calculating conversion stats...");
         timerStart(&t);
 
-        clImage * convertedImage = clContextRead(C, C->outputFilename, NULL, NULL);
+        // Decode what was just encoded, straight from memory
+        clImage * convertedImage = clContextReadRaw(C, &output, params.formatName);
         if (convertedImage) {
             clImageSignals signals;
-            if (clImageCalcSignals(C, params.jobs, srcImage, convertedImage, &signals)) {
+            clBool calculated;
+            if (params.ssim) {
+                calculated = clImageCalcSignalsSSIM(C, params.jobs, srcImage, convertedImage, &signals);
+            } else {
+                calculated = clImageCalcSignals(C, params.jobs, srcImage, convertedImage, &signals);
+            }
+            if (calculated) {
                 clContextLog(C, "stats", 1, "MSE  (Lin) : %g", signals.mseLinear);
                 clContextLog(C, "stats", 1, "PSNR (Lin) : %g", signals.psnrLinear);
                 clContextLog(C, "stats", 1, "MSE  (2.2g): %g", signals.mseG22);
                 clContextLog(C, "stats", 1, "PSNR (2.2g): %g", signals.psnrG22);
+                if (params.ssim) {
+                    clContextLog(C, "stats", 1, "SSIM       : %g", signals.ssim);
+                    clContextLog(C, "stats", 1, "MS-SSIM    : %g", signals.msssim);
+                }
             }
             clImageDestroy(C, convertedImage);
         } else {
-            clContextLogError(C, "Failed to reload converted image, skipping conversion stats");
+            clContextLogError(C, "Failed to decode converted image, skipping conversion stats");
         }
 
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
     }
 
 convertCleanup:
+    if (writer)
+        writer->destroy(C, writer);
+    if (outputFile) {
+        if (fclose(outputFile) && (returnCode == 0)) {
+            clContextLogError(C, "Failed to write: %s", C->outputFilename);
+            returnCode = 1;
+        }
+        if (returnCode != 0)
+            remove(C->outputFilename); // don't leave a truncated image behind
+    }
+    if (reader)
+        reader->destroy(C, reader);
+    clRawFree(C, &input);
+    clRawFree(C, &output);
+    if (pipeline)
+        clImagePipelineDestroy(C, pipeline);
+    for (int i = 0; i < compositeImageCount; ++i)
+        clImageDestroy(C, compositeImages[i]);
     if (dstProfile)
         clProfileDestroy(C, dstProfile);
     if (srcImage)
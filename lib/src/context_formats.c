@@ -9,29 +9,41 @@
 
 #include <string.h>
 
-struct clImage * clFormatReadAPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadAPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteAPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clBool clFormatProbeAPG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
-struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteAVIF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
 
-struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
 
-struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clFormatReader * clFormatReadBeginJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
+clFormatWriter * clFormatWriteBeginJPG(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams);
+clBool clFormatProbeJPG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
-struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clBool clFormatProbeJP2(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
-struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clFormatReader * clFormatReadBeginPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
+clFormatWriter * clFormatWriteBeginPNG(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams);
+clBool clFormatProbePNG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
-struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clFormatReader * clFormatReadBeginTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
+clFormatWriter * clFormatWriteBeginTIFF(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams);
+clBool clFormatProbeTIFF(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
-struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clBool clFormatProbeWebP(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
 void clContextRegisterBuiltinFormats(struct clContext * C)
 {
@@ -54,6 +66,7 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesYUVFormat = clFalse;
         format.readFunc = clFormatReadAPG;
         format.writeFunc = clFormatWriteAPG;
+        format.probeFunc = clFormatProbeAPG;
         clContextRegisterFormat(C, &format);
     }
 
@@ -114,6 +127,9 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesYUVFormat = clFalse;
         format.readFunc = clFormatReadJPG;
         format.writeFunc = clFormatWriteJPG;
+        format.probeFunc = clFormatProbeJPG;
+        format.readBeginFunc = clFormatReadBeginJPG;
+        format.writeBeginFunc = clFormatWriteBeginJPG;
         clContextRegisterFormat(C, &format);
     }
 
@@ -135,6 +151,7 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesYUVFormat = clFalse;
         format.readFunc = clFormatReadJP2;
         format.writeFunc = clFormatWriteJP2;
+        format.probeFunc = clFormatProbeJP2;
         clContextRegisterFormat(C, &format);
     }
 
@@ -156,6 +173,7 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesYUVFormat = clFalse;
         format.readFunc = clFormatReadJP2;
         format.writeFunc = clFormatWriteJP2;
+        format.probeFunc = clFormatProbeJP2;
         clContextRegisterFormat(C, &format);
     }
 
@@ -176,6 +194,9 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesYUVFormat = clFalse;
         format.readFunc = clFormatReadPNG;
         format.writeFunc = clFormatWritePNG;
+        format.probeFunc = clFormatProbePNG;
+        format.readBeginFunc = clFormatReadBeginPNG;
+        format.writeBeginFunc = clFormatWriteBeginPNG;
         clContextRegisterFormat(C, &format);
     }
 
@@ -201,6 +222,9 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesYUVFormat = clFalse;
         format.readFunc = clFormatReadTIFF;
         format.writeFunc = clFormatWriteTIFF;
+        format.probeFunc = clFormatProbeTIFF;
+        format.readBeginFunc = clFormatReadBeginTIFF;
+        format.writeBeginFunc = clFormatWriteBeginTIFF;
         clContextRegisterFormat(C, &format);
     }
 
@@ -222,6 +246,7 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesYUVFormat = clFalse;
         format.readFunc = clFormatReadWebP;
         format.writeFunc = clFormatWriteWebP;
+        format.probeFunc = clFormatProbeWebP;
         clContextRegisterFormat(C, &format);
     }
 }
@@ -14,19 +14,44 @@
 
 #include <string.h>
 
+static void dumpProbe(clContext * C, struct cJSON * output, clProbeInfo * info)
+{
+    // Matches what the image dumps print for a rect holding no pixels
+    clProfile * profile = info->profile ? info->profile : clProfileCreateStock(C, CL_PS_SRGB);
+    if (output) {
+        cJSON * jsonProfile = cJSON_AddObjectToObject(output, "profile");
+        cJSON_AddNumberToObject(output, "width", info->width);
+        cJSON_AddNumberToObject(output, "height", info->height);
+        cJSON_AddNumberToObject(output, "depth", info->depth);
+        clProfileDebugDumpJSON(C, jsonProfile, profile, C->verbose);
+    } else {
+        clContextLog(C, "image", 1, "Image: %dx%d %d-bit", info->width, info->height, info->depth);
+        clProfileDebugDump(C, profile, C->verbose, 2);
+    }
+    if (profile != info->profile) {
+        clProfileDestroy(C, profile);
+    }
+}
+
 int clContextIdentify(clContext * C, struct cJSON * output)
 {
+    // The file is read once; its format, size, headers and any pixels all come from that one read
+    clRaw input = CL_RAW_EMPTY;
+    if (!clRawReadFile(C, &input, C->inputFilename)) {
+        return 1;
+    }
     const char * formatName = C->params.formatName;
     if (!formatName)
-        formatName = clFormatDetect(C, C->inputFilename);
+        formatName = clFormatDetectRaw(C, C->inputFilename, &input);
     if (!formatName) {
         clContextLogError(C, "Unknown file format: %s", C->inputFilename);
+        clRawFree(C, &input);
         return 1;
     }
 
     clContextLog(C, "action", 0, "Identify: %s", C->inputFilename);
     if (!strcmp(formatName, "icc")) {
-        clProfile * profile = clProfileRead(C, C->inputFilename);
+        clProfile * profile = clProfileParse(C, input.ptr, input.size, NULL);
         if (profile) {
             clContextLog(C, "identify", 1, "Format: %s", formatName);
             if (output) {
@@ -37,24 +62,46 @@ int clContextIdentify(clContext * C, struct cJSON * output)
             clProfileDestroy(C, profile);
         }
     } else {
-        clContextLog(C, "decode", 0, "Reading: %s (%d bytes)", C->inputFilename, clFileSize(C->inputFilename));
-        clImage * image = clContextRead(C, C->inputFilename, C->iccOverrideIn, &formatName);
-        if (image) {
-            int rect[4];
-            memcpy(rect, C->params.rect, sizeof(rect));
-            if ((rect[2] < 0) && (rect[3] < 0)) {
-                // Defaults for identify
-                rect[2] = 3;
-                rect[3] = 3;
+        clContextLog(C, "decode", 0, "Reading: %s (%d bytes)", C->inputFilename, (int)input.size);
+        // Only the pixels being dumped need decoding, if the reader can manage it
+        clDecodeHint hint;
+        memset(&hint, 0, sizeof(hint));
+        int * rect = hint.rect;
+        memcpy(rect, C->params.rect, sizeof(hint.rect));
+        if ((rect[2] < 0) && (rect[3] < 0)) {
+            // Defaults for identify
+            rect[2] = 3;
+            rect[3] = 3;
+        }
+
+        clFormat * format = clContextFindFormat(C, formatName);
+        if (format && format->probeFunc && ((rect[2] == 0) || (rect[3] == 0))) {
+            // No pixels wanted, so the headers are enough
+            clProbeInfo info;
+            if (clContextProbeRaw(C, &input, formatName, C->iccOverrideIn, &info)) {
+                clContextLog(C, "identify", 1, "Format: %s", formatName);
+                dumpProbe(C, output, &info);
+                clProbeInfoFree(C, &info);
             }
-            clContextLog(C, "identify", 1, "Format: %s", formatName);
-            if (output) {
-                clImageDebugDumpJSON(C, output, image, rect[0], rect[1], rect[2], rect[3]);
-            } else {
-                clImageDebugDump(C, image, rect[0], rect[1], rect[2], rect[3], 1);
+        } else {
+            clImage * image = clContextReadImage(C, &input, formatName, C->iccOverrideIn, &hint);
+            if (image) {
+                clContextLog(C, "identify", 1, "Format: %s", formatName);
+                if (hint.cropped) {
+                    if (output) {
+                        clImageDebugDumpRegionJSON(C, output, image, &hint);
+                    } else {
+                        clImageDebugDumpRegion(C, image, &hint, 1);
+                    }
+                } else if (output) {
+                    clImageDebugDumpJSON(C, output, image, rect[0], rect[1], rect[2], rect[3]);
+                } else {
+                    clImageDebugDump(C, image, rect[0], rect[1], rect[2], rect[3], 1);
+                }
+                clImageDestroy(C, image);
             }
-            clImageDestroy(C, image);
         }
     }
+    clRawFree(C, &input);
     return 0;
 }
@@ -11,56 +11,224 @@
 #include "colorist/image.h"
 #include "colorist/pixelmath.h"
 #include "colorist/profile.h"
+#include "colorist/raw.h"
 #include "colorist/transform.h"
 
 #include "cJSON.h"
 
 #include <math.h>
+#include <stdio.h>
 #include <string.h>
 
 #define FAIL() { returnCode = 1; goto reportCleanup; }
 
-static clBool addSRGBHighlight(clContext * C, clImage * image, int maxLuminance, cJSON * payload, const char * name)
+// The report payload is streamed straight into the output file as it is produced. Small values are
+// rendered with cJSON one at a time, and large blobs (raw pixels, highlight info, PNGs) are deflated and/or
+// Base64 encoded in chunks, so the whole payload never has to exist in memory.
+#define CL_REPORT_MAX_DEPTH 5
+
+// Per-pixel arrays (raw pixels, highlight info) are split into tiles of this size, which the report viewer
+// inflates one at a time as pixels in them are inspected, instead of inflating everything when it opens.
+#define CL_REPORT_TILE_SIZE 256
+
+// Visuals open as an overview no larger than this on either side. Bigger images also carry their full
+// resolution as CL_REPORT_TILE_SIZE PNG tiles, which the viewer only shows once zoomed in on them.
+#define CL_REPORT_OVERVIEW_SIZE 1024
+
+typedef struct clReportWriter
 {
-    clImage * highlight;
-    char * pngB64;
-    clImageSRGBHighlightStats stats;
-    cJSON * base;
-    cJSON * highlightInfo = NULL;
+    FILE * f;
+    int depth;
+    int itemCounts[CL_REPORT_MAX_DEPTH];
+} clReportWriter;
 
-    highlight = clImageCreateSRGBHighlight(C, image, maxLuminance, &stats, NULL, &highlightInfo);
-    if (!highlight) {
+// Starts the next object member (key) or array element (NULL key)
+static void reportKey(clReportWriter * writer, const char * key)
+{
+    fputs(writer->itemCounts[writer->depth] ? ",\n" : "\n", writer->f);
+    if (key) {
+        // Keys are fixed identifiers, so they need no escaping
+        fprintf(writer->f, "\"%s\": ", key);
+    }
+    ++writer->itemCounts[writer->depth];
+}
+
+static void reportBegin(clReportWriter * writer, const char * key, char open)
+{
+    COLORIST_ASSERT(writer->depth < (CL_REPORT_MAX_DEPTH - 1));
+    if (key) {
+        reportKey(writer, key);
+    }
+    fputc(open, writer->f);
+    ++writer->depth;
+    writer->itemCounts[writer->depth] = 0;
+}
+
+static void reportEnd(clReportWriter * writer, char close)
+{
+    COLORIST_ASSERT(writer->depth > 0);
+    fputc('\n', writer->f);
+    fputc(close, writer->f);
+    --writer->depth;
+}
+
+static void reportBeginObject(clReportWriter * writer, const char * key)
+{
+    reportBegin(writer, key, '{');
+}
+
+static void reportEndObject(clReportWriter * writer)
+{
+    reportEnd(writer, '}');
+}
+
+static void reportBeginArray(clReportWriter * writer, const char * key)
+{
+    reportBegin(writer, key, '[');
+}
+
+static void reportEndArray(clReportWriter * writer)
+{
+    reportEnd(writer, ']');
+}
+
+// Writes item and deletes it
+static void reportJSON(clReportWriter * writer, const char * key, cJSON * item)
+{
+    char * text = cJSON_PrintUnformatted(item);
+    reportKey(writer, key);
+    fputs(text, writer->f);
+    cJSON_free(text);
+    cJSON_Delete(item);
+}
+
+static void reportNumber(clReportWriter * writer, const char * key, double number)
+{
+    reportJSON(writer, key, cJSON_CreateNumber(number));
+}
+
+// Writes image as a Base64 data URI without building the URI string. A NULL key writes an array element.
+static clBool reportImageURI(clContext * C, clReportWriter * writer, const char * key, clImage * image, const char * formatName)
+{
+    clFormat * format = clContextFindFormat(C, formatName);
+    if (!format) {
+        clContextLogError(C, "Unknown format: %s", formatName);
         return clFalse;
     }
+
     clWriteParams writeParams;
     clWriteParamsSetDefaults(C, &writeParams);
-    pngB64 = clContextWriteURI(C, highlight, "png", &writeParams);
-    clImageDestroy(C, highlight);
-    if (!pngB64) {
+    clRaw encoded = CL_RAW_EMPTY;
+    if (!clContextWriteRaw(C, image, formatName, &writeParams, &encoded)) {
         return clFalse;
     }
 
-    base = cJSON_CreateObject();
-    cJSON_AddItemToObject(base, "visual", cJSON_CreateString(pngB64));
-    cJSON_AddItemToObject(base, "info", highlightInfo);
-    cJSON_AddItemToObject(base, "highlightLuminance", cJSON_CreateNumber(maxLuminance));
-    cJSON_AddItemToObject(base, "hlgLuminance", cJSON_CreateNumber(clTransformCalcHLGLuminance(maxLuminance)));
-    cJSON_AddItemToObject(base, "overbrightPixelCount", cJSON_CreateNumber(stats.overbrightPixelCount));
-    cJSON_AddItemToObject(base, "outOfGamutPixelCount", cJSON_CreateNumber(stats.outOfGamutPixelCount));
-    cJSON_AddItemToObject(base, "bothPixelCount", cJSON_CreateNumber(stats.bothPixelCount));
-    cJSON_AddItemToObject(base, "hdrPixelCount", cJSON_CreateNumber(stats.hdrPixelCount));
-    cJSON_AddItemToObject(base, "pixelCount", cJSON_CreateNumber(stats.pixelCount));
-    cJSON_AddItemToObject(base, "brightestPixelX", cJSON_CreateNumber(stats.brightestPixelX));
-    cJSON_AddItemToObject(base, "brightestPixelY", cJSON_CreateNumber(stats.brightestPixelY));
-    cJSON_AddItemToObject(base, "brightestPixelNits", cJSON_CreateNumber(stats.brightestPixelNits));
-    cJSON_AddItemToObject(payload, name, base);
-    clFree(pngB64);
-    return clTrue;
+    reportKey(writer, key);
+    fprintf(writer->f, "\"data:%s;base64,", format->mimeType);
+    clBool ret = clRawWriteBase64(C, writer->f, &encoded);
+    fputc('"', writer->f);
+    clRawFree(C, &encoded);
+    return ret;
+}
+
+// Writes an 8-bit visual as { width, height, overview[, tileSize, tiles] }, see CL_REPORT_OVERVIEW_SIZE.
+// Tiles are listed row by row, and the ones on the right and bottom edges may be smaller.
+static clBool reportVisual(clContext * C, clReportWriter * writer, const char * key, clImage * image)
+{
+    clImage * overview = image;
+    if ((image->width > CL_REPORT_OVERVIEW_SIZE) || (image->height > CL_REPORT_OVERVIEW_SIZE)) {
+        int overviewWidth = CL_REPORT_OVERVIEW_SIZE;
+        int overviewHeight = CL_REPORT_OVERVIEW_SIZE;
+        if (image->width > image->height) {
+            overviewHeight = (int)(((int64_t)image->height * CL_REPORT_OVERVIEW_SIZE) / image->width);
+        } else {
+            overviewWidth = (int)(((int64_t)image->width * CL_REPORT_OVERVIEW_SIZE) / image->height);
+        }
+        if (overviewWidth < 1) {
+            overviewWidth = 1;
+        }
+        if (overviewHeight < 1) {
+            overviewHeight = 1;
+        }
+        overview = clImageResize(C, image, overviewWidth, overviewHeight, CL_FILTER_BOX);
+        if (!overview) {
+            return clFalse;
+        }
+    }
+
+    reportBeginObject(writer, key);
+    reportNumber(writer, "width", image->width);
+    reportNumber(writer, "height", image->height);
+    clBool ret = reportImageURI(C, writer, "overview", overview, "png");
+    if (ret && (overview != image)) {
+        reportNumber(writer, "tileSize", CL_REPORT_TILE_SIZE);
+        reportBeginArray(writer, "tiles");
+        for (int tileY = 0; ret && (tileY < image->height); tileY += CL_REPORT_TILE_SIZE) {
+            for (int tileX = 0; ret && (tileX < image->width); tileX += CL_REPORT_TILE_SIZE) {
+                int tileW = image->width - tileX;
+                int tileH = image->height - tileY;
+                if (tileW > CL_REPORT_TILE_SIZE) {
+                    tileW = CL_REPORT_TILE_SIZE;
+                }
+                if (tileH > CL_REPORT_TILE_SIZE) {
+                    tileH = CL_REPORT_TILE_SIZE;
+                }
+                clImage * tile = clImageCreateView(C, image, tileX, tileY, tileW, tileH);
+                ret = reportImageURI(C, writer, NULL, tile, "png");
+                clImageDestroy(C, tile);
+            }
+        }
+        reportEndArray(writer);
+    }
+    reportEndObject(writer);
+
+    if (overview != image) {
+        clImageDestroy(C, overview);
+    }
+    return ret;
 }
 
-static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
+static clBool reportSRGBHighlight(clContext * C, clReportWriter * writer, clImage * image, int maxLuminance, const char * name)
 {
     Timer t;
+    clImageSRGBHighlightStats stats;
+    clImageSRGBHighlightPixelInfo * pixelInfo = clImageSRGBHighlightPixelInfoCreate(C, image->width * image->height);
+    clImage * highlight = clImageCreateSRGBHighlight(C, image, maxLuminance, &stats, pixelInfo, NULL);
+    if (!highlight) {
+        clImageSRGBHighlightPixelInfoDestroy(C, pixelInfo);
+        return clFalse;
+    }
+
+    reportBeginObject(writer, name);
+    clBool ret = reportVisual(C, writer, "visual", highlight);
+    clImageDestroy(C, highlight);
+
+    if (ret) {
+        clContextLog(C, "highlight", 1, "Packing highlight info...");
+        timerStart(&t);
+        reportKey(writer, "info");
+        ret = clImageSRGBHighlightPixelInfoWrite(C, pixelInfo, image->width, image->height, CL_REPORT_TILE_SIZE, writer->f);
+        clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+    }
+    clImageSRGBHighlightPixelInfoDestroy(C, pixelInfo);
+
+    reportNumber(writer, "highlightLuminance", maxLuminance);
+    reportNumber(writer, "hlgLuminance", clTransformCalcHLGLuminance(maxLuminance));
+    reportNumber(writer, "overbrightPixelCount", stats.overbrightPixelCount);
+    reportNumber(writer, "outOfGamutPixelCount", stats.outOfGamutPixelCount);
+    reportNumber(writer, "bothPixelCount", stats.bothPixelCount);
+    reportNumber(writer, "hdrPixelCount", stats.hdrPixelCount);
+    reportNumber(writer, "pixelCount", stats.pixelCount);
+    reportNumber(writer, "brightestPixelX", stats.brightestPixelX);
+    reportNumber(writer, "brightestPixelY", stats.brightestPixelY);
+    reportNumber(writer, "brightestPixelNits", stats.brightestPixelNits);
+    reportEndObject(writer);
+    return ret;
+}
+
+// Everything about the profile; this is small, so it is built as cJSON before the report file is opened
+static cJSON * reportICCInfo(clContext * C, clImage * image)
+{
     clProfilePrimaries primaries;
     clProfileCurve curve;
     int maxLuminance;
@@ -69,32 +237,78 @@ static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
     char * text;
     char * rawProfileB64;
 
-    jsonICC = cJSON_CreateObject();
-    cJSON_AddItemToObject(payload, "icc", jsonICC);
-
     if (!clProfileQuery(C, image->profile, &primaries, &curve, &maxLuminance)) {
-        return clFalse;
+        return NULL;
+    }
+
+    const char * curveType = NULL;
+    if (clProfileHasPQSignature(C, image->profile, &primaries)) {
+        curve.gamma = 0.0f;
+        maxLuminance = 10000;
+        curveType = "pq";
+    } else if ((curve.type == CL_PCT_HLG) || (curve.type == CL_PCT_PQ)) {
+        curve.gamma = 0.0f;
+        curveType = clProfileCurveTypeToLowercaseString(C, curve.type);
+    } else if (curve.type != CL_PCT_GAMMA) {
+        // Check for profiles that we can't make valid reports for
+        clContextLogError(C, "Can't create report: the supplied tone curve can't be interpreted by current report JS");
+        return NULL;
     }
 
     clRaw rawProfile = CL_RAW_EMPTY;
     if (!clProfilePack(C, image->profile, &rawProfile)) {
-        return clFalse;
+        return NULL;
     }
     rawProfileB64 = clRawToBase64(C, &rawProfile);
+    clRawFree(C, &rawProfile);
     if (!rawProfileB64) {
-        clRawFree(C, &rawProfile);
-        return clFalse;
+        return NULL;
     }
+
+    jsonICC = cJSON_CreateObject();
     cJSON_AddItemToObject(jsonICC, "raw", cJSON_CreateString(rawProfileB64));
-    clRawFree(C, &rawProfile);
     clFree(rawProfileB64);
 
-    cJSON_AddItemToObject(payload, "width", cJSON_CreateNumber(image->width));
-    cJSON_AddItemToObject(payload, "height", cJSON_CreateNumber(image->height));
-    cJSON_AddItemToObject(payload, "depth", cJSON_CreateNumber(image->depth));
+    text = clProfileGetMLU(C, image->profile, "desc", "en", "US");
+    if (text == NULL) {
+        text = clContextStrdup(C, "Unknown");
+    }
+    cJSON_AddItemToObject(jsonICC, "description", cJSON_CreateString(text));
+    clFree(text);
+
+    if (curveType) {
+        cJSON_AddItemToObject(jsonICC, "curveType", cJSON_CreateString(curveType));
+    }
+
+    jsonPrimaries = cJSON_CreateArray();
+    {
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[1]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[1]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[1]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[1]));
+    }
+
+    cJSON_AddItemToObject(jsonICC, "primaries", jsonPrimaries);
+    cJSON_AddItemToObject(jsonICC, "gamma", cJSON_CreateNumber(curve.gamma));
+    cJSON_AddItemToObject(jsonICC, "luminance", cJSON_CreateNumber(maxLuminance));
+    return jsonICC;
+}
+
+static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * jsonICC, clReportWriter * writer)
+{
+    Timer t;
+
+    reportJSON(writer, "icc", jsonICC);
+    reportNumber(writer, "width", image->width);
+    reportNumber(writer, "height", image->height);
+    reportNumber(writer, "depth", image->depth);
 
     {
-        char * channelFormat = "u16";
+        char * channelFormat = (image->pixelFormat == CL_PIXELFORMAT_U8) ? "u8" : "u16";
         clRaw rawPixels;
         clStructArraySchema imageSchema[4];
         imageSchema[0].format = channelFormat;
@@ -105,33 +319,37 @@ static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
         imageSchema[2].name = "b";
         imageSchema[3].format = channelFormat;
         imageSchema[3].name = "a";
-        rawPixels.ptr = (uint8_t *)image->pixels;
-        rawPixels.size = image->size;
+        clImage * packed = clImagePack(C, image);
+        rawPixels.ptr = CL_IMAGE_PIXELS(packed);
+        rawPixels.size = packed->size;
+        rawPixels.mapped = clFalse;
         clContextLog(C, "encode", 0, "Packing raw pixels...");
         timerStart(&t);
-        cJSON_AddItemToObject(payload, "raw", clRawToStructArray(C, &rawPixels, image->width, image->height, imageSchema, 4));
+        reportKey(writer, "raw");
+        clBool packedOK = clRawWriteStructArray(C, writer->f, &rawPixels, image->width, image->height, imageSchema, 4, CL_REPORT_TILE_SIZE, C->params.deflateLevel, C->params.jobs);
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+        if (packed != image) {
+            clImageDestroy(C, packed);
+        }
+        if (!packedOK) {
+            return clFalse;
+        }
     }
 
     {
         clImage * visual;
-        char * pngB64;
         clContextLog(C, "encode", 0, "Creating raw pixels visual...");
         timerStart(&t);
         visual = clImageConvert(C, image, C->params.jobs, 8, NULL, CL_TONEMAP_AUTO);
         if (!visual) {
             return clFalse;
         }
-        clContextLog(C, "encode", 1, "Generating Base64 encoded PNG...");
-        clWriteParams writeParams;
-        clWriteParamsSetDefaults(C, &writeParams);
-        pngB64 = clContextWriteURI(C, visual, "png", &writeParams);
+        clContextLog(C, "encode", 1, "Generating Base64 encoded PNGs...");
+        clBool visualOK = reportVisual(C, writer, "visual", visual);
         clImageDestroy(C, visual);
-        if (!pngB64) {
+        if (!visualOK) {
             return clFalse;
         }
-        cJSON_AddItemToObject(payload, "visual", cJSON_CreateString(pngB64));
-        clFree(pngB64);
         clContextLog(C, "encode", 0, "Visual generation complete.");
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
     }
@@ -140,60 +358,25 @@ static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
         clContextLog(C, "highlight", 0, "Creating out-of-gamut highlights...");
         timerStart(&t);
 
-        if (!addSRGBHighlight(C, image, C->defaultLuminance, payload, "srgb")) {
+        if (!reportSRGBHighlight(C, writer, image, C->defaultLuminance, "srgb")) {
             return clFalse;
         }
 
         clContextLog(C, "highlight", 0, "Highlight generation complete.");
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
     }
-
-    text = clProfileGetMLU(C, image->profile, "desc", "en", "US");
-    if (text == NULL) {
-        text = clContextStrdup(C, "Unknown");
-    }
-    cJSON_AddItemToObject(jsonICC, "description", cJSON_CreateString(text));
-    clFree(text);
-
-    if (clProfileHasPQSignature(C, image->profile, &primaries)) {
-        curve.gamma = 0.0f;
-        maxLuminance = 10000;
-        cJSON_AddItemToObject(jsonICC, "curveType", cJSON_CreateString("pq"));
-    } else if ((curve.type == CL_PCT_HLG) || (curve.type == CL_PCT_PQ)) {
-        curve.gamma = 0.0f;
-        cJSON_AddItemToObject(jsonICC, "curveType", cJSON_CreateString(clProfileCurveTypeToLowercaseString(C, curve.type)));
-    } else {
-        // Check for profiles that we can't make valid reports for
-        if (curve.type != CL_PCT_GAMMA) {
-            clContextLogError(C, "Can't create report: the supplied tone curve can't be interpreted by current report JS");
-            return clFalse;
-        }
-    }
-
-    jsonPrimaries = cJSON_CreateArray();
-    {
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[1]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[1]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[1]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[1]));
-    }
-
-    cJSON_AddItemToObject(jsonICC, "primaries", jsonPrimaries);
-    cJSON_AddItemToObject(jsonICC, "gamma", cJSON_CreateNumber(curve.gamma));
-    cJSON_AddItemToObject(jsonICC, "luminance", cJSON_CreateNumber(maxLuminance));
     return clTrue;
 }
 
 int clContextReport(clContext * C)
 {
+    static const char payloadPrefix[] = "var COLORIST_DATA = ";
+    static const char coloristDataMarker[] = "__COLORIST_DATA__";
+
     Timer overall, t;
     int returnCode = 0;
 
-    cJSON * payload = cJSON_CreateObject();
+    cJSON * jsonICC = NULL;
     FILE * outf = NULL;
 
     clContextLog(C, "action", 0, "Report: %s -> %s", C->inputFilename, C->outputFilename);
@@ -201,57 +384,58 @@ int clContextReport(clContext * C)
 
     clContextLog(C, "decode", 0, "Reading: %s (%d bytes)", C->inputFilename, clFileSize(C->inputFilename));
     timerStart(&t);
-    clImage * image = clContextRead(C, C->inputFilename, C->iccOverrideIn, NULL);
+    clImage * image = clContextRead(C, C->inputFilename, C->iccOverrideIn, NULL, NULL);
     if (image == NULL) {
         return 1;
     }
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
-    // Basic Info
-    {
-        timerStart(&t);
-        cJSON_AddItemToObject(payload, "filename", cJSON_CreateString(C->inputFilename));
-        if (!reportBasicInfo(C, image, payload)) {
-            FAIL();
-        }
+    const char * coloristDataInjectLoc = strstr((const char *)reportTemplateBinaryData, coloristDataMarker);
+    if (!coloristDataInjectLoc) {
+        clContextLogError(C, "Template does not contain the string \"%s\", bailing out", coloristDataMarker);
+        FAIL();
     }
+    size_t beforeLen = (coloristDataInjectLoc - (const char *)reportTemplateBinaryData);
+    const char * afterPtr = coloristDataInjectLoc + strlen(coloristDataMarker);
 
-    timerStart(&t);
-    {
-        static const char payloadPrefix[] = "var COLORIST_DATA = ";
-        static const char coloristDataMarker[] = "__COLORIST_DATA__";
-        const char * coloristDataInjectLoc = strstr((const char *)reportTemplateBinaryData, coloristDataMarker);
-        const char * afterPtr;
-        size_t beforeLen, afterLen;
-        char * payloadString;
-        if (!coloristDataInjectLoc) {
-            clContextLogError(C, "Template does not contain the string \"%s\", bailing out", coloristDataMarker);
-            FAIL();
-        }
+    // Anything that can reject the image happens before the report file is created
+    jsonICC = reportICCInfo(C, image);
+    if (!jsonICC) {
+        FAIL();
+    }
 
-        beforeLen = (coloristDataInjectLoc - (const char *)reportTemplateBinaryData);
-        afterPtr = coloristDataInjectLoc + strlen(coloristDataMarker);
-        afterLen = strlen(afterPtr);
+    outf = fopen(C->outputFilename, "wb");
+    if (!outf) {
+        clContextLogError(C, "Cant open report file for write: %s", C->outputFilename);
+        FAIL();
+    }
+    fwrite(reportTemplateBinaryData, beforeLen, 1, outf);
+    fwrite(payloadPrefix, strlen(payloadPrefix), 1, outf);
 
-        outf = fopen(C->outputFilename, "wb");
-        if (!outf) {
-            clContextLogError(C, "Cant open report file for write: %s", C->outputFilename);
-            FAIL();
-        }
+    // Basic Info
+    {
+        clReportWriter writer;
+        memset(&writer, 0, sizeof(writer));
+        writer.f = outf;
 
-        payloadString = cJSON_Print(payload);
-        if (!payloadString) {
-            clContextLogError(C, "failed to create payload string!");
+        timerStart(&t);
+        reportBeginObject(&writer, NULL);
+        reportJSON(&writer, "filename", cJSON_CreateString(C->inputFilename));
+        clBool reported = reportBasicInfo(C, image, jsonICC, &writer);
+        jsonICC = NULL; // owned by the writer now
+        if (!reported) {
             FAIL();
         }
+        reportEndObject(&writer);
+    }
 
-        fwrite(reportTemplateBinaryData, beforeLen, 1, outf);
-        fwrite(payloadPrefix, strlen(payloadPrefix), 1, outf);
-        fwrite(payloadString, strlen(payloadString), 1, outf);
-        fwrite(afterPtr, afterLen, 1, outf);
-        fclose(outf);
-        outf = NULL;
+    fwrite(afterPtr, strlen(afterPtr), 1, outf);
+    if (ferror(outf)) {
+        clContextLogError(C, "Failed to write report file: %s", C->outputFilename);
+        FAIL();
     }
+    fclose(outf);
+    outf = NULL;
 
     clContextLog(C, "encode", 1, "Wrote %d bytes.", clFileSize(C->outputFilename));
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
@@ -260,9 +444,13 @@ reportCleanup:
     if (image)
         clImageDestroy(C, image);
 
-    cJSON_Delete(payload);
-    if (outf)
+    if (jsonICC)
+        cJSON_Delete(jsonICC);
+    if (outf) {
+        // Don't leave a truncated report behind
         fclose(outf);
+        remove(C->outputFilename);
+    }
 
     if (returnCode == 0) {
         clContextLog(C, "action", 0, "Conversion complete.");
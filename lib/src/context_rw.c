@@ -13,37 +13,62 @@
 #include <stdio.h>
 #include <string.h>
 
-struct clImage * clContextRead(clContext * C, const char * filename, const char * iccOverride, const char ** outFormatName)
+struct clImage * clContextRead(clContext * C, const char * filename, const char * iccOverride, clDecodeHint * hint, const char ** outFormatName)
 {
-    clImage * image = NULL;
-    clFormat * format;
-    const char * formatName = clFormatDetect(C, filename);
+    clRaw input = CL_RAW_EMPTY;
+    const char * formatName = clContextReadInput(C, filename, &input);
     if (outFormatName)
         *outFormatName = formatName;
     if (!formatName) {
         return NULL;
     }
 
+    clImage * image = clContextReadImage(C, &input, formatName, iccOverride, hint);
+    clRawFree(C, &input);
+    return image;
+}
+
+const char * clContextReadInput(clContext * C, const char * filename, struct clRaw * input)
+{
+    if (!clRawReadFile(C, input, filename)) {
+        return NULL;
+    }
+    const char * formatName = clFormatDetectRaw(C, filename, input);
+    if (!formatName) {
+        clRawFree(C, input);
+    }
+    return formatName;
+}
+
+static clProfile * readOverrideProfile(clContext * C, const char * iccOverride, clBool * failed)
+{
     clProfile * overrideProfile = NULL;
+    *failed = clFalse;
     if (iccOverride) {
         overrideProfile = clProfileRead(C, iccOverride);
         if (overrideProfile) {
             clContextLog(C, "profile", 1, "Overriding src profile with file: %s", iccOverride);
         } else {
             clContextLogError(C, "Bad ICC override file [-i]: %s", iccOverride);
-            return NULL;
+            *failed = clTrue;
         }
     }
+    return overrideProfile;
+}
 
-    clRaw input = CL_RAW_EMPTY;
-    if (!clRawReadFile(C, &input, filename)) {
-        return clFalse;
+struct clImage * clContextReadImage(clContext * C, struct clRaw * input, const char * formatName, const char * iccOverride, clDecodeHint * hint)
+{
+    clImage * image = NULL;
+    clBool overrideFailed;
+    clProfile * overrideProfile = readOverrideProfile(C, iccOverride, &overrideFailed);
+    if (overrideFailed) {
+        return NULL;
     }
 
-    format = clContextFindFormat(C, formatName);
+    clFormat * format = clContextFindFormat(C, formatName);
     COLORIST_ASSERT(format);
     if (format->readFunc) {
-        image = format->readFunc(C, formatName, overrideProfile, &input);
+        image = format->readFunc(C, formatName, overrideProfile, input, hint);
     } else {
         clContextLogError(C, "Unimplemented file reader '%s'", formatName);
     }
@@ -67,7 +92,259 @@ struct clImage * clContextRead(clContext * C, const char * filename, const char
             overrideProfile = NULL;
         }
     }
+    return image;
+}
+
+clBool clContextProbe(clContext * C, const char * filename, const char * iccOverride, clProbeInfo * info, const char ** outFormatName)
+{
+    memset(info, 0, sizeof(clProbeInfo));
+    clRaw input = CL_RAW_EMPTY;
+    const char * formatName = clContextReadInput(C, filename, &input);
+    if (outFormatName)
+        *outFormatName = formatName;
+    if (!formatName) {
+        return clFalse;
+    }
+
+    clBool probed = clContextProbeRaw(C, &input, formatName, iccOverride, info);
     clRawFree(C, &input);
+    return probed;
+}
+
+static clBool imageHasAlpha(clImage * image)
+{
+    int maxChannel = (1 << image->depth) - 1;
+    for (int j = 0; j < image->height; ++j) {
+        const uint8_t * row = CL_IMAGE_ROW(image, j);
+        for (int i = 0; i < image->width; ++i) {
+            int alpha = (image->pixelFormat == CL_PIXELFORMAT_U8) ? row[(i * 4) + 3] : ((const uint16_t *)row)[(i * 4) + 3];
+            if (alpha != maxChannel) {
+                return clTrue;
+            }
+        }
+    }
+    return clFalse;
+}
+
+clBool clContextProbeRaw(clContext * C, struct clRaw * input, const char * formatName, const char * iccOverride, clProbeInfo * info)
+{
+    memset(info, 0, sizeof(clProbeInfo));
+    clFormat * format = clContextFindFormat(C, formatName);
+    if (!format) {
+        return clFalse;
+    }
+    if (!format->probeFunc) {
+        // Nothing cheaper than a full decode for this format
+        clImage * image = clContextReadImage(C, input, formatName, iccOverride, NULL);
+        if (!image) {
+            return clFalse;
+        }
+        info->width = image->width;
+        info->height = image->height;
+        info->depth = image->depth;
+        info->hasAlpha = imageHasAlpha(image);
+        info->profile = image->profile;
+        image->profile = NULL;
+        clImageDestroy(C, image);
+        return clTrue;
+    }
+
+    clBool overrideFailed;
+    clProfile * overrideProfile = readOverrideProfile(C, iccOverride, &overrideFailed);
+    if (overrideFailed) {
+        return clFalse;
+    }
+    if (!format->probeFunc(C, formatName, input, info)) {
+        if (overrideProfile) {
+            clProfileDestroy(C, overrideProfile);
+        }
+        memset(info, 0, sizeof(clProbeInfo));
+        return clFalse;
+    }
+    if (overrideProfile) {
+        if (info->profile) {
+            clProfileDestroy(C, info->profile);
+        }
+        info->profile = overrideProfile; // take ownership
+    }
+    clImageLogCreate(C, info->width, info->height, info->depth, info->profile);
+    return clTrue;
+}
+
+void clProbeInfoFree(clContext * C, clProbeInfo * info)
+{
+    if (info->profile) {
+        clProfileDestroy(C, info->profile);
+        info->profile = NULL;
+    }
+}
+
+struct clImage * clContextReadRaw(clContext * C, struct clRaw * input, const char * formatName)
+{
+    clFormat * format = clContextFindFormat(C, formatName);
+    if (!format || !format->readFunc) {
+        clContextLogError(C, "Unimplemented file reader '%s'", formatName);
+        return NULL;
+    }
+    return format->readFunc(C, formatName, NULL, input, NULL);
+}
+
+struct clFormatReader * clContextReadBegin(clContext * C, const char * filename, const char * iccOverride, clDecodeHint * hint, struct clRaw * input)
+{
+    const char * formatName = clContextReadInput(C, filename, input);
+    if (!formatName) {
+        return NULL;
+    }
+    clFormat * format = clContextFindFormat(C, formatName);
+    COLORIST_ASSERT(format);
+    if (!format->readBeginFunc) {
+        clContextLogError(C, "Unimplemented streaming reader '%s'", formatName);
+        return NULL;
+    }
+
+    clBool overrideFailed;
+    clProfile * overrideProfile = readOverrideProfile(C, iccOverride, &overrideFailed);
+    if (overrideFailed) {
+        return NULL;
+    }
+
+    clFormatReader * reader = format->readBeginFunc(C, formatName, overrideProfile, input, hint); // takes a copy of overrideProfile
+    if (overrideProfile) {
+        clProfileDestroy(C, overrideProfile);
+    }
+    return reader;
+}
+
+int clDecodeHintChooseShift(struct clContext * C, clDecodeHint * hint, int width, int height, int maxShift)
+{
+    COLORIST_UNUSED(C);
+
+    if (!hint || ((hint->rect[0] >= 0) && (hint->rect[1] >= 0) && (hint->rect[2] > 0) && (hint->rect[3] > 0))) {
+        return 0; // a region is decoded at full size
+    }
+    hint->fullWidth = width;
+    hint->fullHeight = height;
+
+    // Same rules as --resize for a missing dimension
+    int targetW = hint->width;
+    int targetH = hint->height;
+    if ((targetW <= 0) && (targetH <= 0)) {
+        return 0;
+    } else if (targetW <= 0) {
+        targetW = (int)(((float)width / (float)height) * targetH);
+    } else if (targetH <= 0) {
+        targetH = (int)(((float)height / (float)width) * targetW);
+    }
+
+    // Decoder scaling averages blocks of pixels, which is all a box (or nearest) resize would do anyway.
+    // Every other filter gets twice the target size so its kernel still has real pixels to work with.
+    if ((hint->filter != CL_FILTER_BOX) && (hint->filter != CL_FILTER_NEAREST)) {
+        targetW *= 2;
+        targetH *= 2;
+    }
+
+    int shift = 0;
+    while (shift < maxShift) {
+        int scale = 1 << (shift + 1);
+        if ((((width + scale - 1) / scale) < targetW) || (((height + scale - 1) / scale) < targetH)) {
+            break;
+        }
+        ++shift;
+    }
+    return shift;
+}
+
+clBool clDecodeHintChooseRect(struct clContext * C, clDecodeHint * hint, int width, int height)
+{
+    COLORIST_UNUSED(C);
+
+    if (!hint) {
+        return clFalse;
+    }
+    int * rect = hint->rect;
+    if ((rect[0] < 0) || (rect[1] < 0) || (rect[2] <= 0) || (rect[3] <= 0)) {
+        return clFalse; // leaves fullWidth alone, clDecodeHintChooseShift() may have already scaled
+    }
+    hint->fullWidth = width;
+    hint->fullHeight = height;
+    rect[0] = (rect[0] < width) ? rect[0] : width - 1;
+    rect[1] = (rect[1] < height) ? rect[1] : height - 1;
+    rect[2] = ((rect[0] + rect[2]) < width) ? rect[2] : width - rect[0];
+    rect[3] = ((rect[1] + rect[3]) < height) ? rect[3] : height - rect[1];
+    hint->cropped = clTrue;
+    return clTrue;
+}
+
+// Hands out just a region of another reader's rows. Rows above the region are still decoded (and
+// dropped), but rows below it never are.
+typedef struct clCropReader
+{
+    clFormatReader reader; // must be first; profile is borrowed from source
+    clFormatReader * source;
+    clImage * sourceRow;
+    int x;
+    int skipRows;
+} clCropReader;
+
+static void cropReaderDestroy(struct clContext * C, clFormatReader * reader)
+{
+    clCropReader * cr = (clCropReader *)reader;
+    cr->source->destroy(C, cr->source);
+    clImageDestroy(C, cr->sourceRow);
+    clFree(cr);
+}
+
+static clBool cropReaderReadRows(struct clContext * C, clFormatReader * reader, clImage * rows, int rowCount)
+{
+    clCropReader * cr = (clCropReader *)reader;
+    for (; cr->skipRows > 0; --cr->skipRows) {
+        if (!cr->source->readRows(C, cr->source, cr->sourceRow, 1)) {
+            return clFalse;
+        }
+    }
+    if (cr->reader.width == cr->source->width) {
+        return cr->source->readRows(C, cr->source, rows, rowCount);
+    }
+
+    size_t offset = (size_t)cr->x * rows->pixelBytes;
+    size_t rowBytes = (size_t)cr->reader.width * rows->pixelBytes;
+    for (int j = 0; j < rowCount; ++j) {
+        if (!cr->source->readRows(C, cr->source, cr->sourceRow, 1)) {
+            return clFalse;
+        }
+        memcpy(CL_IMAGE_ROW(rows, j), CL_IMAGE_ROW(cr->sourceRow, 0) + offset, rowBytes);
+    }
+    return clTrue;
+}
+
+struct clFormatReader * clFormatReaderCrop(struct clContext * C, struct clFormatReader * reader, clDecodeHint * hint)
+{
+    if (!reader || !clDecodeHintChooseRect(C, hint, reader->width, reader->height)) {
+        return reader;
+    }
+
+    clCropReader * cr = clAllocateStruct(clCropReader);
+    cr->reader.width = hint->rect[2];
+    cr->reader.height = hint->rect[3];
+    cr->reader.depth = reader->depth;
+    cr->reader.profile = reader->profile;
+    cr->reader.readRows = cropReaderReadRows;
+    cr->reader.destroy = cropReaderDestroy;
+    cr->source = reader;
+    cr->sourceRow = clImageCreate(C, reader->width, 1, reader->depth, reader->profile);
+    cr->x = hint->rect[0];
+    cr->skipRows = hint->rect[1];
+    return &cr->reader;
+}
+
+struct clImage * clFormatReaderReadImage(struct clContext * C, struct clFormatReader * reader)
+{
+    clImage * image = clImageCreate(C, reader->width, reader->height, reader->depth, reader->profile);
+    if (!reader->readRows(C, reader, image, image->height)) {
+        clImageDestroy(C, image);
+        image = NULL;
+    }
+    reader->destroy(C, reader);
     return image;
 }
 
@@ -83,21 +360,38 @@ clBool clContextWrite(clContext * C, struct clImage * image, const char * filena
         }
     }
 
+    clRaw output = CL_RAW_EMPTY;
+    if (clContextWriteRaw(C, image, formatName, writeParams, &output)) {
+        if (clRawWriteFile(C, &output, filename)) {
+            result = clTrue;
+        }
+    }
+    clRawFree(C, &output);
+    return result;
+}
+
+clBool clContextWriteRaw(clContext * C, struct clImage * image, const char * formatName, clWriteParams * writeParams, struct clRaw * output)
+{
     clFormat * format = clContextFindFormat(C, formatName);
     COLORIST_ASSERT(format);
 
-    if (format->writeFunc) {
-        clRaw output = CL_RAW_EMPTY;
-        if (format->writeFunc(C, image, formatName, &output, writeParams)) {
-            if (clRawWriteFile(C, &output, filename)) {
-                result = clTrue;
-            }
-        }
-        clRawFree(C, &output);
-    } else {
+    if (!format->writeFunc) {
         clContextLogError(C, "Unimplemented file writer '%s'", formatName);
+        return clFalse;
     }
-    return result;
+    return format->writeFunc(C, image, formatName, output, writeParams);
+}
+
+struct clFormatWriter * clContextWriteBegin(clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, clWriteParams * writeParams)
+{
+    clFormat * format = clContextFindFormat(C, formatName);
+    COLORIST_ASSERT(format);
+
+    if (!format->writeBeginFunc) {
+        clContextLogError(C, "Unimplemented streaming writer '%s'", formatName);
+        return NULL;
+    }
+    return format->writeBeginFunc(C, formatName, width, height, depth, profile, output, writeParams);
 }
 
 char * clContextWriteURI(struct clContext * C, clImage * image, const char * formatName, clWriteParams * writeParams)
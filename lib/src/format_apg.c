@@ -15,14 +15,16 @@
 
 #include <string.h>
 
-struct clImage * clFormatReadAPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadAPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteAPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clBool clFormatProbeAPG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
 static void dumpAPG(struct clContext * C, apgImage * apg, uint32_t totalSize);
 
-struct clImage * clFormatReadAPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+struct clImage * clFormatReadAPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
 {
     COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(hint);
     COLORIST_UNUSED(input);
     COLORIST_UNUSED(C);
 
@@ -50,8 +52,12 @@ struct clImage * clFormatReadAPG(struct clContext * C, const char * formatName,
     image = clImageCreate(C, apg->width, apg->height, apg->depth, profile);
 
     int pixelChannelCount = CL_CHANNELS_PER_PIXEL * image->width * image->height;
-    for (int i = 0; i < pixelChannelCount; ++i) {
-        image->pixels[i] = apg->pixels[i];
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+        for (int i = 0; i < pixelChannelCount; ++i) {
+            image->pixelsU8[i] = (uint8_t)apg->pixels[i];
+        }
+    } else {
+        memcpy(image->pixelsU16, apg->pixels, image->size);
     }
 
     if (C->verbose) {
@@ -68,6 +74,45 @@ readCleanup:
     return image;
 }
 
+static uint32_t readBE32(const uint8_t * p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+clBool clFormatProbeAPG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info)
+{
+    COLORIST_UNUSED(formatName);
+
+    // Everything but the AV1 payloads is in the fixed size header (see apg.h) and the ICC payload after it
+    const uint8_t * header = input->ptr;
+    if ((input->size < APG_HEADER_SIZE_V1) || memcmp(header, "APG!", 4) || (readBE32(header + 4) != 1)) {
+        clContextLogError(C, "Failed to read APG header");
+        return clFalse;
+    }
+    uint32_t width = readBE32(header + 8);
+    uint32_t height = readBE32(header + 12);
+    int depth = (header[16] << 8) | header[17];
+    uint32_t iccSize = readBE32(header + 24);
+    uint32_t alphaPayloadSize = readBE32(header + 32);
+    if ((width == 0) || (height == 0) || (depth < 8) || (depth > 16) || (iccSize > (input->size - APG_HEADER_SIZE_V1))) {
+        clContextLogError(C, "Failed to read APG header");
+        return clFalse;
+    }
+
+    if (iccSize) {
+        info->profile = clProfileParse(C, header + APG_HEADER_SIZE_V1, iccSize, NULL);
+        if (!info->profile) {
+            clContextLogError(C, "Failed parse ICC profile chunk");
+            return clFalse;
+        }
+    }
+    info->width = (int)width;
+    info->height = (int)height;
+    info->depth = depth;
+    info->hasAlpha = (alphaPayloadSize > 0) ? clTrue : clFalse;
+    return clTrue;
+}
+
 clBool clFormatWriteAPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     COLORIST_UNUSED(formatName);
@@ -92,19 +137,27 @@ clBool clFormatWriteAPG(struct clContext * C, struct clImage * image, const char
     gamma1.type = CL_PCT_GAMMA;
     gamma1.gamma = 1.0f;
     clProfile * linearProfile = clProfileCreate(C, &primaries, &gamma1, 1, NULL);
-    clTransform * linearToXYZ = clTransformCreate(C, linearProfile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
-    clTransform * linearFromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, linearProfile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
+    clTransform * linearToXYZ = clTransformAcquire(C, linearProfile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    clTransform * linearFromXYZ = clTransformAcquire(C, NULL, CL_XF_XYZ, 32, linearProfile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
     float kr = clTransformCalcMaxY(C, linearFromXYZ, linearToXYZ, primaries.red[0], primaries.red[1]);
     float kg = clTransformCalcMaxY(C, linearFromXYZ, linearToXYZ, primaries.green[0], primaries.green[1]);
     float kb = clTransformCalcMaxY(C, linearFromXYZ, linearToXYZ, primaries.blue[0], primaries.blue[1]);
     apgImageSetYUVCoefficients(apg, kr, kg, kb);
-    clTransformDestroy(C, linearToXYZ);
-    clTransformDestroy(C, linearFromXYZ);
+    clTransformRelease(C, linearToXYZ);
+    clTransformRelease(C, linearFromXYZ);
     clProfileDestroy(C, linearProfile);
 
-    int pixelChannelCount = CL_CHANNELS_PER_PIXEL * image->width * image->height;
-    for (int i = 0; i < pixelChannelCount; ++i) {
-        apg->pixels[i] = image->pixels[i];
+    int rowChannelCount = CL_CHANNELS_PER_PIXEL * image->width;
+    for (int j = 0; j < image->height; ++j) {
+        uint16_t * dstRow = &apg->pixels[j * rowChannelCount];
+        if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+            uint8_t * srcRow = CL_IMAGE_ROW(image, j);
+            for (int i = 0; i < rowChannelCount; ++i) {
+                dstRow[i] = srcRow[i];
+            }
+        } else {
+            memcpy(dstRow, CL_IMAGE_ROW(image, j), rowChannelCount * sizeof(uint16_t));
+        }
     }
 
     apgResult result = apgImageEncode(apg, writeParams->quality);
@@ -19,12 +19,13 @@ static clProfile * nclxToclProfile(struct clContext * C, avifNclxColorProfile *
 static clBool clProfileToNclx(struct clContext * C, struct clProfile * profile, avifNclxColorProfile * nclx);
 static void logAvifImage(struct clContext * C, avifImage * avif);
 
-struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteAVIF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
 
-struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
 {
     COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(hint);
     COLORIST_UNUSED(input);
     COLORIST_UNUSED(C);
 
@@ -63,7 +64,7 @@ struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName,
     if (usesU16) {
         for (int j = 0; j < image->height; ++j) {
             for (int i = 0; i < image->width; ++i) {
-                uint16_t * pixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
+                uint16_t * pixel = &image->pixelsU16[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
                 pixel[0] = *((uint16_t *)&avif->rgbPlanes[AVIF_CHAN_R][(i * 2) + (j * avif->rgbRowBytes[AVIF_CHAN_R])]);
                 pixel[1] = *((uint16_t *)&avif->rgbPlanes[AVIF_CHAN_G][(i * 2) + (j * avif->rgbRowBytes[AVIF_CHAN_G])]);
                 pixel[2] = *((uint16_t *)&avif->rgbPlanes[AVIF_CHAN_B][(i * 2) + (j * avif->rgbRowBytes[AVIF_CHAN_B])]);
@@ -77,7 +78,7 @@ struct clImage * clFormatReadAVIF(struct clContext * C, const char * formatName,
     } else {
         for (int j = 0; j < image->height; ++j) {
             for (int i = 0; i < image->width; ++i) {
-                uint16_t * pixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
+                uint8_t * pixel = &image->pixelsU8[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
                 pixel[0] = avif->rgbPlanes[AVIF_CHAN_R][i + (j * avif->rgbRowBytes[AVIF_CHAN_R])];
                 pixel[1] = avif->rgbPlanes[AVIF_CHAN_G][i + (j * avif->rgbRowBytes[AVIF_CHAN_G])];
                 pixel[2] = avif->rgbPlanes[AVIF_CHAN_B][i + (j * avif->rgbRowBytes[AVIF_CHAN_B])];
@@ -145,17 +146,18 @@ clBool clFormatWriteAVIF(struct clContext * C, struct clImage * image, const cha
     avifBool usesU16 = avifImageUsesU16(avif);
     for (int j = 0; j < image->height; ++j) {
         for (int i = 0; i < image->width; ++i) {
-            uint16_t * pixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
             if (usesU16) {
+                uint16_t * pixel = (uint16_t *)CL_IMAGE_ROW(image, j) + (CL_CHANNELS_PER_PIXEL * i);
                 *((uint16_t *)&avif->rgbPlanes[AVIF_CHAN_R][(i * 2) + (j * avif->rgbRowBytes[AVIF_CHAN_R])]) = pixel[0];
                 *((uint16_t *)&avif->rgbPlanes[AVIF_CHAN_G][(i * 2) + (j * avif->rgbRowBytes[AVIF_CHAN_G])]) = pixel[1];
                 *((uint16_t *)&avif->rgbPlanes[AVIF_CHAN_B][(i * 2) + (j * avif->rgbRowBytes[AVIF_CHAN_B])]) = pixel[2];
                 *((uint16_t *)&avif->alphaPlane[(i * 2) + (j * avif->alphaRowBytes)]) = pixel[3];
             } else {
-                avif->rgbPlanes[AVIF_CHAN_R][i + (j * avif->rgbRowBytes[AVIF_CHAN_R])] = (uint8_t)pixel[0];
-                avif->rgbPlanes[AVIF_CHAN_G][i + (j * avif->rgbRowBytes[AVIF_CHAN_G])] = (uint8_t)pixel[1];
-                avif->rgbPlanes[AVIF_CHAN_B][i + (j * avif->rgbRowBytes[AVIF_CHAN_B])] = (uint8_t)pixel[2];
-                avif->alphaPlane[i + (j * avif->alphaRowBytes)] = (uint8_t)pixel[3];
+                uint8_t * pixel = CL_IMAGE_ROW(image, j) + (CL_CHANNELS_PER_PIXEL * i);
+                avif->rgbPlanes[AVIF_CHAN_R][i + (j * avif->rgbRowBytes[AVIF_CHAN_R])] = pixel[0];
+                avif->rgbPlanes[AVIF_CHAN_G][i + (j * avif->rgbRowBytes[AVIF_CHAN_G])] = pixel[1];
+                avif->rgbPlanes[AVIF_CHAN_B][i + (j * avif->rgbRowBytes[AVIF_CHAN_B])] = pixel[2];
+                avif->alphaPlane[i + (j * avif->alphaRowBytes)] = pixel[3];
             }
         }
     }
@@ -78,7 +78,7 @@ typedef struct BITMAPV5HEADER
 
 #define APPEND(PTR, SIZE) memcpy(p, PTR, SIZE); p += (SIZE);
 
-struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
 
 // ---------------------------------------------------------------------------
@@ -107,9 +107,10 @@ static int maskDepth(uint32_t mask, int currentDepth, int * channelDepth, int *
     return (depth > currentDepth) ? depth : currentDepth;
 }
 
-struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
 {
     COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(hint);
 
     clImage * image = NULL;
     clProfile * profile = NULL;
@@ -218,15 +219,25 @@ struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName,
     image = clImageCreate(C, info.bV5Width, info.bV5Height, depth, profile);
 
     for (int i = 0; i < pixelCount; ++i) {
-        uint16_t * pixels = (uint16_t *)image->pixels;
-        uint16_t * dstPixel = &pixels[i * 4];
-        dstPixel[0] = (uint16_t)((packedPixels[i] & info.bV5RedMask) >> rShift);
-        dstPixel[1] = (uint16_t)((packedPixels[i] & info.bV5GreenMask) >> gShift);
-        dstPixel[2] = (uint16_t)((packedPixels[i] & info.bV5BlueMask) >> bShift);
+        uint16_t r = (uint16_t)((packedPixels[i] & info.bV5RedMask) >> rShift);
+        uint16_t g = (uint16_t)((packedPixels[i] & info.bV5GreenMask) >> gShift);
+        uint16_t b = (uint16_t)((packedPixels[i] & info.bV5BlueMask) >> bShift);
+        uint16_t a = (uint16_t)((1 << depth) - 1);
         if (aDepth > 0)
-            dstPixel[3] = (uint16_t)((packedPixels[i] & info.bV5AlphaMask) >> aShift);
-        else
-            dstPixel[3] = (uint16_t)((1 << depth) - 1);
+            a = (uint16_t)((packedPixels[i] & info.bV5AlphaMask) >> aShift);
+        if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+            uint8_t * dstPixel = &image->pixelsU8[i * CL_CHANNELS_PER_PIXEL];
+            dstPixel[0] = (uint8_t)r;
+            dstPixel[1] = (uint8_t)g;
+            dstPixel[2] = (uint8_t)b;
+            dstPixel[3] = (uint8_t)a;
+        } else {
+            uint16_t * dstPixel = &image->pixelsU16[i * CL_CHANNELS_PER_PIXEL];
+            dstPixel[0] = r;
+            dstPixel[1] = g;
+            dstPixel[2] = b;
+            dstPixel[3] = a;
+        }
     }
 
 readCleanup:
@@ -278,12 +289,12 @@ clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char
     packedPixels = clAllocate(packedPixelBytes);
     if (image->depth == 8) {
         for (int i = 0; i < pixelCount; ++i) {
-            uint16_t * srcPixel = &image->pixels[i * CL_CHANNELS_PER_PIXEL];
+            uint8_t * srcPixel = CL_IMAGE_ROW(image, i / image->width) + ((i % image->width) * CL_CHANNELS_PER_PIXEL);
             packedPixels[i] =
-                (srcPixel[2] << 0) +  // B
-                (srcPixel[1] << 8) +  // G
-                (srcPixel[0] << 16) + // R
-                (srcPixel[3] << 24);  // A
+                ((uint32_t)srcPixel[2] << 0) +  // B
+                ((uint32_t)srcPixel[1] << 8) +  // G
+                ((uint32_t)srcPixel[0] << 16) + // R
+                ((uint32_t)srcPixel[3] << 24);  // A
         }
         info.bV5BlueMask = 255U << 0;
         info.bV5GreenMask = 255U << 8;
@@ -292,8 +303,7 @@ clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char
     } else {
         // 10 bit
         for (int i = 0; i < pixelCount; ++i) {
-            uint16_t * pixels = (uint16_t *)image->pixels;
-            uint16_t * srcPixel = &pixels[i * CL_CHANNELS_PER_PIXEL];
+            uint16_t * srcPixel = (uint16_t *)CL_IMAGE_ROW(image, i / image->width) + ((i % image->width) * CL_CHANNELS_PER_PIXEL);
             packedPixels[i] =
                 ((srcPixel[2] & 1023) << 0) +  // B
                 ((srcPixel[1] & 1023) << 10) + // G
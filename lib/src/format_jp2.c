@@ -16,8 +16,9 @@
 
 #include <string.h>
 
-struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clBool clFormatProbeJP2(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
 static void error_callback(const char * msg, void * client_data)
 {
@@ -47,6 +48,9 @@ struct opjCallbackInfo
 static OPJ_SIZE_T readCallback(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
 {
     struct opjCallbackInfo * ci = (struct opjCallbackInfo *)p_user_data;
+    if ((size_t)ci->offset >= ci->raw->size) {
+        return (OPJ_SIZE_T)-1; // end of stream, as openjpeg expects it
+    }
     if ((ci->offset + p_nb_bytes) > ci->raw->size) {
         p_nb_bytes = (OPJ_SIZE_T)(ci->raw->size - ci->offset);
     }
@@ -119,7 +123,7 @@ static int limitedToFullUV(int depth, int v)
     return v;
 }
 
-struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
 {
     COLORIST_UNUSED(formatName);
 
@@ -180,6 +184,39 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
         return NULL;
     }
 
+    // Region: only the code-blocks that overlap it are decoded
+    if (clDecodeHintChooseRect(C, hint, opjImage->x1 - opjImage->x0, opjImage->y1 - opjImage->y0)) {
+        int regionX = (int)opjImage->x0 + hint->rect[0];
+        int regionY = (int)opjImage->y0 + hint->rect[1];
+        if (!opj_set_decode_area(opjCodec, opjImage, regionX, regionY, regionX + hint->rect[2], regionY + hint->rect[3])) {
+            clContextLogError(C, "Failed to set %s decode area", errorExtName);
+            opj_stream_destroy(opjStream);
+            opj_destroy_codec(opjCodec);
+            opj_image_destroy(opjImage);
+            return NULL;
+        }
+    }
+
+    // Resolution levels: each one dropped halves both dimensions and skips that level's wavelet data
+    if (hint) {
+        opj_codestream_info_v2_t * cstrInfo = opj_get_cstr_info(opjCodec);
+        int maxReduce = 32;
+        for (i = 0; i < (int)cstrInfo->nbcomps; ++i) {
+            int reduce = (int)cstrInfo->m_default_tile_info.tccp_info[i].numresolutions - 1;
+            maxReduce = (maxReduce < reduce) ? maxReduce : reduce;
+        }
+        opj_destroy_cstr_info(&cstrInfo);
+
+        int reduce = clDecodeHintChooseShift(C, hint, opjImage->x1 - opjImage->x0, opjImage->y1 - opjImage->y0, maxReduce);
+        if ((reduce > 0) && !opj_set_decoded_resolution_factor(opjCodec, (OPJ_UINT32)reduce)) {
+            clContextLogError(C, "Failed to reduce %s resolution", errorExtName);
+            opj_stream_destroy(opjStream);
+            opj_destroy_codec(opjCodec);
+            opj_image_destroy(opjImage);
+            return NULL;
+        }
+    }
+
     if (!opj_decode(opjCodec, opjStream, opjImage)) {
         clContextLogError(C, "Failed to decode %s!", errorExtName);
         opj_destroy_codec(opjCodec);
@@ -239,8 +276,9 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
         clProfileQueryYUVCoefficients(C, profile, &yuv);
     }
 
-    clImageLogCreate(C, opjImage->x1, opjImage->y1, dstDepth, profile);
-    image = clImageCreate(C, opjImage->x1, opjImage->y1, dstDepth, profile);
+    // The first component is never subsampled, and its size accounts for any decode area or dropped resolution levels
+    clImageLogCreate(C, opjImage->comps[0].w, opjImage->comps[0].h, dstDepth, profile);
+    image = clImageCreate(C, opjImage->comps[0].w, opjImage->comps[0].h, dstDepth, profile);
     if (profile) {
         clProfileDestroy(C, profile);
     }
@@ -252,9 +290,9 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
         for (int y = 0; y < image->height; ++y) {
             for (int x = 0; x < image->width; ++x) {
 
-                uint16_t * pixel = &image->pixels[(x + (y * image->width)) * CL_CHANNELS_PER_PIXEL];
-                int uvX = x >> chromaShiftX;
-                int uvY = y >> chromaShiftY;
+                // Chroma samples sit on their own grid, which a decode area may start partway into
+                int uvX = (((int)opjImage->comps[0].x0 + x) >> chromaShiftX) - (int)opjImage->comps[1].x0;
+                int uvY = (((int)opjImage->comps[0].y0 + y) >> chromaShiftY) - (int)opjImage->comps[1].y0;
 
                 yuvUNorm[0] = opjImage->comps[0].data[x + (y * opjImage->comps[0].w)] * channelFactor[0];
                 yuvUNorm[1] = opjImage->comps[1].data[uvX + (uvY * opjImage->comps[1].w)] * channelFactor[1];
@@ -282,36 +320,32 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
                 G = CL_CLAMP(G, 0.0f, 1.0f);
                 B = CL_CLAMP(B, 0.0f, 1.0f);
 
-                pixel[0] = (uint16_t)clPixelMathRoundf(R * maxChannel);
-                pixel[1] = (uint16_t)clPixelMathRoundf(G * maxChannel);
-                pixel[2] = (uint16_t)clPixelMathRoundf(B * maxChannel);
-                if (opjImage->numcomps == 3) {
-                    pixel[3] = (uint16_t)(maxChannel);
-                } else {
-                    pixel[3] = (uint16_t)(opjImage->comps[3].data[i] * channelFactor[3]);
+                int A = maxChannel;
+                if (opjImage->numcomps != 3) {
+                    A = opjImage->comps[3].data[i] * channelFactor[3];
                 }
+                clImageSetPixel(C, image, x, y, (int)clPixelMathRoundf(R * maxChannel), (int)clPixelMathRoundf(G * maxChannel), (int)clPixelMathRoundf(B * maxChannel), A);
             }
         }
     } else {
-        uint16_t * pixel = image->pixels;
         if (opjImage->numcomps == 3) {
             // RGB, fill A
             for (i = 0; i < pixelCount; ++i) {
-                pixel[0] = (uint16_t)(opjImage->comps[0].data[i] * channelFactor[0]);
-                pixel[1] = (uint16_t)(opjImage->comps[1].data[i] * channelFactor[1]);
-                pixel[2] = (uint16_t)(opjImage->comps[2].data[i] * channelFactor[2]);
-                pixel[3] = (uint16_t)(maxChannel);
-                pixel += 4;
+                clImageSetPixel(C, image, i % image->width, i / image->width,
+                                opjImage->comps[0].data[i] * channelFactor[0],
+                                opjImage->comps[1].data[i] * channelFactor[1],
+                                opjImage->comps[2].data[i] * channelFactor[2],
+                                maxChannel);
             }
         } else {
             // RGBA
             COLORIST_ASSERT(opjImage->numcomps == 4);
             for (i = 0; i < pixelCount; ++i) {
-                pixel[0] = (uint16_t)(opjImage->comps[0].data[i] * channelFactor[0]);
-                pixel[1] = (uint16_t)(opjImage->comps[1].data[i] * channelFactor[1]);
-                pixel[2] = (uint16_t)(opjImage->comps[2].data[i] * channelFactor[2]);
-                pixel[3] = (uint16_t)(opjImage->comps[3].data[i] * channelFactor[3]);
-                pixel += 4;
+                clImageSetPixel(C, image, i % image->width, i / image->width,
+                                opjImage->comps[0].data[i] * channelFactor[0],
+                                opjImage->comps[1].data[i] * channelFactor[1],
+                                opjImage->comps[2].data[i] * channelFactor[2],
+                                opjImage->comps[3].data[i] * channelFactor[3]);
             }
         }
     }
@@ -323,6 +357,131 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
     return image;
 }
 
+static uint32_t readBE32(const uint8_t * p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Finds the next box of type within [*offset, end) of input, leaving *offset just past it. On success,
+// *contents and *contentsSize cover the box's payload.
+static clBool findBox(clRaw * input, size_t * offset, size_t end, const char * type, size_t * contents, size_t * contentsSize)
+{
+    while ((*offset + 8) <= end) {
+        const uint8_t * header = input->ptr + *offset;
+        uint64_t boxSize = readBE32(header);
+        size_t headerSize = 8;
+        if (boxSize == 1) {
+            if ((*offset + 16) > end) {
+                return clFalse;
+            }
+            boxSize = ((uint64_t)readBE32(header + 8) << 32) | readBE32(header + 12);
+            headerSize = 16;
+        } else if (boxSize == 0) {
+            boxSize = end - *offset; // runs to the end
+        }
+        if ((boxSize < headerSize) || (boxSize > (end - *offset))) {
+            return clFalse;
+        }
+
+        size_t boxStart = *offset;
+        *offset += (size_t)boxSize;
+        if (!memcmp(header + 4, type, 4)) {
+            *contents = boxStart + headerSize;
+            *contentsSize = (size_t)boxSize - headerSize;
+            return clTrue;
+        }
+    }
+    return clFalse;
+}
+
+clBool clFormatProbeJP2(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info)
+{
+    COLORIST_UNUSED(formatName);
+
+    opj_dparameters_t parameters;
+    opj_image_t * opjImage = NULL;
+    struct opjCallbackInfo ci;
+
+    static const unsigned char j2kHeader[4] = { 0xff, 0x4f, 0xff, 0x51 };
+    if (input->size < 4) {
+        clContextLogError(C, "JP2/J2K header too small");
+        return clFalse;
+    }
+    clBool isJ2K = !memcmp(input->ptr, j2kHeader, 4) ? clTrue : clFalse;
+
+    ci.C = C;
+    ci.raw = input;
+    ci.offset = 0;
+
+    // Reads the boxes up to the codestream, then the codestream's main header; no tile is touched
+    opj_stream_t * opjStream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE);
+    opj_stream_set_user_data(opjStream, &ci, NULL);
+    opj_stream_set_user_data_length(opjStream, input->size);
+    opj_stream_set_read_function(opjStream, readCallback);
+    opj_stream_set_skip_function(opjStream, skipCallback);
+    opj_stream_set_seek_function(opjStream, seekCallback);
+
+    opj_codec_t * opjCodec = opj_create_decompress(isJ2K ? OPJ_CODEC_J2K : OPJ_CODEC_JP2);
+    opj_set_info_handler(opjCodec, info_callback, C);
+    opj_set_warning_handler(opjCodec, warning_callback, C);
+    opj_set_error_handler(opjCodec, error_callback, C);
+    opj_set_default_decoder_parameters(&parameters);
+    clBool headerRead = (opj_setup_decoder(opjCodec, &parameters) && opj_read_header(opjStream, opjCodec, &opjImage)) ? clTrue : clFalse;
+    opj_stream_destroy(opjStream);
+    opj_destroy_codec(opjCodec);
+    if (!headerRead) {
+        clContextLogError(C, "Failed to read %s header", isJ2K ? "J2K" : "JP2");
+        opj_image_destroy(opjImage);
+        return clFalse;
+    }
+
+    int channelCount = (int)opjImage->numcomps;
+    int depth = 8;
+    for (int i = 0; i < channelCount; ++i) {
+        depth = (depth > (int)opjImage->comps[i].prec) ? depth : (int)opjImage->comps[i].prec;
+    }
+    info->width = (int)(opjImage->x1 - opjImage->x0);
+    info->height = (int)(opjImage->y1 - opjImage->y0);
+    opj_image_destroy(opjImage);
+
+    if (!isJ2K) {
+        // openjpeg only hands over the ICC profile (and applies any palette) while decoding, so look in jp2h directly
+        size_t offset = 0;
+        size_t jp2h, jp2hSize;
+        if (findBox(input, &offset, input->size, "jp2h", &jp2h, &jp2hSize)) {
+            size_t box, boxSize;
+            offset = jp2h;
+            if (findBox(input, &offset, jp2h + jp2hSize, "pclr", &box, &boxSize) && (boxSize >= 3)) {
+                // NE(2) NPC(1) B(NPC): the palette's columns become the image's channels
+                const uint8_t * pclr = input->ptr + box;
+                channelCount = pclr[2];
+                depth = 8;
+                for (int i = 0; (i < channelCount) && ((size_t)(3 + i) < boxSize); ++i) {
+                    int prec = (pclr[3 + i] & 0x7f) + 1;
+                    depth = (depth > prec) ? depth : prec;
+                }
+            }
+            offset = jp2h;
+            if (findBox(input, &offset, jp2h + jp2hSize, "colr", &box, &boxSize) && (boxSize > 3) && (input->ptr[box] == 2)) {
+                // METH(1) PREC(1) APPROX(1), then a restricted ICC profile. Only the first colr box counts.
+                info->profile = clProfileParse(C, input->ptr + box + 3, boxSize - 3, NULL);
+            }
+        }
+    }
+
+    if ((channelCount != 3) && (channelCount != 4)) {
+        clContextLogError(C, "Unsupported %s component count: %d", isJ2K ? "J2K" : "JP2", channelCount);
+        if (info->profile) {
+            clProfileDestroy(C, info->profile);
+            info->profile = NULL;
+        }
+        return clFalse;
+    }
+    info->depth = CL_CLAMP(depth, 8, 16);
+    info->hasAlpha = (channelCount == 4) ? clTrue : clFalse;
+    return clTrue;
+}
+
 clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     struct opjCallbackInfo ci;
@@ -387,11 +546,11 @@ clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char
     }
 
     if (image->depth > 8) {
-        unsigned short * src = (unsigned short *)image->pixels;
         for (int j = 0; j < image->height; ++j) {
+            unsigned short * src = (unsigned short *)CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
                 int dstOffset = i + (j * image->width);
-                int srcOffset = 4 * dstOffset;
+                int srcOffset = 4 * i;
                 opjImage->comps[0].data[dstOffset] = src[srcOffset + 0];
                 opjImage->comps[1].data[dstOffset] = src[srcOffset + 1];
                 opjImage->comps[2].data[dstOffset] = src[srcOffset + 2];
@@ -399,11 +558,11 @@ clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char
             }
         }
     } else {
-        unsigned char * src = (unsigned char *)image->pixels;
         for (int j = 0; j < image->height; ++j) {
+            unsigned char * src = CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
                 int dstOffset = i + (j * image->width);
-                int srcOffset = 4 * dstOffset;
+                int srcOffset = 4 * i;
                 opjImage->comps[0].data[dstOffset] = src[srcOffset + 0];
                 opjImage->comps[1].data[dstOffset] = src[srcOffset + 1];
                 opjImage->comps[2].data[dstOffset] = src[srcOffset + 2];
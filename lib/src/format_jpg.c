@@ -35,78 +35,151 @@ static void setup_read_icc_profile(j_decompress_ptr cinfo);
 static boolean read_icc_profile(struct clContext * C, j_decompress_ptr cinfo, JOCTET ** icc_data_ptr, unsigned int * icc_data_len);
 static void write_icc_profile(j_compress_ptr cinfo, const JOCTET * icc_data_ptr, unsigned int icc_data_len);
 
-struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clFormatReader * clFormatReadBeginJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
+clFormatWriter * clFormatWriteBeginJPG(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams);
+clBool clFormatProbeJPG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
-struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+typedef struct jpgReader
 {
-    COLORIST_UNUSED(formatName);
-
-    clImage * image = NULL;
-
+    clFormatReader reader; // must be first
     struct my_error_mgr jerr;
     struct jpeg_decompress_struct cinfo;
-    cinfo.err = jpeg_std_error(&jerr.pub);
-    jerr.pub.error_exit = my_error_exit;
-    if (setjmp(jerr.setjmp_buffer)) {
-        if (image) {
-            clImageDestroy(C, image);
+    JSAMPARRAY buffer;
+} jpgReader;
+
+static void jpgReaderDestroy(struct clContext * C, clFormatReader * reader)
+{
+    jpgReader * jr = (jpgReader *)reader;
+    jpeg_destroy_decompress(&jr->cinfo);
+    if (jr->reader.profile) {
+        clProfileDestroy(C, jr->reader.profile);
+    }
+    clFree(jr);
+}
+
+static clBool jpgReaderReadRows(struct clContext * C, clFormatReader * reader, clImage * rows, int rowCount)
+{
+    jpgReader * jr = (jpgReader *)reader;
+    if (setjmp(jr->jerr.setjmp_buffer)) {
+        clContextLogError(C, "Failed to decode JPEG scanlines");
+        return clFalse;
+    }
+
+    for (int row = 0; row < rowCount; ++row) {
+        jpeg_read_scanlines(&jr->cinfo, jr->buffer, 1);
+        uint8_t * pixelRow = CL_IMAGE_ROW(rows, row);
+        for (unsigned int i = 0; i < jr->cinfo.output_width; ++i) {
+            uint8_t * dst = &pixelRow[i * CL_CHANNELS_PER_PIXEL];
+            uint8_t * src = &jr->buffer[0][i * 3];
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst[3] = 255;
         }
-        jpeg_destroy_decompress(&cinfo);
-        return 0;
     }
+    return clTrue;
+}
 
-    jpeg_create_decompress(&cinfo);
-    setup_read_icc_profile(&cinfo);
-    jpeg_mem_src(&cinfo, input->ptr, (unsigned long)input->size);
-    jpeg_read_header(&cinfo, TRUE);
-    jpeg_start_decompress(&cinfo);
+clFormatReader * clFormatReadBeginJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
+{
+    COLORIST_UNUSED(formatName);
+
+    jpgReader * jr = clAllocateStruct(jpgReader);
+    jr->reader.readRows = jpgReaderReadRows;
+    jr->reader.destroy = jpgReaderDestroy;
+    jr->cinfo.err = jpeg_std_error(&jr->jerr.pub);
+    jr->jerr.pub.error_exit = my_error_exit;
+    if (setjmp(jr->jerr.setjmp_buffer)) {
+        jpgReaderDestroy(C, &jr->reader);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&jr->cinfo);
+    setup_read_icc_profile(&jr->cinfo);
+    jpeg_mem_src(&jr->cinfo, input->ptr, (unsigned long)input->size);
+    jpeg_read_header(&jr->cinfo, TRUE);
 
-    int row_stride = cinfo.output_width * cinfo.output_components;
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) & cinfo, JPOOL_IMAGE, row_stride, 1);
+    // DCT scaling: libjpeg decodes at 1/2, 1/4 or 1/8 size for a fraction of the work
+    int shift = clDecodeHintChooseShift(C, hint, jr->cinfo.image_width, jr->cinfo.image_height, 3);
+    if (shift > 0) {
+        jr->cinfo.scale_num = 1;
+        jr->cinfo.scale_denom = 1 << shift;
+    }
+    jpeg_start_decompress(&jr->cinfo);
+
+    int row_stride = jr->cinfo.output_width * jr->cinfo.output_components;
+    jr->buffer = (*jr->cinfo.mem->alloc_sarray)((j_common_ptr) & jr->cinfo, JPOOL_IMAGE, row_stride, 1);
 
-    clProfile * profile = NULL;
     if (overrideProfile) {
-        profile = clProfileClone(C, overrideProfile);
+        jr->reader.profile = clProfileClone(C, overrideProfile);
     } else {
         uint8_t * iccData = NULL;
         unsigned int iccDataLen;
-        if (read_icc_profile(C, &cinfo, &iccData, &iccDataLen)) {
-            profile = clProfileParse(C, iccData, iccDataLen, NULL);
-            if (!profile) {
+        if (read_icc_profile(C, &jr->cinfo, &iccData, &iccDataLen)) {
+            jr->reader.profile = clProfileParse(C, iccData, iccDataLen, NULL);
+            clFree(iccData);
+            if (!jr->reader.profile) {
                 clContextLogError(C, "ERROR: can't parse JPEG embedded ICC profile");
-                jpeg_destroy_decompress(&cinfo);
+                jpgReaderDestroy(C, &jr->reader);
                 return NULL;
             }
-            clFree(iccData);
         }
     }
 
-    clImageLogCreate(C, cinfo.output_width, cinfo.output_height, 8, profile);
-    image = clImageCreate(C, cinfo.output_width, cinfo.output_height, 8, profile);
+    jr->reader.width = jr->cinfo.output_width;
+    jr->reader.height = jr->cinfo.output_height;
+    jr->reader.depth = 8;
+    clImageLogCreate(C, jr->reader.width, jr->reader.height, 8, jr->reader.profile);
+    return clFormatReaderCrop(C, &jr->reader, hint); // rows past the rect are never decoded
+}
 
-    if (profile) {
-        clProfileDestroy(C, profile);
+struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
+{
+    clFormatReader * reader = clFormatReadBeginJPG(C, formatName, overrideProfile, input, hint);
+    if (!reader) {
+        return NULL;
     }
+    return clFormatReaderReadImage(C, reader);
+}
 
-    int row = 0;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, buffer, 1);
-        uint16_t * pixelRow = &image->pixels[row * image->width * CL_CHANNELS_PER_PIXEL];
-        for (unsigned int i = 0; i < cinfo.output_width; ++i) {
-            uint16_t * dst = &pixelRow[i * CL_CHANNELS_PER_PIXEL];
-            uint8_t * src = &buffer[0][i * 3];
-            dst[0] = src[0];
-            dst[1] = src[1];
-            dst[2] = src[2];
-            dst[3] = 255;
+clBool clFormatProbeJPG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info)
+{
+    COLORIST_UNUSED(formatName);
+
+    struct my_error_mgr jerr;
+    struct jpeg_decompress_struct cinfo;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = my_error_exit;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        return clFalse;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    setup_read_icc_profile(&cinfo);
+    jpeg_mem_src(&cinfo, input->ptr, (unsigned long)input->size);
+    jpeg_read_header(&cinfo, TRUE); // stops at the first SOS, after the SOF and any APP2 markers
+
+    uint8_t * iccData = NULL;
+    unsigned int iccDataLen;
+    if (read_icc_profile(C, &cinfo, &iccData, &iccDataLen)) {
+        info->profile = clProfileParse(C, iccData, iccDataLen, NULL);
+        clFree(iccData);
+        if (!info->profile) {
+            clContextLogError(C, "ERROR: can't parse JPEG embedded ICC profile");
+            jpeg_destroy_decompress(&cinfo);
+            return clFalse;
         }
-        ++row;
     }
 
-    jpeg_finish_decompress(&cinfo);
+    info->width = cinfo.image_width;
+    info->height = cinfo.image_height;
+    info->depth = 8;
+    info->hasAlpha = clFalse;
     jpeg_destroy_decompress(&cinfo);
-    return image;
+    return clTrue;
 }
 
 clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
@@ -165,6 +238,100 @@ clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char
     return (output->size > 0) ? clTrue : clFalse;
 }
 
+typedef struct jpgWriter
+{
+    clFormatWriter writer; // must be first
+    struct my_error_mgr jerr;
+    struct jpeg_compress_struct cinfo;
+    uint8_t * rgbPixels; // one band of rows
+    int rgbRows;
+} jpgWriter;
+
+static void jpgWriterDestroy(struct clContext * C, clFormatWriter * writer)
+{
+    jpgWriter * jw = (jpgWriter *)writer;
+    jpeg_destroy_compress(&jw->cinfo);
+    if (jw->rgbPixels) {
+        clFree(jw->rgbPixels);
+    }
+    clFree(jw);
+}
+
+static clBool jpgWriterWriteRows(struct clContext * C, clFormatWriter * writer, clImage * rows, int rowCount)
+{
+    jpgWriter * jw = (jpgWriter *)writer;
+    if (jw->rgbRows < rows->height) {
+        if (jw->rgbPixels) {
+            clFree(jw->rgbPixels);
+        }
+        jw->rgbPixels = clAllocate((size_t)3 * rows->width * rows->height);
+        jw->rgbRows = rows->height;
+    }
+    clImageToRGB8(C, rows, jw->rgbPixels);
+
+    if (setjmp(jw->jerr.setjmp_buffer)) {
+        clContextLogError(C, "Failed to encode JPEG scanlines");
+        return clFalse;
+    }
+    int row_stride = rows->width * 3;
+    for (int row = 0; row < rowCount; ++row) {
+        JSAMPROW row_pointer[1];
+        row_pointer[0] = &jw->rgbPixels[row * row_stride];
+        (void)jpeg_write_scanlines(&jw->cinfo, row_pointer, 1);
+    }
+    return clTrue;
+}
+
+static clBool jpgWriterFinish(struct clContext * C, clFormatWriter * writer)
+{
+    jpgWriter * jw = (jpgWriter *)writer;
+    if (setjmp(jw->jerr.setjmp_buffer)) {
+        clContextLogError(C, "ERROR: JPG compression failed");
+        return clFalse;
+    }
+    jpeg_finish_compress(&jw->cinfo);
+    return clTrue;
+}
+
+clFormatWriter * clFormatWriteBeginJPG(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams)
+{
+    COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(depth);
+
+    clRaw rawProfile = CL_RAW_EMPTY;
+    if (!clProfilePack(C, profile, &rawProfile)) {
+        return NULL;
+    }
+
+    jpgWriter * jw = clAllocateStruct(jpgWriter);
+    jw->writer.writeRows = jpgWriterWriteRows;
+    jw->writer.finish = jpgWriterFinish;
+    jw->writer.destroy = jpgWriterDestroy;
+    jw->cinfo.err = jpeg_std_error(&jw->jerr.pub);
+    jw->jerr.pub.error_exit = my_error_exit;
+    if (setjmp(jw->jerr.setjmp_buffer)) {
+        clContextLogError(C, "ERROR: JPG compression failed");
+        clRawFree(C, &rawProfile);
+        jpgWriterDestroy(C, &jw->writer);
+        return NULL;
+    }
+
+    jpeg_create_compress(&jw->cinfo);
+    jpeg_stdio_dest(&jw->cinfo, output);
+
+    jw->cinfo.image_width = width;
+    jw->cinfo.image_height = height;
+    jw->cinfo.input_components = 3;
+    jw->cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&jw->cinfo);
+    jpeg_set_quality(&jw->cinfo, writeParams->quality, TRUE);
+    jpeg_start_compress(&jw->cinfo, TRUE);
+
+    write_icc_profile(&jw->cinfo, rawProfile.ptr, (unsigned int)rawProfile.size);
+    clRawFree(C, &rawProfile);
+    return &jw->writer;
+}
+
 // ----------------------------------------------------------------------------
 // Taken from http://www.littlecms.com/1/iccjpeg.c
 // Minor adaptations for compilation / formattingv
@@ -14,8 +14,11 @@
 
 #include <string.h>
 
-struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clFormatReader * clFormatReadBeginPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
+clFormatWriter * clFormatWriteBeginPNG(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams);
+clBool clFormatProbePNG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
 struct readInfo
 {
@@ -33,53 +36,96 @@ static void readCallback(png_structp png, png_bytep data, png_size_t length)
     ri->offset += length;
 }
 
-struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+typedef struct pngReader
 {
-    COLORIST_UNUSED(formatName);
+    clFormatReader reader; // must be first
+    png_structp png;
+    png_infop info;
+    struct readInfo ri;
+    clImage * deinterlaced; // interlaced files are decoded whole up front, then handed out a band at a time
+    png_bytep * rowPointers;
+    int nextRow;
+} pngReader;
 
-    clImage * image = NULL;
-    png_bytep * rowPointers = NULL;
-    uint8_t * rgba8 = NULL;
+static void pngReaderDestroy(struct clContext * C, clFormatReader * reader)
+{
+    pngReader * pr = (pngReader *)reader;
+    png_destroy_read_struct(&pr->png, &pr->info, NULL);
+    if (pr->deinterlaced) {
+        clImageDestroy(C, pr->deinterlaced);
+    }
+    if (pr->rowPointers) {
+        clFree(pr->rowPointers);
+    }
+    if (pr->reader.profile) {
+        clProfileDestroy(C, pr->reader.profile);
+    }
+    clFree(pr);
+}
+
+static clBool pngReaderReadRows(struct clContext * C, clFormatReader * reader, clImage * rows, int rowCount)
+{
+    pngReader * pr = (pngReader *)reader;
+    size_t rowBytes = (size_t)pr->reader.width * rows->pixelBytes;
+
+    if (pr->deinterlaced) {
+        for (int j = 0; j < rowCount; ++j) {
+            memcpy(CL_IMAGE_ROW(rows, j), CL_IMAGE_ROW(pr->deinterlaced, pr->nextRow + j), rowBytes);
+        }
+        pr->nextRow += rowCount;
+        return clTrue;
+    }
+
+    if (setjmp(png_jmpbuf(pr->png))) {
+        clContextLogError(C, "Failed to decode PNG rows %d-%d", pr->nextRow, pr->nextRow + rowCount - 1);
+        return clFalse;
+    }
+    for (int j = 0; j < rowCount; ++j) {
+        png_read_row(pr->png, CL_IMAGE_ROW(rows, j), NULL);
+    }
+    pr->nextRow += rowCount;
+    return clTrue;
+}
+
+clFormatReader * clFormatReadBeginPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
+{
+    COLORIST_UNUSED(formatName);
 
-    if (png_sig_cmp(input->ptr, 0, 8)) {
+    if ((input->size < 8) || png_sig_cmp(input->ptr, 0, 8)) {
         clContextLogError(C, "not a PNG");
         return NULL;
     }
 
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info = png_create_info_struct(png);
-    COLORIST_ASSERT(png && info);
+    pngReader * pr = clAllocateStruct(pngReader);
+    pr->reader.readRows = pngReaderReadRows;
+    pr->reader.destroy = pngReaderDestroy;
+    pr->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    pr->info = png_create_info_struct(pr->png);
+    COLORIST_ASSERT(pr->png && pr->info);
 
-    if (setjmp(png_jmpbuf(png))) {
-        if (rowPointers) {
-            clFree(rowPointers);
-        }
-        if (image) {
-            clImageDestroy(C, image);
-        }
-        png_destroy_read_struct(&png, &info, NULL);
+    if (setjmp(png_jmpbuf(pr->png))) {
+        pngReaderDestroy(C, &pr->reader);
         return NULL;
     }
 
-    struct readInfo ri;
-    ri.C = C;
-    ri.src = input;
-    ri.offset = 0;
+    pr->ri.C = C;
+    pr->ri.src = input;
+    pr->ri.offset = 0;
 
-    png_set_read_fn(png, &ri, readCallback);
+    png_structp png = pr->png;
+    png_infop info = pr->info;
+    png_set_read_fn(png, &pr->ri, readCallback);
     png_read_info(png, info);
 
-    clProfile * profile = NULL;
-
     char * iccpProfileName;
     int iccpCompression;
     unsigned char * iccpData;
     png_uint_32 iccpDataLen;
 
     if (overrideProfile) {
-        profile = clProfileClone(C, overrideProfile);
+        pr->reader.profile = clProfileClone(C, overrideProfile);
     } else if (png_get_iCCP(png, info, &iccpProfileName, &iccpCompression, &iccpData, &iccpDataLen) == PNG_INFO_iCCP) {
-        profile = clProfileParse(C, iccpData, iccpDataLen, iccpProfileName);
+        pr->reader.profile = clProfileParse(C, iccpData, iccpDataLen, iccpProfileName);
     }
 
     int rawWidth = png_get_image_width(png, info);
@@ -113,39 +159,85 @@ struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName,
     }
 
     int imgBitDepth = 8;
-    int imgBytesPerChannel = 1;
     if (rawBitDepth == 16) {
         png_set_swap(png);
         imgBitDepth = 16;
-        imgBytesPerChannel = 2;
+    }
+
+    clBool interlaced = (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) ? clTrue : clFalse;
+    if (interlaced) {
+        png_set_interlace_handling(png);
     }
 
     png_read_update_info(png, info);
 
-    clImageLogCreate(C, rawWidth, rawHeight, imgBitDepth, profile);
-    image = clImageCreate(C, rawWidth, rawHeight, imgBitDepth, profile);
-    if (profile) {
-        clProfileDestroy(C, profile);
-    }
-    rowPointers = (png_bytep *)clAllocate(sizeof(png_bytep) * rawHeight);
-    if (imgBytesPerChannel == 1) {
-        rgba8 = clAllocate(image->width * image->height * CL_CHANNELS_PER_PIXEL);
-        for (int y = 0; y < rawHeight; ++y) {
-            rowPointers[y] = &rgba8[CL_CHANNELS_PER_PIXEL * y * rawWidth];
-        }
-    } else {
+    pr->reader.width = rawWidth;
+    pr->reader.height = rawHeight;
+    pr->reader.depth = imgBitDepth;
+    clImageLogCreate(C, rawWidth, rawHeight, imgBitDepth, pr->reader.profile);
+
+    if (interlaced) {
+        // Every Adam7 pass touches rows all over the image, so there is nothing to gain by streaming these
+        pr->deinterlaced = clImageCreate(C, rawWidth, rawHeight, imgBitDepth, pr->reader.profile);
+        pr->rowPointers = (png_bytep *)clAllocate(sizeof(png_bytep) * rawHeight);
         for (int y = 0; y < rawHeight; ++y) {
-            rowPointers[y] = (png_byte *)&image->pixels[CL_CHANNELS_PER_PIXEL * y * rawWidth];
+            pr->rowPointers[y] = CL_IMAGE_ROW(pr->deinterlaced, y);
         }
+        png_read_image(png, pr->rowPointers);
+        clFree(pr->rowPointers);
+        pr->rowPointers = NULL;
     }
-    png_read_image(png, rowPointers);
-    if (rgba8) {
-        clImageFromRGBA8(C, image, rgba8);
-        clFree(rgba8);
+    return clFormatReaderCrop(C, &pr->reader, hint); // rows past the rect are never decoded
+}
+
+clBool clFormatProbePNG(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info)
+{
+    COLORIST_UNUSED(formatName);
+
+    if ((input->size < 8) || png_sig_cmp(input->ptr, 0, 8)) {
+        clContextLogError(C, "not a PNG");
+        return clFalse;
     }
-    png_destroy_read_struct(&png, &info, NULL);
-    clFree(rowPointers);
-    return image;
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop pngInfo = png_create_info_struct(png);
+    COLORIST_ASSERT(png && pngInfo);
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &pngInfo, NULL);
+        return clFalse;
+    }
+
+    struct readInfo ri;
+    ri.C = C;
+    ri.src = input;
+    ri.offset = 0;
+    png_set_read_fn(png, &ri, readCallback);
+    png_read_info(png, pngInfo); // stops at the first IDAT
+
+    char * iccpProfileName;
+    int iccpCompression;
+    unsigned char * iccpData;
+    png_uint_32 iccpDataLen;
+    if (png_get_iCCP(png, pngInfo, &iccpProfileName, &iccpCompression, &iccpData, &iccpDataLen) == PNG_INFO_iCCP) {
+        info->profile = clProfileParse(C, iccpData, iccpDataLen, iccpProfileName);
+    }
+
+    png_byte rawColorType = png_get_color_type(png, pngInfo);
+    info->width = png_get_image_width(png, pngInfo);
+    info->height = png_get_image_height(png, pngInfo);
+    info->depth = (png_get_bit_depth(png, pngInfo) == 16) ? 16 : 8;
+    info->hasAlpha = ((rawColorType & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, pngInfo, PNG_INFO_tRNS)) ? clTrue : clFalse;
+    png_destroy_read_struct(&png, &pngInfo, NULL);
+    return clTrue;
+}
+
+struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
+{
+    clFormatReader * reader = clFormatReadBeginPNG(C, formatName, overrideProfile, input, hint);
+    if (!reader) {
+        return NULL;
+    }
+    return clFormatReaderReadImage(C, reader);
 }
 
 struct writeInfo
@@ -171,6 +263,23 @@ static void writeCallback(png_structp png, png_bytep data, png_size_t length)
     wi->offset += length;
 }
 
+// Writes everything that comes before the first row
+static void writeHeader(png_structp png, png_infop info, int width, int height, int depth, clProfile * profile, clRaw * rawProfile)
+{
+    png_set_IHDR(
+        png,
+        info,
+        width, height,
+        depth,
+        PNG_COLOR_TYPE_RGBA,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+        );
+    png_set_iCCP(png, info, profile->description, 0, rawProfile->ptr, (png_uint_32)rawProfile->size);
+    png_write_info(png, info);
+}
+
 clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     COLORIST_UNUSED(formatName);
@@ -203,32 +312,22 @@ clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char
     wi.dst = output;
     png_set_write_fn(png, &wi, writeCallback, NULL);
 
-    png_set_IHDR(
-        png,
-        info,
-        image->width, image->height,
-        image->depth,
-        PNG_COLOR_TYPE_RGBA,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT
-        );
-    png_set_iCCP(png, info, image->profile->description, 0, rawProfile.ptr, (png_uint_32)rawProfile.size);
-    png_write_info(png, info);
+    writeHeader(png, info, image->width, image->height, image->depth, image->profile, &rawProfile);
 
     rowPointers = (png_bytep *)clAllocate(sizeof(png_bytep) * image->height);
-    int imgBytesPerChannel = (image->depth == 16) ? 2 : 1;
-    if (imgBytesPerChannel == 1) {
-        rgba8 = clAllocate(image->width * image->height * CL_CHANNELS_PER_PIXEL);
-        clImageToRGBA8(C, image, rgba8);
+    if ((image->depth == 8) || (image->depth == 16)) {
         for (int y = 0; y < image->height; ++y) {
-            rowPointers[y] = &rgba8[CL_CHANNELS_PER_PIXEL * y * image->width];
+            rowPointers[y] = CL_IMAGE_ROW(image, y);
+        }
+        if (image->depth == 16) {
+            png_set_swap(png);
         }
     } else {
+        rgba8 = clAllocate(image->width * image->height * CL_CHANNELS_PER_PIXEL);
+        clImageToRGBA8(C, image, rgba8);
         for (int y = 0; y < image->height; ++y) {
-            rowPointers[y] = (png_byte *)&image->pixels[CL_CHANNELS_PER_PIXEL * y * image->width];
+            rowPointers[y] = &rgba8[CL_CHANNELS_PER_PIXEL * y * image->width];
         }
-        png_set_swap(png);
     }
 
     png_write_image(png, rowPointers);
@@ -243,3 +342,78 @@ clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char
     }
     return clTrue;
 }
+
+typedef struct pngWriter
+{
+    clFormatWriter writer; // must be first
+    png_structp png;
+    png_infop info;
+    clRaw rawProfile;
+} pngWriter;
+
+static void pngWriterDestroy(struct clContext * C, clFormatWriter * writer)
+{
+    pngWriter * pw = (pngWriter *)writer;
+    png_destroy_write_struct(&pw->png, &pw->info);
+    clRawFree(C, &pw->rawProfile);
+    clFree(pw);
+}
+
+static clBool pngWriterWriteRows(struct clContext * C, clFormatWriter * writer, clImage * rows, int rowCount)
+{
+    pngWriter * pw = (pngWriter *)writer;
+    if (setjmp(png_jmpbuf(pw->png))) {
+        clContextLogError(C, "Failed to encode PNG rows");
+        return clFalse;
+    }
+    for (int j = 0; j < rowCount; ++j) {
+        png_write_row(pw->png, CL_IMAGE_ROW(rows, j));
+    }
+    return clTrue;
+}
+
+static clBool pngWriterFinish(struct clContext * C, clFormatWriter * writer)
+{
+    pngWriter * pw = (pngWriter *)writer;
+    if (setjmp(png_jmpbuf(pw->png))) {
+        clContextLogError(C, "Failed to finish PNG");
+        return clFalse;
+    }
+    png_write_end(pw->png, NULL);
+    return clTrue;
+}
+
+clFormatWriter * clFormatWriteBeginPNG(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams)
+{
+    COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(writeParams);
+
+    if ((depth != 8) && (depth != 16)) {
+        clContextLogError(C, "Can't stream %d-bit PNG rows", depth);
+        return NULL;
+    }
+
+    pngWriter * pw = clAllocateStruct(pngWriter);
+    pw->writer.writeRows = pngWriterWriteRows;
+    pw->writer.finish = pngWriterFinish;
+    pw->writer.destroy = pngWriterDestroy;
+    if (!clProfilePack(C, profile, &pw->rawProfile)) {
+        clFree(pw);
+        return NULL;
+    }
+    pw->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    pw->info = png_create_info_struct(pw->png);
+    COLORIST_ASSERT(pw->png && pw->info);
+
+    if (setjmp(png_jmpbuf(pw->png))) {
+        pngWriterDestroy(C, &pw->writer);
+        return NULL;
+    }
+
+    png_init_io(pw->png, output);
+    writeHeader(pw->png, pw->info, width, height, depth, profile, &pw->rawProfile);
+    if (depth == 16) {
+        png_set_swap(pw->png);
+    }
+    return &pw->writer;
+}
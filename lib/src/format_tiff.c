@@ -14,8 +14,11 @@
 
 #include <string.h>
 
-struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clFormatReader * clFormatReadBeginTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
+clFormatWriter * clFormatWriteBeginTIFF(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams);
+clBool clFormatProbeTIFF(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
 typedef struct tiffCallbackInfo
 {
@@ -26,6 +29,9 @@ typedef struct tiffCallbackInfo
 
 static tmsize_t readCallback(tiffCallbackInfo * ci, void * ptr, tmsize_t size)
 {
+    if (ci->offset >= ci->raw->size) {
+        return 0; // a truncated file can point past its end
+    }
     if ((ci->offset + size) > ci->raw->size) {
         size = (tmsize_t)(ci->raw->size - ci->offset);
     }
@@ -91,71 +97,229 @@ static void unmapCallback(tiffCallbackInfo * ci, void * base, toff_t size)
     COLORIST_UNUSED(size);
 }
 
-struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+typedef struct tiffReader
+{
+    clFormatReader reader; // must be first
+    tiffCallbackInfo ci;
+    TIFF * tiff;
+    int channelCount;
+    int sampleBytes;
+    int nextRow;
+    int x; // the reader hands out the region x, y, reader.width, reader.height of the file (see clDecodeHint)
+    int y;
+    int fileWidth;
+    int fileHeight;
+    uint8_t * scanline; // a whole file row, when the region isn't the whole file
+    int rowsPerStrip;
+    int nextScanline;   // the row libtiff's decoder is up to
+    uint32_t tileWidth; // tiled files only
+    uint32_t tileLength;
+    uint8_t * tile;
+    uint8_t * tileRows; // the region's columns of one row of tiles
+    int tileRowIndex;   // which row of tiles tileRows holds, -1 for none
+    clImage * flipped;  // bottom-up files are decoded up front, then handed out a band at a time
+} tiffReader;
+
+static void tiffReaderDestroy(struct clContext * C, clFormatReader * reader)
+{
+    tiffReader * tr = (tiffReader *)reader;
+    if (tr->tiff) {
+        TIFFClose(tr->tiff);
+    }
+    if (tr->scanline) {
+        clFree(tr->scanline);
+    }
+    if (tr->tile) {
+        clFree(tr->tile);
+        clFree(tr->tileRows);
+    }
+    if (tr->flipped) {
+        clImageDestroy(C, tr->flipped);
+    }
+    if (tr->reader.profile) {
+        clProfileDestroy(C, tr->reader.profile);
+    }
+    clFree(tr);
+}
+
+// Copies count pixels of the file's samples to RGBA, filling A if the file has none. Works backwards,
+// reading each pixel before writing it, so dst may start at src to expand in place.
+static void expandToRGBA(tiffReader * tr, const uint8_t * src, uint8_t * dst, int count)
+{
+    if (tr->channelCount == 4) {
+        memmove(dst, src, (size_t)count * 4 * tr->sampleBytes);
+    } else if (tr->reader.depth == 8) {
+        for (int x = count - 1; x >= 0; --x) {
+            const uint8_t * srcPixel = &src[x * 3];
+            uint8_t r = srcPixel[0];
+            uint8_t g = srcPixel[1];
+            uint8_t b = srcPixel[2];
+            uint8_t * dstPixel = &dst[x * 4];
+            dstPixel[0] = r;
+            dstPixel[1] = g;
+            dstPixel[2] = b;
+            dstPixel[3] = 255;
+        }
+    } else {
+        for (int x = count - 1; x >= 0; --x) {
+            const uint16_t * srcPixel = (const uint16_t *)&src[x * 3 * sizeof(uint16_t)];
+            uint16_t r = srcPixel[0];
+            uint16_t g = srcPixel[1];
+            uint16_t b = srcPixel[2];
+            uint16_t * dstPixel = (uint16_t *)&dst[x * 4 * sizeof(uint16_t)];
+            dstPixel[0] = r;
+            dstPixel[1] = g;
+            dstPixel[2] = b;
+            dstPixel[3] = 65535;
+        }
+    }
+}
+
+// Decodes the tiles covering the region's columns in one row of tiles into tileRows
+static clBool readTileRow(struct clContext * C, tiffReader * tr, int tileRowIndex)
+{
+    int fileBytes = tr->sampleBytes * tr->channelCount;
+    int pixelBytes = tr->sampleBytes * CL_CHANNELS_PER_PIXEL;
+    int tileY = tileRowIndex * (int)tr->tileLength;
+    int rowCount = tr->fileHeight - tileY;
+    if (rowCount > (int)tr->tileLength) {
+        rowCount = (int)tr->tileLength;
+    }
+
+    int endX = tr->x + tr->reader.width;
+    for (int tileX = tr->x - (tr->x % (int)tr->tileWidth); tileX < endX; tileX += (int)tr->tileWidth) {
+        if (TIFFReadTile(tr->tiff, tr->tile, (uint32_t)tileX, (uint32_t)tileY, 0, 0) < 0) {
+            clContextLogError(C, "Failed to read TIFF tile at %d,%d", tileX, tileY);
+            return clFalse;
+        }
+
+        int startCol = (tileX > tr->x) ? tileX : tr->x;
+        int endCol = ((tileX + (int)tr->tileWidth) < endX) ? (tileX + (int)tr->tileWidth) : endX;
+        for (int j = 0; j < rowCount; ++j) {
+            const uint8_t * src = tr->tile + ((size_t)j * tr->tileWidth + (startCol - tileX)) * fileBytes;
+            uint8_t * dst = tr->tileRows + ((size_t)j * tr->reader.width + (startCol - tr->x)) * pixelBytes;
+            expandToRGBA(tr, src, dst, endCol - startCol);
+        }
+    }
+    tr->tileRowIndex = tileRowIndex;
+    return clTrue;
+}
+
+// Decodes the region's columns of file row rowIndex into pixelRow as RGBA
+static clBool readFileRow(struct clContext * C, tiffReader * tr, uint8_t * pixelRow, int rowIndex)
+{
+    size_t pixelBytes = (size_t)tr->sampleBytes * CL_CHANNELS_PER_PIXEL;
+    size_t rowBytes = tr->reader.width * pixelBytes;
+
+    if (tr->tile) {
+        int tileRowIndex = rowIndex / (int)tr->tileLength;
+        if ((tileRowIndex != tr->tileRowIndex) && !readTileRow(C, tr, tileRowIndex)) {
+            return clFalse;
+        }
+        memcpy(pixelRow, tr->tileRows + (rowIndex % (int)tr->tileLength) * rowBytes, rowBytes);
+        return clTrue;
+    }
+
+    // Strips: most codecs can only start decoding at the top of a strip, so jump to the one holding
+    // rowIndex and decode down to it. Strips above it are never decoded.
+    if (rowIndex > tr->nextScanline) {
+        int skipRow = rowIndex - (rowIndex % tr->rowsPerStrip);
+        for (skipRow = (skipRow > tr->nextScanline) ? skipRow : tr->nextScanline; skipRow < rowIndex; ++skipRow) {
+            if (TIFFReadScanline(tr->tiff, tr->scanline, skipRow, 0) < 0) {
+                clContextLogError(C, "Failed to read TIFF scanline row %d", skipRow);
+                return clFalse;
+            }
+        }
+    }
+    uint8_t * scanline = tr->scanline ? tr->scanline : pixelRow;
+    if (TIFFReadScanline(tr->tiff, scanline, rowIndex, 0) < 0) {
+        clContextLogError(C, "Failed to read TIFF scanline row %d", rowIndex);
+        return clFalse;
+    }
+    tr->nextScanline = rowIndex + 1;
+    expandToRGBA(tr, scanline, scanline, tr->fileWidth);
+    if (tr->scanline) {
+        memcpy(pixelRow, tr->scanline + (tr->x * pixelBytes), rowBytes);
+    }
+    return clTrue;
+}
+
+static clBool tiffReaderReadRows(struct clContext * C, clFormatReader * reader, clImage * rows, int rowCount)
+{
+    tiffReader * tr = (tiffReader *)reader;
+    for (int j = 0; j < rowCount; ++j) {
+        uint8_t * pixelRow = CL_IMAGE_ROW(rows, j);
+        if (tr->flipped) {
+            memcpy(pixelRow, CL_IMAGE_ROW(tr->flipped, tr->nextRow), (size_t)tr->reader.width * rows->pixelBytes);
+        } else if (!readFileRow(C, tr, pixelRow, tr->y + tr->nextRow)) {
+            return clFalse;
+        }
+        ++tr->nextRow;
+    }
+    return clTrue;
+}
+
+clFormatReader * clFormatReadBeginTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
 {
     COLORIST_UNUSED(formatName);
 
-    clProfile * profile = NULL;
-    clImage * image = NULL;
-    TIFF * tiff;
     int width = 0;
     int height = 0;
     int depth = 0;
     int iccLen = 0;
-    int channelCount = 0;
     int orientation = ORIENTATION_TOPLEFT;
     uint8_t * iccBuf = NULL;
-    int rowIndex, rowBytes;
-    tiffCallbackInfo ci;
-    uint8_t * pixels = NULL;
-    uint8_t * rgba8 = NULL;
 
-    ci.C = C;
-    ci.raw = input;
-    ci.offset = 0;
+    tiffReader * tr = clAllocateStruct(tiffReader);
+    tr->reader.readRows = tiffReaderReadRows;
+    tr->reader.destroy = tiffReaderDestroy;
+    tr->ci.C = C;
+    tr->ci.raw = input;
+    tr->ci.offset = 0;
 
-    tiff = TIFFClientOpen("tiff", "rb",
-        (thandle_t)&ci,
+    tr->tiff = TIFFClientOpen("tiff", "rb",
+        (thandle_t)&tr->ci,
         (TIFFReadWriteProc)readCallback, (TIFFReadWriteProc)writeCallback,
         (TIFFSeekProc)seekCallback, (TIFFCloseProc)closeCalllback,
         (TIFFSizeProc)sizeCallback,
         (TIFFMapFileProc)mapCallback, (TIFFUnmapFileProc)unmapCallback);
-    if (!tiff) {
+    if (!tr->tiff) {
         clContextLogError(C, "cannot open TIFF for read");
-        goto readCleanup;
+        goto readFailed;
     }
+    TIFF * tiff = tr->tiff;
 
     TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
     TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
     if ((width <= 0) || (height <= 0)) {
         clContextLogError(C, "cannot read width and height from TIFF");
-        goto readCleanup;
+        goto readFailed;
     }
 
-    TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &channelCount);
-    if ((channelCount != 3) && (channelCount != 4)) {
-        clContextLogError(C, "unsupported channelCount(%d) from TIFF", channelCount);
-        goto readCleanup;
+    TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &tr->channelCount);
+    if ((tr->channelCount != 3) && (tr->channelCount != 4)) {
+        clContextLogError(C, "unsupported channelCount(%d) from TIFF", tr->channelCount);
+        goto readFailed;
     }
 
     TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &depth);
     if ((depth <= 0)) {
         // TODO: convert to 16bit
         clContextLogError(C, "cannot read depth from TIFF: '%s'");
-        goto readCleanup;
+        goto readFailed;
     }
     if ((depth != 8) && (depth != 16)) {
         clContextLogError(C, "unsupported depth(%d) from TIFF", depth);
-        goto readCleanup;
+        goto readFailed;
     }
 
     if (overrideProfile) {
-        profile = clProfileClone(C, overrideProfile);
+        tr->reader.profile = clProfileClone(C, overrideProfile);
     } else if (TIFFGetField(tiff, TIFFTAG_ICCPROFILE, &iccLen, &iccBuf)) {
-        profile = clProfileParse(C, iccBuf, iccLen, NULL);
-        if (!profile) {
+        tr->reader.profile = clProfileParse(C, iccBuf, iccLen, NULL);
+        if (!tr->reader.profile) {
             clContextLogError(C, "cannot parse ICC profile from TIFF");
-            goto readCleanup;
+            goto readFailed;
         }
     }
 
@@ -163,77 +327,151 @@ struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName,
         if ((orientation != ORIENTATION_TOPLEFT) && (orientation != ORIENTATION_BOTLEFT)) {
             // TODO: Support other orientations
             clContextLogError(C, "Unsupported orientation (%d)", orientation);
-            goto readCleanup;
+            goto readFailed;
         }
     } else {
         // ?
         orientation = ORIENTATION_TOPLEFT;
     }
 
-    clImageLogCreate(C, width, height, depth, profile);
-    image = clImageCreate(C, width, height, depth, profile);
-    if (depth == 8) {
-        rgba8 = clAllocate(image->width * image->height * CL_CHANNELS_PER_PIXEL);
-        pixels = rgba8;
-        rowBytes = image->width * CL_CHANNELS_PER_PIXEL * 1;
-    } else {
-        pixels = (uint8_t *)image->pixels;
-        rowBytes = image->width * CL_CHANNELS_PER_PIXEL * 2;
+    tr->sampleBytes = (depth == 8) ? sizeof(uint8_t) : sizeof(uint16_t);
+    tr->fileWidth = width;
+    tr->fileHeight = height;
+    tr->reader.width = width;
+    tr->reader.height = height;
+    tr->reader.depth = depth;
+    clImageLogCreate(C, width, height, depth, tr->reader.profile);
+    if (clDecodeHintChooseRect(C, hint, width, height)) {
+        tr->x = hint->rect[0];
+        tr->y = hint->rect[1];
+        tr->reader.width = hint->rect[2];
+        tr->reader.height = hint->rect[3];
     }
-    for (rowIndex = 0; rowIndex < image->height; ++rowIndex) {
-        uint8_t * pixelRow;
-        if (orientation == ORIENTATION_TOPLEFT) {
-            pixelRow = &pixels[rowIndex * rowBytes];
-        } else {
-            // ORIENTATION_BOTLEFT
-            pixelRow = &pixels[(image->height - 1 - rowIndex) * rowBytes];
+
+    if (TIFFIsTiled(tiff)) {
+        TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tr->tileWidth);
+        TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tr->tileLength);
+        if ((tr->tileWidth == 0) || (tr->tileLength == 0)) {
+            clContextLogError(C, "cannot read tile size from TIFF");
+            goto readFailed;
         }
-        if (TIFFReadScanline(tiff, pixelRow, rowIndex, 0) < 0) {
-            clContextLogError(C, "Failed to read TIFF scanline row %d", rowIndex);
-            clImageDestroy(C, image);
-            image = NULL;
-            goto readCleanup;
+        tr->tile = clAllocate(TIFFTileSize(tiff));
+        tr->tileRows = clAllocate((size_t)tr->tileLength * tr->reader.width * CL_CHANNELS_PER_PIXEL * tr->sampleBytes);
+        tr->tileRowIndex = -1;
+    } else {
+        uint32_t rowsPerStrip = 0;
+        TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+        tr->rowsPerStrip = ((rowsPerStrip > 0) && (rowsPerStrip < (uint32_t)height)) ? (int)rowsPerStrip : height;
+        if ((tr->reader.width != width) || (tr->reader.height != height)) {
+            tr->scanline = clAllocate((size_t)width * CL_CHANNELS_PER_PIXEL * tr->sampleBytes);
         }
+    }
 
-        if (channelCount == 3) {
-            // Expand RGB in-place into RGBA, then fill A
-            if (depth == 8) {
-                for (int x = image->width - 1; x >= 0; --x) {
-                    uint8_t * srcPixel = &pixelRow[x * 3 * sizeof(uint8_t)];
-                    uint8_t * dstPixel = &pixelRow[x * 4 * sizeof(uint8_t)];
-                    dstPixel[0] = srcPixel[0];
-                    dstPixel[1] = srcPixel[1];
-                    dstPixel[2] = srcPixel[2];
-                    dstPixel[3] = 255;
-                }
-            } else {
-                for (int x = image->width - 1; x >= 0; --x) {
-                    uint16_t * srcPixel = (uint16_t *)&pixelRow[x * 3 * sizeof(uint16_t)];
-                    uint16_t * dstPixel = (uint16_t *)&pixelRow[x * 4 * sizeof(uint16_t)];
-                    dstPixel[0] = srcPixel[0];
-                    dstPixel[1] = srcPixel[1];
-                    dstPixel[2] = srcPixel[2];
-                    dstPixel[3] = 65535;
-                }
+    if (orientation == ORIENTATION_BOTLEFT) {
+        // The last row comes first; reading scanlines backwards would decode each strip over and over
+        int regionHeight = tr->reader.height;
+        int firstRow = height - tr->y - regionHeight;
+        clImage * flipped = clImageCreate(C, tr->reader.width, regionHeight, depth, tr->reader.profile);
+        for (int j = 0; j < regionHeight; ++j) {
+            if (!readFileRow(C, tr, CL_IMAGE_ROW(flipped, regionHeight - 1 - j), firstRow + j)) {
+                clImageDestroy(C, flipped);
+                goto readFailed;
             }
         }
+        tr->flipped = flipped;
     }
+    return &tr->reader;
 
-    if (rgba8) {
-        clImageFromRGBA8(C, image, rgba8);
+readFailed:
+    tiffReaderDestroy(C, &tr->reader);
+    return NULL;
+}
+
+struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
+{
+    clFormatReader * reader = clFormatReadBeginTIFF(C, formatName, overrideProfile, input, hint);
+    if (!reader) {
+        return NULL;
     }
+    return clFormatReaderReadImage(C, reader);
+}
 
-readCleanup:
-    if (tiff) {
-        TIFFClose(tiff);
+clBool clFormatProbeTIFF(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info)
+{
+    COLORIST_UNUSED(formatName);
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint16_t channelCount = 0;
+    uint16_t depth = 0;
+    uint32_t iccLen = 0;
+    uint8_t * iccBuf = NULL;
+
+    tiffCallbackInfo ci;
+    ci.C = C;
+    ci.raw = input;
+    ci.offset = 0;
+
+    // Opening reads just the first IFD; no strip or tile is touched
+    TIFF * tiff = TIFFClientOpen("tiff", "rb",
+        (thandle_t)&ci,
+        (TIFFReadWriteProc)readCallback, (TIFFReadWriteProc)writeCallback,
+        (TIFFSeekProc)seekCallback, (TIFFCloseProc)closeCalllback,
+        (TIFFSizeProc)sizeCallback,
+        (TIFFMapFileProc)mapCallback, (TIFFUnmapFileProc)unmapCallback);
+    if (!tiff) {
+        clContextLogError(C, "cannot open TIFF for read");
+        return clFalse;
     }
-    if (profile) {
-        clProfileDestroy(C, profile);
+
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &channelCount);
+    TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &depth);
+    if ((width == 0) || (height == 0) || ((channelCount != 3) && (channelCount != 4)) || ((depth != 8) && (depth != 16))) {
+        clContextLogError(C, "unsupported TIFF (%ux%u, %u channels, %u-bit)", width, height, channelCount, depth);
+        TIFFClose(tiff);
+        return clFalse;
     }
-    if (rgba8) {
-        clFree(rgba8);
+
+    if (TIFFGetField(tiff, TIFFTAG_ICCPROFILE, &iccLen, &iccBuf)) {
+        info->profile = clProfileParse(C, iccBuf, iccLen, NULL);
+        if (!info->profile) {
+            clContextLogError(C, "cannot parse ICC profile from TIFF");
+            TIFFClose(tiff);
+            return clFalse;
+        }
     }
-    return image;
+
+    info->width = (int)width;
+    info->height = (int)height;
+    info->depth = depth;
+    info->hasAlpha = (channelCount == 4) ? clTrue : clFalse;
+    TIFFClose(tiff);
+    return clTrue;
+}
+
+// libtiff byte-swaps 16-bit samples in the buffer it is handed (the file is big-endian), so rows are
+// written from a copy to leave the caller's pixels alone
+static clBool writeScanline(TIFF * tiff, uint8_t * scratchRow, const uint8_t * pixelRow, size_t rowBytes, int rowIndex)
+{
+    memcpy(scratchRow, pixelRow, rowBytes);
+    return (TIFFWriteScanline(tiff, scratchRow, rowIndex, 0) < 0) ? clFalse : clTrue;
+}
+
+static void writeHeader(TIFF * tiff, int width, int height, int depth, clRaw * rawProfile)
+{
+    int rowBytes = width * CL_CHANNELS_PER_PIXEL * ((depth > 8) ? 2 : 1);
+
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 4);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, depth);
+    TIFFSetField(tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiff, rowBytes));
+    TIFFSetField(tiff, TIFFTAG_ICCPROFILE, rawProfile->size, rawProfile->ptr);
 }
 
 clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
@@ -243,10 +481,9 @@ clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const cha
 
     clBool writeResult = clTrue;
     TIFF * tiff = NULL;
-    int rowIndex, rowBytes;
+    int rowIndex;
+    uint8_t * scratchRow = NULL;
     tiffCallbackInfo ci;
-    uint8_t * pixels = NULL;
-    uint8_t * rgba8 = NULL;
 
     clRaw rawProfile = CL_RAW_EMPTY;
     if (!clProfilePack(C, image->profile, &rawProfile)) {
@@ -270,29 +507,11 @@ clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const cha
         goto writeCleanup;
     }
 
-    if (image->depth == 8) {
-        rgba8 = clAllocate(image->width * image->height * CL_CHANNELS_PER_PIXEL);
-        clImageToRGBA8(C, image, rgba8);
-        pixels = rgba8;
-        rowBytes = image->width * CL_CHANNELS_PER_PIXEL * 1;
-    } else {
-        pixels = (uint8_t *)image->pixels;
-        rowBytes = image->width * CL_CHANNELS_PER_PIXEL * 2;
-    }
-
-    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, image->width);
-    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, image->height);
-    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 4);
-    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, image->depth);
-    TIFFSetField(tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiff, rowBytes));
-    TIFFSetField(tiff, TIFFTAG_ICCPROFILE, rawProfile.size, rawProfile.ptr);
+    writeHeader(tiff, image->width, image->height, image->depth, &rawProfile);
 
+    scratchRow = clAllocate((size_t)image->width * image->pixelBytes);
     for (rowIndex = 0; rowIndex < image->height; ++rowIndex) {
-        uint8_t * pixelRow = &pixels[rowIndex * rowBytes];
-        if (TIFFWriteScanline(tiff, pixelRow, rowIndex, 0) < 0) {
+        if (!writeScanline(tiff, scratchRow, CL_IMAGE_ROW(image, rowIndex), (size_t)image->width * image->pixelBytes, rowIndex)) {
             clContextLogError(C, "Failed to write TIFF scanline row %d", rowIndex);
             writeResult = clFalse;
             goto writeCleanup;
@@ -303,6 +522,126 @@ writeCleanup:
     if (tiff) {
         TIFFClose(tiff);
     }
+    if (scratchRow) {
+        clFree(scratchRow);
+    }
     clRawFree(C, &rawProfile);
     return writeResult;
 }
+
+// Callbacks for streaming straight into a FILE (opened for update, as libtiff rewrites the header on close)
+static tmsize_t fileReadCallback(thandle_t handle, void * ptr, tmsize_t size)
+{
+    return (tmsize_t)fread(ptr, 1, (size_t)size, (FILE *)handle);
+}
+
+static tmsize_t fileWriteCallback(thandle_t handle, void * ptr, tmsize_t size)
+{
+    return (tmsize_t)fwrite(ptr, 1, (size_t)size, (FILE *)handle);
+}
+
+static toff_t fileSeekCallback(thandle_t handle, toff_t off, int whence)
+{
+    FILE * f = (FILE *)handle;
+    if (fseek(f, (long)off, whence) != 0) {
+        return (toff_t)-1;
+    }
+    return (toff_t)ftell(f);
+}
+
+static toff_t fileSizeCallback(thandle_t handle)
+{
+    FILE * f = (FILE *)handle;
+    long offset = ftell(f);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, offset, SEEK_SET);
+    return (toff_t)size;
+}
+
+static int fileCloseCallback(thandle_t handle)
+{
+    COLORIST_UNUSED(handle);
+
+    return 0; // the FILE belongs to the caller
+}
+
+typedef struct tiffWriter
+{
+    clFormatWriter writer; // must be first
+    TIFF * tiff;
+    uint8_t * scratchRow;
+    int nextRow;
+} tiffWriter;
+
+static void tiffWriterDestroy(struct clContext * C, clFormatWriter * writer)
+{
+    tiffWriter * tw = (tiffWriter *)writer;
+    if (tw->tiff) {
+        TIFFClose(tw->tiff);
+    }
+    if (tw->scratchRow) {
+        clFree(tw->scratchRow);
+    }
+    clFree(tw);
+}
+
+static clBool tiffWriterWriteRows(struct clContext * C, clFormatWriter * writer, clImage * rows, int rowCount)
+{
+    tiffWriter * tw = (tiffWriter *)writer;
+    size_t rowBytes = (size_t)rows->width * rows->pixelBytes;
+    if (!tw->scratchRow) {
+        tw->scratchRow = clAllocate(rowBytes);
+    }
+    for (int j = 0; j < rowCount; ++j) {
+        if (!writeScanline(tw->tiff, tw->scratchRow, CL_IMAGE_ROW(rows, j), rowBytes, tw->nextRow)) {
+            clContextLogError(C, "Failed to write TIFF scanline row %d", tw->nextRow);
+            return clFalse;
+        }
+        ++tw->nextRow;
+    }
+    return clTrue;
+}
+
+static clBool tiffWriterFinish(struct clContext * C, clFormatWriter * writer)
+{
+    tiffWriter * tw = (tiffWriter *)writer;
+    if (!TIFFFlush(tw->tiff)) {
+        clContextLogError(C, "Failed to finish TIFF");
+        return clFalse;
+    }
+    return clTrue;
+}
+
+clFormatWriter * clFormatWriteBeginTIFF(struct clContext * C, const char * formatName, int width, int height, int depth, struct clProfile * profile, FILE * output, struct clWriteParams * writeParams)
+{
+    COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(writeParams);
+
+    clRaw rawProfile = CL_RAW_EMPTY;
+    if (!clProfilePack(C, profile, &rawProfile)) {
+        clContextLogError(C, "Failed to create ICC profile");
+        return NULL;
+    }
+
+    TIFF * tiff = TIFFClientOpen("tiff", "wb",
+        (thandle_t)output,
+        fileReadCallback, fileWriteCallback,
+        fileSeekCallback, fileCloseCallback,
+        fileSizeCallback,
+        (TIFFMapFileProc)mapCallback, (TIFFUnmapFileProc)unmapCallback);
+    if (!tiff) {
+        clContextLogError(C, "cannot open TIFF for write");
+        clRawFree(C, &rawProfile);
+        return NULL;
+    }
+    writeHeader(tiff, width, height, depth, &rawProfile);
+    clRawFree(C, &rawProfile); // libtiff keeps its own copy of every field
+
+    tiffWriter * tw = clAllocateStruct(tiffWriter);
+    tw->writer.writeRows = tiffWriterWriteRows;
+    tw->writer.finish = tiffWriterFinish;
+    tw->writer.destroy = tiffWriterDestroy;
+    tw->tiff = tiff;
+    return &tw->writer;
+}
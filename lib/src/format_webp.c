@@ -16,16 +16,19 @@
 
 #include <string.h>
 
-struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input);
+struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint);
 clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clBool clFormatProbeWebP(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info);
 
-struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input)
+struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clProfile * overrideProfile, struct clRaw * input, struct clDecodeHint * hint)
 {
     COLORIST_UNUSED(formatName);
 
     clImage * image = NULL;
     clProfile * profile = NULL;
     uint8_t * readPixels = NULL;
+    WebPDecoderConfig config;
+    WebPInitDecoderConfig(&config);
 
     WebPData webpFileContents;
     webpFileContents.bytes = input->ptr;
@@ -57,12 +60,29 @@ struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName,
         goto readCleanup;
     }
 
-    int width, height;
-    readPixels = WebPDecodeRGBA(frameInfo.bitstream.bytes, frameInfo.bitstream.size, &width, &height);
-    if (!readPixels) {
+    if (WebPGetFeatures(frameInfo.bitstream.bytes, frameInfo.bitstream.size, &config.input) != VP8_STATUS_OK) {
+        clContextLogError(C, "Failed to read WebP features");
+        goto readCleanup;
+    }
+
+    // Scaled decoding: libwebp rescales each row as it's decoded, so the full size image never exists
+    int width = config.input.width;
+    int height = config.input.height;
+    int shift = clDecodeHintChooseShift(C, hint, width, height, 3);
+    if (shift > 0) {
+        int scale = 1 << shift;
+        width = (width + scale - 1) / scale;
+        height = (height + scale - 1) / scale;
+        config.options.use_scaling = 1;
+        config.options.scaled_width = width;
+        config.options.scaled_height = height;
+    }
+    config.output.colorspace = MODE_RGBA;
+    if (WebPDecode(frameInfo.bitstream.bytes, frameInfo.bitstream.size, &config) != VP8_STATUS_OK) {
         clContextLogError(C, "Failed to decode WebP");
         goto readCleanup;
     }
+    readPixels = config.output.u.RGBA.rgba;
 
     clImageLogCreate(C, width, height, 8, profile);
     image = clImageCreate(C, width, height, 8, profile);
@@ -71,7 +91,7 @@ struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName,
 readCleanup:
     WebPDataClear(&frameInfo.bitstream);
     if (readPixels) {
-        WebPFree(readPixels);
+        WebPFreeDecBuffer(&config.output);
     }
     if (mux) {
         WebPMuxDelete(mux);
@@ -82,6 +102,61 @@ readCleanup:
     return image;
 }
 
+clBool clFormatProbeWebP(struct clContext * C, const char * formatName, struct clRaw * input, struct clProbeInfo * info)
+{
+    COLORIST_UNUSED(formatName);
+
+    clBool probed = clFalse;
+    WebPBitstreamFeatures features;
+
+    // The mux only splits the file into chunks; the frame's VP8/VP8L header holds the rest
+    WebPData webpFileContents;
+    webpFileContents.bytes = input->ptr;
+    webpFileContents.size = input->size;
+    WebPMux * mux = WebPMuxCreate(&webpFileContents, 0);
+    if (!mux) {
+        clContextLogError(C, "Failed to read WebP chunks");
+        return clFalse;
+    }
+
+    WebPMuxFrameInfo frameInfo;
+    memset(&frameInfo, 0, sizeof(frameInfo));
+    if (WebPMuxGetFrame(mux, 1, &frameInfo) != WEBP_MUX_OK) {
+        clContextLogError(C, "Failed to get frame chunk in WebP");
+        goto probeCleanup;
+    }
+    if (WebPGetFeatures(frameInfo.bitstream.bytes, frameInfo.bitstream.size, &features) != VP8_STATUS_OK) {
+        clContextLogError(C, "Failed to read WebP features");
+        goto probeCleanup;
+    }
+
+    uint32_t muxFlags;
+    WebPMuxGetFeatures(mux, &muxFlags);
+    if (muxFlags & ICCP_FLAG) {
+        WebPData iccChunk;
+        if (WebPMuxGetChunk(mux, "ICCP", &iccChunk) != WEBP_MUX_OK) {
+            clContextLogError(C, "Failed get ICC profile chunk");
+            goto probeCleanup;
+        }
+        info->profile = clProfileParse(C, iccChunk.bytes, iccChunk.size, NULL);
+        if (!info->profile) {
+            clContextLogError(C, "Failed parse ICC profile chunk");
+            goto probeCleanup;
+        }
+    }
+
+    info->width = features.width;
+    info->height = features.height;
+    info->depth = 8;
+    info->hasAlpha = features.has_alpha ? clTrue : clFalse;
+    probed = clTrue;
+
+probeCleanup:
+    WebPDataClear(&frameInfo.bitstream);
+    WebPMuxDelete(mux);
+    return probed;
+}
+
 clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     COLORIST_UNUSED(formatName);
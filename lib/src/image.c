@@ -10,7 +10,6 @@
 #include "colorist/context.h"
 #include "colorist/pixelmath.h"
 #include "colorist/profile.h"
-#include "colorist/transform.h"
 
 #include <string.h>
 
@@ -25,6 +24,16 @@ void clImageLogCreate(clContext * C, int width, int height, int depth, clProfile
     }
 }
 
+clPixelFormat clPixelFormatFromDepth(int depth)
+{
+    return (depth == 8) ? CL_PIXELFORMAT_U8 : CL_PIXELFORMAT_U16;
+}
+
+int clPixelFormatBytesPerChannel(clPixelFormat pixelFormat)
+{
+    return (pixelFormat == CL_PIXELFORMAT_U8) ? 1 : 2;
+}
+
 clImage * clImageCreate(clContext * C, int width, int height, int depth, clProfile * profile)
 {
     clImage * image = clAllocateStruct(clImage);
@@ -37,12 +46,50 @@ clImage * clImageCreate(clContext * C, int width, int height, int depth, clProfi
     image->width = width;
     image->height = height;
     image->depth = depth;
-    image->size = image->width * image->height * CL_BYTES_PER_PIXEL;
-    image->pixels = (uint16_t *)clAllocate(image->size);
-    memset(image->pixels, 0xff, image->size);
+    image->pixelFormat = clPixelFormatFromDepth(depth);
+    image->pixelBytes = CL_CHANNELS_PER_PIXEL * clPixelFormatBytesPerChannel(image->pixelFormat);
+    image->stride = image->width * image->pixelBytes;
+    image->size = image->stride * image->height;
+    image->pixelsU8 = NULL;
+    image->pixelsU16 = NULL;
+    image->parent = NULL;
+    image->ownsParent = clFalse;
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+        image->pixelsU8 = (uint8_t *)clAllocate(image->size);
+    } else {
+        image->pixelsU16 = (uint16_t *)clAllocate(image->size);
+    }
+    memset(CL_IMAGE_PIXELS(image), 0xff, image->size);
     return image;
 }
 
+clImage * clImageCreateView(struct clContext * C, clImage * image, int x, int y, int w, int h)
+{
+    if (!clImageAdjustRect(C, image, &x, &y, &w, &h)) {
+        return NULL;
+    }
+
+    clImage * view = clAllocateStruct(clImage);
+    view->profile = clProfileClone(C, image->profile);
+    view->width = w;
+    view->height = h;
+    view->depth = image->depth;
+    view->pixelFormat = image->pixelFormat;
+    view->pixelBytes = image->pixelBytes;
+    view->stride = image->stride;
+    view->size = w * h * image->pixelBytes;
+    view->pixelsU8 = NULL;
+    view->pixelsU16 = NULL;
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+        view->pixelsU8 = CL_IMAGE_ROW(image, y) + (x * image->pixelBytes);
+    } else {
+        view->pixelsU16 = (uint16_t *)(CL_IMAGE_ROW(image, y) + (x * image->pixelBytes));
+    }
+    view->parent = image;
+    view->ownsParent = clFalse;
+    return view;
+}
+
 clImage * clImageCrop(struct clContext * C, clImage * srcImage, int x, int y, int w, int h, clBool keepSrc)
 {
     if (!srcImage) {
@@ -52,62 +99,55 @@ clImage * clImageCrop(struct clContext * C, clImage * srcImage, int x, int y, in
         return NULL;
     }
 
-    clImage * dstImage = clImageCreate(C, w, h, srcImage->depth, srcImage->profile);
-    for (int j = 0; j < h; ++j) {
-        for (int i = 0; i < w; ++i) {
-            uint16_t * src = &srcImage->pixels[CL_CHANNELS_PER_PIXEL * ((i + x) + (srcImage->width * (j + y)))];
-            uint16_t * dst = &dstImage->pixels[CL_CHANNELS_PER_PIXEL * (i + (dstImage->width * j))];
-            memcpy(dst, src, CL_BYTES_PER_PIXEL);
-        }
+    if (!keepSrc) {
+        // Nobody else will see srcImage again, so hand it to a view instead of copying out of it
+        clImage * view = clImageCreateView(C, srcImage, x, y, w, h);
+        view->ownsParent = clTrue;
+        return view;
     }
 
-    if (!keepSrc) {
-        clImageDestroy(C, srcImage);
+    clImage * dstImage = clImageCreate(C, w, h, srcImage->depth, srcImage->profile);
+    for (int j = 0; j < h; ++j) {
+        uint8_t * src = CL_IMAGE_ROW(srcImage, j + y) + (x * srcImage->pixelBytes);
+        memcpy(CL_IMAGE_ROW(dstImage, j), src, w * dstImage->pixelBytes);
     }
     return dstImage;
 }
 
-clImage * clImageApplyHALD(struct clContext * C, clImage * image, clImage * hald, int haldDims)
+clImage * clImagePack(struct clContext * C, clImage * image)
 {
-    clImage * appliedImage = clImageCreate(C, image->width, image->height, image->depth, image->profile);
-    int pixelCount = image->width * image->height;
-    int haldDataCount = hald->width * hald->height;
-
-    float * haldData = clAllocate(4 * sizeof(float) * haldDataCount);
-    clPixelMathUNormToFloat(C, hald->pixels, hald->depth, haldData, haldDataCount);
-    float * srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    clPixelMathUNormToFloat(C, image->pixels, image->depth, srcFloats, pixelCount);
-    float * dstFloats = clAllocate(4 * sizeof(float) * pixelCount);
-
-    for (int i = 0; i < pixelCount; ++i) {
-        clPixelMathHaldCLUTLookup(C, haldData, haldDims, &srcFloats[i * 4], &dstFloats[i * 4]);
+    if (CL_IMAGE_IS_PACKED(image)) {
+        return image;
     }
-    clPixelMathFloatToUNorm(C, dstFloats, appliedImage->pixels, appliedImage->depth, pixelCount);
+    return clImageCrop(C, image, 0, 0, image->width, image->height, clTrue);
+}
 
-    clFree(dstFloats);
-    clFree(srcFloats);
-    clFree(haldData);
+clImage * clImageApplyHALD(struct clContext * C, clImage * image, clImage * hald, int haldDims)
+{
+    clImagePipeline * pipeline = clImagePipelineCreateCopy(C, image);
+    clImagePipelineAddHALD(C, pipeline, hald, haldDims);
+    clImage * appliedImage = clImagePipelineRun(C, pipeline, C->params.jobs);
+    clImagePipelineDestroy(C, pipeline);
     return appliedImage;
 }
 
 clImage * clImageResize(struct clContext * C, clImage * image, int width, int height, clFilter resizeFilter)
 {
     clImage * resizedImage = clImageCreate(C, width, height, image->depth, image->profile);
-    int pixelCount = image->width * image->height;
-    int resizedPixelCount = resizedImage->width * resizedImage->height;
-    float * srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    float * dstFloats = clAllocate(4 * sizeof(float) * resizedPixelCount);
-
-    clPixelMathUNormToFloat(C, image->pixels, image->depth, srcFloats, pixelCount);
-    clPixelMathResize(C, image->width, image->height, srcFloats, resizedImage->width, resizedImage->height, dstFloats, resizeFilter);
-    int resizedChannelCount = resizedPixelCount * 4;
-    for (int i = 0; i < resizedChannelCount; ++i) {
-        // catmullrom and mitchell sometimes give values outside of 0-1, so clamp before calling clPixelMathFloatToUNorm
-        dstFloats[i] = CL_CLAMP(dstFloats[i], 0.0f, 1.0f);
-    }
-    clPixelMathFloatToUNorm(C, dstFloats, resizedImage->pixels, resizedImage->depth, resizedPixelCount);
-    clFree(dstFloats);
-    clFree(srcFloats);
+
+    clResizeBuffer src;
+    src.pixels = CL_IMAGE_PIXELS(image);
+    src.stride = image->stride;
+    src.depth = image->depth;
+
+    clResizeBuffer dst;
+    dst.pixels = CL_IMAGE_PIXELS(resizedImage);
+    dst.stride = resizedImage->stride;
+    dst.depth = resizedImage->depth;
+
+    clResizePlan * plan = clPixelMathResizePlanCreate(C, image->width, image->height, width, height, resizeFilter);
+    clPixelMathResizeRun(C, plan, C->params.jobs, &src, &dst);
+    clPixelMathResizePlanDestroy(C, plan);
     return resizedImage;
 }
 
@@ -123,81 +163,20 @@ void clBlendParamsSetDefaults(struct clContext * C, clBlendParams * blendParams)
 
 clImage * clImageBlend(struct clContext * C, clImage * image, clImage * compositeImage, int taskCount, clBlendParams * blendParams)
 {
-    // Sanity checks
-    if ((image->width != compositeImage->width) || (image->height != compositeImage->height)) {
-        return NULL;
-    }
-
-    // Query profile used for both src and dst image
-    clProfilePrimaries primaries;
-    clProfileCurve curve;
-    int maxLuminance;
-    if (!clProfileQuery(C, image->profile, &primaries, &curve, &maxLuminance)) {
-        clContextLogError(C, "clImageBlend: failed to query source profile");
-        return NULL;
-    }
-    maxLuminance = (int)((float)maxLuminance * curve.implicitScale);
-
-    // Build a profile using the same color volume, but a blend-friendly gamma
-    curve.type = CL_PCT_GAMMA;
-    curve.implicitScale = 1.0f;
-    curve.gamma = blendParams->gamma;
-    clProfile * blendProfile = clProfileCreate(C, &primaries, &curve, maxLuminance, NULL);
-
-    // Build transforms that go [src -> blend], [cmp -> blend], [blend -> dst]
-    clTransform * srcBlendTransform = clTransformCreate(C, image->profile, CL_XF_RGBA, image->depth, blendProfile, CL_XF_RGBA, 32, blendParams->srcTonemap);
-    clTransform * cmpBlendTransform = clTransformCreate(C, compositeImage->profile, CL_XF_RGBA, compositeImage->depth, blendProfile, CL_XF_RGBA, 32, blendParams->cmpTonemap);
-    clTransform * dstTransform = clTransformCreate(C, blendProfile, CL_XF_RGBA, 32, image->profile, CL_XF_RGBA, image->depth, CL_TONEMAP_OFF); // maxLuminance should match, no need to tonemap
+    return clImageBlendLayers(C, image, 1, &compositeImage, blendParams, taskCount);
+}
 
-    // Transform src and comp images into normalized blend space
-    int pixelCount = image->width * image->height;
-    float * srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    clTransformRun(C, srcBlendTransform, taskCount, image->pixels, srcFloats, pixelCount);
-    float * cmpFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    clTransformRun(C, cmpBlendTransform, taskCount, compositeImage->pixels, cmpFloats, pixelCount);
-
-    // Perform SourceOver blend
-    float * dstFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    if (blendParams->premultiplied) {
-        // Premultiplied alpha
-        for (int i = 0; i < pixelCount; ++i) {
-            float * srcPixel = &srcFloats[i * 4];
-            float * cmpPixel = &cmpFloats[i * 4];
-            float * dstPixel = &dstFloats[i * 4];
-
-            // cmpPixel is the "Source" in a SourceOver Porter/Duff blend
-            dstPixel[0] = cmpPixel[0] + (srcPixel[0] * (1 - cmpPixel[3]));
-            dstPixel[1] = cmpPixel[1] + (srcPixel[1] * (1 - cmpPixel[3]));
-            dstPixel[2] = cmpPixel[2] + (srcPixel[2] * (1 - cmpPixel[3]));
-            dstPixel[3] = cmpPixel[3] + (srcPixel[3] * (1 - cmpPixel[3]));
-        }
-    } else {
-        // Not Premultiplied alpha, perform the multiply during the blend
-        for (int i = 0; i < pixelCount; ++i) {
-            float * srcPixel = &srcFloats[i * 4];
-            float * cmpPixel = &cmpFloats[i * 4];
-            float * dstPixel = &dstFloats[i * 4];
-
-            // cmpPixel is the "Source" in a SourceOver Porter/Duff blend
-            dstPixel[0] = (cmpPixel[0] * cmpPixel[3]) + (srcPixel[0] * srcPixel[3] * (1 - cmpPixel[3]));
-            dstPixel[1] = (cmpPixel[1] * cmpPixel[3]) + (srcPixel[1] * srcPixel[3] * (1 - cmpPixel[3]));
-            dstPixel[2] = (cmpPixel[2] * cmpPixel[3]) + (srcPixel[2] * srcPixel[3] * (1 - cmpPixel[3]));
-            dstPixel[3] = cmpPixel[3] + (srcPixel[3] * (1 - cmpPixel[3]));
+clImage * clImageBlendLayers(struct clContext * C, clImage * image, int layerCount, clImage ** compositeImages, clBlendParams * blendParams, int taskCount)
+{
+    clImagePipeline * pipeline = clImagePipelineCreateCopy(C, image);
+    for (int i = 0; i < layerCount; ++i) {
+        if (!clImagePipelineAddComposite(C, pipeline, compositeImages[i], &blendParams[i])) {
+            clImagePipelineDestroy(C, pipeline);
+            return NULL;
         }
     }
-
-    // Transform blended pixels into new destination image
-    clImage * dstImage = clImageCreate(C, image->width, image->height, image->depth, image->profile);
-    clTransformRun(C, dstTransform, taskCount, dstFloats, dstImage->pixels, pixelCount);
-
-    // Cleanup
-    clTransformDestroy(C, srcBlendTransform);
-    clTransformDestroy(C, cmpBlendTransform);
-    clTransformDestroy(C, dstTransform);
-    clProfileDestroy(C, blendProfile);
-    clFree(srcFloats);
-    clFree(cmpFloats);
-    clFree(dstFloats);
+    clImage * dstImage = clImagePipelineRun(C, pipeline, taskCount);
+    clImagePipelineDestroy(C, pipeline);
     return dstImage;
 }
 
@@ -226,11 +205,58 @@ void clImageSetPixel(clContext * C, clImage * image, int x, int y, int r, int g,
 {
     COLORIST_UNUSED(C);
 
-    uint16_t * pixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (x + (y * image->width))];
-    pixel[0] = (uint16_t)r;
-    pixel[1] = (uint16_t)g;
-    pixel[2] = (uint16_t)b;
-    pixel[3] = (uint16_t)a;
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+        uint8_t * pixel = CL_IMAGE_ROW(image, y) + (x * image->pixelBytes);
+        pixel[0] = (uint8_t)r;
+        pixel[1] = (uint8_t)g;
+        pixel[2] = (uint8_t)b;
+        pixel[3] = (uint8_t)a;
+    } else {
+        uint16_t * pixel = (uint16_t *)(CL_IMAGE_ROW(image, y) + (x * image->pixelBytes));
+        pixel[0] = (uint16_t)r;
+        pixel[1] = (uint16_t)g;
+        pixel[2] = (uint16_t)b;
+        pixel[3] = (uint16_t)a;
+    }
+}
+
+void clImageGetPixel(clContext * C, clImage * image, int x, int y, uint16_t outRGBA[4])
+{
+    COLORIST_UNUSED(C);
+
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+        uint8_t * pixel = CL_IMAGE_ROW(image, y) + (x * image->pixelBytes);
+        outRGBA[0] = pixel[0];
+        outRGBA[1] = pixel[1];
+        outRGBA[2] = pixel[2];
+        outRGBA[3] = pixel[3];
+    } else {
+        memcpy(outRGBA, CL_IMAGE_ROW(image, y) + (x * image->pixelBytes), sizeof(uint16_t) * 4);
+    }
+}
+
+void clImageRowsToFloat(struct clContext * C, clImage * image, int y, int rowCount, float * outPixels)
+{
+    for (int j = 0; j < rowCount; ++j) {
+        float * outRow = &outPixels[(size_t)j * image->width * CL_CHANNELS_PER_PIXEL];
+        if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+            clPixelMathUNorm8ToFloat(C, CL_IMAGE_ROW(image, y + j), outRow, image->width);
+        } else {
+            clPixelMathUNormToFloat(C, (uint16_t *)CL_IMAGE_ROW(image, y + j), image->depth, outRow, image->width);
+        }
+    }
+}
+
+void clImageRowsFromFloat(struct clContext * C, clImage * image, int y, int rowCount, const float * inPixels)
+{
+    for (int j = 0; j < rowCount; ++j) {
+        const float * inRow = &inPixels[(size_t)j * image->width * CL_CHANNELS_PER_PIXEL];
+        if (image->pixelFormat == CL_PIXELFORMAT_U8) {
+            clPixelMathFloatToUNorm8(C, inRow, CL_IMAGE_ROW(image, y + j), image->width);
+        } else {
+            clPixelMathFloatToUNorm(C, (float *)inRow, (uint16_t *)CL_IMAGE_ROW(image, y + j), image->depth, image->width);
+        }
+    }
 }
 
 clImage * clImageRotate(struct clContext * C, clImage * image, int cwTurns)
@@ -239,15 +265,17 @@ clImage * clImageRotate(struct clContext * C, clImage * image, int cwTurns)
     switch (cwTurns) {
         case 0: // Not rotated
             rotated = clImageCreate(C, image->width, image->height, image->depth, image->profile);
-            memcpy(rotated->pixels, image->pixels, rotated->size);
+            for (int j = 0; j < image->height; ++j) {
+                memcpy(CL_IMAGE_ROW(rotated, j), CL_IMAGE_ROW(image, j), rotated->width * rotated->pixelBytes);
+            }
             break;
         case 1: // 90 degrees clockwise
             rotated = clImageCreate(C, image->height, image->width, image->depth, image->profile);
             for (int j = 0; j < image->height; ++j) {
                 for (int i = 0; i < image->width; ++i) {
-                    uint16_t * srcPixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
-                    uint16_t * dstPixel = &rotated->pixels[CL_CHANNELS_PER_PIXEL * ((rotated->width - 1 - j) + (i * rotated->width))];
-                    memcpy(dstPixel, srcPixel, CL_BYTES_PER_PIXEL);
+                    uint8_t * srcPixel = CL_IMAGE_ROW(image, j) + (i * image->pixelBytes);
+                    uint8_t * dstPixel = CL_IMAGE_ROW(rotated, i) + ((rotated->width - 1 - j) * rotated->pixelBytes);
+                    memcpy(dstPixel, srcPixel, rotated->pixelBytes);
                 }
             }
             break;
@@ -255,9 +283,9 @@ clImage * clImageRotate(struct clContext * C, clImage * image, int cwTurns)
             rotated = clImageCreate(C, image->width, image->height, image->depth, image->profile);
             for (int j = 0; j < image->height; ++j) {
                 for (int i = 0; i < image->width; ++i) {
-                    uint16_t * srcPixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
-                    uint16_t * dstPixel = &rotated->pixels[CL_CHANNELS_PER_PIXEL * ((rotated->width - 1 - i) + ((rotated->height - 1 - j) * rotated->width))];
-                    memcpy(dstPixel, srcPixel, CL_BYTES_PER_PIXEL);
+                    uint8_t * srcPixel = CL_IMAGE_ROW(image, j) + (i * image->pixelBytes);
+                    uint8_t * dstPixel = CL_IMAGE_ROW(rotated, rotated->height - 1 - j) + ((rotated->width - 1 - i) * rotated->pixelBytes);
+                    memcpy(dstPixel, srcPixel, rotated->pixelBytes);
                 }
             }
             break;
@@ -265,9 +293,9 @@ clImage * clImageRotate(struct clContext * C, clImage * image, int cwTurns)
             rotated = clImageCreate(C, image->height, image->width, image->depth, image->profile);
             for (int j = 0; j < image->height; ++j) {
                 for (int i = 0; i < image->width; ++i) {
-                    uint16_t * srcPixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (i + (j * image->width))];
-                    uint16_t * dstPixel = &rotated->pixels[CL_CHANNELS_PER_PIXEL * (j + ((rotated->height - 1 - i) * rotated->width))];
-                    memcpy(dstPixel, srcPixel, CL_BYTES_PER_PIXEL);
+                    uint8_t * srcPixel = CL_IMAGE_ROW(image, j) + (i * image->pixelBytes);
+                    uint8_t * dstPixel = CL_IMAGE_ROW(rotated, rotated->height - 1 - i) + (j * rotated->pixelBytes);
+                    memcpy(dstPixel, srcPixel, rotated->pixelBytes);
                 }
             }
             break;
@@ -279,28 +307,11 @@ clImage * clImageConvert(struct clContext * C, clImage * srcImage, int taskCount
 {
     Timer t;
 
-    // Create destination image
-    clImage * dstImage = clImageCreate(C, srcImage->width, srcImage->height, depth, dstProfile);
-
-    // Show image details
-    clContextLog(C, "details", 0, "Source:");
-    clImageDebugDump(C, srcImage, 0, 0, 0, 0, 1);
-    clContextLog(C, "details", 0, "Destination:");
-    clImageDebugDump(C, dstImage, 0, 0, 0, 0, 1);
-
-    // Create the transform
-    clTransform * transform = clTransformCreate(C, srcImage->profile, CL_XF_RGBA, srcImage->depth, dstImage->profile, CL_XF_RGBA, depth, tonemap);
-    clTransformPrepare(C, transform);
-    float luminanceScale = clTransformGetLuminanceScale(C, transform);
-
-    // Perform conversion
-    clContextLog(C, "convert", 0, "Converting (%s, lum scale %gx, %s)...", clTransformCMMName(C, transform), luminanceScale, transform->tonemapEnabled ? "tonemap" : "clip");
+    clImagePipeline * pipeline = clImagePipelineCreate(C, srcImage, depth, dstProfile, tonemap);
     timerStart(&t);
-    clTransformRun(C, transform, taskCount, srcImage->pixels, dstImage->pixels, srcImage->width * srcImage->height);
+    clImage * dstImage = clImagePipelineRun(C, pipeline, taskCount);
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
-
-    // Cleanup
-    clTransformDestroy(C, transform);
+    clImagePipelineDestroy(C, pipeline);
     return dstImage;
 }
 
@@ -311,17 +322,27 @@ void clImageColorGrade(struct clContext * C, clImage * image, int taskCount, int
     srcLuminance = (srcLuminance != 0) ? srcLuminance : C->defaultLuminance;
 
     int pixelCount = image->width * image->height;
-    float * floatPixels = clAllocate(4 * sizeof(float) * pixelCount);
-    clPixelMathUNormToFloat(C, image->pixels, image->depth, floatPixels, pixelCount);
-    clPixelMathColorGrade(C, taskCount, image->profile, floatPixels, pixelCount, image->width, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
-    clFree(floatPixels);
+    clImage * packed = clImagePack(C, image);
+    clPixelMathColorGradeUNorm(C, taskCount, image->profile, CL_IMAGE_PIXELS(packed), image->depth, pixelCount, image->width, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
+    if (packed != image) {
+        clImageDestroy(C, packed);
+    }
 }
 
 void clImageDestroy(clContext * C, clImage * image)
 {
     clProfileDestroy(C, image->profile);
-    if (image->pixels) {
-        clFree(image->pixels);
+    if (image->parent) {
+        if (image->ownsParent) {
+            clImageDestroy(C, image->parent);
+        }
+    } else {
+        if (image->pixelsU8) {
+            clFree(image->pixelsU8);
+        }
+        if (image->pixelsU16) {
+            clFree(image->pixelsU16);
+        }
     }
     clFree(image);
 }
@@ -330,21 +351,23 @@ void clImageToRGB8(struct clContext * C, clImage * image, uint8_t * outPixels)
 {
     COLORIST_UNUSED(C);
 
-    if (image->depth == 8) {
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
         for (int j = 0; j < image->height; ++j) {
+            uint8_t * srcRow = CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
-                uint16_t * srcPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
+                uint8_t * srcPixel = &srcRow[i * CL_CHANNELS_PER_PIXEL];
                 uint8_t * dstPixel = &outPixels[(i + (j * image->width)) * 3];
-                dstPixel[0] = (uint8_t)srcPixel[0];
-                dstPixel[1] = (uint8_t)srcPixel[1];
-                dstPixel[2] = (uint8_t)srcPixel[2];
+                dstPixel[0] = srcPixel[0];
+                dstPixel[1] = srcPixel[1];
+                dstPixel[2] = srcPixel[2];
             }
         }
     } else {
         float maxSrcChannel = (float)((1 << image->depth) - 1);
         for (int j = 0; j < image->height; ++j) {
+            uint16_t * srcRow = (uint16_t *)CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
-                uint16_t * srcPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
+                uint16_t * srcPixel = &srcRow[i * CL_CHANNELS_PER_PIXEL];
                 uint8_t * dstPixel = &outPixels[(i + (j * image->width)) * 3];
                 dstPixel[0] = (uint8_t)clPixelMathRoundf((srcPixel[0] / maxSrcChannel) * 255.0f);
                 dstPixel[1] = (uint8_t)clPixelMathRoundf((srcPixel[1] / maxSrcChannel) * 255.0f);
@@ -358,11 +381,12 @@ void clImageFromRGB8(struct clContext * C, clImage * image, uint8_t * inPixels)
 {
     COLORIST_UNUSED(C);
 
-    if (image->depth == 8) {
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
         for (int j = 0; j < image->height; ++j) {
+            uint8_t * dstRow = CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
                 uint8_t * srcPixel = &inPixels[(i + (j * image->width)) * 3];
-                uint16_t * dstPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
+                uint8_t * dstPixel = &dstRow[i * CL_CHANNELS_PER_PIXEL];
                 dstPixel[0] = srcPixel[0];
                 dstPixel[1] = srcPixel[1];
                 dstPixel[2] = srcPixel[2];
@@ -372,42 +396,35 @@ void clImageFromRGB8(struct clContext * C, clImage * image, uint8_t * inPixels)
     } else {
         uint16_t maxDstChannel = (uint16_t)((1 << image->depth) - 1);
         for (int j = 0; j < image->height; ++j) {
+            uint16_t * dstRow = (uint16_t *)CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
                 uint8_t * srcPixel = &inPixels[(i + (j * image->width)) * 3];
-                uint16_t * dstPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                dstPixel[0] = (uint8_t)clPixelMathRoundf((srcPixel[0] / 255.0f) * maxDstChannel);
-                dstPixel[1] = (uint8_t)clPixelMathRoundf((srcPixel[1] / 255.0f) * maxDstChannel);
-                dstPixel[2] = (uint8_t)clPixelMathRoundf((srcPixel[2] / 255.0f) * maxDstChannel);
+                uint16_t * dstPixel = &dstRow[i * CL_CHANNELS_PER_PIXEL];
+                dstPixel[0] = (uint16_t)clPixelMathRoundf((srcPixel[0] / 255.0f) * maxDstChannel);
+                dstPixel[1] = (uint16_t)clPixelMathRoundf((srcPixel[1] / 255.0f) * maxDstChannel);
+                dstPixel[2] = (uint16_t)clPixelMathRoundf((srcPixel[2] / 255.0f) * maxDstChannel);
                 dstPixel[3] = maxDstChannel;
             }
         }
     }
 }
+
 void clImageToRGBA8(struct clContext * C, clImage * image, uint8_t * outPixels)
 {
     COLORIST_UNUSED(C);
 
-    if (image->depth == 8) {
+    int rowBytes = image->width * CL_CHANNELS_PER_PIXEL;
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
         for (int j = 0; j < image->height; ++j) {
-            for (int i = 0; i < image->width; ++i) {
-                uint16_t * srcPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                uint8_t * dstPixel = &outPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                dstPixel[0] = (uint8_t)srcPixel[0];
-                dstPixel[1] = (uint8_t)srcPixel[1];
-                dstPixel[2] = (uint8_t)srcPixel[2];
-                dstPixel[3] = (uint8_t)srcPixel[3];
-            }
+            memcpy(&outPixels[j * rowBytes], CL_IMAGE_ROW(image, j), rowBytes);
         }
     } else {
         float maxSrcChannel = (float)((1 << image->depth) - 1);
         for (int j = 0; j < image->height; ++j) {
-            for (int i = 0; i < image->width; ++i) {
-                uint16_t * srcPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                uint8_t * dstPixel = &outPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                dstPixel[0] = (uint8_t)clPixelMathRoundf((srcPixel[0] / maxSrcChannel) * 255.0f);
-                dstPixel[1] = (uint8_t)clPixelMathRoundf((srcPixel[1] / maxSrcChannel) * 255.0f);
-                dstPixel[2] = (uint8_t)clPixelMathRoundf((srcPixel[2] / maxSrcChannel) * 255.0f);
-                dstPixel[3] = (uint8_t)clPixelMathRoundf((srcPixel[3] / maxSrcChannel) * 255.0f);
+            uint16_t * srcRow = (uint16_t *)CL_IMAGE_ROW(image, j);
+            uint8_t * dstRow = &outPixels[j * rowBytes];
+            for (int i = 0; i < rowBytes; ++i) {
+                dstRow[i] = (uint8_t)clPixelMathRoundf((srcRow[i] / maxSrcChannel) * 255.0f);
             }
         }
     }
@@ -417,27 +434,18 @@ void clImageFromRGBA8(struct clContext * C, clImage * image, uint8_t * inPixels)
 {
     COLORIST_UNUSED(C);
 
-    if (image->depth == 8) {
+    int rowBytes = image->width * CL_CHANNELS_PER_PIXEL;
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
         for (int j = 0; j < image->height; ++j) {
-            for (int i = 0; i < image->width; ++i) {
-                uint8_t * srcPixel = &inPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                uint16_t * dstPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                dstPixel[0] = srcPixel[0];
-                dstPixel[1] = srcPixel[1];
-                dstPixel[2] = srcPixel[2];
-                dstPixel[3] = srcPixel[3];
-            }
+            memcpy(CL_IMAGE_ROW(image, j), &inPixels[j * rowBytes], rowBytes);
         }
     } else {
         float maxDstChannel = (float)((1 << image->depth) - 1);
         for (int j = 0; j < image->height; ++j) {
-            for (int i = 0; i < image->width; ++i) {
-                uint8_t * srcPixel = &inPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                uint16_t * dstPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                dstPixel[0] = (uint8_t)clPixelMathRoundf((srcPixel[0] / 255.0f) * maxDstChannel);
-                dstPixel[1] = (uint8_t)clPixelMathRoundf((srcPixel[1] / 255.0f) * maxDstChannel);
-                dstPixel[2] = (uint8_t)clPixelMathRoundf((srcPixel[2] / 255.0f) * maxDstChannel);
-                dstPixel[3] = (uint8_t)clPixelMathRoundf((srcPixel[3] / 255.0f) * maxDstChannel);
+            uint8_t * srcRow = &inPixels[j * rowBytes];
+            uint16_t * dstRow = (uint16_t *)CL_IMAGE_ROW(image, j);
+            for (int i = 0; i < rowBytes; ++i) {
+                dstRow[i] = (uint16_t)clPixelMathRoundf((srcRow[i] / 255.0f) * maxDstChannel);
             }
         }
     }
@@ -447,22 +455,24 @@ void clImageToBGRA8(struct clContext * C, clImage * image, uint8_t * outPixels)
 {
     COLORIST_UNUSED(C);
 
-    if (image->depth == 8) {
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
         for (int j = 0; j < image->height; ++j) {
+            uint8_t * srcRow = CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
-                uint16_t * srcPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
+                uint8_t * srcPixel = &srcRow[i * CL_CHANNELS_PER_PIXEL];
                 uint8_t * dstPixel = &outPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                dstPixel[2] = (uint8_t)srcPixel[0];
-                dstPixel[1] = (uint8_t)srcPixel[1];
-                dstPixel[0] = (uint8_t)srcPixel[2];
-                dstPixel[3] = (uint8_t)srcPixel[3];
+                dstPixel[2] = srcPixel[0];
+                dstPixel[1] = srcPixel[1];
+                dstPixel[0] = srcPixel[2];
+                dstPixel[3] = srcPixel[3];
             }
         }
     } else {
         float maxSrcChannel = (float)((1 << image->depth) - 1);
         for (int j = 0; j < image->height; ++j) {
+            uint16_t * srcRow = (uint16_t *)CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
-                uint16_t * srcPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
+                uint16_t * srcPixel = &srcRow[i * CL_CHANNELS_PER_PIXEL];
                 uint8_t * dstPixel = &outPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
                 dstPixel[2] = (uint8_t)clPixelMathRoundf((srcPixel[0] / maxSrcChannel) * 255.0f);
                 dstPixel[1] = (uint8_t)clPixelMathRoundf((srcPixel[1] / maxSrcChannel) * 255.0f);
@@ -477,11 +487,12 @@ void clImageFromBGRA8(struct clContext * C, clImage * image, uint8_t * inPixels)
 {
     COLORIST_UNUSED(C);
 
-    if (image->depth == 8) {
+    if (image->pixelFormat == CL_PIXELFORMAT_U8) {
         for (int j = 0; j < image->height; ++j) {
+            uint8_t * dstRow = CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
                 uint8_t * srcPixel = &inPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                uint16_t * dstPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
+                uint8_t * dstPixel = &dstRow[i * CL_CHANNELS_PER_PIXEL];
                 dstPixel[2] = srcPixel[0];
                 dstPixel[1] = srcPixel[1];
                 dstPixel[0] = srcPixel[2];
@@ -491,13 +502,14 @@ void clImageFromBGRA8(struct clContext * C, clImage * image, uint8_t * inPixels)
     } else {
         float maxDstChannel = (float)((1 << image->depth) - 1);
         for (int j = 0; j < image->height; ++j) {
+            uint16_t * dstRow = (uint16_t *)CL_IMAGE_ROW(image, j);
             for (int i = 0; i < image->width; ++i) {
                 uint8_t * srcPixel = &inPixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                uint16_t * dstPixel = &image->pixels[(i + (j * image->width)) * CL_CHANNELS_PER_PIXEL];
-                dstPixel[2] = (uint8_t)clPixelMathRoundf((srcPixel[0] / 255.0f) * maxDstChannel);
-                dstPixel[1] = (uint8_t)clPixelMathRoundf((srcPixel[1] / 255.0f) * maxDstChannel);
-                dstPixel[0] = (uint8_t)clPixelMathRoundf((srcPixel[2] / 255.0f) * maxDstChannel);
-                dstPixel[3] = (uint8_t)clPixelMathRoundf((srcPixel[3] / 255.0f) * maxDstChannel);
+                uint16_t * dstPixel = &dstRow[i * CL_CHANNELS_PER_PIXEL];
+                dstPixel[2] = (uint16_t)clPixelMathRoundf((srcPixel[0] / 255.0f) * maxDstChannel);
+                dstPixel[1] = (uint16_t)clPixelMathRoundf((srcPixel[1] / 255.0f) * maxDstChannel);
+                dstPixel[0] = (uint16_t)clPixelMathRoundf((srcPixel[2] / 255.0f) * maxDstChannel);
+                dstPixel[3] = (uint16_t)clPixelMathRoundf((srcPixel[3] / 255.0f) * maxDstChannel);
             }
         }
     }
@@ -15,13 +15,61 @@
 
 #include <string.h>
 
-static void dumpPixel(struct clContext * C, clImage * image, clTransform * toXYZ, float maxLuminance, int x, int y, int extraIndent, cJSON * jsonPixels, clImagePixelInfo * pixelInfo);
+static void dumpPixel(struct clContext * C, clImage * image, clTransform * toXYZ, float maxLuminance, int originX, int originY, int x, int y, int extraIndent, cJSON * jsonPixels, clImagePixelInfo * pixelInfo);
+
+// The region dumps below describe an image decoded from just hint->rect of a larger file, so they
+// report the file's size, and pixel coordinates within the file
+static void dumpText(struct clContext * C, clImage * image, int originX, int originY, int fullWidth, int fullHeight, int x, int y, int w, int h, int extraIndent);
+static void dumpJSON(struct clContext * C, struct cJSON * jsonOutput, clImage * image, int originX, int originY, int fullWidth, int fullHeight, int x, int y, int w, int h);
 
 void clImageDebugDump(struct clContext * C, clImage * image, int x, int y, int w, int h, int extraIndent)
 {
-    clTransform * toXYZ = clTransformCreate(C, image->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    dumpText(C, image, 0, 0, image->width, image->height, x, y, w, h, extraIndent);
+}
+
+void clImageDebugDumpRegion(struct clContext * C, clImage * image, const clDecodeHint * hint, int extraIndent)
+{
+    const int * rect = hint->rect;
+    dumpText(C, image, rect[0], rect[1], hint->fullWidth, hint->fullHeight, rect[0], rect[1], rect[2], rect[3], extraIndent);
+}
+
+void clImageDebugDumpJSON(struct clContext * C, struct cJSON * jsonOutput, clImage * image, int x, int y, int w, int h)
+{
+    dumpJSON(C, jsonOutput, image, 0, 0, image->width, image->height, x, y, w, h);
+}
+
+void clImageDebugDumpRegionJSON(struct clContext * C, struct cJSON * jsonOutput, clImage * image, const clDecodeHint * hint)
+{
+    const int * rect = hint->rect;
+    dumpJSON(C, jsonOutput, image, rect[0], rect[1], hint->fullWidth, hint->fullHeight, rect[0], rect[1], rect[2], rect[3]);
+}
+
+// Clamps x, y, w, h to the fullWidth x fullHeight picture, then to the part of it image holds
+static clBool adjustRegionRect(clImage * image, int originX, int originY, int fullWidth, int fullHeight, int * x, int * y, int * w, int * h)
+{
+    if ((*x < 0) || (*y < 0) || (*w <= 0) || (*h <= 0)) {
+        return clFalse;
+    }
+
+    *x = (*x < fullWidth) ? *x : fullWidth - 1;
+    *y = (*y < fullHeight) ? *y : fullHeight - 1;
+    int endX = ((*x + *w) < fullWidth) ? (*x + *w) : fullWidth;
+    int endY = ((*y + *h) < fullHeight) ? (*y + *h) : fullHeight;
+
+    *x = (*x > originX) ? *x : originX;
+    *y = (*y > originY) ? *y : originY;
+    endX = (endX < (originX + image->width)) ? endX : (originX + image->width);
+    endY = (endY < (originY + image->height)) ? endY : (originY + image->height);
+    *w = endX - *x;
+    *h = endY - *y;
+    return ((*w > 0) && (*h > 0)) ? clTrue : clFalse;
+}
+
+static void dumpText(struct clContext * C, clImage * image, int originX, int originY, int fullWidth, int fullHeight, int x, int y, int w, int h, int extraIndent)
+{
+    clTransform * toXYZ = clTransformAcquire(C, image->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
 
-    clContextLog(C, "image", 0 + extraIndent, "Image: %dx%d %d-bit", image->width, image->height, image->depth);
+    clContextLog(C, "image", 0 + extraIndent, "Image: %dx%d %d-bit", fullWidth, fullHeight, image->depth);
     clProfileDebugDump(C, image->profile, C->verbose, 1 + extraIndent);
 
     int maxLuminance;
@@ -31,28 +79,28 @@ void clImageDebugDump(struct clContext * C, clImage * image, int x, int y, int w
     }
     float maxLuminanceFloat = (float)maxLuminance;
 
-    if (clImageAdjustRect(C, image, &x, &y, &w, &h)) {
+    if (adjustRegionRect(image, originX, originY, fullWidth, fullHeight, &x, &y, &w, &h)) {
         int endX = x + w;
         int endY = y + h;
         clContextLog(C, "image", 1 + extraIndent, "Pixels:");
         for (int j = y; j < endY; ++j) {
             for (int i = x; i < endX; ++i) {
-                dumpPixel(C, image, toXYZ, maxLuminanceFloat, i, j, extraIndent, NULL, NULL);
+                dumpPixel(C, image, toXYZ, maxLuminanceFloat, originX, originY, i, j, extraIndent, NULL, NULL);
             }
         }
     }
 
-    clTransformDestroy(C, toXYZ);
+    clTransformRelease(C, toXYZ);
 }
 
-void clImageDebugDumpJSON(struct clContext * C, struct cJSON * jsonOutput, clImage * image, int x, int y, int w, int h)
+static void dumpJSON(struct clContext * C, struct cJSON * jsonOutput, clImage * image, int originX, int originY, int fullWidth, int fullHeight, int x, int y, int w, int h)
 {
     cJSON * jsonProfile = cJSON_AddObjectToObject(jsonOutput, "profile");
 
-    clTransform * toXYZ = clTransformCreate(C, image->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    clTransform * toXYZ = clTransformAcquire(C, image->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
 
-    cJSON_AddNumberToObject(jsonOutput, "width", image->width);
-    cJSON_AddNumberToObject(jsonOutput, "height", image->height);
+    cJSON_AddNumberToObject(jsonOutput, "width", fullWidth);
+    cJSON_AddNumberToObject(jsonOutput, "height", fullHeight);
     cJSON_AddNumberToObject(jsonOutput, "depth", image->depth);
 
     clProfileDebugDumpJSON(C, jsonProfile, image->profile, C->verbose);
@@ -64,7 +112,7 @@ void clImageDebugDumpJSON(struct clContext * C, struct cJSON * jsonOutput, clIma
     }
     float maxLuminanceFloat = (float)maxLuminance;
 
-    if (clImageAdjustRect(C, image, &x, &y, &w, &h)) {
+    if (adjustRegionRect(image, originX, originY, fullWidth, fullHeight, &x, &y, &w, &h)) {
         int endX = x + w;
         int endY = y + h;
         cJSON * jsonPixels = NULL;
@@ -74,12 +122,12 @@ void clImageDebugDumpJSON(struct clContext * C, struct cJSON * jsonOutput, clIma
                     // Lazily create it in case we never have to
                     jsonPixels = cJSON_AddArrayToObject(jsonOutput, "pixels");
                 }
-                dumpPixel(C, image, toXYZ, maxLuminanceFloat, i, j, 0, jsonPixels, NULL);
+                dumpPixel(C, image, toXYZ, maxLuminanceFloat, originX, originY, i, j, 0, jsonPixels, NULL);
             }
         }
     }
 
-    clTransformDestroy(C, toXYZ);
+    clTransformRelease(C, toXYZ);
 }
 
 void clImageDebugDumpPixel(struct clContext * C, clImage * image, int x, int y, clImagePixelInfo * pixelInfo)
@@ -89,7 +137,7 @@ void clImageDebugDumpPixel(struct clContext * C, clImage * image, int x, int y,
         return;
     }
 
-    clTransform * toXYZ = clTransformCreate(C, image->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    clTransform * toXYZ = clTransformAcquire(C, image->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
 
     int maxLuminance;
     clProfileQuery(C, image->profile, NULL, NULL, &maxLuminance);
@@ -98,12 +146,12 @@ void clImageDebugDumpPixel(struct clContext * C, clImage * image, int x, int y,
     }
     float maxLuminanceFloat = (float)maxLuminance;
 
-    dumpPixel(C, image, toXYZ, maxLuminanceFloat, x, y, 0, NULL, pixelInfo);
+    dumpPixel(C, image, toXYZ, maxLuminanceFloat, 0, 0, x, y, 0, NULL, pixelInfo);
 
-    clTransformDestroy(C, toXYZ);
+    clTransformRelease(C, toXYZ);
 }
 
-static void dumpPixel(struct clContext * C, clImage * image, clTransform * toXYZ, float maxLuminance, int x, int y, int extraIndent, cJSON * jsonPixels, clImagePixelInfo * pixelInfo)
+static void dumpPixel(struct clContext * C, clImage * image, clTransform * toXYZ, float maxLuminance, int originX, int originY, int x, int y, int extraIndent, cJSON * jsonPixels, clImagePixelInfo * pixelInfo)
 {
     uint16_t intRGB[4];
     float maxChannel = (float)((1 << image->depth) - 1);
@@ -112,13 +160,9 @@ static void dumpPixel(struct clContext * C, clImage * image, clTransform * toXYZ
     cmsCIEXYZ XYZ;
     cmsCIExyY xyY;
 
-    COLORIST_ASSERT(image->pixels);
+    COLORIST_ASSERT(CL_IMAGE_PIXELS(image));
 
-    uint16_t * pixel = &image->pixels[CL_CHANNELS_PER_PIXEL * (x + (y * image->width))];
-    intRGB[0] = pixel[0];
-    intRGB[1] = pixel[1];
-    intRGB[2] = pixel[2];
-    intRGB[3] = pixel[3];
+    clImageGetPixel(C, image, x - originX, y - originY, intRGB);
 
     floatRGBA[0] = intRGB[0] / maxChannel;
     floatRGBA[1] = intRGB[1] / maxChannel;
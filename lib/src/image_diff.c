@@ -10,18 +10,192 @@
 #include "colorist/context.h"
 #include "colorist/pixelmath.h"
 #include "colorist/profile.h"
+#include "colorist/task.h"
 #include "colorist/transform.h"
 
-#include <string.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Rows per slice of work; small enough that clImageIdentical() stops soon after a difference shows up
+#define CL_IMAGE_COMPARE_SLICE_ROWS 16
+
+static clBool imagesComparable(struct clContext * C, clImage * image1, clImage * image2)
+{
+    return clProfileMatches(C, image1->profile, image2->profile) && (image1->width == image2->width) && (image1->height == image2->height) &&
+           (image1->depth == image2->depth);
+}
+
+// Writes the largest channel difference of each pixel in row y
+static void rowChannelDiffs(clImage * image1, clImage * image2, int y, uint16_t * outDiffs)
+{
+    int channelCount = image1->width * CL_CHANNELS_PER_PIXEL;
+    if (image1->pixelFormat == CL_PIXELFORMAT_U8) {
+        const uint8_t * row1 = CL_IMAGE_ROW(image1, y);
+        const uint8_t * row2 = CL_IMAGE_ROW(image2, y);
+        for (int c = 0; c < channelCount; c += CL_CHANNELS_PER_PIXEL) {
+            int largestDiff = 0;
+            for (int i = 0; i < CL_CHANNELS_PER_PIXEL; ++i) {
+                int channelDiff = abs((int)row1[c + i] - (int)row2[c + i]);
+                largestDiff = (largestDiff < channelDiff) ? channelDiff : largestDiff;
+            }
+            outDiffs[c / CL_CHANNELS_PER_PIXEL] = (uint16_t)largestDiff;
+        }
+    } else {
+        const uint16_t * row1 = (const uint16_t *)CL_IMAGE_ROW(image1, y);
+        const uint16_t * row2 = (const uint16_t *)CL_IMAGE_ROW(image2, y);
+        for (int c = 0; c < channelCount; c += CL_CHANNELS_PER_PIXEL) {
+            int largestDiff = 0;
+            for (int i = 0; i < CL_CHANNELS_PER_PIXEL; ++i) {
+                int channelDiff = abs((int)row1[c + i] - (int)row2[c + i]);
+                largestDiff = (largestDiff < channelDiff) ? channelDiff : largestDiff;
+            }
+            outDiffs[c / CL_CHANNELS_PER_PIXEL] = (uint16_t)largestDiff;
+        }
+    }
+}
+
+typedef struct clImageCompareTask
+{
+    clContext * C;
+    clImage * image1;
+    clImage * image2;
+    int threshold;
+    clImageCompareStats * sliceStats;
+
+    // clImageIdentical(): every slice stops once any slice has seen a pixel over the threshold. The flag
+    // is only a hint to stop early; the answer comes from sliceStats.
+    clBool stopOverThreshold;
+    clTaskFlag sawOverThreshold;
+} clImageCompareTask;
+
+static void compareSliceFunc(void * userData, int startSlice, int endSlice)
+{
+    clImageCompareTask * info = (clImageCompareTask *)userData;
+    clContext * C = info->C;
+    int width = info->image1->width;
+    uint16_t * diffs = clAllocate(sizeof(uint16_t) * width);
+
+    for (int slice = startSlice; slice < endSlice; ++slice) {
+        clImageCompareStats * stats = &info->sliceStats[slice];
+        int endY = (slice + 1) * CL_IMAGE_COMPARE_SLICE_ROWS;
+        if (endY > info->image1->height) {
+            endY = info->image1->height;
+        }
+        for (int y = slice * CL_IMAGE_COMPARE_SLICE_ROWS; y < endY; ++y) {
+            if (info->stopOverThreshold && clTaskFlagIsRaised(&info->sawOverThreshold)) {
+                break;
+            }
+
+            rowChannelDiffs(info->image1, info->image2, y, diffs);
+            for (int i = 0; i < width; ++i) {
+                if (diffs[i] == 0) {
+                    ++stats->matchCount;
+                } else if (diffs[i] <= info->threshold) {
+                    ++stats->underThresholdCount;
+                } else {
+                    ++stats->overThresholdCount;
+                }
+                if (stats->largestChannelDiff < diffs[i]) {
+                    stats->largestChannelDiff = diffs[i];
+                }
+            }
+            if (info->stopOverThreshold && stats->overThresholdCount) {
+                clTaskFlagRaise(&info->sawOverThreshold);
+            }
+        }
+    }
+    clFree(diffs);
+}
+
+static void compareImages(struct clContext * C, clImage * image1, clImage * image2, int taskCount, int threshold, clBool stopOverThreshold, clImageCompareStats * stats)
+{
+    clImageCompareTask info;
+    int sliceCount = (image1->height + CL_IMAGE_COMPARE_SLICE_ROWS - 1) / CL_IMAGE_COMPARE_SLICE_ROWS;
+
+    info.C = C;
+    info.image1 = image1;
+    info.image2 = image2;
+    info.threshold = threshold;
+    info.sliceStats = clAllocate(sizeof(clImageCompareStats) * sliceCount);
+    memset(info.sliceStats, 0, sizeof(clImageCompareStats) * sliceCount);
+    info.stopOverThreshold = stopOverThreshold;
+    clTaskFlagClear(&info.sawOverThreshold);
+    clTaskParallelFor(C, taskCount, sliceCount, 1, compareSliceFunc, &info);
+
+    memset(stats, 0, sizeof(clImageCompareStats));
+    stats->pixelCount = image1->width * image1->height;
+    for (int i = 0; i < sliceCount; ++i) {
+        stats->matchCount += info.sliceStats[i].matchCount;
+        stats->underThresholdCount += info.sliceStats[i].underThresholdCount;
+        stats->overThresholdCount += info.sliceStats[i].overThresholdCount;
+        if (stats->largestChannelDiff < info.sliceStats[i].largestChannelDiff) {
+            stats->largestChannelDiff = info.sliceStats[i].largestChannelDiff;
+        }
+    }
+    clFree(info.sliceStats);
+}
+
+clBool clImageCompare(struct clContext * C, clImage * image1, clImage * image2, int taskCount, int threshold, clImageCompareStats * stats)
+{
+    if (!imagesComparable(C, image1, image2)) {
+        return clFalse;
+    }
+    compareImages(C, image1, image2, taskCount, threshold, clFalse, stats);
+    return clTrue;
+}
+
+clBool clImageIdentical(struct clContext * C, clImage * image1, clImage * image2, int taskCount, int threshold)
+{
+    clImageCompareStats stats;
+    if (!imagesComparable(C, image1, image2)) {
+        return clFalse;
+    }
+    compareImages(C, image1, image2, taskCount, threshold, clTrue, &stats);
+    return (stats.overThresholdCount == 0) ? clTrue : clFalse;
+}
+
+typedef struct clImageDiffTask
+{
+    clContext * C;
+    clImage * image1;
+    clImage * image2;
+    clTransform * intensityTransform;
+    clImageDiff * diff;
+} clImageDiffTask;
+
+static void diffRowsFunc(void * userData, int startRow, int endRow)
+{
+    clImageDiffTask * info = (clImageDiffTask *)userData;
+    clContext * C = info->C;
+    clImageDiff * diff = info->diff;
+    int width = info->image1->width;
+    uint16_t * intensityPixels = clAllocate(sizeof(uint16_t) * CL_CHANNELS_PER_PIXEL * width);
+
+    float kr = 0.2126f;
+    float kb = 0.0722f;
+    float kg = 1.0f - kr - kb;
+    for (int y = startRow; y < endRow; ++y) {
+        rowChannelDiffs(info->image1, info->image2, y, &diff->diffs[y * width]);
+
+        clTransformRunPrepared(C, info->intensityTransform, CL_IMAGE_ROW(info->image1, y), intensityPixels, width);
+        for (int x = 0; x < width; ++x) {
+            int i = x + (y * width);
+            uint16_t * intensityPixel = &intensityPixels[x * CL_CHANNELS_PER_PIXEL];
+            float intensity = ((intensityPixel[0] / 65535.0f) * kr) +
+                              ((intensityPixel[1] / 65535.0f) * kg) +
+                              ((intensityPixel[2] / 65535.0f) * kb);
+            intensity = CL_CLAMP(intensity + diff->minIntensity, 0.0f, 1.0f);
+            diff->intensities[i] = (uint16_t)clPixelMathRoundf(255.0f * powf(intensity, 1.0f / 2.2f));
+            diff->image->pixelsU8[(i * CL_CHANNELS_PER_PIXEL) + 3] = 255;
+        }
+    }
+    clFree(intensityPixels);
+}
 
 clImageDiff * clImageDiffCreate(struct clContext * C, clImage * image1, clImage * image2, int taskCount, float minIntensity, int threshold)
 {
-    if (!clProfileMatches(C, image1->profile, image2->profile) ||
-        (image1->width != image2->width) ||
-        (image1->height != image2->height) ||
-        (image1->depth != image2->depth))
-    {
+    if (!imagesComparable(C, image1, image2)) {
         return NULL;
     }
 
@@ -50,50 +224,24 @@ clImageDiff * clImageDiffCreate(struct clContext * C, clImage * image1, clImage
     curve.implicitScale = 1.0f;
     curve.gamma = 1.0f;
     clProfile * intensityProfile = clProfileCreate(C, &primaries, &curve, C->defaultLuminance, NULL);
-    clImage * intensityMap = clImageConvert(C, image1, taskCount, 16, intensityProfile, CL_TONEMAP_AUTO);
+
+    // Intensities and channel differences are both computed a row at a time, without a full converted copy
+    clImageDiffTask info;
+    info.C = C;
+    info.image1 = image1;
+    info.image2 = image2;
+    info.intensityTransform = clTransformAcquire(C, image1->profile, CL_XF_RGBA, image1->depth, intensityProfile, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    info.diff = diff;
+    clTaskParallelFor(C, taskCount, image1->height, CL_IMAGE_COMPARE_SLICE_ROWS, diffRowsFunc, &info);
+    clTransformRelease(C, info.intensityTransform);
     clProfileDestroy(C, intensityProfile);
 
-    float kr = 0.2126f;
-    float kb = 0.0722f;
-    float kg = 1.0f - kr - kb;
     for (int i = 0; i < diff->pixelCount; ++i) {
-        uint16_t * p1 = &image1->pixels[i * CL_CHANNELS_PER_PIXEL];
-        uint16_t * p2 = &image2->pixels[i * CL_CHANNELS_PER_PIXEL];
-        uint16_t * diffPixel = &diff->image->pixels[i * CL_CHANNELS_PER_PIXEL];
-
-        uint16_t * intensityPixel = &intensityMap->pixels[i * CL_CHANNELS_PER_PIXEL];
-        float intensity = ((intensityPixel[0] / 65535.0f) * kr) +
-                          ((intensityPixel[1] / 65535.0f) * kg) +
-                          ((intensityPixel[2] / 65535.0f) * kb);
-        intensity = CL_CLAMP(intensity + diff->minIntensity, 0.0f, 1.0f);
-        diff->intensities[i] = (uint16_t)clPixelMathRoundf(255.0f * powf(intensity, 1.0f / 2.2f));
-
-        int channelDiff;
-        int largestDiff = abs((int)p1[0] - (int)p2[0]);
-        channelDiff = abs((int)p1[1] - (int)p2[1]);
-        if (largestDiff < channelDiff) {
-            largestDiff = channelDiff;
+        if (diff->largestChannelDiff < diff->diffs[i]) {
+            diff->largestChannelDiff = diff->diffs[i];
         }
-        channelDiff = abs((int)p1[2] - (int)p2[2]);
-        if (largestDiff < channelDiff) {
-            largestDiff = channelDiff;
-        }
-        channelDiff = abs((int)p1[3] - (int)p2[3]);
-        if (largestDiff < channelDiff) {
-            largestDiff = channelDiff;
-        }
-
-        diff->diffs[i] = (uint16_t)largestDiff;
-
-        if (diff->largestChannelDiff < largestDiff) {
-            diff->largestChannelDiff = largestDiff;
-        }
-
-        diffPixel[3] = 255;
     }
 
-    clImageDestroy(C, intensityMap);
-
     clImageDiffUpdate(C, diff, threshold);
     return diff;
 }
@@ -108,23 +256,23 @@ void clImageDiffUpdate(struct clContext * C, clImageDiff * diff, int threshold)
     diff->overThresholdCount = 0;
 
     for (int i = 0; i < diff->pixelCount; ++i) {
-        uint16_t * diffPixel = &diff->image->pixels[i * CL_CHANNELS_PER_PIXEL];
+        uint8_t * diffPixel = &diff->image->pixelsU8[i * CL_CHANNELS_PER_PIXEL];
 
         if (diff->diffs[i] == 0) {
             ++diff->matchCount;
-            diffPixel[0] = diff->intensities[i];
-            diffPixel[1] = diff->intensities[i];
-            diffPixel[2] = diff->intensities[i];
+            diffPixel[0] = (uint8_t)diff->intensities[i];
+            diffPixel[1] = (uint8_t)diff->intensities[i];
+            diffPixel[2] = (uint8_t)diff->intensities[i];
         } else if (diff->diffs[i] <= threshold) {
             ++diff->underThresholdCount;
-            diffPixel[0] = diff->intensities[i] >> 4;
-            diffPixel[1] = diff->intensities[i] >> 4;
-            diffPixel[2] = diff->intensities[i];
+            diffPixel[0] = (uint8_t)(diff->intensities[i] >> 4);
+            diffPixel[1] = (uint8_t)(diff->intensities[i] >> 4);
+            diffPixel[2] = (uint8_t)diff->intensities[i];
         } else {
             ++diff->overThresholdCount;
-            diffPixel[0] = diff->intensities[i];
-            diffPixel[1] = diff->intensities[i] >> 4;
-            diffPixel[2] = diff->intensities[i] >> 4;
+            diffPixel[0] = (uint8_t)diff->intensities[i];
+            diffPixel[1] = (uint8_t)(diff->intensities[i] >> 4);
+            diffPixel[2] = (uint8_t)(diff->intensities[i] >> 4);
         }
     }
 }
@@ -10,8 +10,10 @@
 #include "colorist/context.h"
 #include "colorist/pixelmath.h"
 #include "colorist/profile.h"
+#include "colorist/task.h"
 #include "colorist/transform.h"
 
+#include <math.h>
 #include <string.h>
 
 // This much match clImageSRGBHighlightPixel member order exactly!
@@ -25,6 +27,35 @@ static const char * highlightInfoPropertyNames[HII_COUNT] = {
     "outOfGamut"
 };
 
+// SSE2 is part of every x86-64 CPU, so no runtime dispatch is needed for it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define COLORIST_HIGHLIGHT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Rows per slice of work, and pixels per span handed to the chromaticity kernel
+#define CL_HIGHLIGHT_SLICE_ROWS 16
+#define CL_HIGHLIGHT_SPAN_PIXELS 256
+
+static const float whitePointX = 0.3127f;
+static const float whitePointY = 0.3290f;
+
+// Everything about the source and sRGB gamuts that doesn't depend on the pixel, computed once per image
+typedef struct clHighlightKernel
+{
+    float fromXYZ[9]; // XYZ -> linear source RGB, row-major
+    float whiteMaxY;  // max Y of the white point, used for black pixels
+    clBool srcIsSRGB;
+    float srcEdges[3][3];  // normalized line equations (a * x + b * y + c) of the RG, GB and RB edges
+    float srgbEdges[3][3]; // the same for sRGB
+} clHighlightKernel;
+
+static float maxChannel3(float r, float g, float b)
+{
+    float maxChannel = (r > g) ? r : g;
+    return (maxChannel > b) ? maxChannel : b;
+}
+
 static float calcOverbright(float Y, float overbrightScale, float maxY)
 {
     // Even at 10,000 nits, this is only 1 nit difference. If its less than this, we're not over.
@@ -39,51 +70,121 @@ static float calcOverbright(float Y, float overbrightScale, float maxY)
     return 0.0f;
 }
 
-static void calcGamutDistances(float x, float y, const clProfilePrimaries * primaries, float outDistances[3])
+static void calcEdge(const float p0[2], const float p1[2], float outEdge[3])
 {
-    float rX = primaries->red[0];
-    float rY = primaries->red[1];
-    float gX = primaries->green[0];
-    float gY = primaries->green[1];
-    float bX = primaries->blue[0];
-    float bY = primaries->blue[1];
-
-    float distBetweenRG = sqrtf(((rY - gY) * (rY - gY)) + ((rX - gX) * (rX - gX)));
-    float distBetweenGB = sqrtf(((gY - bY) * (gY - bY)) + ((gX - bX) * (gX - bX)));
-    float distBetweenRB = sqrtf(((rY - bY) * (rY - bY)) + ((rX - bX) * (rX - bX)));
-    float distFromRGEdge = ((x * (gY - rY)) - (y * (gX - rX)) + (gX * rY) - (gY * rX)) / distBetweenRG;
-    float distFromGBEdge = ((x * (bY - gY)) - (y * (bX - gX)) + (bX * gY) - (bY * gX)) / distBetweenGB;
-    float distFromRBEdge = ((x * (rY - bY)) - (y * (rX - bX)) + (rX * bY) - (rY * bX)) / distBetweenRB;
-
-    outDistances[0] = distFromRGEdge;
-    outDistances[1] = distFromGBEdge;
-    outDistances[2] = distFromRBEdge;
+    float dist = sqrtf(((p0[1] - p1[1]) * (p0[1] - p1[1])) + ((p0[0] - p1[0]) * (p0[0] - p1[0])));
+    outEdge[0] = (p1[1] - p0[1]) / dist;
+    outEdge[1] = -(p1[0] - p0[0]) / dist;
+    outEdge[2] = ((p1[0] * p0[1]) - (p1[1] * p0[0])) / dist;
 }
 
-static float calcOutofSRGB(clContext * C, float x, float y, clProfilePrimaries * primaries)
+static void calcGamutEdges(const clProfilePrimaries * primaries, float outEdges[3][3])
 {
-    COLORIST_UNUSED(C);
+    calcEdge(primaries->red, primaries->green, outEdges[0]);
+    calcEdge(primaries->green, primaries->blue, outEdges[1]);
+    calcEdge(primaries->blue, primaries->red, outEdges[2]);
+}
 
+static void highlightKernelInit(struct clContext * C, clHighlightKernel * kernel, clProfilePrimaries * srcPrimaries)
+{
     static const clProfilePrimaries srgbPrimaries = { { 0.64f, 0.33f }, { 0.30f, 0.60f }, { 0.15f, 0.06f }, { 0.3127f, 0.3290f } };
 
-    float gamutDistances[3];
-    float srgbDistances[3];
+    // The brightest Y at a chromaticity is reached when the largest linear RGB channel hits 1, and linear RGB
+    // is linear in XYZ, so for any XYZ: maxY = Y / max(R, G, B)
+    gbMat3 toXYZ, fromXYZ;
+    clTransformDeriveXYZMatrix(C, srcPrimaries, &toXYZ);
+    gb_mat3_inverse(&fromXYZ, &toXYZ);
+    gb_mat3_transpose(&fromXYZ);
+    memcpy(kernel->fromXYZ, fromXYZ.e, sizeof(kernel->fromXYZ));
+
+    const float * m = kernel->fromXYZ;
+    float X = whitePointX / whitePointY;
+    float Z = (1.0f - whitePointX - whitePointY) / whitePointY;
+    float r = (m[0] * X) + m[1] + (m[2] * Z);
+    float g = (m[3] * X) + m[4] + (m[5] * Z);
+    float b = (m[6] * X) + m[7] + (m[8] * Z);
+    float maxChannel = maxChannel3(r, g, b);
+    kernel->whiteMaxY = 1.0f / maxChannel;
+
+    // If the green primaries line up, we're probably in sRGB and everything is in-gamut
+    kernel->srcIsSRGB = (fabsf(srgbPrimaries.green[1] - srcPrimaries->green[1]) < 0.0001f) ? clTrue : clFalse;
+    calcGamutEdges(srcPrimaries, kernel->srcEdges);
+    calcGamutEdges(&srgbPrimaries, kernel->srgbEdges);
+}
+
+// Converts a span of interleaved XYZ into chromaticities and the max Y (at 1 nit) for each of them
+static void highlightSpanXY(const clHighlightKernel * kernel, const float * xyz, int count, float * outX, float * outY, float * outLum, float * outMaxY)
+{
+    float X[CL_HIGHLIGHT_SPAN_PIXELS];
+    float Z[CL_HIGHLIGHT_SPAN_PIXELS];
+    for (int i = 0; i < count; ++i) {
+        X[i] = xyz[(i * 3) + 0];
+        outLum[i] = xyz[(i * 3) + 1];
+        Z[i] = xyz[(i * 3) + 2];
+    }
+
+    const float * m = kernel->fromXYZ;
+    int i = 0;
+#if defined(COLORIST_HIGHLIGHT_SSE2)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 whiteX = _mm_set1_ps(whitePointX);
+    const __m128 whiteY = _mm_set1_ps(whitePointY);
+    const __m128 whiteMaxY = _mm_set1_ps(kernel->whiteMaxY);
+    for (; i + 4 <= count; i += 4) {
+        __m128 vX = _mm_loadu_ps(&X[i]);
+        __m128 vY = _mm_loadu_ps(&outLum[i]);
+        __m128 vZ = _mm_loadu_ps(&Z[i]);
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), vX), _mm_mul_ps(_mm_set1_ps(m[1]), vY)), _mm_mul_ps(_mm_set1_ps(m[2]), vZ));
+        __m128 g = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[3]), vX), _mm_mul_ps(_mm_set1_ps(m[4]), vY)), _mm_mul_ps(_mm_set1_ps(m[5]), vZ));
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[6]), vX), _mm_mul_ps(_mm_set1_ps(m[7]), vY)), _mm_mul_ps(_mm_set1_ps(m[8]), vZ));
+        __m128 maxChannel = _mm_max_ps(r, _mm_max_ps(g, b));
+
+        // Black (or negative) pixels have no chromaticity; treat them as the white point
+        __m128 lit = _mm_and_ps(_mm_cmpgt_ps(vY, zero), _mm_cmpgt_ps(maxChannel, zero));
+        __m128 sum = _mm_add_ps(_mm_add_ps(vX, vY), vZ);
+        sum = _mm_or_ps(_mm_and_ps(lit, sum), _mm_andnot_ps(lit, _mm_set1_ps(1.0f))); // avoid dividing by zero in unlit lanes
+        maxChannel = _mm_or_ps(_mm_and_ps(lit, maxChannel), _mm_andnot_ps(lit, _mm_set1_ps(1.0f)));
+        __m128 x = _mm_div_ps(vX, sum);
+        __m128 y = _mm_div_ps(vY, sum);
+        __m128 maxY = _mm_div_ps(vY, maxChannel);
+        _mm_storeu_ps(&outX[i], _mm_or_ps(_mm_and_ps(lit, x), _mm_andnot_ps(lit, whiteX)));
+        _mm_storeu_ps(&outY[i], _mm_or_ps(_mm_and_ps(lit, y), _mm_andnot_ps(lit, whiteY)));
+        _mm_storeu_ps(&outMaxY[i], _mm_or_ps(_mm_and_ps(lit, maxY), _mm_andnot_ps(lit, whiteMaxY)));
+    }
+#endif
+    for (; i < count; ++i) {
+        float r = (m[0] * X[i]) + (m[1] * outLum[i]) + (m[2] * Z[i]);
+        float g = (m[3] * X[i]) + (m[4] * outLum[i]) + (m[5] * Z[i]);
+        float b = (m[6] * X[i]) + (m[7] * outLum[i]) + (m[8] * Z[i]);
+        float maxChannel = maxChannel3(r, g, b);
+        if ((outLum[i] > 0.0f) && (maxChannel > 0.0f)) {
+            float sum = X[i] + outLum[i] + Z[i];
+            outX[i] = X[i] / sum;
+            outY[i] = outLum[i] / sum;
+            outMaxY[i] = outLum[i] / maxChannel;
+        } else {
+            outX[i] = whitePointX;
+            outY[i] = whitePointY;
+            outMaxY[i] = kernel->whiteMaxY;
+        }
+    }
+}
+
+static float calcOutofSRGB(const clHighlightKernel * kernel, float x, float y)
+{
     float srgbMaxDist, gamutMaxDist = 0.0f, totalDist, ratio;
     int i;
 
-    if (fabsf(srgbPrimaries.green[1] - primaries->green[1]) < 0.0001f) {
-        // We're probably in sRGB, just say we're in-gamut
+    if (kernel->srcIsSRGB) {
         return 0;
     }
 
-    calcGamutDistances(x, y, primaries, gamutDistances);
-    calcGamutDistances(x, y, &srgbPrimaries, srgbDistances);
-
-    srgbMaxDist = srgbDistances[0];
+    srgbMaxDist = (kernel->srgbEdges[0][0] * x) + (kernel->srgbEdges[0][1] * y) + kernel->srgbEdges[0][2];
     for (i = 0; i < 3; ++i) {
-        if (srgbMaxDist <= srgbDistances[i]) {
-            srgbMaxDist = srgbDistances[i];
-            gamutMaxDist = gamutDistances[i];
+        float srgbDist = (kernel->srgbEdges[i][0] * x) + (kernel->srgbEdges[i][1] * y) + kernel->srgbEdges[i][2];
+        if (srgbMaxDist <= srgbDist) {
+            srgbMaxDist = srgbDist;
+            gamutMaxDist = (kernel->srcEdges[i][0] * x) + (kernel->srcEdges[i][1] * y) + kernel->srcEdges[i][2];
         }
     }
 
@@ -131,12 +232,141 @@ void clImageSRGBHighlightPixelInfoDestroy(struct clContext * C, clImageSRGBHighl
     clFree(pixelInfo);
 }
 
-clImage * clImageCreateSRGBHighlight(clContext * C, clImage * srcImage, int srgbLuminance, clImageSRGBHighlightStats * stats, clImageSRGBHighlightPixelInfo * outPixelInfo, struct cJSON ** highlightInfoJSON)
+static void highlightInfoSchema(clImageSRGBHighlightPixelInfo * pixelInfo, clRaw * outRawInfo, clStructArraySchema outSchema[HII_COUNT])
 {
-    const float minHighlight = 0.4f;
+    for (int i = 0; i < HII_COUNT; ++i) {
+        outSchema[i].format = "f32";
+        outSchema[i].name = highlightInfoPropertyNames[i];
+    }
+    outRawInfo->ptr = (uint8_t *)pixelInfo->pixels;
+    outRawInfo->size = HII_COUNT * sizeof(float) * pixelInfo->pixelCount;
+    outRawInfo->mapped = clFalse;
+}
 
-    clTransform * toXYZ = clTransformCreate(C, srcImage->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
-    clTransform * fromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, srcImage->profile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
+clBool clImageSRGBHighlightPixelInfoWrite(struct clContext * C, clImageSRGBHighlightPixelInfo * pixelInfo, int width, int height, int tileSize, FILE * f)
+{
+    clRaw rawInfo;
+    clStructArraySchema infoSchema[HII_COUNT];
+    highlightInfoSchema(pixelInfo, &rawInfo, infoSchema);
+    return clRawWriteStructArray(C, f, &rawInfo, width, height, infoSchema, HII_COUNT, tileSize, C->params.deflateLevel, C->params.jobs);
+}
+
+typedef struct clHighlightTask
+{
+    clContext * C;
+    clImage * srcImage;
+    clImage * highlight;
+    clTransform * toXYZ;
+    const clHighlightKernel * kernel;
+    clImageSRGBHighlightPixelInfo * pixelInfo;
+    clImageSRGBHighlightStats * sliceStats;
+    float srcLuminanceScale;
+    float srgbLuminance;
+    float overbrightScale;
+} clHighlightTask;
+
+static void highlightSliceFunc(void * userData, int startSlice, int endSlice)
+{
+    static const float minHighlight = 0.4f;
+
+    clHighlightTask * info = (clHighlightTask *)userData;
+    clContext * C = info->C;
+    clImage * srcImage = info->srcImage;
+    int width = srcImage->width;
+    float * srcFloats = clAllocate(4 * sizeof(float) * width);
+    float * xyzPixels = clAllocate(3 * sizeof(float) * width);
+    float spanX[CL_HIGHLIGHT_SPAN_PIXELS];
+    float spanY[CL_HIGHLIGHT_SPAN_PIXELS];
+    float spanLum[CL_HIGHLIGHT_SPAN_PIXELS];
+    float spanMaxY[CL_HIGHLIGHT_SPAN_PIXELS];
+
+    for (int slice = startSlice; slice < endSlice; ++slice) {
+        clImageSRGBHighlightStats * stats = &info->sliceStats[slice];
+        int endRow = (slice + 1) * CL_HIGHLIGHT_SLICE_ROWS;
+        if (endRow > srcImage->height) {
+            endRow = srcImage->height;
+        }
+        for (int row = slice * CL_HIGHLIGHT_SLICE_ROWS; row < endRow; ++row) {
+            clImageRowsToFloat(C, srcImage, row, 1, srcFloats);
+            clTransformRunPrepared(C, info->toXYZ, srcFloats, xyzPixels, width);
+
+            for (int spanStart = 0; spanStart < width; spanStart += CL_HIGHLIGHT_SPAN_PIXELS) {
+                int spanCount = width - spanStart;
+                if (spanCount > CL_HIGHLIGHT_SPAN_PIXELS) {
+                    spanCount = CL_HIGHLIGHT_SPAN_PIXELS;
+                }
+                highlightSpanXY(info->kernel, &xyzPixels[spanStart * 3], spanCount, spanX, spanY, spanLum, spanMaxY);
+
+                for (int s = 0; s < spanCount; ++s) {
+                    int i = (row * width) + spanStart + s;
+                    uint8_t * dstPixel = &info->highlight->pixelsU8[i * CL_CHANNELS_PER_PIXEL];
+                    clImageSRGBHighlightPixel * pixelHighlightInfo = &info->pixelInfo->pixels[i];
+
+                    // Negative Y (imaginary primaries) is as dark as black; highlightSpanXY() already gave it the white point
+                    float pixelNits = (spanLum[s] > 0.0f) ? spanLum[s] : 0.0f;
+                    pixelHighlightInfo->x = spanX[s];
+                    pixelHighlightInfo->y = spanY[s];
+                    pixelHighlightInfo->Y = pixelNits / info->srcLuminanceScale;
+
+                    if (stats->brightestPixelNits < pixelNits) {
+                        stats->brightestPixelNits = pixelNits;
+                        stats->brightestPixelX = spanStart + s;
+                        stats->brightestPixelY = row;
+                    }
+
+                    float maxY = spanMaxY[s] * info->srgbLuminance;
+                    float overbright = calcOverbright(pixelNits, info->overbrightScale, maxY);
+                    float outOfSRGB = calcOutofSRGB(info->kernel, spanX[s], spanY[s]);
+
+                    pixelHighlightInfo->nits = pixelNits;
+                    pixelHighlightInfo->maxNits = maxY;
+                    pixelHighlightInfo->outOfGamut = outOfSRGB;
+
+                    float baseIntensity = pixelNits / info->srgbLuminance;
+                    baseIntensity = CL_CLAMP(baseIntensity, 0.0f, 1.0f);
+                    uint8_t intensity8 = intensityToU8(baseIntensity);
+
+                    if ((overbright > 0.0f) && (outOfSRGB > 0.0f)) {
+                        float biggerHighlight = (overbright > outOfSRGB) ? overbright : outOfSRGB;
+                        float highlightIntensity = minHighlight + (biggerHighlight * (1.0f - minHighlight));
+                        // Yellow
+                        dstPixel[0] = intensity8;
+                        dstPixel[1] = intensity8;
+                        dstPixel[2] = intensityToU8(baseIntensity * (1.0f - highlightIntensity));
+                        ++stats->bothPixelCount;
+                    } else if (overbright > 0.0f) {
+                        float highlightIntensity = minHighlight + (overbright * (1.0f - minHighlight));
+                        // Magenta
+                        dstPixel[0] = intensity8;
+                        dstPixel[1] = intensityToU8(baseIntensity * (1.0f - highlightIntensity));
+                        dstPixel[2] = intensity8;
+                        ++stats->overbrightPixelCount;
+                    } else if (outOfSRGB > 0.0f) {
+                        float highlightIntensity = minHighlight + (outOfSRGB * (1.0f - minHighlight));
+                        // Cyan
+                        dstPixel[0] = intensityToU8(baseIntensity * (1.0f - highlightIntensity));
+                        dstPixel[1] = intensity8;
+                        dstPixel[2] = intensity8;
+                        ++stats->outOfGamutPixelCount;
+                    } else {
+                        // Gray
+                        dstPixel[0] = intensity8;
+                        dstPixel[1] = intensity8;
+                        dstPixel[2] = intensity8;
+                    }
+                    dstPixel[3] = 255;
+                }
+            }
+        }
+    }
+
+    clFree(srcFloats);
+    clFree(xyzPixels);
+}
+
+clImage * clImageCreateSRGBHighlight(clContext * C, clImage * srcImage, int srgbLuminance, clImageSRGBHighlightStats * stats, clImageSRGBHighlightPixelInfo * outPixelInfo, struct cJSON ** highlightInfoJSON)
+{
+    clTransform * toXYZ = clTransformAcquire(C, srcImage->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
 
     clContextLog(C, "highlight", 1, "Creating sRGB highlight (%d nits, %s)...", srgbLuminance, clTransformCMMName(C, toXYZ));
 
@@ -152,114 +382,53 @@ clImage * clImageCreateSRGBHighlight(clContext * C, clImage * srcImage, int srgb
         }
     }
 
-    float overbrightScale = (float)srcLuminance * srcCurve.implicitScale / (float)srgbLuminance;
-
-    // clTransformCalcMaxY assumes the RGB profile is linear with a 1 nit luminance
-    clProfileCurve gamma1;
-    gamma1.type = CL_PCT_GAMMA;
-    gamma1.gamma = 1.0f;
-    clProfile * linearProfile = clProfileCreate(C, &srcPrimaries, &gamma1, 1, NULL);
-    clTransform * linearToXYZ = clTransformCreate(C, linearProfile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
-    clTransform * linearFromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, linearProfile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
+    clHighlightKernel kernel;
+    highlightKernelInit(C, &kernel, &srcPrimaries);
 
     memset(stats, 0, sizeof(clImageSRGBHighlightStats));
     int pixelCount = stats->pixelCount = srcImage->width * srcImage->height;
 
-    float * srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    clPixelMathUNormToFloat(C, srcImage->pixels, srcImage->depth, srcFloats, pixelCount);
-
-    float * xyzPixels = clAllocate(3 * sizeof(float) * pixelCount);
-    clTransformRun(C, toXYZ, C->params.jobs, (uint8_t *)srcFloats, (uint8_t *)xyzPixels, pixelCount);
-
     clImageSRGBHighlightPixelInfo * pixelInfo = outPixelInfo;
     if (!pixelInfo) {
         pixelInfo = clImageSRGBHighlightPixelInfoCreate(C, pixelCount);
     }
 
     clImage * highlight = clImageCreate(C, srcImage->width, srcImage->height, 8, NULL);
-    for (int i = 0; i < pixelCount; ++i) {
-        float * srcXYZ = &xyzPixels[i * 3];
-        uint16_t * dstPixel = &highlight->pixels[i * CL_CHANNELS_PER_PIXEL];
-        clImageSRGBHighlightPixel * pixelHighlightInfo = &pixelInfo->pixels[i];
-
-        cmsCIEXYZ XYZ;
-        XYZ.X = srcXYZ[0];
-        XYZ.Y = srcXYZ[1];
-        XYZ.Z = srcXYZ[2];
-
-        cmsCIExyY xyY;
-        if (XYZ.Y > 0) {
-            cmsXYZ2xyY(&xyY, &XYZ);
-        } else {
-            xyY.x = 0.3127f;
-            xyY.y = 0.3290f;
-            xyY.Y = 0.0f;
-        }
-
-        pixelHighlightInfo->x = (float)xyY.x;
-        pixelHighlightInfo->y = (float)xyY.y;
-        pixelHighlightInfo->Y = (float)xyY.Y / ((float)srcLuminance * srcCurve.implicitScale);
 
-        float pixelNits = (float)xyY.Y;
-        if (stats->brightestPixelNits < pixelNits) {
-            stats->brightestPixelNits = pixelNits;
-            stats->brightestPixelX = i % srcImage->width;
-            stats->brightestPixelY = i / srcImage->width;
+    clHighlightTask info;
+    int sliceCount = (srcImage->height + CL_HIGHLIGHT_SLICE_ROWS - 1) / CL_HIGHLIGHT_SLICE_ROWS;
+    info.C = C;
+    info.srcImage = srcImage;
+    info.highlight = highlight;
+    info.toXYZ = toXYZ;
+    info.kernel = &kernel;
+    info.pixelInfo = pixelInfo;
+    info.sliceStats = clAllocate(sizeof(clImageSRGBHighlightStats) * sliceCount);
+    memset(info.sliceStats, 0, sizeof(clImageSRGBHighlightStats) * sliceCount);
+    info.srcLuminanceScale = (float)srcLuminance * srcCurve.implicitScale;
+    info.srgbLuminance = (float)srgbLuminance;
+    info.overbrightScale = info.srcLuminanceScale / (float)srgbLuminance;
+    clTaskParallelFor(C, C->params.jobs, sliceCount, 1, highlightSliceFunc, &info);
+
+    // Slices are merged top to bottom, so the brightest pixel is the first one found, as in a single pass
+    for (int i = 0; i < sliceCount; ++i) {
+        clImageSRGBHighlightStats * sliceStats = &info.sliceStats[i];
+        stats->overbrightPixelCount += sliceStats->overbrightPixelCount;
+        stats->outOfGamutPixelCount += sliceStats->outOfGamutPixelCount;
+        stats->bothPixelCount += sliceStats->bothPixelCount;
+        if (stats->brightestPixelNits < sliceStats->brightestPixelNits) {
+            stats->brightestPixelNits = sliceStats->brightestPixelNits;
+            stats->brightestPixelX = sliceStats->brightestPixelX;
+            stats->brightestPixelY = sliceStats->brightestPixelY;
         }
-
-        float maxY = clTransformCalcMaxY(C, linearFromXYZ, linearToXYZ, (float)xyY.x, (float)xyY.y) * (float)srgbLuminance;
-        float overbright = calcOverbright((float)xyY.Y, overbrightScale, maxY);
-        float outOfSRGB = calcOutofSRGB(C, (float)xyY.x, (float)xyY.y, &srcPrimaries);
-
-        pixelHighlightInfo->nits = pixelNits;
-        pixelHighlightInfo->maxNits = maxY;
-        pixelHighlightInfo->outOfGamut = outOfSRGB;
-
-        float baseIntensity = pixelNits / (float)srgbLuminance;
-        baseIntensity = CL_CLAMP(baseIntensity, 0.0f, 1.0f);
-        uint8_t intensity8 = intensityToU8(baseIntensity);
-
-        if ((overbright > 0.0f) && (outOfSRGB > 0.0f)) {
-            float biggerHighlight = (overbright > outOfSRGB) ? overbright : outOfSRGB;
-            float highlightIntensity = minHighlight + (biggerHighlight * (1.0f - minHighlight));
-            // Yellow
-            dstPixel[0] = intensity8;
-            dstPixel[1] = intensity8;
-            dstPixel[2] = intensityToU8(baseIntensity * (1.0f - highlightIntensity));
-            ++stats->bothPixelCount;
-        } else if (overbright > 0.0f) {
-            float highlightIntensity = minHighlight + (overbright * (1.0f - minHighlight));
-            // Magenta
-            dstPixel[0] = intensity8;
-            dstPixel[1] = intensityToU8(baseIntensity * (1.0f - highlightIntensity));
-            dstPixel[2] = intensity8;
-            ++stats->overbrightPixelCount;
-        } else if (outOfSRGB > 0.0f) {
-            float highlightIntensity = minHighlight + (outOfSRGB * (1.0f - minHighlight));
-            // Cyan
-            dstPixel[0] = intensityToU8(baseIntensity * (1.0f - highlightIntensity));
-            dstPixel[1] = intensity8;
-            dstPixel[2] = intensity8;
-            ++stats->outOfGamutPixelCount;
-        } else {
-            // Gray
-            dstPixel[0] = intensity8;
-            dstPixel[1] = intensity8;
-            dstPixel[2] = intensity8;
-        }
-        dstPixel[3] = 255;
     }
     stats->hdrPixelCount = stats->bothPixelCount + stats->overbrightPixelCount + stats->outOfGamutPixelCount;
+    clFree(info.sliceStats);
 
     if (highlightInfoJSON) {
         clRaw rawInfo;
         clStructArraySchema infoSchema[HII_COUNT];
-        for (int i = 0; i < HII_COUNT; ++i) {
-            infoSchema[i].format = "f32";
-            infoSchema[i].name = highlightInfoPropertyNames[i];
-        }
-        rawInfo.ptr = (uint8_t *)pixelInfo->pixels;
-        rawInfo.size = HII_COUNT * sizeof(float) * pixelCount;
+        highlightInfoSchema(pixelInfo, &rawInfo, infoSchema);
 
         Timer t;
         clContextLog(C, "highlight", 1, "Packing highlight info...");
@@ -272,13 +441,6 @@ clImage * clImageCreateSRGBHighlight(clContext * C, clImage * srcImage, int srgb
         clImageSRGBHighlightPixelInfoDestroy(C, pixelInfo);
     }
 
-    clTransformDestroy(C, linearToXYZ);
-    clTransformDestroy(C, linearFromXYZ);
-    clProfileDestroy(C, linearProfile);
-
-    clTransformDestroy(C, fromXYZ);
-    clTransformDestroy(C, toXYZ);
-    clFree(srcFloats);
-    clFree(xyzPixels);
+    clTransformRelease(C, toXYZ);
     return highlight;
 }
@@ -0,0 +1,257 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "colorist/image.h"
+
+#include "colorist/context.h"
+#include "colorist/pixelmath.h"
+#include "colorist/profile.h"
+#include "colorist/task.h"
+#include "colorist/transform.h"
+
+#include <string.h>
+
+// A NULL dstProfile skips the convert stage entirely (see clImagePipelineCreateCopy())
+static clImagePipeline * pipelineCreate(struct clContext * C, clImage * srcImage, int depth, struct clProfile * dstProfile, clTonemap tonemap)
+{
+    clImagePipeline * pipeline = clAllocateStruct(clImagePipeline);
+    memset(pipeline, 0, sizeof(clImagePipeline));
+    pipeline->srcImage = srcImage;
+    pipeline->bandHeight = 1;
+    if ((srcImage->width > 0) && (srcImage->height > 0)) {
+        pipeline->bandHeight = CL_IMAGE_PIPELINE_BAND_PIXELS / srcImage->width;
+        if (pipeline->bandHeight < 1) {
+            pipeline->bandHeight = 1;
+        }
+    }
+
+    if (dstProfile) {
+        pipeline->dstImage = clImageCreate(C, srcImage->width, srcImage->height, depth, dstProfile);
+
+        // Show image details
+        clContextLog(C, "details", 0, "Source:");
+        clImageDebugDump(C, srcImage, 0, 0, 0, 0, 1);
+        clContextLog(C, "details", 0, "Destination:");
+        clImageDebugDump(C, pipeline->dstImage, 0, 0, 0, 0, 1);
+
+        pipeline->convertTransform = clTransformAcquire(C, srcImage->profile, CL_XF_RGBA, srcImage->depth, pipeline->dstImage->profile, CL_XF_RGBA, depth, tonemap);
+        clContextLog(C, "convert", 0, "Converting (%s, lum scale %gx, %s)...",
+            clTransformCMMName(C, pipeline->convertTransform),
+            clTransformGetLuminanceScale(C, pipeline->convertTransform),
+            pipeline->convertTransform->tonemapEnabled ? "tonemap" : "clip");
+    } else {
+        pipeline->dstImage = clImageCreate(C, srcImage->width, srcImage->height, srcImage->depth, srcImage->profile);
+    }
+    return pipeline;
+}
+
+clImagePipeline * clImagePipelineCreate(struct clContext * C, clImage * srcImage, int depth, struct clProfile * dstProfile, clTonemap tonemap)
+{
+    if (dstProfile) {
+        return pipelineCreate(C, srcImage, depth, dstProfile, tonemap);
+    }
+
+    // Just like clImageCreate(), no profile means sRGB
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    clImagePipeline * pipeline = pipelineCreate(C, srcImage, depth, srgb, tonemap);
+    clProfileDestroy(C, srgb);
+    return pipeline;
+}
+
+clImagePipeline * clImagePipelineCreateCopy(struct clContext * C, clImage * srcImage)
+{
+    return pipelineCreate(C, srcImage, srcImage->depth, NULL, CL_TONEMAP_OFF);
+}
+
+clBool clImagePipelineAddComposite(struct clContext * C, clImagePipeline * pipeline, clImage * compositeImage, clBlendParams * blendParams)
+{
+    clImage * image = pipeline->dstImage; // blending happens on top of whatever the convert stage produced
+
+    // Sanity checks
+    if ((pipeline->layerCount == CL_MAX_COMPOSITE_LAYERS) || (image->width != compositeImage->width) || (image->height != compositeImage->height)) {
+        return clFalse;
+    }
+
+    // Query profile used for both src and dst image
+    clProfilePrimaries primaries;
+    clProfileCurve curve;
+    int maxLuminance;
+    if (!clProfileQuery(C, image->profile, &primaries, &curve, &maxLuminance)) {
+        clContextLogError(C, "clImageBlend: failed to query source profile");
+        return clFalse;
+    }
+    maxLuminance = (int)((float)maxLuminance * curve.implicitScale);
+
+    // Build a profile using the same color volume, but a blend-friendly gamma
+    clImagePipelineLayer * layer = &pipeline->layers[pipeline->layerCount];
+    curve.type = CL_PCT_GAMMA;
+    curve.implicitScale = 1.0f;
+    curve.gamma = blendParams->gamma;
+    layer->blendProfile = clProfileCreate(C, &primaries, &curve, maxLuminance, NULL);
+
+    // Build transforms that go [src -> blend], [cmp -> blend], [blend -> dst]
+    layer->srcBlendTransform = clTransformAcquire(C, image->profile, CL_XF_RGBA, image->depth, layer->blendProfile, CL_XF_RGBA, 32, blendParams->srcTonemap);
+    layer->cmpBlendTransform = clTransformAcquire(C, compositeImage->profile, CL_XF_RGBA, compositeImage->depth, layer->blendProfile, CL_XF_RGBA, 32, blendParams->cmpTonemap);
+    layer->dstBlendTransform = clTransformAcquire(C, layer->blendProfile, CL_XF_RGBA, 32, image->profile, CL_XF_RGBA, image->depth, CL_TONEMAP_OFF); // maxLuminance should match, no need to tonemap
+
+    layer->image = compositeImage;
+    layer->premultiplied = blendParams->premultiplied;
+    ++pipeline->layerCount;
+    return clTrue;
+}
+
+void clImagePipelineAddHALD(struct clContext * C, clImagePipeline * pipeline, clImage * hald, int haldDims)
+{
+    float * haldPixels = clAllocate(4 * sizeof(float) * hald->width * hald->height);
+    clImageRowsToFloat(C, hald, 0, hald->height, haldPixels);
+    COLORIST_ASSERT(!pipeline->ownedHald);
+    pipeline->ownedHald = clHaldCLUTCreate(C, haldPixels, haldDims);
+    clFree(haldPixels);
+    clImagePipelineAddHALDCLUT(C, pipeline, pipeline->ownedHald);
+}
+
+void clImagePipelineAddHALDCLUT(struct clContext * C, clImagePipeline * pipeline, const clHaldCLUT * clut)
+{
+    COLORIST_UNUSED(C);
+
+    COLORIST_ASSERT(!pipeline->hald);
+    pipeline->hald = clut;
+}
+
+// Runs transform over rows [y, y + rows) of image into a packed destination. Views that don't span
+// their parent's full width have gaps between rows, so those are transformed one row at a time.
+static void transformRows(clContext * C, clTransform * transform, clImage * image, int y, int rows, void * dstPixels)
+{
+    if (CL_IMAGE_IS_PACKED(image)) {
+        clTransformRunPrepared(C, transform, CL_IMAGE_ROW(image, y), dstPixels, image->width * rows);
+        return;
+    }
+
+    int dstRowBytes = image->width * clTransformFormatToPixelBytes(C, transform->dstFormat, transform->dstDepth);
+    for (int j = 0; j < rows; ++j) {
+        clTransformRunPrepared(C, transform, CL_IMAGE_ROW(image, y + j), (uint8_t *)dstPixels + ((size_t)j * dstRowBytes), image->width);
+    }
+}
+
+static clBool isOpaque(const float * pixels, int pixelCount)
+{
+    for (int i = 0; i < pixelCount; ++i) {
+        if (pixels[(i * 4) + 3] != 1.0f) {
+            return clFalse;
+        }
+    }
+    return clTrue;
+}
+
+typedef struct clImagePipelineBandTask
+{
+    clContext * C;
+    clImagePipeline * pipeline;
+    int rowCount;
+} clImagePipelineBandTask;
+
+static void pipelineBandFunc(void * userData, int startBand, int endBand)
+{
+    clImagePipelineBandTask * info = (clImagePipelineBandTask *)userData;
+    clContext * C = info->C;
+    clImagePipeline * pipeline = info->pipeline;
+    clImage * srcImage = pipeline->srcImage;
+    clImage * dstImage = pipeline->dstImage;
+    int width = srcImage->width;
+    float * floatsA = NULL;
+    float * floatsB = NULL;
+
+    if (pipeline->layerCount || pipeline->hald) {
+        floatsA = clAllocate(4 * sizeof(float) * width * pipeline->bandHeight);
+        floatsB = clAllocate(4 * sizeof(float) * width * pipeline->bandHeight);
+    }
+
+    for (int band = startBand; band < endBand; ++band) {
+        int y = band * pipeline->bandHeight;
+        int rows = info->rowCount - y;
+        if (rows > pipeline->bandHeight) {
+            rows = pipeline->bandHeight;
+        }
+        int pixelCount = width * rows;
+        uint8_t * dstPixels = CL_IMAGE_ROW(dstImage, y);
+
+        // Convert
+        if (pipeline->convertTransform) {
+            transformRows(C, pipeline->convertTransform, srcImage, y, rows, dstPixels);
+        } else {
+            for (int j = 0; j < rows; ++j) {
+                memcpy(CL_IMAGE_ROW(dstImage, y + j), CL_IMAGE_ROW(srcImage, y + j), (size_t)width * dstImage->pixelBytes);
+            }
+        }
+
+        // Composite, one layer on top of the other
+        for (int l = 0; l < pipeline->layerCount; ++l) {
+            clImagePipelineLayer * layer = &pipeline->layers[l];
+            transformRows(C, layer->cmpBlendTransform, layer->image, y, rows, floatsB);
+            if (isOpaque(floatsB, pixelCount)) {
+                // SourceOver with an opaque composite yields the composite exactly; skip the source
+                clTransformRunPrepared(C, layer->dstBlendTransform, floatsB, dstPixels, pixelCount);
+            } else {
+                clTransformRunPrepared(C, layer->srcBlendTransform, dstPixels, floatsA, pixelCount);
+                clPixelMathBlend(C, floatsA, floatsB, floatsA, pixelCount, layer->premultiplied);
+                clTransformRunPrepared(C, layer->dstBlendTransform, floatsA, dstPixels, pixelCount);
+            }
+        }
+
+        // HALD CLUT
+        if (pipeline->hald) {
+            clImageRowsToFloat(C, dstImage, y, rows, floatsA);
+            clPixelMathHaldCLUTApply(C, pipeline->hald, floatsA, floatsA, pixelCount);
+            clImageRowsFromFloat(C, dstImage, y, rows, floatsA);
+        }
+    }
+
+    if (floatsA) {
+        clFree(floatsA);
+        clFree(floatsB);
+    }
+}
+
+void clImagePipelineRunRows(struct clContext * C, clImagePipeline * pipeline, int rowCount, int taskCount)
+{
+    clImagePipelineBandTask info;
+    int bandCount = (rowCount + pipeline->bandHeight - 1) / pipeline->bandHeight;
+
+    info.C = C;
+    info.pipeline = pipeline;
+    info.rowCount = rowCount;
+    clTaskParallelFor(C, taskCount, bandCount, 1, pipelineBandFunc, &info);
+}
+
+clImage * clImagePipelineRun(struct clContext * C, clImagePipeline * pipeline, int taskCount)
+{
+    clImage * dstImage = pipeline->dstImage;
+    clImagePipelineRunRows(C, pipeline, pipeline->srcImage->height, taskCount);
+    pipeline->dstImage = NULL;
+    return dstImage;
+}
+
+void clImagePipelineDestroy(struct clContext * C, clImagePipeline * pipeline)
+{
+    if (pipeline->dstImage) {
+        clImageDestroy(C, pipeline->dstImage);
+    }
+    if (pipeline->convertTransform) {
+        clTransformRelease(C, pipeline->convertTransform);
+    }
+    for (int l = 0; l < pipeline->layerCount; ++l) {
+        clImagePipelineLayer * layer = &pipeline->layers[l];
+        clTransformRelease(C, layer->srcBlendTransform);
+        clTransformRelease(C, layer->cmpBlendTransform);
+        clTransformRelease(C, layer->dstBlendTransform);
+        clProfileDestroy(C, layer->blendProfile);
+    }
+    if (pipeline->ownedHald) {
+        clHaldCLUTDestroy(C, pipeline->ownedHald);
+    }
+    clFree(pipeline);
+}
@@ -9,100 +9,366 @@
 
 #include "colorist/context.h"
 #include "colorist/profile.h"
+#include "colorist/task.h"
 #include "colorist/transform.h"
 
+#include <math.h>
 #include <string.h>
 
-clBool clImageCalcSignals(struct clContext * C, int taskCount, clImage * srcImage, clImage * dstImage, clImageSignals * signals)
+// Rows per slice of work; every slice sums into its own accumulators
+#define CL_SIGNALS_SLICE_ROWS 16
+
+// x^(1/2.2) is looked up with linear interpolation between this many evenly spaced samples
+#define CL_SIGNALS_GAMMA_LUT_SIZE 65536
+
+// SSIM window: an 11-tap gaussian (sigma 1.5), applied separably
+#define CL_SSIM_RADIUS 5
+#define CL_SSIM_TAPS ((CL_SSIM_RADIUS * 2) + 1)
+#define CL_SSIM_SIGMA 1.5f
+#define CL_SSIM_C1 (0.01f * 0.01f)
+#define CL_SSIM_C2 (0.03f * 0.03f)
+#define CL_MSSSIM_MAX_SCALES 5
+
+static float * createGammaLUT(struct clContext * C)
 {
-    memset(signals, 0, sizeof(*signals));
+    float * lut = clAllocate(sizeof(float) * (CL_SIGNALS_GAMMA_LUT_SIZE + 1));
+    float gamma = 1.0f / 2.2f;
+    for (int i = 0; i <= CL_SIGNALS_GAMMA_LUT_SIZE; ++i) {
+        lut[i] = powf((float)i / CL_SIGNALS_GAMMA_LUT_SIZE, gamma);
+    }
+    return lut;
+}
 
-    if ((srcImage->width != dstImage->width) || (srcImage->height != dstImage->height)) {
-        clContextLogError(C, "Conversion stats unavailable on images of different sizes");
-        return clFalse;
+typedef struct clSignalsTask
+{
+    clContext * C;
+    clImage * srcImage;
+    clImage * dstImage;
+    clTransform * srcToXYZ;
+    clTransform * dstToXYZ;
+    const clTransformKernels * kernels; // for signalErrors
+    float luminanceScale;               // 1 / maxLuminance
+    const float * gammaLUT;
+    double * sliceSums; // per slice: squared error sum (linear), squared error sum (2.2 gamma)
+
+    // Optional (SSIM): the 2.2 gamma Y of every pixel
+    float * srcLuma;
+    float * dstLuma;
+} clSignalsTask;
+
+static void signalsSliceFunc(void * userData, int startSlice, int endSlice)
+{
+    clSignalsTask * info = (clSignalsTask *)userData;
+    clContext * C = info->C;
+    int width = info->srcImage->width;
+    float * srcXYZ = clAllocate(3 * sizeof(float) * width);
+    float * dstXYZ = clAllocate(3 * sizeof(float) * width);
+    float * squaredLinear = clAllocate(3 * sizeof(float) * width);
+    float * squaredG22 = clAllocate(3 * sizeof(float) * width);
+
+    for (int slice = startSlice; slice < endSlice; ++slice) {
+        double errorSquaredSumLinear = 0.0;
+        double errorSquaredSumG22 = 0.0;
+        int endY = (slice + 1) * CL_SIGNALS_SLICE_ROWS;
+        if (endY > info->srcImage->height) {
+            endY = info->srcImage->height;
+        }
+        for (int y = slice * CL_SIGNALS_SLICE_ROWS; y < endY; ++y) {
+            clTransformRunPrepared(C, info->srcToXYZ, CL_IMAGE_ROW(info->srcImage, y), srcXYZ, width);
+            clTransformRunPrepared(C, info->dstToXYZ, CL_IMAGE_ROW(info->dstImage, y), dstXYZ, width);
+            // X, Y and Z all get the same math, so the kernel sees the row as one flat run of values. It
+            // leaves their 2.2 gamma versions behind in srcXYZ and dstXYZ.
+            info->kernels->signalErrors(srcXYZ, dstXYZ, squaredLinear, squaredG22, info->gammaLUT, CL_SIGNALS_GAMMA_LUT_SIZE, info->luminanceScale, width * 3);
+            for (int i = 0; i < width * 3; ++i) {
+                errorSquaredSumLinear += (double)squaredLinear[i];
+                errorSquaredSumG22 += (double)squaredG22[i];
+            }
+            if (info->srcLuma) {
+                for (int i = 0; i < width; ++i) {
+                    info->srcLuma[i + (y * width)] = srcXYZ[(i * 3) + 1];
+                    info->dstLuma[i + (y * width)] = dstXYZ[(i * 3) + 1];
+                }
+            }
+        }
+        info->sliceSums[(slice * 2) + 0] = errorSquaredSumLinear;
+        info->sliceSums[(slice * 2) + 1] = errorSquaredSumG22;
     }
 
-    int pixelCount = srcImage->width * srcImage->height;
+    clFree(srcXYZ);
+    clFree(dstXYZ);
+    clFree(squaredLinear);
+    clFree(squaredG22);
+}
+
+// Runs the per-pixel pass shared by clImageCalcSignals() and clImageCalcSignalsSSIM(). Returns the squared error
+// sums in outSums (if not NULL), and fills srcLuma and dstLuma (if not NULL).
+static void signalsPass(struct clContext * C, int taskCount, clImage * srcImage, clImage * dstImage, double outSums[2], float * srcLuma, float * dstLuma)
+{
+    clSignalsTask info;
+    int sliceCount = (srcImage->height + CL_SIGNALS_SLICE_ROWS - 1) / CL_SIGNALS_SLICE_ROWS;
 
     int srcLuminance, dstLuminance;
     clProfileQuery(C, srcImage->profile, NULL, NULL, &srcLuminance);
     clProfileQuery(C, dstImage->profile, NULL, NULL, &dstLuminance);
+    srcLuminance = (srcLuminance != 0) ? srcLuminance : C->defaultLuminance;
+    dstLuminance = (dstLuminance != 0) ? dstLuminance : C->defaultLuminance;
     int maxLuminance = srcLuminance;
     if (maxLuminance < dstLuminance) {
         maxLuminance = dstLuminance;
     }
-    float maxLuminanceF = (float)maxLuminance;
 
-    clTransform * srcToXYZ = clTransformCreate(C, srcImage->profile, CL_XF_RGBA, srcImage->depth, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
-    float * srcXYZ = clAllocate(3 * sizeof(float) * pixelCount);
-    clTransformRun(C, srcToXYZ, taskCount, srcImage->pixels, srcXYZ, pixelCount);
-    clTransformDestroy(C, srcToXYZ);
+    info.C = C;
+    info.srcImage = srcImage;
+    info.dstImage = dstImage;
+    info.srcToXYZ = clTransformAcquire(C, srcImage->profile, CL_XF_RGBA, srcImage->depth, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    info.dstToXYZ = clTransformAcquire(C, dstImage->profile, CL_XF_RGBA, dstImage->depth, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    info.kernels = clTransformKernelsBest();
+    info.luminanceScale = 1.0f / (float)maxLuminance;
+    info.gammaLUT = createGammaLUT(C);
+    info.sliceSums = clAllocate(2 * sizeof(double) * sliceCount);
+    info.srcLuma = srcLuma;
+    info.dstLuma = dstLuma;
+    clTaskParallelFor(C, taskCount, sliceCount, 1, signalsSliceFunc, &info);
 
-    clTransform * dstToXYZ = clTransformCreate(C, dstImage->profile, CL_XF_RGBA, dstImage->depth, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
-    float * dstXYZ = clAllocate(3 * sizeof(float) * pixelCount);
-    clTransformRun(C, dstToXYZ, taskCount, dstImage->pixels, dstXYZ, pixelCount);
-    clTransformDestroy(C, dstToXYZ);
+    if (outSums) {
+        outSums[0] = 0.0;
+        outSums[1] = 0.0;
+        for (int i = 0; i < sliceCount; ++i) {
+            outSums[0] += info.sliceSums[(i * 2) + 0];
+            outSums[1] += info.sliceSums[(i * 2) + 1];
+        }
+    }
 
-    float errorSquaredSumLinear = 0.0f;
-    float errorSquaredSumG22 = 0.0f;
-    float gamma = 1.0f / 2.2f;
-    for (int i = 0; i < pixelCount; ++i) {
-        float * srcPixel = &srcXYZ[3 * i];
-        float * dstPixel = &dstXYZ[3 * i];
-
-        float normLinearSrcXYZ[3];
-        normLinearSrcXYZ[0] = srcPixel[0] / maxLuminanceF;
-        normLinearSrcXYZ[0] = CL_CLAMP(normLinearSrcXYZ[0], 0.0f, 1.0f);
-        normLinearSrcXYZ[1] = srcPixel[1] / maxLuminanceF;
-        normLinearSrcXYZ[1] = CL_CLAMP(normLinearSrcXYZ[1], 0.0f, 1.0f);
-        normLinearSrcXYZ[2] = srcPixel[2] / maxLuminanceF;
-        normLinearSrcXYZ[2] = CL_CLAMP(normLinearSrcXYZ[2], 0.0f, 1.0f);
-
-        float normLinearDstXYZ[3];
-        normLinearDstXYZ[0] = dstPixel[0] / maxLuminanceF;
-        normLinearDstXYZ[0] = CL_CLAMP(normLinearDstXYZ[0], 0.0f, 1.0f);
-        normLinearDstXYZ[1] = dstPixel[1] / maxLuminanceF;
-        normLinearDstXYZ[1] = CL_CLAMP(normLinearDstXYZ[1], 0.0f, 1.0f);
-        normLinearDstXYZ[2] = dstPixel[2] / maxLuminanceF;
-        normLinearDstXYZ[2] = CL_CLAMP(normLinearDstXYZ[2], 0.0f, 1.0f);
-
-        float normLinearDiff[3];
-        normLinearDiff[0] = normLinearDstXYZ[0] - normLinearSrcXYZ[0];
-        normLinearDiff[1] = normLinearDstXYZ[1] - normLinearSrcXYZ[1];
-        normLinearDiff[2] = normLinearDstXYZ[2] - normLinearSrcXYZ[2];
-        errorSquaredSumLinear += (normLinearDiff[0] * normLinearDiff[0]) + (normLinearDiff[1] * normLinearDiff[1]) + (normLinearDiff[2] * normLinearDiff[2]);
-
-        float normG22SrcXYZ[3];
-        normG22SrcXYZ[0] = powf(normLinearSrcXYZ[0], gamma);
-        normG22SrcXYZ[1] = powf(normLinearSrcXYZ[1], gamma);
-        normG22SrcXYZ[2] = powf(normLinearSrcXYZ[2], gamma);
-
-        float normG22DstXYZ[3];
-        normG22DstXYZ[0] = powf(normLinearDstXYZ[0], gamma);
-        normG22DstXYZ[1] = powf(normLinearDstXYZ[1], gamma);
-        normG22DstXYZ[2] = powf(normLinearDstXYZ[2], gamma);
-
-        float normG22Diff[3];
-        normG22Diff[0] = normG22DstXYZ[0] - normG22SrcXYZ[0];
-        normG22Diff[1] = normG22DstXYZ[1] - normG22SrcXYZ[1];
-        normG22Diff[2] = normG22DstXYZ[2] - normG22SrcXYZ[2];
-        errorSquaredSumG22 += (normG22Diff[0] * normG22Diff[0]) + (normG22Diff[1] * normG22Diff[1]) + (normG22Diff[2] * normG22Diff[2]);
-    }
-
-    if (errorSquaredSumLinear > 0.0f) {
-        signals->mseLinear = errorSquaredSumLinear / (float)pixelCount;
-        signals->psnrLinear = 10.0f * log10f(1.0f / signals->mseLinear);
+    clTransformRelease(C, info.srcToXYZ);
+    clTransformRelease(C, info.dstToXYZ);
+    clFree((float *)info.gammaLUT);
+    clFree(info.sliceSums);
+}
+
+// ------------------------------------------------------------------------------------------------
+// SSIM
+
+typedef struct clSSIMTask
+{
+    clContext * C;
+    int width;
+    int height;
+    const float * src;
+    const float * dst;
+    float kernel[CL_SSIM_TAPS];
+    double * sliceSums; // per slice: SSIM sum, contrast-structure sum
+} clSSIMTask;
+
+// The five windowed moments, filtered horizontally: mean of src, mean of dst, src^2, dst^2, src*dst
+#define CL_SSIM_MOMENTS 5
+
+static void ssimSliceFunc(void * userData, int startSlice, int endSlice)
+{
+    clSSIMTask * info = (clSSIMTask *)userData;
+    clContext * C = info->C;
+    int width = info->width;
+    int height = info->height;
+    int bandRows = CL_SIGNALS_SLICE_ROWS + (CL_SSIM_RADIUS * 2);
+    float * filtered = clAllocate(sizeof(float) * CL_SSIM_MOMENTS * width * bandRows);
+
+    for (int slice = startSlice; slice < endSlice; ++slice) {
+        int startY = slice * CL_SIGNALS_SLICE_ROWS;
+        int endY = startY + CL_SIGNALS_SLICE_ROWS;
+        if (endY > height) {
+            endY = height;
+        }
+
+        // Horizontal pass over every row the slice's windows touch (rows past either edge are clamped)
+        int firstRow = startY - CL_SSIM_RADIUS;
+        for (int r = firstRow; r < (endY + CL_SSIM_RADIUS); ++r) {
+            int y = CL_CLAMP(r, 0, height - 1);
+            const float * srcRow = &info->src[y * width];
+            const float * dstRow = &info->dst[y * width];
+            float * out = &filtered[(r - firstRow) * CL_SSIM_MOMENTS * width];
+            for (int x = 0; x < width; ++x) {
+                float m[CL_SSIM_MOMENTS] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+                for (int k = 0; k < CL_SSIM_TAPS; ++k) {
+                    int sx = x + k - CL_SSIM_RADIUS;
+                    sx = CL_CLAMP(sx, 0, width - 1);
+                    float w = info->kernel[k];
+                    float a = srcRow[sx];
+                    float b = dstRow[sx];
+                    m[0] += w * a;
+                    m[1] += w * b;
+                    m[2] += w * a * a;
+                    m[3] += w * b * b;
+                    m[4] += w * a * b;
+                }
+                for (int i = 0; i < CL_SSIM_MOMENTS; ++i) {
+                    out[(i * width) + x] = m[i];
+                }
+            }
+        }
+
+        // Vertical pass, then SSIM per pixel
+        double ssimSum = 0.0;
+        double csSum = 0.0;
+        for (int y = startY; y < endY; ++y) {
+            for (int x = 0; x < width; ++x) {
+                float m[CL_SSIM_MOMENTS] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+                for (int k = 0; k < CL_SSIM_TAPS; ++k) {
+                    const float * in = &filtered[(y - startY + k) * CL_SSIM_MOMENTS * width];
+                    float w = info->kernel[k];
+                    for (int i = 0; i < CL_SSIM_MOMENTS; ++i) {
+                        m[i] += w * in[(i * width) + x];
+                    }
+                }
+                float mu1 = m[0];
+                float mu2 = m[1];
+                float sigma1 = m[2] - (mu1 * mu1);
+                float sigma2 = m[3] - (mu2 * mu2);
+                float sigma12 = m[4] - (mu1 * mu2);
+                float cs = ((2.0f * sigma12) + CL_SSIM_C2) / (sigma1 + sigma2 + CL_SSIM_C2);
+                float l = ((2.0f * mu1 * mu2) + CL_SSIM_C1) / ((mu1 * mu1) + (mu2 * mu2) + CL_SSIM_C1);
+                ssimSum += (double)(l * cs);
+                csSum += (double)cs;
+            }
+        }
+        info->sliceSums[(slice * 2) + 0] = ssimSum;
+        info->sliceSums[(slice * 2) + 1] = csSum;
+    }
+    clFree(filtered);
+}
+
+// Mean SSIM and mean contrast-structure term of two planes
+static void ssimPlane(struct clContext * C, int taskCount, int width, int height, const float * src, const float * dst, double * outSSIM, double * outCS)
+{
+    clSSIMTask info;
+    int sliceCount = (height + CL_SIGNALS_SLICE_ROWS - 1) / CL_SIGNALS_SLICE_ROWS;
+
+    info.C = C;
+    info.width = width;
+    info.height = height;
+    info.src = src;
+    info.dst = dst;
+    float kernelSum = 0.0f;
+    for (int k = 0; k < CL_SSIM_TAPS; ++k) {
+        float d = (float)(k - CL_SSIM_RADIUS);
+        info.kernel[k] = expf(-(d * d) / (2.0f * CL_SSIM_SIGMA * CL_SSIM_SIGMA));
+        kernelSum += info.kernel[k];
+    }
+    for (int k = 0; k < CL_SSIM_TAPS; ++k) {
+        info.kernel[k] /= kernelSum;
+    }
+    info.sliceSums = clAllocate(2 * sizeof(double) * sliceCount);
+    clTaskParallelFor(C, taskCount, sliceCount, 1, ssimSliceFunc, &info);
+
+    double ssimSum = 0.0;
+    double csSum = 0.0;
+    for (int i = 0; i < sliceCount; ++i) {
+        ssimSum += info.sliceSums[(i * 2) + 0];
+        csSum += info.sliceSums[(i * 2) + 1];
+    }
+    clFree(info.sliceSums);
+
+    *outSSIM = ssimSum / ((double)width * height);
+    *outCS = csSum / ((double)width * height);
+}
+
+// Halves a plane in place (2x2 box average), dropping an odd last row / column
+static void halvePlane(float * plane, int * width, int * height)
+{
+    int halfW = *width / 2;
+    int halfH = *height / 2;
+    for (int y = 0; y < halfH; ++y) {
+        const float * row0 = &plane[(y * 2) * *width];
+        const float * row1 = row0 + *width;
+        for (int x = 0; x < halfW; ++x) {
+            plane[x + (y * halfW)] = (row0[x * 2] + row0[(x * 2) + 1] + row1[x * 2] + row1[(x * 2) + 1]) * 0.25f;
+        }
+    }
+    *width = halfW;
+    *height = halfH;
+}
+
+// SSIM and MS-SSIM of two luma planes, which are halved in place between scales
+static void calcSSIM(struct clContext * C, int taskCount, int width, int height, float * srcLuma, float * dstLuma, float * outSSIM, float * outMSSSIM)
+{
+    // Scale weights from Wang, Simoncelli and Bovik, "Multi-scale structural similarity for image quality assessment"
+    static const double scaleWeights[CL_MSSSIM_MAX_SCALES] = { 0.0448, 0.2856, 0.3001, 0.2363, 0.1333 };
+
+    // Use as many scales as leave room for a full window; weights are renormalized over those
+    int minDimension = (width < height) ? width : height;
+    int scaleCount = 1;
+    while ((scaleCount < CL_MSSSIM_MAX_SCALES) && ((minDimension >> scaleCount) >= CL_SSIM_TAPS)) {
+        ++scaleCount;
+    }
+    double weightSum = 0.0;
+    for (int i = 0; i < scaleCount; ++i) {
+        weightSum += scaleWeights[i];
+    }
+
+    double msssim = 1.0;
+    for (int scale = 0; scale < scaleCount; ++scale) {
+        double ssim, cs;
+        ssimPlane(C, taskCount, width, height, srcLuma, dstLuma, &ssim, &cs);
+        if (scale == 0) {
+            *outSSIM = (float)ssim;
+        }
+        double term = (scale == (scaleCount - 1)) ? ssim : cs;
+        msssim *= pow((term > 0.0) ? term : 0.0, scaleWeights[scale] / weightSum);
+        if (scale < (scaleCount - 1)) {
+            int halfW = width;
+            int halfH = height;
+            halvePlane(srcLuma, &halfW, &halfH);
+            halvePlane(dstLuma, &width, &height);
+        }
+    }
+    *outMSSSIM = (float)msssim;
+}
+
+static clBool calcSignals(struct clContext * C, int taskCount, clImage * srcImage, clImage * dstImage, clBool withSSIM, clImageSignals * signals)
+{
+    memset(signals, 0, sizeof(*signals));
+
+    if ((srcImage->width != dstImage->width) || (srcImage->height != dstImage->height)) {
+        clContextLogError(C, "Conversion stats unavailable on images of different sizes");
+        return clFalse;
+    }
+
+    // SSIM needs every pixel's luma before its windows can run, so the one signals pass gathers it too
+    int pixelCount = srcImage->width * srcImage->height;
+    float * srcLuma = NULL;
+    float * dstLuma = NULL;
+    if (withSSIM) {
+        srcLuma = clAllocate(sizeof(float) * pixelCount);
+        dstLuma = clAllocate(sizeof(float) * pixelCount);
+    }
+    double errorSquaredSums[2];
+    signalsPass(C, taskCount, srcImage, dstImage, errorSquaredSums, srcLuma, dstLuma);
+
+    if (errorSquaredSums[0] > 0.0) {
+        signals->mseLinear = (float)(errorSquaredSums[0] / pixelCount);
+        signals->psnrLinear = (float)(10.0 * log10(pixelCount / errorSquaredSums[0]));
     } else {
         signals->psnrLinear = INFINITY;
     }
-    if (errorSquaredSumG22 > 0.0f) {
-        signals->mseG22 = errorSquaredSumG22 / (float)pixelCount;
-        signals->psnrG22 = 10.0f * log10f(1.0f / signals->mseG22);
+    if (errorSquaredSums[1] > 0.0) {
+        signals->mseG22 = (float)(errorSquaredSums[1] / pixelCount);
+        signals->psnrG22 = (float)(10.0 * log10(pixelCount / errorSquaredSums[1]));
     } else {
         signals->psnrG22 = INFINITY;
     }
 
-    clFree(srcXYZ);
-    clFree(dstXYZ);
+    if (withSSIM) {
+        calcSSIM(C, taskCount, srcImage->width, srcImage->height, srcLuma, dstLuma, &signals->ssim, &signals->msssim);
+        clFree(srcLuma);
+        clFree(dstLuma);
+    }
     return clTrue;
 }
+
+clBool clImageCalcSignals(struct clContext * C, int taskCount, clImage * srcImage, clImage * dstImage, clImageSignals * signals)
+{
+    return calcSignals(C, taskCount, srcImage, dstImage, clFalse, signals);
+}
+
+clBool clImageCalcSignalsSSIM(struct clContext * C, int taskCount, clImage * srcImage, clImage * dstImage, clImageSignals * signals)
+{
+    return calcSignals(C, taskCount, srcImage, dstImage, clTrue, signals);
+}
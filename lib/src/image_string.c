@@ -665,8 +665,8 @@ clImage * clImageParseString(struct clContext * C, const char * str, int depth,
     char * buffer = clContextStrdup(C, str);
     const char * stripeDelims = "|/";
     char * stripeString;
-    uint16_t * pixelPos;
-    clTransform * fromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, profile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
+    uint8_t * pixelPos;
+    clTransform * fromXYZ = clTransformAcquire(C, NULL, CL_XF_XYZ, 32, profile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
     int luminance = 0;
 
     clContextLog(C, "parse", 0, "Parsing image string (%s)...", clTransformCMMName(C, fromXYZ));
@@ -714,12 +714,12 @@ clImage * clImageParseString(struct clContext * C, const char * str, int depth,
     if (stripeCount > 1) {
         clContextLog(C, "parse", 0, "Compositing final image (stacking vertically): %dx%d", maxStripeWidth, totalStripeHeight);
         image = clImageCreate(C, maxStripeWidth, totalStripeHeight, depth, profile);
-        pixelPos = image->pixels;
+        pixelPos = CL_IMAGE_PIXELS(image);
         for (stripe = stripes; stripe != NULL; stripe = stripe->next) {
             int y;
             for (y = 0; y < stripe->image->height; ++y) {
-                memcpy(pixelPos, &stripe->image->pixels[CL_CHANNELS_PER_PIXEL * y * stripe->image->width], CL_BYTES_PER_PIXEL * stripe->image->width);
-                pixelPos += CL_CHANNELS_PER_PIXEL * image->width;
+                memcpy(pixelPos, CL_IMAGE_ROW(stripe->image, y), (size_t)stripe->image->pixelBytes * stripe->image->width);
+                pixelPos += image->stride;
             }
         }
     } else {
@@ -739,7 +739,7 @@ parseCleanup:
         clFree(deleteme);
     }
     clFree(buffer);
-    clTransformDestroy(C, fromXYZ);
+    clTransformRelease(C, fromXYZ);
     return image;
 }
 
@@ -879,11 +879,7 @@ static clImage * interpretTokens(struct clContext * C, clToken * tokens, int dep
         }
         colorIndex = CL_CLAMP(colorIndex, 0, colorCount - 1);
         getColor(C, tokens, colorIndex, depth, &color);
-        uint16_t * pixel = &image->pixels[4 * verticalPixelIndex];
-        pixel[0] = (uint16_t)(color.r);
-        pixel[1] = (uint16_t)(color.g);
-        pixel[2] = (uint16_t)(color.b);
-        pixel[3] = (uint16_t)(color.a);
+        clImageSetPixel(C, image, verticalPixelIndex % imageWidth, verticalPixelIndex / imageWidth, color.r, color.g, color.b, color.a);
     }
 
     if (rotate != 0) {
@@ -6,6 +6,7 @@
 #include "colorist/transform.h"
 
 #include <math.h>
+#include <string.h>
 
 // (1.0 - 4.0) by 0.05
 #define GAMMA_RANGE_START 20
@@ -72,68 +73,134 @@ static float gammaErrorTerm(float gamma, float * pixels, int pixelCount, float m
 
 typedef struct clGammaErrorTermTask
 {
-    int gammaInt;
-    float gamma;
+    // Either a float image...
     float * pixels;
     int pixelCount;
+
+    // ... or the same image as UNorm codes (RGBA), with codeUsed flagging every code it holds
+    struct clContext * C;
+    const uint8_t * pixels8;   // depth 8
+    const uint16_t * pixels16; // everything else
+    const uint8_t * codeUsed;
+    int codeCount;
+
     float maxChannel;
     float luminanceScale;
-    float outErrorTerm;
+    double * outErrorTerms; // indexed by (gammaInt - GAMMA_RANGE_START)
 } clGammaErrorTermTask;
 
-static void gammaErrorTermTaskFunc(clGammaErrorTermTask * info)
+// Same error terms as gammaErrorTerm(), for the gammas in [start, end) at once. Each channel's error
+// only depends on its code, so it is looked up in a per code table instead of calling powf(), but it
+// is still summed pixel by pixel in float: a different summation order can flip a near tie between
+// two gammas, and the pick has to match clPixelMathColorGrade() exactly.
+static void gammaErrorTermsUNorm(clGammaErrorTermTask * info, int start, int end)
+{
+    struct clContext * C = info->C;
+    const int gammaCount = end - start;
+    const uint16_t lastCode = (uint16_t)(info->codeCount - 1);
+    const float maxCodeFloat = (float)lastCode;
+    float errorTerms[GAMMA_RANGE_END - GAMMA_RANGE_START + 1];
+    float * codeErrorTerms = clAllocate(sizeof(float) * info->codeCount * gammaCount); // [code][gamma - start]
+
+    for (int i = 0; i < gammaCount; ++i) {
+        float gamma = (float)(GAMMA_RANGE_START + start + i) / GAMMA_INT_DIVISOR;
+        float invGamma = 1.0f / gamma;
+        for (int code = 0; code < info->codeCount; ++code) {
+            float scaledChannel;
+            if (!info->codeUsed[code]) {
+                continue;
+            }
+            scaledChannel = (code / maxCodeFloat) * info->luminanceScale; // code / maxCodeFloat matches clPixelMathUNormToFloat()
+            scaledChannel = CL_CLAMP(scaledChannel, 0.0f, 1.0f);
+            codeErrorTerms[(code * gammaCount) + i] =
+                fabsf(scaledChannel - powf(clPixelMathRoundf(powf(scaledChannel, invGamma) * info->maxChannel) / info->maxChannel, gamma));
+        }
+        errorTerms[i] = 0.0f;
+    }
+
+    for (int pixelIndex = 0; pixelIndex < info->pixelCount; ++pixelIndex) {
+        const float * r;
+        const float * g;
+        const float * b;
+        if (info->pixels8) {
+            const uint8_t * pixel = &info->pixels8[(size_t)pixelIndex * 4];
+            r = &codeErrorTerms[pixel[0] * gammaCount];
+            g = &codeErrorTerms[pixel[1] * gammaCount];
+            b = &codeErrorTerms[pixel[2] * gammaCount];
+        } else {
+            // Clamped just like the histogram pass in clPixelMathColorGradeUNorm()
+            const uint16_t * pixel = &info->pixels16[(size_t)pixelIndex * 4];
+            r = &codeErrorTerms[((pixel[0] <= lastCode) ? pixel[0] : lastCode) * gammaCount];
+            g = &codeErrorTerms[((pixel[1] <= lastCode) ? pixel[1] : lastCode) * gammaCount];
+            b = &codeErrorTerms[((pixel[2] <= lastCode) ? pixel[2] : lastCode) * gammaCount];
+        }
+        for (int i = 0; i < gammaCount; ++i) {
+            errorTerms[i] += r[i];
+            errorTerms[i] += g[i];
+            errorTerms[i] += b[i];
+        }
+    }
+
+    for (int i = 0; i < gammaCount; ++i) {
+        info->outErrorTerms[start + i] = errorTerms[i];
+    }
+    clFree(codeErrorTerms);
+}
+
+static void gammaErrorTermTaskFunc(void * userData, int start, int end)
 {
-    info->outErrorTerm = gammaErrorTerm(info->gamma, info->pixels, info->pixelCount, info->maxChannel, info->luminanceScale);
+    clGammaErrorTermTask * info = (clGammaErrorTermTask *)userData;
+    if (info->codeUsed) {
+        gammaErrorTermsUNorm(info, start, end);
+        return;
+    }
+    for (int i = start; i < end; ++i) {
+        float gamma = (float)(GAMMA_RANGE_START + i) / GAMMA_INT_DIVISOR;
+        info->outErrorTerms[i] = gammaErrorTerm(gamma, info->pixels, info->pixelCount, info->maxChannel, info->luminanceScale);
+    }
 }
 
-void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile * pixelProfile, float * pixels, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose)
+// maxPixel is the first pixel holding the largest single RGB channel (maxChannel) in the image, at index maxPixelIndex.
+static void colorGrade(struct clContext * C,
+                       int taskCount,
+                       struct clProfile * pixelProfile,
+                       clGammaErrorTermTask * info,
+                       float maxPixel[4],
+                       int maxPixelIndex,
+                       float maxChannel,
+                       int imageWidth,
+                       int srcLuminance,
+                       int dstColorDepth,
+                       int * outLuminance,
+                       float * outGamma,
+                       clBool verbose)
 {
     int maxLuminance = 0;
     float bestGamma = 0.0f;
 
     // Find max luminance
     if (*outLuminance == 0) {
-        float * pixel;
-        int indexWithMaxChannel = 0;
-        float maxChannel = 0.0f;
-        float maxPixel[4];
+        float whitePixel[4];
         float xyz[3];
         int pixelX, pixelY;
         float pixelLuminance, maxLuminanceFloat;
 
-        clTransform * toXYZ = clTransformCreate(C, pixelProfile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+        clTransform * toXYZ = clTransformAcquire(C, pixelProfile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
 
-        pixel = pixels;
-        for (int i = 0; i < pixelCount; ++i) {
-            if (maxChannel < pixel[0]) {
-                indexWithMaxChannel = i;
-                maxChannel = pixel[0];
-            }
-            if (maxChannel < pixel[1]) {
-                indexWithMaxChannel = i;
-                maxChannel = pixel[1];
-            }
-            if (maxChannel < pixel[2]) {
-                indexWithMaxChannel = i;
-                maxChannel = pixel[2];
-            }
-            pixel += 4;
-        }
-
-        clTransformRun(C, toXYZ, 1, &pixels[indexWithMaxChannel * 4], xyz, 1);
-        pixelX = indexWithMaxChannel % imageWidth;
-        pixelY = indexWithMaxChannel / imageWidth;
+        clTransformRun(C, toXYZ, 1, maxPixel, xyz, 1);
+        pixelX = maxPixelIndex % imageWidth;
+        pixelY = maxPixelIndex / imageWidth;
         pixelLuminance = xyz[1];
 
-        maxPixel[0] = maxChannel;
-        maxPixel[1] = maxChannel;
-        maxPixel[2] = maxChannel;
-        maxPixel[3] = 1.0f;
-        clTransformRun(C, toXYZ, 1, maxPixel, xyz, 1);
+        whitePixel[0] = maxChannel;
+        whitePixel[1] = maxChannel;
+        whitePixel[2] = maxChannel;
+        whitePixel[3] = 1.0f;
+        clTransformRun(C, toXYZ, 1, whitePixel, xyz, 1);
         maxLuminanceFloat = xyz[1];
         maxLuminance = (int)clPixelMathRoundf(maxLuminanceFloat);
 
-        clTransformDestroy(C, toXYZ);
+        clTransformRelease(C, toXYZ);
 
         clContextLog(C, "grading", 1, "Found pixel (%d,%d) with largest single RGB channel (%g nits, %g nits if white).", pixelX, pixelY, pixelLuminance, maxLuminanceFloat);
     } else {
@@ -143,54 +210,32 @@ void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile
 
     // Find best gamma
     if (*outGamma <= 0.0f) {
-        float luminanceScale = (float)srcLuminance / maxLuminance;
-        int gammaInt;
+        double errorTerms[GAMMA_RANGE_END - GAMMA_RANGE_START + 1];
         int minGammaInt = 0;
-        float minErrorTerm = -1.0f;
-        float maxChannel = (float)((1 << dstColorDepth) - 1);
-        clTask ** tasks;
-        clGammaErrorTermTask * infos;
-        int tasksInFlight = 0;
+        double minErrorTerm = -1.0;
+        int chunkSize;
         COLORIST_ASSERT(taskCount);
 
         clContextLog(C, "grading", 1, "Using %d thread%s to find best gamma.", taskCount, (taskCount == 1) ? "" : "s");
 
-        tasks = clAllocate(taskCount * sizeof(clTask *));
-        infos = clAllocate(taskCount * sizeof(clGammaErrorTermTask));
-        for (gammaInt = GAMMA_RANGE_START; gammaInt <= GAMMA_RANGE_END; ++gammaInt) {
-            float gammaAttempt = (float)gammaInt / GAMMA_INT_DIVISOR;
-
-            infos[tasksInFlight].gammaInt = gammaInt;
-            infos[tasksInFlight].gamma = gammaAttempt;
-            infos[tasksInFlight].pixels = pixels;
-            infos[tasksInFlight].pixelCount = pixelCount;
-            infos[tasksInFlight].maxChannel = maxChannel;
-            infos[tasksInFlight].luminanceScale = luminanceScale;
-            infos[tasksInFlight].outErrorTerm = 0;
-            tasks[tasksInFlight] = clTaskCreate(C, (clTaskFunc)gammaErrorTermTaskFunc, &infos[tasksInFlight]);
-            ++tasksInFlight;
-
-            if ((tasksInFlight == taskCount) || (gammaInt == GAMMA_RANGE_END)) {
-                for (int i = 0; i < tasksInFlight; ++i) {
-                    clTaskJoin(C, tasks[i]);
-                    if (minErrorTerm < 0.0f) {
-                        minErrorTerm = infos[i].outErrorTerm;
-                        minGammaInt = infos[i].gammaInt;
-                    } else if (minErrorTerm > infos[i].outErrorTerm) {
-                        minErrorTerm = infos[i].outErrorTerm;
-                        minGammaInt = infos[i].gammaInt;
-                    }
-                    if (verbose)
-                        clContextLog(C, "grading", 2, "attempt: gamma %.3g, err: %g     best -> gamma: %g, err: %g", infos[i].gamma, infos[i].outErrorTerm, (float)minGammaInt / GAMMA_INT_DIVISOR, minErrorTerm);
-                    clTaskDestroy(C, tasks[i]);
-                }
-                tasksInFlight = 0;
+        info->maxChannel = (float)((1 << dstColorDepth) - 1);
+        info->luminanceScale = (float)srcLuminance / maxLuminance;
+        info->outErrorTerms = errorTerms;
+        // The UNorm path walks the whole image once per chunk of gammas, so hand each thread a single chunk
+        chunkSize = info->codeUsed ? ((GAMMA_RANGE_END - GAMMA_RANGE_START + 1) + taskCount - 1) / taskCount : 1;
+        clTaskParallelFor(C, taskCount, GAMMA_RANGE_END - GAMMA_RANGE_START + 1, chunkSize, gammaErrorTermTaskFunc, info);
+
+        for (int gammaInt = GAMMA_RANGE_START; gammaInt <= GAMMA_RANGE_END; ++gammaInt) {
+            double errorTerm = errorTerms[gammaInt - GAMMA_RANGE_START];
+            if ((minErrorTerm < 0.0) || (minErrorTerm > errorTerm)) {
+                minErrorTerm = errorTerm;
+                minGammaInt = gammaInt;
             }
+            if (verbose)
+                clContextLog(C, "grading", 2, "attempt: gamma %.3g, err: %g     best -> gamma: %g, err: %g", (float)gammaInt / GAMMA_INT_DIVISOR, errorTerm, (float)minGammaInt / GAMMA_INT_DIVISOR, minErrorTerm);
         }
         bestGamma = (float)minGammaInt / GAMMA_INT_DIVISOR;
         clContextLog(C, "grading", 1, "Found best gamma: %g", bestGamma);
-        clFree(tasks);
-        clFree(infos);
     } else {
         bestGamma = *outGamma;
         clContextLog(C, "grading", 1, "Using requested gamma: %g", bestGamma);
@@ -199,3 +244,163 @@ void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile
     *outLuminance = maxLuminance;
     *outGamma = bestGamma;
 }
+
+void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile * pixelProfile, float * pixels, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose)
+{
+    clGammaErrorTermTask info;
+    int indexWithMaxChannel = 0;
+    float maxChannel = 0.0f;
+
+    if (*outLuminance == 0) {
+        float * pixel = pixels;
+        for (int i = 0; i < pixelCount; ++i) {
+            if (maxChannel < pixel[0]) {
+                indexWithMaxChannel = i;
+                maxChannel = pixel[0];
+            }
+            if (maxChannel < pixel[1]) {
+                indexWithMaxChannel = i;
+                maxChannel = pixel[1];
+            }
+            if (maxChannel < pixel[2]) {
+                indexWithMaxChannel = i;
+                maxChannel = pixel[2];
+            }
+            pixel += 4;
+        }
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.pixels = pixels;
+    info.pixelCount = pixelCount;
+    colorGrade(C, taskCount, pixelProfile, &info, &pixels[indexWithMaxChannel * 4], indexWithMaxChannel, maxChannel, imageWidth, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
+}
+
+typedef struct clGradeHistogramTask
+{
+    const uint8_t * pixels8;   // depth 8
+    const uint16_t * pixels16; // everything else
+    int pixelCount;
+    int binCount;
+    int sliceCount;
+    uint64_t * sliceCounts;   // sliceCount * binCount
+    int * sliceMaxIndex;      // first pixel in the slice holding sliceMaxCode
+    uint16_t * sliceMaxCode;  // largest single RGB channel in the slice
+} clGradeHistogramTask;
+
+static void gradeHistogramTaskFunc(void * userData, int start, int end)
+{
+    clGradeHistogramTask * info = (clGradeHistogramTask *)userData;
+    for (int slice = start; slice < end; ++slice) {
+        int first = (int)(((int64_t)info->pixelCount * slice) / info->sliceCount);
+        int last = (int)(((int64_t)info->pixelCount * (slice + 1)) / info->sliceCount);
+        uint64_t * counts = &info->sliceCounts[(size_t)slice * info->binCount];
+        const uint16_t lastBin = (uint16_t)(info->binCount - 1);
+        int maxIndex = first;
+        uint16_t maxCode = 0;
+
+        for (int i = first; i < last; ++i) {
+            uint16_t r, g, b;
+            if (info->pixels8) {
+                const uint8_t * pixel = &info->pixels8[(size_t)i * 4];
+                r = pixel[0];
+                g = pixel[1];
+                b = pixel[2];
+            } else {
+                // Clamp garbage in the unused high bits (such as pixels a decoder never wrote), just like
+                // unpackUNormEOTFTable() does
+                const uint16_t * pixel = &info->pixels16[(size_t)i * 4];
+                r = (pixel[0] <= lastBin) ? pixel[0] : lastBin;
+                g = (pixel[1] <= lastBin) ? pixel[1] : lastBin;
+                b = (pixel[2] <= lastBin) ? pixel[2] : lastBin;
+            }
+            ++counts[r];
+            ++counts[g];
+            ++counts[b];
+            if (maxCode < r) {
+                maxIndex = i;
+                maxCode = r;
+            }
+            if (maxCode < g) {
+                maxIndex = i;
+                maxCode = g;
+            }
+            if (maxCode < b) {
+                maxIndex = i;
+                maxCode = b;
+            }
+        }
+        info->sliceMaxIndex[slice] = maxIndex;
+        info->sliceMaxCode[slice] = maxCode;
+    }
+}
+
+void clPixelMathColorGradeUNorm(struct clContext * C, int taskCount, struct clProfile * pixelProfile, const void * pixels, int depth, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose)
+{
+    clGammaErrorTermTask info;
+    clGradeHistogramTask histogramInfo;
+    float maxCodeFloat = (float)((1 << depth) - 1);
+    int binCount = 1 << depth;
+    int indexWithMaxChannel = 0;
+    uint16_t maxCode = 0;
+    float maxPixel[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    uint8_t * codeUsed = NULL;
+
+    memset(&info, 0, sizeof(info));
+    if ((*outLuminance == 0) || (*outGamma <= 0.0f)) {
+        // One pass over the image: how often each code value shows up in R, G or B, and where the largest one lives
+        histogramInfo.pixels8 = (depth == 8) ? (const uint8_t *)pixels : NULL;
+        histogramInfo.pixels16 = (depth == 8) ? NULL : (const uint16_t *)pixels;
+        histogramInfo.pixelCount = pixelCount;
+        histogramInfo.binCount = binCount;
+        histogramInfo.sliceCount = (taskCount > 1) ? taskCount : 1;
+        histogramInfo.sliceCounts = clAllocate(sizeof(uint64_t) * binCount * histogramInfo.sliceCount);
+        memset(histogramInfo.sliceCounts, 0, sizeof(uint64_t) * binCount * histogramInfo.sliceCount);
+        histogramInfo.sliceMaxIndex = clAllocate(sizeof(int) * histogramInfo.sliceCount);
+        histogramInfo.sliceMaxCode = clAllocate(sizeof(uint16_t) * histogramInfo.sliceCount);
+        clTaskParallelFor(C, taskCount, histogramInfo.sliceCount, 1, gradeHistogramTaskFunc, &histogramInfo);
+
+        for (int slice = 0; slice < histogramInfo.sliceCount; ++slice) {
+            if (maxCode < histogramInfo.sliceMaxCode[slice]) {
+                indexWithMaxChannel = histogramInfo.sliceMaxIndex[slice];
+                maxCode = histogramInfo.sliceMaxCode[slice];
+            }
+        }
+
+        codeUsed = clAllocate(sizeof(uint8_t) * binCount);
+        for (int code = 0; code < binCount; ++code) {
+            uint64_t count = 0;
+            for (int slice = 0; slice < histogramInfo.sliceCount; ++slice) {
+                count += histogramInfo.sliceCounts[((size_t)slice * binCount) + code];
+            }
+            codeUsed[code] = (count > 0) ? 1 : 0;
+        }
+
+        clFree(histogramInfo.sliceCounts);
+        clFree(histogramInfo.sliceMaxIndex);
+        clFree(histogramInfo.sliceMaxCode);
+
+        if (pixelCount > 0) {
+            for (int i = 0; i < 4; ++i) {
+                if (depth == 8) {
+                    maxPixel[i] = histogramInfo.pixels8[(indexWithMaxChannel * 4) + i] / maxCodeFloat;
+                } else {
+                    uint16_t code = histogramInfo.pixels16[(indexWithMaxChannel * 4) + i];
+                    maxPixel[i] = ((code < binCount) ? code : (binCount - 1)) / maxCodeFloat;
+                }
+            }
+        }
+    }
+
+    info.C = C;
+    info.pixels8 = (depth == 8) ? (const uint8_t *)pixels : NULL;
+    info.pixels16 = (depth == 8) ? NULL : (const uint16_t *)pixels;
+    info.pixelCount = pixelCount;
+    info.codeUsed = codeUsed;
+    info.codeCount = binCount;
+    colorGrade(C, taskCount, pixelProfile, &info, maxPixel, indexWithMaxChannel, maxCode / maxCodeFloat, imageWidth, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
+
+    if (codeUsed) {
+        clFree(codeUsed);
+    }
+}
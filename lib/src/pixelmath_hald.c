@@ -0,0 +1,147 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "colorist/pixelmath.h"
+
+#include "colorist/context.h"
+
+#include <string.h>
+
+// SSE2 is part of every x86-64 CPU, so no runtime dispatch is needed for it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define COLORIST_HALD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+clHaldCLUT * clHaldCLUTCreate(struct clContext * C, const float * haldPixels, int haldDims)
+{
+    int entryCount = haldDims * haldDims * haldDims;
+    clHaldCLUT * clut = clAllocateStruct(clHaldCLUT);
+    clut->dims = haldDims;
+    clut->lattice = clAllocate(sizeof(float) * CL_HALD_LATTICE_STRIDE * entryCount);
+    for (int i = 0; i < entryCount; ++i) {
+        const float * src = &haldPixels[i * 4];
+        float * dst = &clut->lattice[i * CL_HALD_LATTICE_STRIDE];
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 0.0f;
+    }
+    return clut;
+}
+
+void clHaldCLUTDestroy(struct clContext * C, clHaldCLUT * clut)
+{
+    clFree(clut->lattice);
+    clFree(clut);
+}
+
+// Finds the lattice cell containing src and the tetrahedron within it (the cell is split along its
+// black-white diagonal). Returns the offset of the cell's first corner; offsets[] gets the two corners
+// between it and the opposite corner (offsets[2]), and weights[] the barycentric weights of all four.
+static int findTetrahedron(const clHaldCLUT * clut, const float src[4], int offsets[3], float weights[4])
+{
+    int dims = clut->dims;
+    float maxIndex = (float)(dims - 1);
+    float pos[3];
+    int cell[3];
+    float frac[3];
+    for (int c = 0; c < 3; ++c) {
+        pos[c] = CL_CLAMP(src[c], 0.0f, 1.0f) * maxIndex;
+        cell[c] = (int)pos[c];
+        if (cell[c] > (dims - 2)) {
+            cell[c] = dims - 2;
+        }
+        frac[c] = pos[c] - (float)cell[c];
+    }
+
+    int stepR = CL_HALD_LATTICE_STRIDE;
+    int stepG = stepR * dims;
+    int stepB = stepG * dims;
+    float fr = frac[0];
+    float fg = frac[1];
+    float fb = frac[2];
+    if (fr >= fg) {
+        if (fg >= fb) {
+            offsets[0] = stepR;
+            offsets[1] = stepR + stepG;
+            weights[0] = 1.0f - fr;
+            weights[1] = fr - fg;
+            weights[2] = fg - fb;
+            weights[3] = fb;
+        } else if (fr >= fb) {
+            offsets[0] = stepR;
+            offsets[1] = stepR + stepB;
+            weights[0] = 1.0f - fr;
+            weights[1] = fr - fb;
+            weights[2] = fb - fg;
+            weights[3] = fg;
+        } else {
+            offsets[0] = stepB;
+            offsets[1] = stepR + stepB;
+            weights[0] = 1.0f - fb;
+            weights[1] = fb - fr;
+            weights[2] = fr - fg;
+            weights[3] = fg;
+        }
+    } else {
+        if (fr >= fb) {
+            offsets[0] = stepG;
+            offsets[1] = stepR + stepG;
+            weights[0] = 1.0f - fg;
+            weights[1] = fg - fr;
+            weights[2] = fr - fb;
+            weights[3] = fb;
+        } else if (fg >= fb) {
+            offsets[0] = stepG;
+            offsets[1] = stepG + stepB;
+            weights[0] = 1.0f - fg;
+            weights[1] = fg - fb;
+            weights[2] = fb - fr;
+            weights[3] = fr;
+        } else {
+            offsets[0] = stepB;
+            offsets[1] = stepG + stepB;
+            weights[0] = 1.0f - fb;
+            weights[1] = fb - fg;
+            weights[2] = fg - fr;
+            weights[3] = fr;
+        }
+    }
+    offsets[2] = stepR + stepG + stepB;
+    return (cell[0] * stepR) + (cell[1] * stepG) + (cell[2] * stepB);
+}
+
+void clPixelMathHaldCLUTApply(struct clContext * C, const clHaldCLUT * clut, const float * srcPixels, float * dstPixels, int pixelCount)
+{
+    COLORIST_UNUSED(C);
+
+    for (int i = 0; i < pixelCount; ++i) {
+        const float * src = &srcPixels[i * 4];
+        float * dst = &dstPixels[i * 4];
+        int offsets[3];
+        float weights[4];
+        const float * v0 = clut->lattice + findTetrahedron(clut, src, offsets, weights);
+        const float * v1 = v0 + offsets[0];
+        const float * v2 = v0 + offsets[1];
+        const float * v3 = v0 + offsets[2];
+        float alpha = src[3]; // src and dst may alias
+
+#if defined(COLORIST_HALD_SSE2)
+        __m128 sum = _mm_mul_ps(_mm_loadu_ps(v0), _mm_set1_ps(weights[0]));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(v1), _mm_set1_ps(weights[1])));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(v2), _mm_set1_ps(weights[2])));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(v3), _mm_set1_ps(weights[3])));
+        _mm_storeu_ps(dst, sum);
+#else
+        for (int c = 0; c < 3; ++c) {
+            dst[c] = (v0[c] * weights[0]) + (v1[c] * weights[1]) + (v2[c] * weights[2]) + (v3[c] * weights[3]);
+        }
+#endif
+        dst[3] = alpha;
+    }
+}
@@ -1,39 +1,381 @@
 #include "colorist/pixelmath.h"
 
 #include "colorist/context.h"
+#include "colorist/image.h"
+#include "colorist/task.h"
 
-#include "stb_image_resize.h"
-
+#include <math.h>
 #include <string.h>
 
-void clPixelMathResize(struct clContext * C, int srcW, int srcH, float * srcPixels, int dstW, int dstH, float * dstPixels, clFilter filter)
+// Destination rows filtered per task; each band re-filters the few source rows it shares with its neighbors
+#define CL_RESIZE_BAND_ROWS 32
+
+// ------------------------------------------------------------------------------------------------
+// Filter kernels (same shapes and supports as stb_image_resize)
+
+static float filterBox(float x, float scale)
+{
+    // A trapezoid with 1-pixel wide ramps
+    float halfScale = scale / 2;
+    float t = 0.5f + halfScale;
+    float r = 0.5f - halfScale;
+
+    x = fabsf(x);
+    if (x >= t) {
+        return 0.0f;
+    }
+    if (x <= r) {
+        return 1.0f;
+    }
+    return (t - x) / scale;
+}
+
+static float filterTriangle(float x, float scale)
+{
+    COLORIST_UNUSED(scale);
+
+    x = fabsf(x);
+    return (x <= 1.0f) ? (1.0f - x) : 0.0f;
+}
+
+static float filterCubicBSpline(float x, float scale)
 {
-    COLORIST_UNUSED(C);
-
-    if (filter == CL_FILTER_NEAREST) {
-        // colorist's very own super-obvious nearest neighbor implementation
-        float scaleW = (float)srcW / (float)dstW;
-        float scaleH = (float)srcH / (float)dstH;
-        for (int j = 0; j < dstH; ++j) {
-            for (int i = 0; i < dstW; ++i) {
-                float * srcPixel;
-                float * dstPixel;
-                int srcX = (int)(((float)i + 0.5f) * scaleW);
-                int srcY = (int)(((float)j + 0.5f) * scaleH);
-                srcX = CL_CLAMP(srcX, 0, srcW - 1);
-                srcY = CL_CLAMP(srcY, 0, srcH - 1);
-                srcPixel = &srcPixels[4 * (srcX + (srcY * srcW))];
-                dstPixel = &dstPixels[4 * (i + (j * dstW))];
-                memcpy(dstPixel, srcPixel, 4 * sizeof(float));
+    COLORIST_UNUSED(scale);
+
+    x = fabsf(x);
+    if (x < 1.0f) {
+        return (4 + x * x * (3 * x - 6)) / 6;
+    } else if (x < 2.0f) {
+        return (8 + x * (-12 + x * (6 - x))) / 6;
+    }
+    return 0.0f;
+}
+
+static float filterCatmullRom(float x, float scale)
+{
+    COLORIST_UNUSED(scale);
+
+    x = fabsf(x);
+    if (x < 1.0f) {
+        return 1 - x * x * (2.5f - 1.5f * x);
+    } else if (x < 2.0f) {
+        return 2 - x * (4 + x * (0.5f * x - 2.5f));
+    }
+    return 0.0f;
+}
+
+static float filterMitchell(float x, float scale)
+{
+    COLORIST_UNUSED(scale);
+
+    x = fabsf(x);
+    if (x < 1.0f) {
+        return (16 + x * x * (21 * x - 36)) / 18;
+    } else if (x < 2.0f) {
+        return (32 + x * (-60 + x * (36 - 7 * x))) / 18;
+    }
+    return 0.0f;
+}
+
+typedef float (* clResizeFilterFunc)(float x, float scale);
+
+static clResizeFilterFunc filterFunc(clFilter filter, float *support, float scale)
+{
+    switch (filter) {
+        case CL_FILTER_BOX:
+            *support = 0.5f + (scale / 2);
+            return filterBox;
+        case CL_FILTER_TRIANGLE:
+            *support = 1.0f;
+            return filterTriangle;
+        case CL_FILTER_CUBICBSPLINE:
+            *support = 2.0f;
+            return filterCubicBSpline;
+        case CL_FILTER_CATMULLROM:
+            *support = 2.0f;
+            return filterCatmullRom;
+        case CL_FILTER_MITCHELL:
+        default:
+            *support = 2.0f;
+            return filterMitchell;
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Taps
+
+static void calcTaps(struct clContext * C, clResizeTaps * taps, int srcSize, int dstSize, clFilter filter)
+{
+    float scale = (float)dstSize / (float)srcSize;
+    clBool upsampling = (scale > 1.0f) ? clTrue : clFalse;
+    if (filter == CL_FILTER_AUTO) {
+        filter = upsampling ? CL_FILTER_CATMULLROM : CL_FILTER_MITCHELL;
+    }
+
+    // Upsampling evaluates the kernel in source pixels, downsampling stretches it over 1/scale source pixels
+    float kernelScale = upsampling ? (1.0f / scale) : scale;
+    float support = 0.0f;
+    clResizeFilterFunc func = NULL;
+    if (filter != CL_FILTER_NEAREST) {
+        func = filterFunc(filter, &support, kernelScale);
+    }
+    float radius = upsampling ? support : (support / scale);
+
+    taps->srcSize = srcSize;
+    taps->dstSize = dstSize;
+    taps->maxTaps = (filter == CL_FILTER_NEAREST) ? 1 : ((int)ceilf(radius * 2) + 2);
+    if (taps->maxTaps > srcSize) {
+        taps->maxTaps = srcSize; // edge clamping folds everything else onto the ends
+    }
+    taps->first = clAllocate(sizeof(int) * dstSize);
+    taps->count = clAllocate(sizeof(int) * dstSize);
+    taps->weights = clAllocate(sizeof(float) * dstSize * taps->maxTaps);
+    memset(taps->weights, 0, sizeof(float) * dstSize * taps->maxTaps);
+
+    for (int dst = 0; dst < dstSize; ++dst) {
+        float * weights = &taps->weights[dst * taps->maxTaps];
+
+        if (filter == CL_FILTER_NEAREST) {
+            int src = (int)(((float)dst + 0.5f) * ((float)srcSize / (float)dstSize));
+            taps->first[dst] = CL_CLAMP(src, 0, srcSize - 1);
+            taps->count[dst] = 1;
+            weights[0] = 1.0f;
+            continue;
+        }
+
+        float center = ((float)dst + 0.5f) / scale; // in source pixels
+        int lo = (int)floorf(center - radius);
+        int hi = (int)ceilf(center + radius);
+        int first = CL_CLAMP(lo, 0, srcSize - 1);
+        int last = CL_CLAMP(hi, 0, srcSize - 1);
+        COLORIST_ASSERT((last - first + 1) <= taps->maxTaps);
+
+        float total = 0.0f;
+        for (int src = lo; src <= hi; ++src) {
+            float w;
+            if (upsampling) {
+                w = func(center - ((float)src + 0.5f), kernelScale);
+            } else {
+                w = func((((float)src + 0.5f) * scale) - ((float)dst + 0.5f), kernelScale) * scale;
             }
+            int clamped = CL_CLAMP(src, 0, srcSize - 1);
+            weights[clamped - first] += w;
+            total += w;
+        }
+
+        // Skip zero weights on either end
+        int count = last - first + 1;
+        int skip = 0;
+        while ((skip < (count - 1)) && (weights[skip] == 0.0f)) {
+            ++skip;
+        }
+        if (skip > 0) {
+            memmove(weights, weights + skip, sizeof(float) * (count - skip));
+            memset(weights + count - skip, 0, sizeof(float) * skip);
+            first += skip;
+            count -= skip;
+        }
+        while ((count > 1) && (weights[count - 1] == 0.0f)) {
+            --count;
+        }
+
+        float normalize = (total != 0.0f) ? (1.0f / total) : 0.0f;
+        for (int i = 0; i < count; ++i) {
+            weights[i] *= normalize;
+        }
+        taps->first[dst] = first;
+        taps->count[dst] = count;
+    }
+}
+
+static void freeTaps(struct clContext * C, clResizeTaps * taps)
+{
+    clFree(taps->first);
+    clFree(taps->count);
+    clFree(taps->weights);
+}
+
+clResizePlan * clPixelMathResizePlanCreate(struct clContext * C, int srcW, int srcH, int dstW, int dstH, clFilter filter)
+{
+    clResizePlan * plan = clAllocateStruct(clResizePlan);
+    plan->filter = filter;
+    plan->premultiply = (filter != CL_FILTER_NEAREST) ? clTrue : clFalse;
+    calcTaps(C, &plan->horizontal, srcW, dstW, filter);
+    calcTaps(C, &plan->vertical, srcH, dstH, filter);
+    return plan;
+}
+
+void clPixelMathResizePlanDestroy(struct clContext * C, clResizePlan * plan)
+{
+    freeTaps(C, &plan->horizontal);
+    freeTaps(C, &plan->vertical);
+    clFree(plan);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Rows
+
+static void loadRow(const clResizeBuffer * src, int y, int width, clBool premultiply, float * outPixels)
+{
+    const uint8_t * row = src->pixels + ((size_t)y * src->stride);
+    int channelCount = width * CL_CHANNELS_PER_PIXEL;
+    if (src->depth == 32) {
+        memcpy(outPixels, row, sizeof(float) * channelCount);
+    } else if (src->depth == 8) {
+        for (int i = 0; i < channelCount; ++i) {
+            outPixels[i] = row[i] / 255.0f;
+        }
+    } else {
+        const uint16_t * row16 = (const uint16_t *)row;
+        float maxChannel = (float)((1 << src->depth) - 1);
+        for (int i = 0; i < channelCount; ++i) {
+            outPixels[i] = row16[i] / maxChannel;
+        }
+    }
+
+    if (premultiply) {
+        for (int i = 0; i < width; ++i) {
+            float * pixel = &outPixels[i * CL_CHANNELS_PER_PIXEL];
+            pixel[0] *= pixel[3];
+            pixel[1] *= pixel[3];
+            pixel[2] *= pixel[3];
+        }
+    }
+}
+
+static void storeRow(clResizeBuffer * dst, int y, int width, clBool premultiply, float * pixels)
+{
+    uint8_t * row = dst->pixels + ((size_t)y * dst->stride);
+    int channelCount = width * CL_CHANNELS_PER_PIXEL;
+
+    if (premultiply) {
+        for (int i = 0; i < width; ++i) {
+            float * pixel = &pixels[i * CL_CHANNELS_PER_PIXEL];
+            float reciprocal = (pixel[3] != 0.0f) ? (1.0f / pixel[3]) : 0.0f;
+            pixel[0] *= reciprocal;
+            pixel[1] *= reciprocal;
+            pixel[2] *= reciprocal;
+        }
+    }
+
+    if (dst->depth == 32) {
+        memcpy(row, pixels, sizeof(float) * channelCount);
+    } else if (dst->depth == 8) {
+        for (int i = 0; i < channelCount; ++i) {
+            row[i] = (uint8_t)clPixelMathRoundf(CL_CLAMP(pixels[i], 0.0f, 1.0f) * 255.0f);
         }
     } else {
-        // use STB!
-        stbir_resize_float_generic(
-            srcPixels, srcW, srcH, srcW * 4 * sizeof(float),
-            dstPixels, dstW, dstH, dstW * 4 * sizeof(float),
-            4, 3, 0,
-            STBIR_EDGE_CLAMP, (stbir_filter)filter, STBIR_COLORSPACE_LINEAR,
-            NULL);
+        uint16_t * row16 = (uint16_t *)row;
+        float maxChannel = (float)((1 << dst->depth) - 1);
+        for (int i = 0; i < channelCount; ++i) {
+            row16[i] = (uint16_t)clPixelMathRoundf(CL_CLAMP(pixels[i], 0.0f, 1.0f) * maxChannel);
+        }
     }
 }
+
+static void filterRow(const clResizeTaps * taps, const float * srcPixels, float * dstPixels)
+{
+    for (int dst = 0; dst < taps->dstSize; ++dst) {
+        const float * weights = &taps->weights[dst * taps->maxTaps];
+        const float * src = &srcPixels[taps->first[dst] * CL_CHANNELS_PER_PIXEL];
+        float r = 0.0f, g = 0.0f, b = 0.0f, a = 0.0f;
+        for (int i = 0; i < taps->count[dst]; ++i) {
+            float w = weights[i];
+            r += w * src[0];
+            g += w * src[1];
+            b += w * src[2];
+            a += w * src[3];
+            src += CL_CHANNELS_PER_PIXEL;
+        }
+        float * dstPixel = &dstPixels[dst * CL_CHANNELS_PER_PIXEL];
+        dstPixel[0] = r;
+        dstPixel[1] = g;
+        dstPixel[2] = b;
+        dstPixel[3] = a;
+    }
+}
+
+typedef struct clResizeBandTask
+{
+    clContext * C;
+    clResizePlan * plan;
+    const clResizeBuffer * src;
+    clResizeBuffer * dst;
+} clResizeBandTask;
+
+static void resizeBandFunc(void * userData, int startRow, int endRow)
+{
+    clResizeBandTask * info = (clResizeBandTask *)userData;
+    clContext * C = info->C;
+    const clResizeTaps * horizontal = &info->plan->horizontal;
+    const clResizeTaps * vertical = &info->plan->vertical;
+    clBool premultiply = info->plan->premultiply;
+    int dstChannelCount = horizontal->dstSize * CL_CHANNELS_PER_PIXEL;
+
+    // Source rows this band reads
+    int firstSrcRow = vertical->first[startRow];
+    int lastSrcRow = firstSrcRow;
+    for (int y = startRow; y < endRow; ++y) {
+        int last = vertical->first[y] + vertical->count[y] - 1;
+        if (firstSrcRow > vertical->first[y]) {
+            firstSrcRow = vertical->first[y];
+        }
+        if (lastSrcRow < last) {
+            lastSrcRow = last;
+        }
+    }
+
+    // Filter them horizontally once
+    float * srcRow = clAllocate(sizeof(float) * CL_CHANNELS_PER_PIXEL * horizontal->srcSize);
+    float * filteredRows = clAllocate(sizeof(float) * dstChannelCount * (lastSrcRow - firstSrcRow + 1));
+    for (int y = firstSrcRow; y <= lastSrcRow; ++y) {
+        loadRow(info->src, y, horizontal->srcSize, premultiply, srcRow);
+        filterRow(horizontal, srcRow, &filteredRows[(size_t)(y - firstSrcRow) * dstChannelCount]);
+    }
+    clFree(srcRow);
+
+    // Then combine them vertically
+    float * dstRow = clAllocate(sizeof(float) * dstChannelCount);
+    for (int y = startRow; y < endRow; ++y) {
+        const float * weights = &vertical->weights[y * vertical->maxTaps];
+        const float * rows = &filteredRows[(size_t)(vertical->first[y] - firstSrcRow) * dstChannelCount];
+        memset(dstRow, 0, sizeof(float) * dstChannelCount);
+        for (int i = 0; i < vertical->count[y]; ++i) {
+            float w = weights[i];
+            const float * row = &rows[(size_t)i * dstChannelCount];
+            for (int c = 0; c < dstChannelCount; ++c) {
+                dstRow[c] += w * row[c];
+            }
+        }
+        storeRow(info->dst, y, horizontal->dstSize, premultiply, dstRow);
+    }
+    clFree(dstRow);
+    clFree(filteredRows);
+}
+
+void clPixelMathResizeRun(struct clContext * C, clResizePlan * plan, int taskCount, const clResizeBuffer * src, clResizeBuffer * dst)
+{
+    clResizeBandTask info;
+    info.C = C;
+    info.plan = plan;
+    info.src = src;
+    info.dst = dst;
+    clTaskParallelFor(C, taskCount, plan->vertical.dstSize, CL_RESIZE_BAND_ROWS, resizeBandFunc, &info);
+}
+
+void clPixelMathResize(struct clContext * C, int srcW, int srcH, float * srcPixels, int dstW, int dstH, float * dstPixels, clFilter filter)
+{
+    clResizeBuffer src;
+    src.pixels = (uint8_t *)srcPixels;
+    src.stride = srcW * CL_CHANNELS_PER_PIXEL * sizeof(float);
+    src.depth = 32;
+
+    clResizeBuffer dst;
+    dst.pixels = (uint8_t *)dstPixels;
+    dst.stride = dstW * CL_CHANNELS_PER_PIXEL * sizeof(float);
+    dst.depth = 32;
+
+    clResizePlan * plan = clPixelMathResizePlanCreate(C, srcW, srcH, dstW, dstH, filter);
+    clPixelMathResizeRun(C, plan, C->params.jobs, &src, &dst);
+    clPixelMathResizePlanDestroy(C, plan);
+}
@@ -2,6 +2,12 @@
 
 #include "colorist/context.h"
 
+// SSE2 is part of every x86-64 CPU, so no runtime dispatch is needed for it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define COLORIST_BLEND_SSE2 1
+#include <emmintrin.h>
+#endif
+
 void clPixelMathUNormToFloat(struct clContext * C, uint16_t * inPixels, int inDepth, float * outPixels, int pixelCount)
 {
     COLORIST_UNUSED(C);
@@ -29,6 +35,26 @@ void clPixelMathFloatToUNorm(struct clContext * C, float * inPixels, uint16_t *
     COLORIST_UNUSED(C);
 }
 
+void clPixelMathUNorm8ToFloat(struct clContext * C, const uint8_t * inPixels, float * outPixels, int pixelCount)
+{
+    COLORIST_UNUSED(C);
+
+    int channelCount = pixelCount * 4;
+    for (int i = 0; i < channelCount; ++i) {
+        outPixels[i] = inPixels[i] / 255.0f;
+    }
+}
+
+void clPixelMathFloatToUNorm8(struct clContext * C, const float * inPixels, uint8_t * outPixels, int pixelCount)
+{
+    COLORIST_UNUSED(C);
+
+    int channelCount = pixelCount * 4;
+    for (int i = 0; i < channelCount; ++i) {
+        outPixels[i] = (uint8_t)clPixelMathRoundf(inPixels[i] * 255.0f);
+    }
+}
+
 void clPixelMathScaleLuminance(struct clContext * C, float * pixels, int pixelCount, float luminanceScale, clBool tonemap)
 {
     COLORIST_UNUSED(C);
@@ -64,82 +90,60 @@ void clPixelMathScaleLuminance(struct clContext * C, float * pixels, int pixelCo
     }
 }
 
-// If you're closer than this to a color, just use that color exclusively
-#define MIN_DISTANCE (0.000001f)
-
-// Converts ([0-1], [0-1], [0-1]) to a hald data or weight index in [0-7]
-#define I(X, Y, Z) ((X) + ((Y) * 2) + ((Z) * 4))
-
-void clPixelMathHaldCLUTLookup(struct clContext * C, float * haldData, int haldDims, const float src[4], float dst[4])
+void clPixelMathBlend(struct clContext * C, const float * srcPixels, const float * cmpPixels, float * dstPixels, int pixelCount, clBool premultiplied)
 {
     COLORIST_UNUSED(C);
 
-    float idealR = src[0] * (haldDims - 1);
-    float idealG = src[1] * (haldDims - 1);
-    float idealB = src[2] * (haldDims - 1);
-
-    float firstCornerX = clPixelMathFloorf(idealR);
-    float firstCornerY = clPixelMathFloorf(idealG);
-    float firstCornerZ = clPixelMathFloorf(idealB);
-    firstCornerX = CL_CLAMP(firstCornerX, 0, haldDims - 2);
-    firstCornerY = CL_CLAMP(firstCornerY, 0, haldDims - 2);
-    firstCornerZ = CL_CLAMP(firstCornerZ, 0, haldDims - 2);
-
-    float distSquared[8];
-    int dist0Index = -1; // Index containing a distance of 0, if any
-    for (int z = 0; z < 2; ++z) {
-        for (int y = 0; y < 2; ++y) {
-            for (int x = 0; x < 2; ++x) {
-                float dx = (firstCornerX + x) - idealR;
-                float dy = (firstCornerY + y) - idealG;
-                float dz = (firstCornerZ + z) - idealB;
-                float dsq = (dx * dx) + (dy * dy) + (dz * dz);
-
-                distSquared[I(x, y, z)] = dsq;
-                if (dsq < MIN_DISTANCE) {
-                    dist0Index = I(x, y, z);
-                }
-            }
+    // cmpPixel is the "Source" in a SourceOver Porter/Duff blend. Every channel is read before any is
+    // written, so dstPixels may alias srcPixels or cmpPixels.
+#if defined(COLORIST_BLEND_SSE2)
+    // One pixel per vector, same operations in the same order as the scalar loops below. Alpha comes out
+    // of the color math by scaling the alpha lane by 1 instead of by alpha.
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 alphaLane = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+    for (int i = 0; i < pixelCount; ++i) {
+        __m128 src = _mm_loadu_ps(&srcPixels[i * 4]);
+        __m128 cmp = _mm_loadu_ps(&cmpPixels[i * 4]);
+        __m128 cmpAlpha = _mm_shuffle_ps(cmp, cmp, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128 cmpCoverage = _mm_sub_ps(one, cmpAlpha);
+        if (!premultiplied) {
+            __m128 srcAlpha = _mm_shuffle_ps(src, src, _MM_SHUFFLE(3, 3, 3, 3));
+            cmp = _mm_mul_ps(cmp, _mm_or_ps(_mm_andnot_ps(alphaLane, cmpAlpha), _mm_and_ps(alphaLane, one)));
+            src = _mm_mul_ps(src, _mm_or_ps(_mm_andnot_ps(alphaLane, srcAlpha), _mm_and_ps(alphaLane, one)));
         }
+        _mm_storeu_ps(&dstPixels[i * 4], _mm_add_ps(cmp, _mm_mul_ps(src, cmpCoverage)));
     }
-
-    float weights[8];
-    float idwDivisor;
-    if (dist0Index == -1) {
-        // No color with a distance of 0 found, use IDW
-        idwDivisor = 0.0f;
-        for (int i = 0; i < 8; ++i) {
-            weights[i] = 1.0f / distSquared[i];
-            idwDivisor += weights[i];
+#else
+    if (premultiplied) {
+        // Premultiplied alpha
+        for (int i = 0; i < pixelCount; ++i) {
+            const float * srcPixel = &srcPixels[i * 4];
+            const float * cmpPixel = &cmpPixels[i * 4];
+            float * dstPixel = &dstPixels[i * 4];
+            float r = cmpPixel[0] + (srcPixel[0] * (1 - cmpPixel[3]));
+            float g = cmpPixel[1] + (srcPixel[1] * (1 - cmpPixel[3]));
+            float b = cmpPixel[2] + (srcPixel[2] * (1 - cmpPixel[3]));
+            float a = cmpPixel[3] + (srcPixel[3] * (1 - cmpPixel[3]));
+            dstPixel[0] = r;
+            dstPixel[1] = g;
+            dstPixel[2] = b;
+            dstPixel[3] = a;
         }
     } else {
-        // Give all of the weight to one color, skip IDW
-        for (int i = 0; i < 8; ++i) {
-            weights[i] = 0.0f;
-        }
-        weights[dist0Index] = 1.0f;
-        idwDivisor = 1.0f; // Unused
-    }
-
-    dst[0] = 0.0f;
-    dst[1] = 0.0f;
-    dst[2] = 0.0f;
-    for (int z = 0; z < 2; ++z) {
-        for (int y = 0; y < 2; ++y) {
-            for (int x = 0; x < 2; ++x) {
-                int index = ((int)firstCornerX + x) + (((int)firstCornerY + y) * haldDims) + (((int)firstCornerZ + z) * haldDims * haldDims);
-                float * lookup = &haldData[index * 4];
-                float weight = weights[I(x, y, z)];
-                dst[0] += lookup[0] * weight;
-                dst[1] += lookup[1] * weight;
-                dst[2] += lookup[2] * weight;
-            }
+        // Not Premultiplied alpha, perform the multiply during the blend
+        for (int i = 0; i < pixelCount; ++i) {
+            const float * srcPixel = &srcPixels[i * 4];
+            const float * cmpPixel = &cmpPixels[i * 4];
+            float * dstPixel = &dstPixels[i * 4];
+            float r = (cmpPixel[0] * cmpPixel[3]) + (srcPixel[0] * srcPixel[3] * (1 - cmpPixel[3]));
+            float g = (cmpPixel[1] * cmpPixel[3]) + (srcPixel[1] * srcPixel[3] * (1 - cmpPixel[3]));
+            float b = (cmpPixel[2] * cmpPixel[3]) + (srcPixel[2] * srcPixel[3] * (1 - cmpPixel[3]));
+            float a = cmpPixel[3] + (srcPixel[3] * (1 - cmpPixel[3]));
+            dstPixel[0] = r;
+            dstPixel[1] = g;
+            dstPixel[2] = b;
+            dstPixel[3] = a;
         }
     }
-    dst[0] /= idwDivisor;
-    dst[1] /= idwDivisor;
-    dst[2] /= idwDivisor;
-
-    // Copy alpha directly
-    dst[3] = src[3];
+#endif
 }
@@ -8,6 +8,7 @@
 #include "colorist/raw.h"
 
 #include "colorist/context.h"
+#include "colorist/task.h"
 
 #include "cJSON.h"
 #include "zlib.h"
@@ -16,9 +17,40 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLORIST_RAW_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define CL_TARGET_SSSE3
+#else
+#define CL_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+static void rawUnmap(clRaw * raw);
+
 void clRawRealloc(struct clContext * C, clRaw * raw, size_t newSize)
 {
-    if (raw->size != newSize) {
+    if (raw->mapped) {
+        // A mapping can't be resized or written to, so trade it for an allocation holding its contents
+        clRaw mapping = *raw;
+        size_t bytesToCopy = (mapping.size < newSize) ? mapping.size : newSize;
+        raw->ptr = clAllocate(newSize);
+        raw->size = newSize;
+        raw->mapped = clFalse;
+        memcpy(raw->ptr, mapping.ptr, bytesToCopy);
+        rawUnmap(&mapping);
+    } else if (raw->size != newSize) {
         uint8_t * old = raw->ptr;
         size_t oldSize = raw->size;
         raw->ptr = clAllocate(newSize);
@@ -36,38 +68,193 @@ void clRawClone(struct clContext * C, clRaw * dst, const clRaw * src)
     clRawSet(C, dst, src->ptr, src->size);
 }
 
-clBool clRawDeflate(struct clContext * C, clRaw * dst, const clRaw * src)
+// clRawDeflateParallel() splits its input into chunks and deflates each one on its own (pigz-style). Every
+// chunk is primed with the tail of the chunk before it, so little ratio is lost, and all but the last end
+// in a sync flush, so the raw deflate streams simply concatenate. One zlib header and the combined Adler-32
+// wrap the result into a single ordinary zlib stream. The output depends only on the input and the level,
+// never on how many tasks produced it.
+#define CL_DEFLATE_CHUNK_SIZE (128 * 1024)
+#define CL_DEFLATE_DICT_SIZE (32 * 1024)
+#define CL_DEFLATE_BATCH_CHUNKS 32 // chunks deflated per batch, which bounds memory when streaming
+
+typedef void (* clDeflateSinkFunc)(void * sinkData, const uint8_t * data, size_t size);
+
+typedef struct clDeflateChunk
 {
-    clBool ret = clTrue;
-    z_stream z;
-    int err;
-    size_t maxDeflatedSize = src->size + 6 + (((src->size + 16383) / 16384) * 5);
-    clRawRealloc(C, dst, maxDeflatedSize);
-
-    memset(&z, 0, sizeof(z));
-    z.total_in = (uLong)src->size;
-    z.avail_in = (uInt)src->size;
-    z.total_out = (uLong)dst->size;
-    z.avail_out = (uInt)dst->size;
-    z.next_in = src->ptr;
-    z.next_out = dst->ptr;
-
-    err = deflateInit(&z, Z_DEFAULT_COMPRESSION);
-    if (err == Z_OK) {
-        err = deflate(&z, Z_FINISH);
-        if (err == Z_STREAM_END) {
-            dst->size = z.total_out;
+    uint8_t * ptr;
+    size_t size;
+    uLong adler;
+    clBool ok;
+} clDeflateChunk;
+
+typedef struct clDeflateTask
+{
+    clContext * C;
+    const clRaw * src;
+    int level;
+    int chunkCount;
+    int firstChunk; // of the current batch
+    clDeflateChunk * chunks;
+} clDeflateTask;
+
+static void deflateChunkFunc(void * userData, int start, int end)
+{
+    clDeflateTask * info = (clDeflateTask *)userData;
+    clContext * C = info->C;
+    for (int i = start; i < end; ++i) {
+        clDeflateChunk * chunk = &info->chunks[i];
+        int chunkIndex = info->firstChunk + i;
+        clBool last = (chunkIndex == (info->chunkCount - 1)) ? clTrue : clFalse;
+        size_t offset = (size_t)chunkIndex * CL_DEFLATE_CHUNK_SIZE;
+        size_t len = info->src->size - offset;
+        if (len > CL_DEFLATE_CHUNK_SIZE) {
+            len = CL_DEFLATE_CHUNK_SIZE;
+        }
+
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        chunk->ok = clFalse;
+        chunk->ptr = NULL;
+        chunk->size = 0;
+        if (deflateInit2(&z, info->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            continue;
+        }
+        if (chunkIndex > 0) {
+            size_t dictSize = (offset < CL_DEFLATE_DICT_SIZE) ? offset : CL_DEFLATE_DICT_SIZE;
+            deflateSetDictionary(&z, info->src->ptr + offset - dictSize, (uInt)dictSize);
+        }
+
+        size_t maxSize = deflateBound(&z, (uLong)len) + 16; // room for the sync flush marker
+        chunk->ptr = clAllocate(maxSize);
+        z.next_in = (len > 0) ? (info->src->ptr + offset) : NULL;
+        z.avail_in = (uInt)len;
+        z.next_out = chunk->ptr;
+        z.avail_out = (uInt)maxSize;
+        int err = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (last) {
+            chunk->ok = (err == Z_STREAM_END) ? clTrue : clFalse;
         } else {
-            clContextLogError(C, "failed to decompress %d bytes!", src->size);
-            ret = clFalse;
+            chunk->ok = ((err == Z_OK) && (z.avail_in == 0) && (z.avail_out > 0)) ? clTrue : clFalse;
+        }
+        chunk->size = maxSize - z.avail_out;
+        chunk->adler = adler32(adler32(0L, Z_NULL, 0), (len > 0) ? (info->src->ptr + offset) : Z_NULL, (uInt)len);
+        deflateEnd(&z);
+    }
+}
+
+// Deflates src into a zlib stream, handing it to sink in order a piece at a time
+static clBool deflateChunked(struct clContext * C, const clRaw * src, int level, int taskCount, clDeflateSinkFunc sink, void * sinkData)
+{
+    clDeflateTask info;
+    clBool ret = clTrue;
+
+    // zlib header: deflate with a 32K window, and the FLEVEL hint that zlib itself would write for this level
+    uint8_t header[2] = { 0x78, 0x9c };
+    if ((level >= 0) && (level < 2)) {
+        header[1] = 0x01;
+    } else if ((level >= 2) && (level < 6)) {
+        header[1] = 0x5e;
+    } else if (level > 6) {
+        header[1] = 0xda;
+    }
+    sink(sinkData, header, sizeof(header));
+
+    info.C = C;
+    info.src = src;
+    info.level = level;
+    info.chunkCount = (int)((src->size + CL_DEFLATE_CHUNK_SIZE - 1) / CL_DEFLATE_CHUNK_SIZE);
+    if (info.chunkCount < 1) {
+        info.chunkCount = 1;
+    }
+    info.chunks = clAllocate(sizeof(clDeflateChunk) * CL_DEFLATE_BATCH_CHUNKS);
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (info.firstChunk = 0; info.firstChunk < info.chunkCount; info.firstChunk += CL_DEFLATE_BATCH_CHUNKS) {
+        int batchCount = info.chunkCount - info.firstChunk;
+        if (batchCount > CL_DEFLATE_BATCH_CHUNKS) {
+            batchCount = CL_DEFLATE_BATCH_CHUNKS;
+        }
+        clTaskParallelFor(C, taskCount, batchCount, 1, deflateChunkFunc, &info);
+
+        for (int i = 0; i < batchCount; ++i) {
+            clDeflateChunk * chunk = &info.chunks[i];
+            if (ret && chunk->ok) {
+                size_t offset = (size_t)(info.firstChunk + i) * CL_DEFLATE_CHUNK_SIZE;
+                size_t len = src->size - offset;
+                if (len > CL_DEFLATE_CHUNK_SIZE) {
+                    len = CL_DEFLATE_CHUNK_SIZE;
+                }
+                sink(sinkData, chunk->ptr, chunk->size);
+                adler = adler32_combine(adler, chunk->adler, (z_off_t)len);
+            } else {
+                ret = clFalse;
+            }
+            if (chunk->ptr) {
+                clFree(chunk->ptr);
+            }
+        }
+        if (!ret) {
+            break;
         }
     }
-    deflateEnd(&z);
+    clFree(info.chunks);
 
     if (!ret) {
+        clContextLogError(C, "failed to compress %d bytes!", (int)src->size);
+        return clFalse;
+    }
+
+    uint8_t trailer[4];
+    trailer[0] = (uint8_t)((adler >> 24) & 0xff);
+    trailer[1] = (uint8_t)((adler >> 16) & 0xff);
+    trailer[2] = (uint8_t)((adler >> 8) & 0xff);
+    trailer[3] = (uint8_t)(adler & 0xff);
+    sink(sinkData, trailer, sizeof(trailer));
+    return clTrue;
+}
+
+typedef struct clDeflateRawSink
+{
+    clContext * C;
+    clRaw * dst;
+    size_t size; // bytes of dst in use
+} clDeflateRawSink;
+
+static void deflateRawSinkFunc(void * sinkData, const uint8_t * data, size_t size)
+{
+    clDeflateRawSink * rawSink = (clDeflateRawSink *)sinkData;
+    clContext * C = rawSink->C;
+    if ((rawSink->size + size) > rawSink->dst->size) {
+        size_t newSize = rawSink->dst->size * 2;
+        if (newSize < (rawSink->size + size)) {
+            newSize = rawSink->size + size;
+        }
+        clRawRealloc(C, rawSink->dst, newSize);
+    }
+    memcpy(rawSink->dst->ptr + rawSink->size, data, size);
+    rawSink->size += size;
+}
+
+clBool clRawDeflate(struct clContext * C, clRaw * dst, const clRaw * src)
+{
+    return clRawDeflateParallel(C, dst, src, CL_DEFLATE_LEVEL_DEFAULT, 1);
+}
+
+clBool clRawDeflateParallel(struct clContext * C, clRaw * dst, const clRaw * src, int level, int taskCount)
+{
+    clDeflateRawSink rawSink;
+    rawSink.C = C;
+    rawSink.dst = dst;
+    rawSink.size = 0;
+
+    // Deflated data rarely grows, so start with room for all of it
+    clRawRealloc(C, dst, src->size + 6 + (((src->size + 16383) / 16384) * 5) + (((src->size / CL_DEFLATE_CHUNK_SIZE) + 1) * 16));
+    if (!deflateChunked(C, src, level, taskCount, deflateRawSinkFunc, &rawSink)) {
         clRawFree(C, dst);
+        return clFalse;
     }
-    return ret;
+    dst->size = rawSink.size;
+    return clTrue;
 }
 
 // Original implementation copyright:
@@ -80,41 +267,82 @@ clBool clRawDeflate(struct clContext * C, clRaw * dst, const clRaw * src)
  * See README for more details.
  */
 
-// Main changes to the original are to add clAllocate and remove line feeds.
+// Main changes to the original are to add clAllocate, remove line feeds, and split out the encoder so
+// it can also be streamed.
 
 static const unsigned char base64_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-char * clRawToBase64(struct clContext * C, clRaw * src)
+clBool clRawBase64SIMDSupported(void)
 {
-    unsigned char * out, * pos;
-    const unsigned char * end, * in;
-    size_t olen;
-    // int line_len;
+#if defined(COLORIST_RAW_X86)
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) ? clTrue : clFalse;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") ? clTrue : clFalse;
+#endif
+#else
+    return clFalse;
+#endif
+}
 
-    olen = src->size * 4 / 3 + 4; /* 3-byte blocks to 4-byte */
-    // olen += olen / 72;            /* line feeds */
-    olen++; /* nul termination */
-    if (olen < src->size)
-        return NULL; /* integer overflow */
-    out = clAllocate(olen);
-    if (out == NULL)
-        return NULL;
+#if defined(COLORIST_RAW_X86)
+
+// Encodes 12 bytes into 16 characters per iteration (reading 16 bytes at a time, so it stops with at least
+// 4 bytes left over for the scalar loop). See http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+CL_TARGET_SSSE3 static size_t base64EncodeSSSE3(const unsigned char ** in, size_t len, unsigned char * out)
+{
+    const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i shiftLUT = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    const unsigned char * src = *in;
+    size_t groups = 0;
+    for (; len >= 16; len -= 12) {
+        __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuffle);
+
+        // Spread each 3 byte group into four 6-bit indices, one per byte
+        __m128i hi = _mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i lo = _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        __m128i indices = _mm_or_si128(hi, lo);
+
+        // Map index ranges [0,26) [26,52) [52,62) 62 63 to their ASCII offsets
+        __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+        __m128i chars = _mm_add_epi8(_mm_shuffle_epi8(shiftLUT, range), indices);
+        _mm_storeu_si128((__m128i *)(out + (groups * 4)), chars);
+
+        src += 12;
+        groups += 4;
+    }
+    *in = src;
+    return groups * 4;
+}
+#endif
+
+// Encodes len bytes of in into out, padding the final group; returns the number of characters written.
+// Only the last call for a given stream may pass a len that isn't a multiple of 3. simd is C->base64SIMD.
+static size_t base64Encode(const unsigned char * in, size_t len, unsigned char * out, clBool simd)
+{
+    const unsigned char * end = in + len;
+    unsigned char * pos = out;
+
+#if defined(COLORIST_RAW_X86)
+    if (simd) {
+        pos += base64EncodeSSSE3(&in, len, pos);
+    }
+#else
+    COLORIST_UNUSED(simd);
+#endif
 
-    end = src->ptr + src->size;
-    in = src->ptr;
-    pos = out;
-    // line_len = 0;
     while (end - in >= 3) {
         *pos++ = base64_table[in[0] >> 2];
         *pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
         *pos++ = base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
         *pos++ = base64_table[in[2] & 0x3f];
         in += 3;
-        // line_len += 4;
-        // if (line_len >= 72) {
-        //     *pos++ = '\n';
-        //     line_len = 0;
-        // }
     }
 
     if (end - in) {
@@ -128,16 +356,120 @@ char * clRawToBase64(struct clContext * C, clRaw * src)
             *pos++ = base64_table[(in[1] & 0x0f) << 2];
         }
         *pos++ = '=';
-        // line_len += 4;
     }
+    return (size_t)(pos - out);
+}
 
-// if (line_len)
-//     *pos++ = '\n';
+char * clRawToBase64(struct clContext * C, clRaw * src)
+{
+    unsigned char * out;
+    size_t olen;
 
-    *pos = '\0';
+    olen = src->size * 4 / 3 + 4; /* 3-byte blocks to 4-byte */
+    olen++; /* nul termination */
+    if (olen < src->size)
+        return NULL; /* integer overflow */
+    out = clAllocate(olen);
+    if (out == NULL)
+        return NULL;
+
+    out[base64Encode(src->ptr, src->size, out, C->base64SIMD)] = '\0';
     return (char *)out;
 }
 
+// Bytes handed to base64StreamWrite() at a time; a multiple of 3 so only the final chunk is padded
+#define CL_BASE64_STREAM_CHUNK (3 * 16 * 1024)
+
+typedef struct clBase64Stream
+{
+    FILE * f;
+    unsigned char carry[3]; // leftover bytes that don't make a full group yet
+    size_t carryCount;
+    clBool simd;
+    unsigned char out[(CL_BASE64_STREAM_CHUNK / 3) * 4];
+    clBool failed;
+} clBase64Stream;
+
+static void base64StreamFlush(clBase64Stream * stream, const unsigned char * in, size_t len)
+{
+    size_t outLen = base64Encode(in, len, stream->out, stream->simd);
+    if (fwrite(stream->out, 1, outLen, stream->f) != outLen) {
+        stream->failed = clTrue;
+    }
+}
+
+static void base64StreamWrite(clBase64Stream * stream, const unsigned char * in, size_t len)
+{
+    // Complete a group started by the previous write
+    while ((stream->carryCount > 0) && (stream->carryCount < 3) && (len > 0)) {
+        stream->carry[stream->carryCount++] = *in++;
+        --len;
+    }
+    if (stream->carryCount == 3) {
+        base64StreamFlush(stream, stream->carry, 3);
+        stream->carryCount = 0;
+    }
+
+    while (len >= 3) {
+        size_t chunk = (len < CL_BASE64_STREAM_CHUNK) ? (len - (len % 3)) : CL_BASE64_STREAM_CHUNK;
+        base64StreamFlush(stream, in, chunk);
+        in += chunk;
+        len -= chunk;
+    }
+    for (; len > 0; --len) {
+        stream->carry[stream->carryCount++] = *in++;
+    }
+}
+
+static void base64StreamFinish(clBase64Stream * stream)
+{
+    if (stream->carryCount) {
+        base64StreamFlush(stream, stream->carry, stream->carryCount);
+        stream->carryCount = 0;
+    }
+}
+
+static void base64StreamSinkFunc(void * sinkData, const uint8_t * data, size_t size)
+{
+    base64StreamWrite((clBase64Stream *)sinkData, data, size);
+}
+
+static clBase64Stream * base64StreamCreate(struct clContext * C, FILE * f)
+{
+    clBase64Stream * stream = clAllocateStruct(clBase64Stream);
+    stream->f = f;
+    stream->carryCount = 0;
+    stream->simd = C->base64SIMD;
+    stream->failed = clFalse;
+    return stream;
+}
+
+static clBool base64StreamDestroy(struct clContext * C, clBase64Stream * stream)
+{
+    base64StreamFinish(stream);
+    clBool ret = stream->failed ? clFalse : clTrue;
+    if (!ret) {
+        clContextLogError(C, "failed to write Base64 data");
+    }
+    clFree(stream);
+    return ret;
+}
+
+clBool clRawWriteBase64(struct clContext * C, FILE * f, const clRaw * src)
+{
+    clBase64Stream * stream = base64StreamCreate(C, f);
+    base64StreamWrite(stream, src->ptr, src->size);
+    return base64StreamDestroy(C, stream);
+}
+
+clBool clRawWriteDeflatedBase64(struct clContext * C, FILE * f, const clRaw * src, int level, int taskCount)
+{
+    // Each batch of deflated chunks is Base64 encoded and written before the next batch is deflated
+    clBase64Stream * stream = base64StreamCreate(C, f);
+    clBool deflated = deflateChunked(C, src, level, taskCount, base64StreamSinkFunc, stream);
+    return base64StreamDestroy(C, stream) && deflated;
+}
+
 void clRawSet(struct clContext * C, clRaw * raw, const uint8_t * data, size_t len)
 {
     if (len) {
@@ -150,9 +482,14 @@ void clRawSet(struct clContext * C, clRaw * raw, const uint8_t * data, size_t le
 
 void clRawFree(struct clContext * C, clRaw * raw)
 {
-    clFree(raw->ptr);
+    if (raw->mapped) {
+        rawUnmap(raw);
+    } else {
+        clFree(raw->ptr);
+    }
     raw->ptr = NULL;
     raw->size = 0;
+    raw->mapped = clFalse;
 }
 
 struct cJSON * clRawToStructArray(struct clContext * C, clRaw * raw, int width, int height, clStructArraySchema * schema, int schemaCount)
@@ -182,11 +519,178 @@ struct cJSON * clRawToStructArray(struct clContext * C, clRaw * raw, int width,
     return json;
 }
 
+typedef struct clStructArrayTileTask
+{
+    clContext * C;
+    const clRaw * raw;
+    int width;
+    int height;
+    size_t elementSize;
+    int tileSize;
+    int tileY;
+    int level;
+    clRaw * deflatedTiles; // one row of tiles
+    clBool * deflatedOK;
+} clStructArrayTileTask;
+
+static void structArrayTileFunc(void * userData, int startTile, int endTile)
+{
+    clStructArrayTileTask * info = (clStructArrayTileTask *)userData;
+    clContext * C = info->C;
+    int y = info->tileY * info->tileSize;
+    int rows = info->height - y;
+    if (rows > info->tileSize) {
+        rows = info->tileSize;
+    }
+
+    for (int tileX = startTile; tileX < endTile; ++tileX) {
+        int x = tileX * info->tileSize;
+        int columns = info->width - x;
+        if (columns > info->tileSize) {
+            columns = info->tileSize;
+        }
+
+        // Gather the tile's rows so its elements are contiguous, then deflate them on this task alone
+        size_t rowBytes = (size_t)columns * info->elementSize;
+        clRaw tile = CL_RAW_EMPTY;
+        clRawRealloc(C, &tile, rowBytes * rows);
+        for (int j = 0; j < rows; ++j) {
+            const uint8_t * srcRow = info->raw->ptr + ((((size_t)(y + j) * info->width) + x) * info->elementSize);
+            memcpy(tile.ptr + (j * rowBytes), srcRow, rowBytes);
+        }
+        info->deflatedOK[tileX] = clRawDeflateParallel(C, &info->deflatedTiles[tileX], &tile, info->level, 1);
+        clRawFree(C, &tile);
+    }
+}
+
+clBool clRawWriteStructArray(struct clContext * C, FILE * f, clRaw * raw, int width, int height, clStructArraySchema * schema, int schemaCount, int tileSize, int level, int taskCount)
+{
+    if (tileSize > 0) {
+        // Each tile is deflated on its own so a viewer can inflate just the tiles it needs. A row of tiles
+        // is deflated in parallel, then written out before the next row starts.
+        clStructArrayTileTask info;
+        clBool ret = clTrue;
+        int tilesX = (width + tileSize - 1) / tileSize;
+        int tilesY = (height + tileSize - 1) / tileSize;
+        info.C = C;
+        info.raw = raw;
+        info.width = width;
+        info.height = height;
+        info.elementSize = ((width > 0) && (height > 0)) ? (raw->size / ((size_t)width * height)) : 0;
+        info.tileSize = tileSize;
+        info.level = level;
+        info.deflatedTiles = clAllocate(sizeof(clRaw) * tilesX);
+        memset(info.deflatedTiles, 0, sizeof(clRaw) * tilesX);
+        info.deflatedOK = clAllocate(sizeof(clBool) * tilesX);
+
+        fprintf(f, "{\"width\": %d, \"height\": %d, \"tileSize\": %d, \"tiles\": [", width, height, tileSize);
+        for (info.tileY = 0; ret && (info.tileY < tilesY); ++info.tileY) {
+            clTaskParallelFor(C, taskCount, tilesX, 1, structArrayTileFunc, &info);
+            for (int tileX = 0; tileX < tilesX; ++tileX) {
+                if (ret && info.deflatedOK[tileX]) {
+                    fputs(((info.tileY + tileX) > 0) ? ", \"" : "\"", f);
+                    ret = clRawWriteBase64(C, f, &info.deflatedTiles[tileX]);
+                    fputc('"', f);
+                } else {
+                    ret = clFalse;
+                }
+                clRawFree(C, &info.deflatedTiles[tileX]);
+            }
+        }
+        clFree(info.deflatedTiles);
+        clFree(info.deflatedOK);
+        if (!ret) {
+            return clFalse;
+        }
+        fputs("], \"schema\": [", f);
+    } else {
+        fprintf(f, "{\"width\": %d, \"height\": %d, \"data\": \"", width, height);
+        if (!clRawWriteDeflatedBase64(C, f, raw, level, taskCount)) {
+            return clFalse;
+        }
+        fputs("\", \"schema\": [", f);
+    }
+    for (int i = 0; i < schemaCount; ++i) {
+        // Schema formats and names are plain identifiers, so they need no escaping
+        fprintf(f, "%s{\"format\": \"%s\", \"name\": \"%s\"}", i ? ", " : "", schema[i].format, schema[i].name);
+    }
+    fputs("]}", f);
+    return ferror(f) ? clFalse : clTrue;
+}
+
+// Regular files at least this large are mapped by clRawReadFile() rather than read into an allocation. Decoders
+// only ever read their input, so a mapping saves a full copy of it (and zeroing the pages to hold that copy).
+// Below this, one read() is cheaper than setting up and tearing down a mapping.
+#define CL_RAW_MAP_MIN_BYTES (64 * 1024)
+
+// Returns clFalse (leaving raw alone) whenever the file can't or shouldn't be mapped, and the caller reads it instead
+static clBool rawMapFile(clRaw * raw, const char * filename)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return clFalse;
+    }
+    LARGE_INTEGER fileSize;
+    if ((GetFileType(file) != FILE_TYPE_DISK) || !GetFileSizeEx(file, &fileSize) || (fileSize.QuadPart < CL_RAW_MAP_MIN_BYTES) || ((unsigned long long)fileSize.QuadPart > (size_t)-1)) {
+        CloseHandle(file);
+        return clFalse;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        return clFalse;
+    }
+    void * view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); // the view keeps the mapping alive
+    if (!view) {
+        return clFalse;
+    }
+    raw->ptr = (uint8_t *)view;
+    raw->size = (size_t)fileSize.QuadPart;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return clFalse;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size < CL_RAW_MAP_MIN_BYTES) || ((unsigned long long)st.st_size > (size_t)-1)) {
+        close(fd);
+        return clFalse;
+    }
+    void * view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (view == MAP_FAILED) {
+        return clFalse;
+    }
+    raw->ptr = (uint8_t *)view;
+    raw->size = (size_t)st.st_size;
+#endif
+    raw->mapped = clTrue;
+    return clTrue;
+}
+
+static void rawUnmap(clRaw * raw)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(raw->ptr);
+#else
+    munmap(raw->ptr, raw->size);
+#endif
+}
+
 clBool clRawReadFile(struct clContext * C, clRaw * raw, const char * filename)
 {
     long bytes;
     FILE * f;
 
+    clRaw mapping = CL_RAW_EMPTY;
+    if (rawMapFile(&mapping, filename)) {
+        clRawFree(C, raw);
+        *raw = mapping;
+        return clTrue;
+    }
+
     f = fopen(filename, "rb");
     if (!f) {
         clContextLogError(C, "Failed to open file for read: %s", filename);
@@ -264,3 +768,33 @@ int clFileSize(const char * filename)
     fclose(f);
     return (int)bytes;
 }
+
+clBool clFileSame(const char * filename1, const char * filename2)
+{
+    // Compares identities rather than names, so links and differently spelled paths still match
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION info[2];
+    const char * filenames[2] = { filename1, filename2 };
+    for (int i = 0; i < 2; ++i) {
+        HANDLE file = CreateFileA(filenames[i], 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return clFalse;
+        }
+        BOOL ok = GetFileInformationByHandle(file, &info[i]);
+        CloseHandle(file);
+        if (!ok) {
+            return clFalse;
+        }
+    }
+    return ((info[0].dwVolumeSerialNumber == info[1].dwVolumeSerialNumber) && (info[0].nFileIndexHigh == info[1].nFileIndexHigh) &&
+            (info[0].nFileIndexLow == info[1].nFileIndexLow))
+               ? clTrue
+               : clFalse;
+#else
+    struct stat st1, st2;
+    if ((stat(filename1, &st1) != 0) || (stat(filename2, &st2) != 0)) {
+        return clFalse;
+    }
+    return ((st1.st_dev == st2.st_dev) && (st1.st_ino == st2.st_ino)) ? clTrue : clFalse;
+#endif
+}
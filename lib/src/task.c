@@ -9,42 +9,51 @@
 
 #include "colorist/context.h"
 
-static void nativeTaskStart(clContext * C, clTask * task);
-static void nativeTaskJoin(clContext * C, clTask * task);
+// ---------------------------------------------------------------------------
+// Native threading primitives
 
-clTask * clTaskCreate(struct clContext * C, clTaskFunc func, void * userData)
+#ifdef _WIN32
+
+#pragma warning(disable: 5031)
+#pragma warning(disable: 5032)
+#include <windows.h>
+
+typedef CRITICAL_SECTION clNativeMutex;
+typedef CONDITION_VARIABLE clNativeCond;
+typedef HANDLE clNativeThread;
+
+static void nativeMutexInit(clNativeMutex * mutex) { InitializeCriticalSection(mutex); }
+static void nativeMutexDestroy(clNativeMutex * mutex) { DeleteCriticalSection(mutex); }
+static void nativeMutexLock(clNativeMutex * mutex) { EnterCriticalSection(mutex); }
+static void nativeMutexUnlock(clNativeMutex * mutex) { LeaveCriticalSection(mutex); }
+static void nativeCondInit(clNativeCond * cond) { InitializeConditionVariable(cond); }
+static void nativeCondDestroy(clNativeCond * cond) { COLORIST_UNUSED(cond); }
+static void nativeCondWait(clNativeCond * cond, clNativeMutex * mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+static void nativeCondBroadcast(clNativeCond * cond) { WakeAllConditionVariable(cond); }
+static long nativeAtomicLoad(long * value) { return InterlockedCompareExchange(value, 0, 0); }
+static void nativeAtomicStore(long * value, long newValue) { InterlockedExchange(value, newValue); }
+
+static void workerThreadProc(void * userData);
+
+static DWORD WINAPI nativeThreadProc(LPVOID lpParameter)
 {
-    clTask * task = clAllocateStruct(clTask);
-    task->func = func;
-    task->nativeData = NULL;
-    task->userData = userData;
-    task->joined = clFalse;
-    nativeTaskStart(C, task);
-    return task;
+    workerThreadProc(lpParameter);
+    return 0;
 }
 
-void clTaskJoin(struct clContext * C, clTask * task)
+static clBool nativeThreadStart(clNativeThread * thread, void * userData)
 {
-    if (!task->joined) {
-        nativeTaskJoin(C, task);
-        task->joined = clTrue;
-    }
+    DWORD threadId;
+    *thread = CreateThread(NULL, 0, nativeThreadProc, userData, 0, &threadId);
+    return (*thread != NULL) ? clTrue : clFalse;
 }
 
-void clTaskDestroy(struct clContext * C, clTask * task)
+static void nativeThreadJoin(clNativeThread * thread)
 {
-    clTaskJoin(C, task);
-    COLORIST_ASSERT(task->joined);
-    COLORIST_ASSERT(task->nativeData == NULL);
-    clFree(task);
+    WaitForSingleObject(*thread, INFINITE);
+    CloseHandle(*thread);
 }
 
-#ifdef _WIN32
-
-#pragma warning(disable: 5031)
-#pragma warning(disable: 5032)
-#include <windows.h>
-
 int clTaskLimit(void)
 {
     int numCPU;
@@ -54,37 +63,43 @@ int clTaskLimit(void)
     return numCPU;
 }
 
-typedef struct clNativeTask
-{
-    HANDLE hThread;
-} clNativeTask;
+#else /* ifdef _WIN32 */
+
+#include <pthread.h>
+
+typedef pthread_mutex_t clNativeMutex;
+typedef pthread_cond_t clNativeCond;
+typedef pthread_t clNativeThread;
+
+static void nativeMutexInit(clNativeMutex * mutex) { pthread_mutex_init(mutex, NULL); }
+static void nativeMutexDestroy(clNativeMutex * mutex) { pthread_mutex_destroy(mutex); }
+static void nativeMutexLock(clNativeMutex * mutex) { pthread_mutex_lock(mutex); }
+static void nativeMutexUnlock(clNativeMutex * mutex) { pthread_mutex_unlock(mutex); }
+static void nativeCondInit(clNativeCond * cond) { pthread_cond_init(cond, NULL); }
+static void nativeCondDestroy(clNativeCond * cond) { pthread_cond_destroy(cond); }
+static void nativeCondWait(clNativeCond * cond, clNativeMutex * mutex) { pthread_cond_wait(cond, mutex); }
+static void nativeCondBroadcast(clNativeCond * cond) { pthread_cond_broadcast(cond); }
+static long nativeAtomicLoad(long * value) { return __atomic_load_n(value, __ATOMIC_RELAXED); }
+static void nativeAtomicStore(long * value, long newValue) { __atomic_store_n(value, newValue, __ATOMIC_RELAXED); }
+
+static void workerThreadProc(void * userData);
 
-static DWORD WINAPI taskThreadProc(LPVOID lpParameter)
+static void * nativeThreadProc(void * userData)
 {
-    clTask * task = (clTask *)lpParameter;
-    task->func(task->userData);
-    return 0;
+    workerThreadProc(userData);
+    return NULL;
 }
 
-static void nativeTaskStart(clContext * C, clTask * task)
+static clBool nativeThreadStart(clNativeThread * thread, void * userData)
 {
-    DWORD threadId;
-    clNativeTask * nativeTask = clAllocateStruct(clNativeTask);
-    task->nativeData = nativeTask;
-    nativeTask->hThread = CreateThread(NULL, 0, taskThreadProc, task, 0, &threadId);
+    return (pthread_create(thread, NULL, nativeThreadProc, userData) == 0) ? clTrue : clFalse;
 }
 
-static void nativeTaskJoin(clContext * C, clTask * task)
+static void nativeThreadJoin(clNativeThread * thread)
 {
-    clNativeTask * nativeTask = (clNativeTask *)task->nativeData;
-    WaitForSingleObject(nativeTask->hThread, INFINITE);
-    CloseHandle(nativeTask->hThread);
-    clFree(task->nativeData);
-    task->nativeData = NULL;
+    pthread_join(*thread, NULL);
 }
 
-#else /* ifdef _WIN32 */
-
 #ifdef __APPLE__
 
 #include <sys/sysctl.h>
@@ -125,33 +140,442 @@ int clTaskLimit()
 }
 #endif /* ifdef __APPLE__ */
 
-#include <pthread.h>
+#endif /* ifdef _WIN32 */
+
+// ---------------------------------------------------------------------------
+// Task pool
+//
+// Every piece of work is a job: a range of indices belonging to a batch (one clTaskParallelFor() call,
+// or one clTask). Running a job first splits off its upper halves (down to the batch's chunk size) and
+// pushes them onto the running worker's deque, so the work a thread generates stays with that thread
+// until somebody idle steals it. Owners pop the newest job (tail), thieves take the oldest (head), which
+// hands thieves the biggest remaining pieces. All deques share a single pool mutex; jobs are coarse
+// (thousands of pixels), so the lock is never held for long.
+
+#define CL_TASK_DEQUE_SIZE 256
+
+typedef struct clTaskBatch
+{
+    clTaskRangeFunc func;
+    void * userData;
+    int chunkSize;
+    int maxWorkers; // how many pool workers may run this batch's jobs at once (waiting threads also help)
+    int running;    // pool workers currently running one of this batch's jobs
+    int remaining;  // indices not yet finished
+} clTaskBatch;
+
+typedef struct clTaskJob
+{
+    clTaskBatch * batch;
+    int start;
+    int end;
+} clTaskJob;
+
+typedef struct clTaskDeque
+{
+    clTaskJob jobs[CL_TASK_DEQUE_SIZE];
+    int head; // thieves take from here
+    int tail; // the owner pushes and pops here
+} clTaskDeque;
+
+typedef struct clTaskWorker
+{
+    struct clTaskPool * pool;
+    int index;
+    clTaskDeque deque;
+    clNativeThread thread;
+} clTaskWorker;
+
+typedef struct clTaskPool
+{
+    clContext * C;
+    clNativeMutex mutex;
+    clNativeCond cond; // broadcast whenever jobs are pushed or a batch finishes
+    clTaskWorker * workers;
+    int workerCount;
+    int nextWorker; // deque that receives jobs pushed by threads outside of the pool
+    clBool quit;
+} clTaskPool;
+
+// Must be called with the pool mutex held. self is the pushing worker's index, or -1 for outside threads.
+static clBool poolPushJob(clTaskPool * pool, int self, const clTaskJob * job)
+{
+    clTaskDeque * deque;
+    if (self < 0) {
+        self = pool->nextWorker;
+        pool->nextWorker = (pool->nextWorker + 1) % pool->workerCount;
+    }
+    deque = &pool->workers[self].deque;
+    if ((deque->tail - deque->head) >= CL_TASK_DEQUE_SIZE) {
+        return clFalse; // full; the caller runs the job itself
+    }
+    deque->jobs[deque->tail % CL_TASK_DEQUE_SIZE] = *job;
+    ++deque->tail;
+    return clTrue;
+}
+
+static clBool poolJobRunnable(const clTaskJob * job, int self, const clTaskBatch * onlyBatch)
+{
+    if (onlyBatch && (job->batch != onlyBatch)) {
+        return clFalse;
+    }
+    if ((self >= 0) && (job->batch->running >= job->batch->maxWorkers)) {
+        return clFalse;
+    }
+    return clTrue;
+}
+
+// Must be called with the pool mutex held. Workers try their own deque first (newest job), then steal
+// the oldest job from everyone else. A non-NULL onlyBatch searches every queued job for that batch's.
+static clBool poolTakeJob(clTaskPool * pool, int self, const clTaskBatch * onlyBatch, clTaskJob * outJob)
+{
+    clTaskDeque * deque;
+    int i;
+
+    if (onlyBatch) {
+        // A waiting thread has to be able to reach its own batch's jobs wherever they are queued: they
+        // may be buried under jobs that belong to other waiting threads. Swap the oldest job into the hole.
+        for (i = 0; i < pool->workerCount; ++i) {
+            int pos;
+            deque = &pool->workers[i].deque;
+            for (pos = deque->head; pos < deque->tail; ++pos) {
+                clTaskJob * job = &deque->jobs[pos % CL_TASK_DEQUE_SIZE];
+                if (poolJobRunnable(job, self, onlyBatch)) {
+                    *outJob = *job;
+                    *job = deque->jobs[deque->head % CL_TASK_DEQUE_SIZE];
+                    ++deque->head;
+                    goto found;
+                }
+            }
+        }
+        return clFalse;
+    }
+
+    if (self >= 0) {
+        deque = &pool->workers[self].deque;
+        if (deque->tail > deque->head) {
+            clTaskJob * job = &deque->jobs[(deque->tail - 1) % CL_TASK_DEQUE_SIZE];
+            if (poolJobRunnable(job, self, onlyBatch)) {
+                *outJob = *job;
+                --deque->tail;
+                goto found;
+            }
+        }
+    }
+
+    for (i = 1; i <= pool->workerCount; ++i) {
+        int victim = (self + i + pool->workerCount) % pool->workerCount;
+        if (victim == self) {
+            continue;
+        }
+        deque = &pool->workers[victim].deque;
+        if (deque->tail > deque->head) {
+            clTaskJob * job = &deque->jobs[deque->head % CL_TASK_DEQUE_SIZE];
+            if (poolJobRunnable(job, self, onlyBatch)) {
+                *outJob = *job;
+                ++deque->head;
+                goto found;
+            }
+        }
+    }
+    return clFalse;
+
+found:
+    if (deque->head == deque->tail) {
+        deque->head = 0;
+        deque->tail = 0;
+    }
+    if (self >= 0) {
+        ++outJob->batch->running;
+    }
+    return clTrue;
+}
+
+// Must be called without the pool mutex held.
+static void poolRunJob(clTaskPool * pool, int self, clTaskJob job)
+{
+    clTaskBatch * batch = job.batch;
+    int start;
+
+    if ((job.end - job.start) > batch->chunkSize) {
+        nativeMutexLock(&pool->mutex);
+        while ((job.end - job.start) > batch->chunkSize) {
+            int chunks = (job.end - job.start + batch->chunkSize - 1) / batch->chunkSize;
+            clTaskJob upper;
+            upper.batch = batch;
+            upper.start = job.start + (chunks / 2) * batch->chunkSize;
+            upper.end = job.end;
+            if (!poolPushJob(pool, self, &upper)) {
+                break;
+            }
+            job.end = upper.start;
+        }
+        nativeCondBroadcast(&pool->cond);
+        nativeMutexUnlock(&pool->mutex);
+    }
+
+    for (start = job.start; start < job.end; start += batch->chunkSize) {
+        int end = start + batch->chunkSize;
+        batch->func(batch->userData, start, (end < job.end) ? end : job.end);
+    }
+
+    nativeMutexLock(&pool->mutex);
+    batch->remaining -= job.end - job.start;
+    if (self >= 0) {
+        --batch->running;
+    }
+    if (batch->remaining == 0) {
+        nativeCondBroadcast(&pool->cond);
+    }
+    nativeMutexUnlock(&pool->mutex);
+}
+
+// Runs the batch's queued jobs on the calling thread until every index in it has finished.
+static void poolWaitBatch(clTaskPool * pool, clTaskBatch * batch)
+{
+    clTaskJob job;
+    nativeMutexLock(&pool->mutex);
+    while (batch->remaining > 0) {
+        if (poolTakeJob(pool, -1, batch, &job)) {
+            nativeMutexUnlock(&pool->mutex);
+            poolRunJob(pool, -1, job);
+            nativeMutexLock(&pool->mutex);
+        } else {
+            nativeCondWait(&pool->cond, &pool->mutex);
+        }
+    }
+    nativeMutexUnlock(&pool->mutex);
+}
+
+static void workerThreadProc(void * userData)
+{
+    clTaskWorker * worker = (clTaskWorker *)userData;
+    clTaskPool * pool = worker->pool;
+    clTaskJob job;
+
+    nativeMutexLock(&pool->mutex);
+    for (;;) {
+        if (poolTakeJob(pool, worker->index, NULL, &job)) {
+            nativeMutexUnlock(&pool->mutex);
+            poolRunJob(pool, worker->index, job);
+            nativeMutexLock(&pool->mutex);
+        } else if (pool->quit) {
+            break;
+        } else {
+            nativeCondWait(&pool->cond, &pool->mutex);
+        }
+    }
+    nativeMutexUnlock(&pool->mutex);
+}
 
-typedef struct clNativeTask
+clTaskPool * clTaskPoolCreate(struct clContext * C, int workerCount)
 {
-    pthread_t pthread;
-} clNativeTask;
+    int i;
+    clTaskPool * pool = clAllocateStruct(clTaskPool);
+    pool->C = C;
+    nativeMutexInit(&pool->mutex);
+    nativeCondInit(&pool->cond);
+    pool->workers = NULL;
+    pool->workerCount = 0;
+    pool->nextWorker = 0;
+    pool->quit = clFalse;
+
+    if (workerCount > 0) {
+        pool->workers = (clTaskWorker *)clAllocate(sizeof(clTaskWorker) * workerCount);
+        for (i = 0; i < workerCount; ++i) {
+            clTaskWorker * worker = &pool->workers[i];
+            worker->pool = pool;
+            worker->index = i;
+            worker->deque.head = 0;
+            worker->deque.tail = 0;
+        }
+        // Deques must exist before any worker starts stealing, and workerCount must only count live threads
+        nativeMutexLock(&pool->mutex);
+        for (i = 0; i < workerCount; ++i) {
+            if (!nativeThreadStart(&pool->workers[i].thread, &pool->workers[i])) {
+                break;
+            }
+            ++pool->workerCount;
+        }
+        nativeMutexUnlock(&pool->mutex);
+    }
+    return pool;
+}
+
+void clTaskPoolDestroy(struct clContext * C, clTaskPool * pool)
+{
+    int i;
+    nativeMutexLock(&pool->mutex);
+    pool->quit = clTrue;
+    nativeCondBroadcast(&pool->cond);
+    nativeMutexUnlock(&pool->mutex);
+    for (i = 0; i < pool->workerCount; ++i) {
+        nativeThreadJoin(&pool->workers[i].thread);
+    }
+    if (pool->workers) {
+        clFree(pool->workers);
+    }
+    nativeCondDestroy(&pool->cond);
+    nativeMutexDestroy(&pool->mutex);
+    clFree(pool);
+}
+
+static clTaskPool * contextTaskPool(struct clContext * C)
+{
+    if (!C->taskPool) {
+        int threadCount = clTaskLimit();
+        if (threadCount < C->params.jobs) {
+            threadCount = C->params.jobs;
+        }
+        C->taskPool = clTaskPoolCreate(C, threadCount - 1);
+    }
+    return C->taskPool;
+}
+
+void clTaskParallelFor(struct clContext * C, int maxThreads, int count, int chunkSize, clTaskRangeFunc func, void * userData)
+{
+    clTaskPool * pool = NULL;
+    clTaskBatch batch;
+    clTaskJob job;
+    int chunkCount;
+    int sliceCount;
+    int i;
+
+    if (count <= 0) {
+        return;
+    }
+    if (chunkSize < 1) {
+        chunkSize = 1;
+    }
+    if ((maxThreads > 1) && (count > chunkSize)) {
+        pool = contextTaskPool(C);
+    }
+    if (!pool || (pool->workerCount == 0)) {
+        int start;
+        for (start = 0; start < count; start += chunkSize) {
+            int end = start + chunkSize;
+            func(userData, start, (end < count) ? end : count);
+        }
+        return;
+    }
+
+    batch.func = func;
+    batch.userData = userData;
+    batch.chunkSize = chunkSize;
+    batch.maxWorkers = (maxThreads - 1 < pool->workerCount) ? (maxThreads - 1) : pool->workerCount;
+    batch.running = 0;
+    batch.remaining = count;
 
-static void * taskThreadProc(void * userData)
+    // Hand every participating thread its own slice up front, so nobody has to wait on a split to get started.
+    // Slices are pushed last-to-first; if a deque is full, the calling thread keeps the rest of the range.
+    chunkCount = (count + chunkSize - 1) / chunkSize;
+    sliceCount = (batch.maxWorkers + 1 < chunkCount) ? (batch.maxWorkers + 1) : chunkCount;
+    job.batch = &batch;
+    job.start = 0;
+    job.end = count;
+    nativeMutexLock(&pool->mutex);
+    for (i = sliceCount - 1; i > 0; --i) {
+        clTaskJob slice;
+        slice.batch = &batch;
+        slice.start = (int)(((int64_t)chunkCount * i) / sliceCount) * chunkSize;
+        slice.end = job.end;
+        if (!poolPushJob(pool, -1, &slice)) {
+            break;
+        }
+        job.end = slice.start;
+    }
+    nativeCondBroadcast(&pool->cond);
+    nativeMutexUnlock(&pool->mutex);
+
+    poolRunJob(pool, -1, job);
+    poolWaitBatch(pool, &batch);
+}
+
+// ---------------------------------------------------------------------------
+// clTask (a single-index batch on the pool)
+
+static void taskRangeFunc(void * userData, int start, int end)
 {
     clTask * task = (clTask *)userData;
+    COLORIST_UNUSED(start);
+    COLORIST_UNUSED(end);
     task->func(task->userData);
-    pthread_exit(NULL);
 }
 
-static void nativeTaskStart(clContext * C, clTask * task)
+clTask * clTaskCreate(struct clContext * C, clTaskFunc func, void * userData)
 {
-    clNativeTask * nativeTask = clAllocateStruct(clNativeTask);
-    task->nativeData = nativeTask;
-    pthread_create(&nativeTask->pthread, NULL, taskThreadProc, task);
+    clTaskPool * pool = contextTaskPool(C);
+    clTask * task = clAllocateStruct(clTask);
+    task->func = func;
+    task->nativeData = NULL;
+    task->userData = userData;
+    task->joined = clFalse;
+
+    if (pool->workerCount > 0) {
+        clTaskBatch * batch = clAllocateStruct(clTaskBatch);
+        clTaskJob job;
+        batch->func = taskRangeFunc;
+        batch->userData = task;
+        batch->chunkSize = 1;
+        batch->maxWorkers = pool->workerCount;
+        batch->running = 0;
+        batch->remaining = 1;
+        job.batch = batch;
+        job.start = 0;
+        job.end = 1;
+
+        nativeMutexLock(&pool->mutex);
+        if (poolPushJob(pool, -1, &job)) {
+            task->nativeData = batch;
+            nativeCondBroadcast(&pool->cond);
+        }
+        nativeMutexUnlock(&pool->mutex);
+        if (task->nativeData) {
+            return task;
+        }
+        clFree(batch);
+    }
+
+    // No worker threads (or no room to queue): run it right now
+    func(userData);
+    return task;
 }
 
-static void nativeTaskJoin(clContext * C, clTask * task)
+void clTaskJoin(struct clContext * C, clTask * task)
 {
-    clNativeTask * nativeTask = (clNativeTask *)task->nativeData;
-    pthread_join(nativeTask->pthread, NULL);
-    clFree(task->nativeData);
-    task->nativeData = NULL;
+    if (!task->joined) {
+        if (task->nativeData) {
+            clTaskBatch * batch = (clTaskBatch *)task->nativeData;
+            poolWaitBatch(C->taskPool, batch);
+            clFree(batch);
+            task->nativeData = NULL;
+        }
+        task->joined = clTrue;
+    }
 }
 
-#endif /* ifdef _WIN32 */
+void clTaskDestroy(struct clContext * C, clTask * task)
+{
+    clTaskJoin(C, task);
+    COLORIST_ASSERT(task->joined);
+    COLORIST_ASSERT(task->nativeData == NULL);
+    clFree(task);
+}
+
+// ---------------------------------------------------------------------------
+// Task flags
+
+void clTaskFlagClear(clTaskFlag * flag)
+{
+    nativeAtomicStore(&flag->raised, 0);
+}
+
+void clTaskFlagRaise(clTaskFlag * flag)
+{
+    nativeAtomicStore(&flag->raised, 1);
+}
+
+clBool clTaskFlagIsRaised(clTaskFlag * flag)
+{
+    return nativeAtomicLoad(&flag->raised) ? clTrue : clFalse;
+}
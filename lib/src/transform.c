@@ -15,10 +15,13 @@
 // this close.)
 #define AUTO_TONEMAP_LUMINANCE_SCALE_THRESHOLD (1.001f)
 
-#define SRC_16_HAS_ALPHA() (srcPixelBytes > 7)
+// Integer pixels are uint8_t per channel at depth 8 (matching clImage's storage), uint16_t otherwise
+#define UNORM_CHANNEL_BYTES(DEPTH) (((DEPTH) == 8) ? 1 : 2)
+
+#define SRC_UNORM_HAS_ALPHA() (srcPixelBytes == (4 * UNORM_CHANNEL_BYTES(srcDepth)))
 #define SRC_FLOAT_HAS_ALPHA() (srcPixelBytes > 15)
 
-#define DST_16_HAS_ALPHA() (dstPixelBytes > 7)
+#define DST_UNORM_HAS_ALPHA() (dstPixelBytes == (4 * UNORM_CHANNEL_BYTES(dstDepth)))
 #define DST_FLOAT_HAS_ALPHA() (dstPixelBytes > 15)
 
 static cmsUInt32Number clTransformFormatToLCMSFormat(struct clContext * C, clTransformFormat format);
@@ -211,6 +214,171 @@ static clBool derivePrimariesAndXTF(struct clContext * C, struct clProfile * pro
     return clTrue;
 }
 
+static float ccmmEOTF(const struct clTransform * transform, float N)
+{
+    N = (N >= 0.0f) ? N : 0.0f;
+    switch (transform->ccmmSrcEOTF) {
+        case CL_XTF_GAMMA:
+            return powf(N, transform->ccmmSrcGamma);
+        case CL_XTF_HLG:
+            return HLG_EOTF(N, transform->ccmmHLGLuminance);
+        case CL_XTF_PQ:
+            return PQ_EOTF(N);
+        default:
+        case CL_XTF_NONE:
+            break;
+    }
+    return N;
+}
+
+static float ccmmOETF(const struct clTransform * transform, float L)
+{
+    L = (L >= 0.0f) ? L : 0.0f;
+    switch (transform->ccmmDstOETF) {
+        case CL_XTF_GAMMA:
+            return powf(L, transform->ccmmDstInvGamma);
+        case CL_XTF_HLG:
+            return HLG_OETF(L, transform->ccmmHLGLuminance);
+        case CL_XTF_PQ:
+            return PQ_OETF(L);
+        default:
+        case CL_XTF_NONE:
+            break;
+    }
+    return L;
+}
+
+// Integer sources have at most 65536 distinct code values per channel, so the EOTF is evaluated
+// once per code value here instead of three times per pixel. The results are bit-exact.
+static void prepareSrcEOTFTable(struct clContext * C, struct clTransform * transform)
+{
+    COLORIST_UNUSED(C);
+
+    int srcDepth = transform->srcDepth;
+    if ((transform->ccmmSrcEOTF == CL_XTF_NONE) || clTransformFormatIsFloat(C, transform->srcFormat, srcDepth) || (srcDepth > 16)) {
+        return;
+    }
+
+    const int tableSize = 1 << srcDepth;
+    const float srcRescale = 1.0f / (float)(tableSize - 1);
+    transform->ccmmSrcEOTFTable = clAllocate(sizeof(float) * tableSize);
+    for (int i = 0; i < tableSize; ++i) {
+        transform->ccmmSrcEOTFTable[i] = ccmmEOTF(transform, (float)i * srcRescale);
+    }
+}
+
+// The destination side is continuous (it follows the matrix math), so it is sampled densely and
+// interpolated. This is within a small fraction of a 16-bit code value for gamma and HLG curves
+// and within float noise of PQ_OETF() itself, so it is only used when quantizing to integers.
+static void prepareDstOETFTable(struct clContext * C, struct clTransform * transform)
+{
+    if ((transform->ccmmDstOETF == CL_XTF_NONE) || !transform->dstProfile || clTransformFormatIsFloat(C, transform->dstFormat, transform->dstDepth)) {
+        return;
+    }
+
+    transform->ccmmDstOETFTable = clAllocate(sizeof(float) * (CL_TRANSFORM_OETF_TABLE_SIZE + 1));
+    for (int i = 0; i <= CL_TRANSFORM_OETF_TABLE_SIZE; ++i) {
+        float u = (float)i / (float)CL_TRANSFORM_OETF_TABLE_SIZE;
+        float u2 = u * u;
+        transform->ccmmDstOETFTable[i] = ccmmOETF(transform, u2 * u2);
+    }
+}
+
+static float lookupOETF(const float * table, float L)
+{
+    L = (L >= 0.0f) ? L : 0.0f; // also catches NaN
+    L = (L <= 1.0f) ? L : 1.0f;
+    float x = sqrtf(sqrtf(L)) * (float)CL_TRANSFORM_OETF_TABLE_SIZE;
+    int index = (int)x;
+    if (index >= CL_TRANSFORM_OETF_TABLE_SIZE) {
+        index = CL_TRANSFORM_OETF_TABLE_SIZE - 1;
+    }
+    float t = x - (float)index;
+    return table[index] + ((table[index + 1] - table[index]) * t);
+}
+
+// spanLuminanceScale() turns any pixel whose Y (or X+Y+Z) isn't positive black, which a plain matrix (or
+// lcmsCombined) can't do. Every source EOTF clamps negative channels to 0 first, so that only happens when
+// some source primary adds no positive Y or X+Y+Z (such as AP0's blue, whose y is negative, or X and Z of
+// an XYZ source). LittleCMS doesn't expose its matrix, so LCMS checks the one derived from the primaries.
+static clBool srcLuminanceAlwaysPositive(struct clContext * C, const struct clTransform * transform, clBool useCCMM)
+{
+    gbMat3 srcToXYZ;
+    if (useCCMM) {
+        srcToXYZ = transform->ccmmSrcToXYZ;
+    } else {
+        clProfilePrimaries srcPrimaries;
+        if (!transform->srcProfile || !clProfileQuery(C, transform->srcProfile, &srcPrimaries, NULL, NULL)) {
+            return clFalse;
+        }
+        clTransformDeriveXYZMatrix(C, &srcPrimaries, &srcToXYZ);
+    }
+
+    const float * A = srcToXYZ.e;
+    for (int col = 0; col < 3; ++col) {
+        if ((A[3 + col] <= 0.0f) || ((A[col] + A[3 + col] + A[6 + col]) <= 0.0f)) {
+            return clFalse;
+        }
+    }
+    return clTrue;
+}
+
+// Decides how clTransformRun() executes the color math for one engine, starting with whether it needs
+// luminance scaling at all (CCMM compares the curve-scaled luminances, LCMS the raw ones), so it must
+// run again whenever the engine changes. Without a tonemap, the luminance scale is a plain multiplier
+// on XYZ, so a CCMM transform can fold src->XYZ, the luminance scale, and XYZ->dst into a single
+// matrix, as long as no pixel would have been blacked out for its Y (see srcLuminanceAlwaysPositive()).
+// LCMS skips XYZ entirely under the same conditions, with nothing to scale. A tonemap depends on Y, so
+// it still needs XYZ, but as a ratio applied to all three channels instead of a trip through xyY.
+static void compilePlan(struct clContext * C, struct clTransform * transform, clBool useCCMM)
+{
+    clBool luminanceMismatch;
+    if (useCCMM) {
+        luminanceMismatch = (fabsf((transform->srcLuminanceScale * transform->srcCurveScale) - (transform->dstLuminanceScale * transform->dstCurveScale)) > 0.00001f) ? clTrue : clFalse;
+    } else {
+        // LCMS applies both curve scales on its own
+        luminanceMismatch = (fabsf(transform->srcLuminanceScale - transform->dstLuminanceScale) > 0.00001f) ? clTrue : clFalse;
+    }
+
+    if (!transform->srcProfile || !transform->dstProfile || transform->tonemapEnabled || luminanceMismatch) {
+        transform->luminanceScaleEnabled = clTrue;
+    } else {
+        transform->luminanceScaleEnabled = clFalse;
+    }
+
+    if (useCCMM) {
+        // Apply srcCurveScale as CCMM, if any (LCMS implicitly does this)
+        transform->luminanceScale = transform->srcCurveScale * transform->srcLuminanceScale / transform->dstLuminanceScale / transform->dstCurveScale;
+        transform->luminancePostScale = 1.0f;
+    } else {
+        // Re-apply dst scale for LCMS after any tonemap, as it expects the XYZ->Dst input to be overranged
+        transform->luminanceScale = transform->srcLuminanceScale / transform->dstLuminanceScale / transform->dstCurveScale;
+        transform->luminancePostScale = transform->dstCurveScale;
+    }
+
+    transform->planUsesCCMM = useCCMM;
+    if (useCCMM && !transform->tonemapEnabled && (!transform->luminanceScaleEnabled || srcLuminanceAlwaysPositive(C, transform, useCCMM))) {
+        const float * A = transform->ccmmSrcToXYZ.e;
+        const float * B = transform->ccmmXYZToDst.e;
+        double scale = transform->luminanceScaleEnabled ? (double)transform->luminanceScale : 1.0;
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                double v = 0.0;
+                for (int k = 0; k < 3; ++k) {
+                    v += (double)B[(row * 3) + k] * (double)A[(k * 3) + col];
+                }
+                transform->ccmmPlanMatrix.e[(row * 3) + col] = (float)(v * scale);
+            }
+        }
+        DEBUG_PRINT_MATRIX("Plan", &transform->ccmmPlanMatrix);
+        transform->plan = CL_XPLAN_MATRIX;
+    } else if (!useCCMM && !transform->luminanceScaleEnabled && srcLuminanceAlwaysPositive(C, transform, useCCMM)) {
+        transform->plan = CL_XPLAN_LCMS;
+    } else {
+        transform->plan = CL_XPLAN_LUMINANCE;
+    }
+}
+
 void clTransformPrepare(struct clContext * C, struct clTransform * transform)
 {
     clBool useCCMM = clTransformUsesCCMM(C, transform);
@@ -287,12 +455,6 @@ void clTransformPrepare(struct clContext * C, struct clTransform * transform)
                 transform->tonemapEnabled = clFalse;
                 break;
         }
-
-        if (!useCCMM || !transform->srcProfile || !transform->dstProfile || transform->tonemapEnabled || (fabsf((transform->srcLuminanceScale * transform->srcCurveScale) - (transform->dstLuminanceScale * transform->dstCurveScale)) > 0.00001f)) {
-            transform->luminanceScaleEnabled = clTrue;
-        } else {
-            transform->luminanceScaleEnabled = clFalse;
-        }
     }
 
     if (useCCMM) {
@@ -333,7 +495,11 @@ void clTransformPrepare(struct clContext * C, struct clTransform * transform)
             gb_mat3_mul(&transform->ccmmCombined, &transform->ccmmSrcToXYZ, &transform->ccmmXYZToDst);
             DEBUG_PRINT_MATRIX("MA*MB", &transform->ccmmCombined);
 
+            prepareSrcEOTFTable(C, transform);
+            prepareDstOETFTable(C, transform);
+
             transform->ccmmReady = clTrue;
+            compilePlan(C, transform, useCCMM);
         }
     } else {
         // Prepare LittleCMS
@@ -375,250 +541,250 @@ void clTransformPrepare(struct clContext * C, struct clTransform * transform)
                 INTENT_ABSOLUTE_COLORIMETRIC, cmsFLAGS_COPY_ALPHA | cmsFLAGS_NOOPTIMIZE);
 
             transform->lcmsReady = clTrue;
+            compilePlan(C, transform, useCCMM);
         }
     }
-}
-
-// The real color conversion function
-static void transformFloatToFloat(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
-{
-    for (int i = 0; i < pixelCount; ++i) {
-        float * srcPixel = (float *)&srcPixels[i * srcPixelBytes];
-        float * dstPixel = (float *)&dstPixels[i * dstPixelBytes];
-        gbVec3 src;
-        float XYZ[3];
-
-        if (useCCMM) {
-            switch (transform->ccmmSrcEOTF) {
-                default:
-                case CL_XTF_NONE:
-                    memcpy(&src, srcPixel, sizeof(src));
-                    break;
-                case CL_XTF_GAMMA:
-                    src.x = powf((srcPixel[0] >= 0.0f) ? srcPixel[0] : 0.0f, transform->ccmmSrcGamma);
-                    src.y = powf((srcPixel[1] >= 0.0f) ? srcPixel[1] : 0.0f, transform->ccmmSrcGamma);
-                    src.z = powf((srcPixel[2] >= 0.0f) ? srcPixel[2] : 0.0f, transform->ccmmSrcGamma);
-                    break;
-                case CL_XTF_HLG:
-                    src.x = HLG_EOTF((srcPixel[0] >= 0.0f) ? srcPixel[0] : 0.0f, transform->ccmmHLGLuminance);
-                    src.y = HLG_EOTF((srcPixel[1] >= 0.0f) ? srcPixel[1] : 0.0f, transform->ccmmHLGLuminance);
-                    src.z = HLG_EOTF((srcPixel[2] >= 0.0f) ? srcPixel[2] : 0.0f, transform->ccmmHLGLuminance);
-                    break;
-                case CL_XTF_PQ:
-                    src.x = PQ_EOTF((srcPixel[0] >= 0.0f) ? srcPixel[0] : 0.0f);
-                    src.y = PQ_EOTF((srcPixel[1] >= 0.0f) ? srcPixel[1] : 0.0f);
-                    src.z = PQ_EOTF((srcPixel[2] >= 0.0f) ? srcPixel[2] : 0.0f);
-                    break;
-            }
-
-            gb_mat3_mul_vec3((gbVec3 *)XYZ, &transform->ccmmSrcToXYZ, src);
-        } else {
-            // Use LCMS
-            cmsDoTransform(transform->lcmsSrcToXYZ, srcPixel, XYZ, 1);
-        }
-
-        // if tonemapping is necessary, luminance scale MUST be enabled
-        COLORIST_ASSERT(!transform->tonemapEnabled || transform->luminanceScaleEnabled);
-
-        if (transform->luminanceScaleEnabled) {
-            float xyY[3];
-
-            // Convert to xyY
-            clTransformXYZToXYY(C, xyY, XYZ, transform->whitePointX, transform->whitePointY);
-
-            // Apply srcCurveScale as CCMM, if any (LCMS implicitly does this)
-            if (useCCMM) {
-                xyY[2] *= transform->srcCurveScale;
-            }
 
-            // Luminance scale
-            xyY[2] *= transform->srcLuminanceScale;
-            xyY[2] /= transform->dstLuminanceScale;
-
-            // Apply inverse dstCurveScale prior to tonemapping to ensure tonemap gets [0-1] range
-            xyY[2] /= transform->dstCurveScale;
-
-            // Tonemap
-            if (transform->tonemapEnabled) {
-                // reinhard tonemap
-                xyY[2] = xyY[2] / (1.0f + xyY[2]);
-            }
-
-            if (!useCCMM) {
-                // Re-apply dst scale for LCMS as it expects the XYZ->Dst input to be overranged
-                xyY[2] *= transform->dstCurveScale;
-            }
+    if (transform->planUsesCCMM != useCCMM) {
+        // Both engines were set up earlier and the context has since switched between them
+        compilePlan(C, transform, useCCMM);
+    }
+}
 
-            // Convert to XYZ
-            clTransformXYYToXYZ(C, XYZ, xyY);
-        }
+// ----------------------------------------------------------------------------
+// Span transform
 
-        if (useCCMM) {
-            float tmp[3];
-            memcpy(&src, XYZ, sizeof(src));
-
-            switch (transform->ccmmDstOETF) {
-                case CL_XTF_NONE:
-                    gb_mat3_mul_vec3((gbVec3 *)dstPixel, &transform->ccmmXYZToDst, src);
-                    if (transform->dstProfile) {                         // don't clamp XYZ
-                        dstPixel[0] = CL_CLAMP(dstPixel[0], 0.0f, 1.0f); // clamp
-                        dstPixel[1] = CL_CLAMP(dstPixel[1], 0.0f, 1.0f); // clamp
-                        dstPixel[2] = CL_CLAMP(dstPixel[2], 0.0f, 1.0f); // clamp
+// Applies a transfer function to the first three planar channels of a span. Negative values are
+// clamped to 0 prior to the curve, just like the per-pixel math always has.
+static void spanTransferFunction(clTransformSpan * span, clTransformTransferFunction xtf, clBool eotf, float gamma, float hlgLuminance, int count)
+{
+    for (int c = 0; c < 3; ++c) {
+        float * ch = span->ch[c];
+        switch (xtf) {
+            default:
+            case CL_XTF_NONE:
+                return;
+            case CL_XTF_GAMMA:
+                for (int i = 0; i < count; ++i) {
+                    ch[i] = powf((ch[i] >= 0.0f) ? ch[i] : 0.0f, gamma);
+                }
+                break;
+            case CL_XTF_HLG:
+                if (eotf) {
+                    for (int i = 0; i < count; ++i) {
+                        ch[i] = HLG_EOTF((ch[i] >= 0.0f) ? ch[i] : 0.0f, hlgLuminance);
                     }
-                    break;
-                case CL_XTF_GAMMA:
-                    gb_mat3_mul_vec3((gbVec3 *)tmp, &transform->ccmmXYZToDst, src);
-                    if (transform->dstProfile) {               // don't clamp XYZ
-                        tmp[0] = CL_CLAMP(tmp[0], 0.0f, 1.0f); // clamp
-                        tmp[1] = CL_CLAMP(tmp[1], 0.0f, 1.0f); // clamp
-                        tmp[2] = CL_CLAMP(tmp[2], 0.0f, 1.0f); // clamp
+                } else {
+                    for (int i = 0; i < count; ++i) {
+                        ch[i] = HLG_OETF((ch[i] >= 0.0f) ? ch[i] : 0.0f, hlgLuminance);
                     }
-                    dstPixel[0] = powf((tmp[0] >= 0.0f) ? tmp[0] : 0.0f, transform->ccmmDstInvGamma);
-                    dstPixel[1] = powf((tmp[1] >= 0.0f) ? tmp[1] : 0.0f, transform->ccmmDstInvGamma);
-                    dstPixel[2] = powf((tmp[2] >= 0.0f) ? tmp[2] : 0.0f, transform->ccmmDstInvGamma);
-                    break;
-                case CL_XTF_HLG:
-                    gb_mat3_mul_vec3((gbVec3 *)tmp, &transform->ccmmXYZToDst, src);
-                    if (transform->dstProfile) {               // don't clamp XYZ
-                        tmp[0] = CL_CLAMP(tmp[0], 0.0f, 1.0f); // clamp
-                        tmp[1] = CL_CLAMP(tmp[1], 0.0f, 1.0f); // clamp
-                        tmp[2] = CL_CLAMP(tmp[2], 0.0f, 1.0f); // clamp
+                }
+                break;
+            case CL_XTF_PQ:
+                if (eotf) {
+                    for (int i = 0; i < count; ++i) {
+                        ch[i] = PQ_EOTF((ch[i] >= 0.0f) ? ch[i] : 0.0f);
                     }
-                    dstPixel[0] = HLG_OETF((tmp[0] >= 0.0f) ? tmp[0] : 0.0f, transform->ccmmHLGLuminance);
-                    dstPixel[1] = HLG_OETF((tmp[1] >= 0.0f) ? tmp[1] : 0.0f, transform->ccmmHLGLuminance);
-                    dstPixel[2] = HLG_OETF((tmp[2] >= 0.0f) ? tmp[2] : 0.0f, transform->ccmmHLGLuminance);
-                    break;
-                case CL_XTF_PQ:
-                    gb_mat3_mul_vec3((gbVec3 *)tmp, &transform->ccmmXYZToDst, src);
-                    if (transform->dstProfile) {               // don't clamp XYZ
-                        tmp[0] = CL_CLAMP(tmp[0], 0.0f, 1.0f); // clamp
-                        tmp[1] = CL_CLAMP(tmp[1], 0.0f, 1.0f); // clamp
-                        tmp[2] = CL_CLAMP(tmp[2], 0.0f, 1.0f); // clamp
+                } else {
+                    for (int i = 0; i < count; ++i) {
+                        ch[i] = PQ_OETF((ch[i] >= 0.0f) ? ch[i] : 0.0f);
                     }
-                    dstPixel[0] = PQ_OETF((tmp[0] >= 0.0f) ? tmp[0] : 0.0f);
-                    dstPixel[1] = PQ_OETF((tmp[1] >= 0.0f) ? tmp[1] : 0.0f);
-                    dstPixel[2] = PQ_OETF((tmp[2] >= 0.0f) ? tmp[2] : 0.0f);
-                    break;
-            }
-        } else {
-            // LittleCMS
-            cmsDoTransform(transform->lcmsXYZToDst, XYZ, dstPixel, 1);
-            if (transform->dstProfile) {                         // don't clamp XYZ
-                dstPixel[0] = CL_CLAMP(dstPixel[0], 0.0f, 1.0f); // clamp
-                dstPixel[1] = CL_CLAMP(dstPixel[1], 0.0f, 1.0f); // clamp
-                dstPixel[2] = CL_CLAMP(dstPixel[2], 0.0f, 1.0f); // clamp
-            }
+                }
+                break;
         }
+    }
+}
 
-        if (DST_FLOAT_HAS_ALPHA()) {
-            if (SRC_FLOAT_HAS_ALPHA()) {
-                // Copy alpha
-                dstPixel[3] = srcPixel[3];
-            } else {
-                // Full alpha
-                dstPixel[3] = 1.0f;
-            }
+static void spanClamp(clTransformSpan * span, int count)
+{
+    for (int c = 0; c < 3; ++c) {
+        float * ch = span->ch[c];
+        for (int i = 0; i < count; ++i) {
+            ch[i] = CL_CLAMP(ch[i], 0.0f, 1.0f);
         }
     }
 }
 
-// ----------------------------------------------------------------------------
-// Transform wrappers for RGB/RGBA
+// Same as spanTransferFunction() for an OETF, but via the destination's prepared table
+static void spanOETFTable(clTransformSpan * span, const float * table, int count)
+{
+    for (int c = 0; c < 3; ++c) {
+        float * ch = span->ch[c];
+        for (int i = 0; i < count; ++i) {
+            ch[i] = lookupOETF(table, ch[i]);
+        }
+    }
+}
 
-static void transformFloatToRGB(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
+// Unpacks integer source pixels straight to linear light via the source's EOTF table.
+// Out of range code values (garbage in the unused high bits) are clamped to the table.
+static void unpackUNormEOTFTable(clTransformSpan * span, const uint16_t * src, int srcChannels, int srcDepth, float srcRescale, const float * table, int count)
 {
-    const int dstMaxChannel = (1 << dstDepth) - 1;
-    const float dstRescale = (float)dstMaxChannel;
+    const uint16_t maxCode = (uint16_t)((1 << srcDepth) - 1);
+    for (int i = 0; i < count; ++i) {
+        const uint16_t * srcPixel = &src[i * srcChannels];
+        span->ch[0][i] = table[(srcPixel[0] <= maxCode) ? srcPixel[0] : maxCode];
+        span->ch[1][i] = table[(srcPixel[1] <= maxCode) ? srcPixel[1] : maxCode];
+        span->ch[2][i] = table[(srcPixel[2] <= maxCode) ? srcPixel[2] : maxCode];
+        span->ch[3][i] = (srcChannels > 3) ? (float)srcPixel[3] * srcRescale : 1.0f; // RGB -> RGBA, set full opacity
+    }
+}
 
-    for (int i = 0; i < pixelCount; ++i) {
-        float tmpPixel[4];
-        int tmpPixelBytes = (DST_16_HAS_ALPHA()) ? sizeof(float) * 4 : sizeof(float) * 3;
-        float * srcPixel = (float *)&srcPixels[i * srcPixelBytes];
-        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)srcPixel, srcPixelBytes, (uint8_t *)tmpPixel, tmpPixelBytes, 1);
-        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[0], dstRescale);
-        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[1], dstRescale);
-        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[2], dstRescale);
-        if (DST_16_HAS_ALPHA()) {
-            if (SRC_FLOAT_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[3], dstRescale);
-            } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = (uint16_t)dstMaxChannel;
-            }
-        }
+// Runs a LittleCMS transform over the first three channels of a span with a single cmsDoTransform()
+// call. The span is interleaved into a scratch buffer first, as planar float support varies between
+// LittleCMS versions.
+static void lcmsTransformSpan(cmsHTRANSFORM lcmsTransform, const clTransformSpan * src, clTransformSpan * dst, int count)
+{
+    float pixels[CL_TRANSFORM_SPAN_SIZE * 3];
+    for (int i = 0; i < count; ++i) {
+        pixels[(i * 3) + 0] = src->ch[0][i];
+        pixels[(i * 3) + 1] = src->ch[1][i];
+        pixels[(i * 3) + 2] = src->ch[2][i];
+    }
+    cmsDoTransform(lcmsTransform, pixels, pixels, (cmsUInt32Number)count);
+    for (int i = 0; i < count; ++i) {
+        dst->ch[0][i] = pixels[(i * 3) + 0];
+        dst->ch[1][i] = pixels[(i * 3) + 1];
+        dst->ch[2][i] = pixels[(i * 3) + 2];
     }
 }
 
-static void transformRGBToFloat(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, int srcDepth, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+// Scales (and optionally tonemaps) the luminance of an XYZ span. This is equivalent to converting to xyY,
+// scaling Y, and converting back, but only needs the ratio of the new Y to the old Y.
+static void spanLuminanceScale(const struct clTransform * transform, clTransformSpan * span, int count)
 {
-    const float srcRescale = 1.0f / (float)((1 << srcDepth) - 1);
+    const float luminanceScale = transform->luminanceScale;
+    const float luminancePostScale = transform->luminancePostScale;
+    const clBool tonemapEnabled = transform->tonemapEnabled;
+    float * X = span->ch[0];
+    float * Y = span->ch[1];
+    float * Z = span->ch[2];
+
+    for (int i = 0; i < count; ++i) {
+        if (((X[i] + Y[i] + Z[i]) <= 0.0f) || (Y[i] <= 0.0f)) {
+            X[i] = 0.0f;
+            Y[i] = 0.0f;
+            Z[i] = 0.0f;
+            continue;
+        }
 
-    for (int i = 0; i < pixelCount; ++i) {
-        float tmpPixel[4];
-        int tmpPixelBytes = (SRC_16_HAS_ALPHA()) ? sizeof(float) * 4 : sizeof(float) * 3;
-        uint16_t * srcPixel = (uint16_t *)&srcPixels[i * srcPixelBytes];
-        float * dstPixel = (float *)&dstPixels[i * dstPixelBytes];
-        tmpPixel[0] = (float)srcPixel[0] * srcRescale;
-        tmpPixel[1] = (float)srcPixel[1] * srcRescale;
-        tmpPixel[2] = (float)srcPixel[2] * srcRescale;
-        if (DST_FLOAT_HAS_ALPHA()) {
-            if (SRC_16_HAS_ALPHA()) {
-                // reformat alpha
-                tmpPixel[3] = (float)srcPixel[3] * srcRescale;
-            } else {
-                // RGB -> RGBA, set full opacity
-                tmpPixel[3] = 1.0f;
-            }
+        float luminance = Y[i] * luminanceScale;
+        if (tonemapEnabled) {
+            // reinhard tonemap
+            luminance = luminance / (1.0f + luminance);
         }
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpPixel, tmpPixelBytes, (uint8_t *)dstPixel, dstPixelBytes, 1);
+        luminance *= luminancePostScale;
+
+        float ratio = luminance / Y[i];
+        X[i] *= ratio;
+        Y[i] = luminance;
+        Z[i] *= ratio;
     }
 }
 
-static void transformRGBToRGB(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, int srcDepth, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
+// The real color conversion function; converts the first three channels of a span in-place (alpha is untouched).
+// If eotfApplied is set, the span is already linear. If oetfTable is non-NULL, it is used instead of the OETF math.
+static void transformSpan(struct clContext * C, struct clTransform * transform, clBool useCCMM, clBool eotfApplied, const float * oetfTable, clTransformSpan * span, int count)
 {
-    const int srcMaxChannel = (1 << srcDepth) - 1;
-    const float srcRescale = 1.0f / (float)srcMaxChannel;
-    const int dstMaxChannel = (1 << dstDepth) - 1;
-    const float dstRescale = (float)dstMaxChannel;
+    COLORIST_UNUSED(C);
 
-    for (int i = 0; i < pixelCount; ++i) {
-        float tmpSrc[4];
-        float tmpDst[4];
-        uint16_t * srcPixel = (uint16_t *)&srcPixels[i * srcPixelBytes];
-        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
-        int tmpSrcBytes;
-        int tmpDstBytes;
-
-        tmpSrc[0] = (float)srcPixel[0] * srcRescale;
-        tmpSrc[1] = (float)srcPixel[1] * srcRescale;
-        tmpSrc[2] = (float)srcPixel[2] * srcRescale;
-        if (SRC_16_HAS_ALPHA()) {
-            tmpSrc[3] = (float)srcPixel[3] * srcRescale;
-            tmpSrcBytes = 16;
+    const clTransformKernels * kernels = transform->kernels;
+
+    if (useCCMM) {
+        clBool clamp = transform->dstProfile ? clTrue : clFalse; // don't clamp XYZ
+
+        if (!eotfApplied) {
+            spanTransferFunction(span, transform->ccmmSrcEOTF, clTrue, transform->ccmmSrcGamma, transform->ccmmHLGLuminance, count);
+        }
+
+        if (transform->plan == CL_XPLAN_MATRIX) {
+            kernels->matrix(span, &transform->ccmmPlanMatrix, clamp, count);
         } else {
-            tmpSrcBytes = 12;
+            // if tonemapping is necessary, luminance scale MUST be enabled
+            COLORIST_ASSERT(!transform->tonemapEnabled || transform->luminanceScaleEnabled);
+
+            kernels->matrix(span, &transform->ccmmSrcToXYZ, clFalse, count);
+            spanLuminanceScale(transform, span, count);
+            kernels->matrix(span, &transform->ccmmXYZToDst, clamp, count);
         }
-        if (DST_16_HAS_ALPHA()) {
-            tmpDstBytes = 16;
+
+        if (oetfTable) {
+            spanOETFTable(span, oetfTable, count);
+        } else {
+            spanTransferFunction(span, transform->ccmmDstOETF, clFalse, transform->ccmmDstInvGamma, transform->ccmmHLGLuminance, count);
+        }
+    } else {
+        // LittleCMS, one call per stage
+        if (transform->plan == CL_XPLAN_LCMS) {
+            lcmsTransformSpan(transform->lcmsCombined, span, span, count);
         } else {
-            tmpDstBytes = 12;
+            lcmsTransformSpan(transform->lcmsSrcToXYZ, span, span, count);
+            spanLuminanceScale(transform, span, count);
+            lcmsTransformSpan(transform->lcmsXYZToDst, span, span, count);
         }
 
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpSrc, tmpSrcBytes, (uint8_t *)tmpDst, tmpDstBytes, 1);
+        if (transform->dstProfile) { // don't clamp XYZ
+            spanClamp(span, count);
+        }
+    }
+}
 
-        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(tmpDst[0], dstRescale);
-        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(tmpDst[1], dstRescale);
-        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(tmpDst[2], dstRescale);
-        if (DST_16_HAS_ALPHA()) {
-            if (SRC_16_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(tmpDst[3], dstRescale);
+// Unpacks, transforms, and packs pixels one span at a time. Float formats are 3 or 4 floats per pixel,
+// all other formats are 3 or 4 uint16_t (uint8_t at depth 8) per pixel. Alpha is carried through the span
+// untouched. 8-bit pixels are widened into (and narrowed out of) a span-sized uint16_t buffer so that every
+// depth shares the same unpack/pack kernels.
+static void transformPixels(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, int srcDepth, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
+{
+    const clTransformKernels * kernels = transform->kernels;
+    const clBool srcIsFloat = clTransformFormatIsFloat(C, transform->srcFormat, srcDepth);
+    const clBool dstIsFloat = clTransformFormatIsFloat(C, transform->dstFormat, dstDepth);
+    const int srcChannels = srcPixelBytes / (srcIsFloat ? (int)sizeof(float) : UNORM_CHANNEL_BYTES(srcDepth));
+    const int dstChannels = dstPixelBytes / (dstIsFloat ? (int)sizeof(float) : UNORM_CHANNEL_BYTES(dstDepth));
+    const float srcRescale = srcIsFloat ? 1.0f : 1.0f / (float)((1 << srcDepth) - 1);
+    const float dstRescale = dstIsFloat ? 1.0f : (float)((1 << dstDepth) - 1);
+    const float * eotfTable = (useCCMM && !srcIsFloat) ? transform->ccmmSrcEOTFTable : NULL;
+    const float * oetfTable = (useCCMM && !dstIsFloat) ? transform->ccmmDstOETFTable : NULL;
+    clTransformSpan span;
+    uint16_t widePixels[CL_TRANSFORM_SPAN_SIZE * 4];
+
+    for (int spanStart = 0; spanStart < pixelCount; spanStart += CL_TRANSFORM_SPAN_SIZE) {
+        int count = pixelCount - spanStart;
+        if (count > CL_TRANSFORM_SPAN_SIZE) {
+            count = CL_TRANSFORM_SPAN_SIZE;
+        }
+        uint8_t * srcSpanPixels = &srcPixels[spanStart * srcPixelBytes];
+        uint8_t * dstSpanPixels = &dstPixels[spanStart * dstPixelBytes];
+
+        if (srcIsFloat) {
+            kernels->unpackFloat(&span, (const float *)srcSpanPixels, srcChannels, count);
+        } else {
+            const uint16_t * srcUNorm = (const uint16_t *)srcSpanPixels;
+            if (srcDepth == 8) {
+                const int channelCount = count * srcChannels;
+                for (int i = 0; i < channelCount; ++i) {
+                    widePixels[i] = srcSpanPixels[i];
+                }
+                srcUNorm = widePixels;
+            }
+            if (eotfTable) {
+                unpackUNormEOTFTable(&span, srcUNorm, srcChannels, srcDepth, srcRescale, eotfTable, count);
             } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = (uint16_t)dstMaxChannel;
+                kernels->unpackUNorm(&span, srcUNorm, srcChannels, srcRescale, count);
+            }
+        }
+
+        transformSpan(C, transform, useCCMM, eotfTable != NULL, oetfTable, &span, count);
+
+        if (dstIsFloat) {
+            kernels->packFloat((float *)dstSpanPixels, dstChannels, &span, count);
+        } else if (dstDepth == 8) {
+            const int channelCount = count * dstChannels;
+            kernels->packUNorm(widePixels, dstChannels, &span, dstRescale, count);
+            for (int i = 0; i < channelCount; ++i) {
+                dstSpanPixels[i] = (uint8_t)widePixels[i];
             }
+        } else {
+            kernels->packUNorm((uint16_t *)dstSpanPixels, dstChannels, &span, dstRescale, count);
         }
     }
 }
@@ -645,6 +811,20 @@ static void reformatFloatToFloat(struct clContext * C, uint8_t * srcPixels, int
     }
 }
 
+static uint16_t loadUNorm(const uint8_t * pixel, int channel, int depth)
+{
+    return (depth == 8) ? pixel[channel] : ((const uint16_t *)pixel)[channel];
+}
+
+static void storeUNorm(uint8_t * pixel, int channel, int depth, uint16_t value)
+{
+    if (depth == 8) {
+        pixel[channel] = (uint8_t)value;
+    } else {
+        ((uint16_t *)pixel)[channel] = value;
+    }
+}
+
 static void reformatFloatToRGB(struct clContext * C, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
 {
     COLORIST_UNUSED(C);
@@ -653,17 +833,17 @@ static void reformatFloatToRGB(struct clContext * C, uint8_t * srcPixels, int sr
     const float dstRescale = (float)dstMaxChannel;
     for (int i = 0; i < pixelCount; ++i) {
         float * srcPixel = (float *)&srcPixels[i * srcPixelBytes];
-        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
-        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(srcPixel[0], dstRescale);
-        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(srcPixel[1], dstRescale);
-        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(srcPixel[2], dstRescale);
-        if (DST_16_HAS_ALPHA()) {
+        uint8_t * dstPixel = &dstPixels[i * dstPixelBytes];
+        storeUNorm(dstPixel, 0, dstDepth, (uint16_t)clPixelMathRoundNormalized(srcPixel[0], dstRescale));
+        storeUNorm(dstPixel, 1, dstDepth, (uint16_t)clPixelMathRoundNormalized(srcPixel[1], dstRescale));
+        storeUNorm(dstPixel, 2, dstDepth, (uint16_t)clPixelMathRoundNormalized(srcPixel[2], dstRescale));
+        if (DST_UNORM_HAS_ALPHA()) {
             if (SRC_FLOAT_HAS_ALPHA()) {
                 // reformat alpha
-                dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(srcPixel[3], dstRescale);
+                storeUNorm(dstPixel, 3, dstDepth, (uint16_t)clPixelMathRoundNormalized(srcPixel[3], dstRescale));
             } else {
                 // RGB -> RGBA, set full opacity
-                dstPixel[3] = (uint16_t)dstMaxChannel;
+                storeUNorm(dstPixel, 3, dstDepth, (uint16_t)dstMaxChannel);
             }
         }
     }
@@ -677,15 +857,15 @@ static void reformatRGBToFloat(struct clContext * C, uint8_t * srcPixels, int sr
     const float srcRescale = 1.0f / (float)srcMaxChannel;
 
     for (int i = 0; i < pixelCount; ++i) {
-        uint16_t * srcPixel = (uint16_t *)&srcPixels[i * srcPixelBytes];
+        uint8_t * srcPixel = &srcPixels[i * srcPixelBytes];
         float * dstPixel = (float *)&dstPixels[i * dstPixelBytes];
-        dstPixel[0] = (float)srcPixel[0] * srcRescale;
-        dstPixel[1] = (float)srcPixel[1] * srcRescale;
-        dstPixel[2] = (float)srcPixel[2] * srcRescale;
+        dstPixel[0] = (float)loadUNorm(srcPixel, 0, srcDepth) * srcRescale;
+        dstPixel[1] = (float)loadUNorm(srcPixel, 1, srcDepth) * srcRescale;
+        dstPixel[2] = (float)loadUNorm(srcPixel, 2, srcDepth) * srcRescale;
         if (DST_FLOAT_HAS_ALPHA()) {
-            if (SRC_16_HAS_ALPHA()) {
+            if (SRC_UNORM_HAS_ALPHA()) {
                 // reformat alpha
-                dstPixel[3] = (float)srcPixel[3] * srcRescale;
+                dstPixel[3] = (float)loadUNorm(srcPixel, 3, srcDepth) * srcRescale;
             } else {
                 // RGB -> RGBA, set full opacity
                 dstPixel[3] = 1.0f;
@@ -704,18 +884,24 @@ static void reformatRGBToRGB(struct clContext * C, uint8_t * srcPixels, int srcP
     const float dstRescale = (float)dstMaxChannel;
     const float rescale = srcRescale * dstRescale;
 
+    if ((srcDepth == dstDepth) && (srcPixelBytes == dstPixelBytes)) {
+        // Same layout, nothing to rescale
+        memcpy(dstPixels, srcPixels, (size_t)pixelCount * dstPixelBytes);
+        return;
+    }
+
     for (int i = 0; i < pixelCount; ++i) {
-        uint16_t * srcPixel = (uint16_t *)&srcPixels[i * srcPixelBytes];
-        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
-        dstPixel[0] = (uint16_t)((float)srcPixel[0] * rescale);
-        dstPixel[1] = (uint16_t)((float)srcPixel[1] * rescale);
-        dstPixel[2] = (uint16_t)((float)srcPixel[2] * rescale);
-        if (DST_16_HAS_ALPHA()) {
-            if (SRC_16_HAS_ALPHA()) {
-                dstPixel[3] = (uint16_t)((float)srcPixel[3] * rescale);
+        uint8_t * srcPixel = &srcPixels[i * srcPixelBytes];
+        uint8_t * dstPixel = &dstPixels[i * dstPixelBytes];
+        storeUNorm(dstPixel, 0, dstDepth, (uint16_t)((float)loadUNorm(srcPixel, 0, srcDepth) * rescale));
+        storeUNorm(dstPixel, 1, dstDepth, (uint16_t)((float)loadUNorm(srcPixel, 1, srcDepth) * rescale));
+        storeUNorm(dstPixel, 2, dstDepth, (uint16_t)((float)loadUNorm(srcPixel, 2, srcDepth) * rescale));
+        if (DST_UNORM_HAS_ALPHA()) {
+            if (SRC_UNORM_HAS_ALPHA()) {
+                storeUNorm(dstPixel, 3, dstDepth, (uint16_t)((float)loadUNorm(srcPixel, 3, srcDepth) * rescale));
             } else {
                 // RGB -> RGBA, set full opacity
-                dstPixel[3] = (uint16_t)dstMaxChannel;
+                storeUNorm(dstPixel, 3, dstDepth, (uint16_t)dstMaxChannel);
             }
         }
     }
@@ -751,15 +937,7 @@ static void clCCMMTransform(struct clContext * C, struct clTransform * transform
     } else {
         // Color conversion is required
 
-        if (clTransformFormatIsFloat(C, transform->srcFormat, srcDepth) && clTransformFormatIsFloat(C, transform->dstFormat, dstDepth)) {
-            transformFloatToFloat(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, pixelCount);
-        } else if (clTransformFormatIsFloat(C, transform->srcFormat, srcDepth)) {
-            transformFloatToRGB(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, dstDepth, pixelCount);
-        } else if (clTransformFormatIsFloat(C, transform->dstFormat, dstDepth)) {
-            transformRGBToFloat(C, transform, useCCMM, srcPixels, srcPixelBytes, srcDepth, dstPixels, dstPixelBytes, pixelCount);
-        } else {
-            transformRGBToRGB(C, transform, useCCMM, srcPixels, srcPixelBytes, srcDepth, dstPixels, dstPixelBytes, dstDepth, pixelCount);
-        }
+        transformPixels(C, transform, useCCMM, srcPixels, srcPixelBytes, srcDepth, dstPixels, dstPixelBytes, dstDepth, pixelCount);
     }
 }
 
@@ -834,7 +1012,12 @@ clTransform * clTransformCreate(struct clContext * C, struct clProfile * srcProf
     transform->srcDepth = srcDepth;
     transform->dstDepth = dstDepth;
     transform->tonemap = tonemap;
+    transform->kernels = clTransformKernelsBest();
+    transform->plan = CL_XPLAN_LUMINANCE; // until clTransformPrepare() compiles a plan
+    transform->planUsesCCMM = clFalse;
 
+    transform->ccmmSrcEOTFTable = NULL;
+    transform->ccmmDstOETFTable = NULL;
     transform->ccmmReady = clFalse;
 
     transform->lcmsXYZProfile = NULL;
@@ -847,6 +1030,12 @@ clTransform * clTransformCreate(struct clContext * C, struct clProfile * srcProf
 
 void clTransformDestroy(struct clContext * C, clTransform * transform)
 {
+    if (transform->ccmmSrcEOTFTable) {
+        clFree(transform->ccmmSrcEOTFTable);
+    }
+    if (transform->ccmmDstOETFTable) {
+        clFree(transform->ccmmDstOETFTable);
+    }
     if (transform->lcmsSrcToXYZ) {
         cmsDeleteTransform(transform->lcmsSrcToXYZ);
     }
@@ -902,13 +1091,13 @@ int clTransformFormatToPixelBytes(struct clContext * C, clTransformFormat format
             if (depth == 32)
                 return sizeof(float) * 3;
             else
-                return sizeof(uint16_t) * 3;
+                return UNORM_CHANNEL_BYTES(depth) * 3;
 
         case CL_XF_RGBA:
             if (depth == 32)
                 return sizeof(float) * 4;
             else
-                return sizeof(uint16_t) * 4;
+                return UNORM_CHANNEL_BYTES(depth) * 4;
     }
 
     COLORIST_FAILURE("clTransformFormatToPixelBytes: Unknown transform format");
@@ -938,74 +1127,56 @@ float clTransformGetLuminanceScale(struct clContext * C, clTransform * transform
     return transform->srcLuminanceScale / transform->dstLuminanceScale * transform->srcCurveScale / transform->dstCurveScale;
 }
 
+// Pixels per clTaskParallelFor() chunk: small enough for idle threads to steal evenly, large enough
+// that pool bookkeeping never shows up next to the span math. Smaller transforms just run inline.
+#define CL_TRANSFORM_TASK_CHUNK_SIZE (CL_TRANSFORM_SPAN_SIZE * 16)
+
 typedef struct clTransformTask
 {
     clContext * C;
     clTransform * transform;
-    void * inPixels;
-    void * outPixels;
-    int pixelCount;
+    uint8_t * inPixels;
+    uint8_t * outPixels;
+    int srcPixelBytes;
+    int dstPixelBytes;
     clBool useCCMM;
 } clTransformTask;
 
-static void transformTaskFunc(clTransformTask * info)
+static void transformTaskFunc(void * userData, int start, int end)
+{
+    clTransformTask * info = (clTransformTask *)userData;
+    clCCMMTransform(info->C, info->transform, info->useCCMM, info->inPixels + ((size_t)start * info->srcPixelBytes), info->outPixels + ((size_t)start * info->dstPixelBytes), end - start);
+}
+
+void clTransformRunPrepared(struct clContext * C, clTransform * transform, void * srcPixels, void * dstPixels, int pixelCount)
 {
-    clCCMMTransform(info->C, info->transform, info->useCCMM, info->inPixels, info->outPixels, info->pixelCount);
+    COLORIST_ASSERT(clTransformUsesCCMM(C, transform) ? transform->ccmmReady : transform->lcmsReady);
+    clCCMMTransform(C, transform, clTransformUsesCCMM(C, transform), srcPixels, dstPixels, pixelCount);
 }
 
 void clTransformRun(struct clContext * C, clTransform * transform, int taskCount, void * srcPixels, void * dstPixels, int pixelCount)
 {
-    int srcPixelBytes = clTransformFormatToPixelBytes(C, transform->srcFormat, transform->srcDepth);
-    int dstPixelBytes = clTransformFormatToPixelBytes(C, transform->dstFormat, transform->dstDepth);
-    clBool useCCMM = clTransformUsesCCMM(C, transform);
+    clTransformTask info;
+    int chunkCount = (pixelCount + CL_TRANSFORM_TASK_CHUNK_SIZE - 1) / CL_TRANSFORM_TASK_CHUNK_SIZE;
 
     clTransformPrepare(C, transform);
 
-    if (taskCount > pixelCount) {
-        // This is a dumb corner case I'm not too worried about.
-        taskCount = pixelCount;
+    info.C = C;
+    info.transform = transform;
+    info.inPixels = (uint8_t *)srcPixels;
+    info.outPixels = (uint8_t *)dstPixels;
+    info.srcPixelBytes = clTransformFormatToPixelBytes(C, transform->srcFormat, transform->srcDepth);
+    info.dstPixelBytes = clTransformFormatToPixelBytes(C, transform->dstFormat, transform->dstDepth);
+    info.useCCMM = clTransformUsesCCMM(C, transform);
+
+    if (taskCount > chunkCount) {
+        // No point in waking up threads that would have nothing to do
+        taskCount = chunkCount;
     }
 
     if (taskCount > 1) {
-        clContextLog(C, "convert", 1, "Using %d threads to pixel transform.", taskCount);
-    }
-
-    if (taskCount == 1) {
-        // Don't bother making any new threads
-        clTransformTask info;
-        info.C = C;
-        info.transform = transform;
-        info.inPixels = srcPixels;
-        info.outPixels = dstPixels;
-        info.pixelCount = pixelCount;
-        info.useCCMM = useCCMM;
-        transformTaskFunc(&info);
-    } else {
-        uint8_t * uSrcPixels = (uint8_t *)srcPixels;
-        uint8_t * uDstPixels = (uint8_t *)dstPixels;
-        int pixelsPerTask = pixelCount / taskCount;
-        int lastTaskPixelCount = pixelCount - (pixelsPerTask * (taskCount - 1));
-        clTask ** tasks;
-        clTransformTask * infos;
-        int i;
-
-        tasks = clAllocate(taskCount * sizeof(clTask *));
-        infos = clAllocate(taskCount * sizeof(clTransformTask));
-        for (i = 0; i < taskCount; ++i) {
-            infos[i].C = C;
-            infos[i].transform = transform;
-            infos[i].inPixels = &uSrcPixels[i * pixelsPerTask * srcPixelBytes];
-            infos[i].outPixels = &uDstPixels[i * pixelsPerTask * dstPixelBytes];
-            infos[i].pixelCount = (i == (taskCount - 1)) ? lastTaskPixelCount : pixelsPerTask;
-            infos[i].useCCMM = useCCMM;
-            tasks[i] = clTaskCreate(C, (clTaskFunc)transformTaskFunc, &infos[i]);
-        }
-
-        for (i = 0; i < taskCount; ++i) {
-            clTaskDestroy(C, tasks[i]);
-        }
-
-        clFree(tasks);
-        clFree(infos);
+        clContextLog(C, "convert", 1, "Using %d threads to pixel transform (%s kernels).", taskCount, transform->kernels->name);
     }
+
+    clTaskParallelFor(C, taskCount, pixelCount, CL_TRANSFORM_TASK_CHUNK_SIZE, transformTaskFunc, &info);
 }
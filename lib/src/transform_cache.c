@@ -0,0 +1,209 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "colorist/transform.h"
+
+#include "colorist/context.h"
+#include "colorist/profile.h"
+
+#include <string.h>
+
+typedef struct clTransformCacheKey
+{
+    uint8_t srcSignature[16]; // all zeros for XYZ
+    uint8_t dstSignature[16]; // all zeros for XYZ
+    clBool srcIsXYZ;
+    clBool dstIsXYZ;
+    clTransformFormat srcFormat;
+    clTransformFormat dstFormat;
+    int srcDepth;
+    int dstDepth;
+    clTonemap tonemap;
+    int defaultLuminance;
+    clBool ccmmAllowed;
+} clTransformCacheKey;
+
+typedef struct clTransformCacheEntry
+{
+    clTransformCacheKey key;
+    clTransform * transform;
+    clProfile * srcProfile; // owned copy, referenced by transform
+    clProfile * dstProfile; // owned copy, referenced by transform
+    int refCount;
+    uint32_t lastUsed;
+} clTransformCacheEntry;
+
+typedef struct clTransformCache
+{
+    clTransformCacheEntry entries[CL_TRANSFORM_CACHE_SIZE];
+    int count;
+    uint32_t clock;
+    int hits;
+    int misses;
+} clTransformCache;
+
+static clBool profileHasSignature(clProfile * profile)
+{
+    for (int i = 0; i < 16; ++i) {
+        if (profile->signature[i] != 0) {
+            return clTrue;
+        }
+    }
+    return clFalse;
+}
+
+static clBool keysMatch(const clTransformCacheKey * a, const clTransformCacheKey * b)
+{
+    return !memcmp(a->srcSignature, b->srcSignature, 16) && !memcmp(a->dstSignature, b->dstSignature, 16) && (a->srcIsXYZ == b->srcIsXYZ) &&
+           (a->dstIsXYZ == b->dstIsXYZ) && (a->srcFormat == b->srcFormat) && (a->dstFormat == b->dstFormat) && (a->srcDepth == b->srcDepth) &&
+           (a->dstDepth == b->dstDepth) && (a->tonemap == b->tonemap) && (a->defaultLuminance == b->defaultLuminance) &&
+           (a->ccmmAllowed == b->ccmmAllowed);
+}
+
+static void destroyEntry(struct clContext * C, clTransformCacheEntry * entry)
+{
+    clTransformDestroy(C, entry->transform);
+    if (entry->srcProfile) {
+        clProfileDestroy(C, entry->srcProfile);
+    }
+    if (entry->dstProfile) {
+        clProfileDestroy(C, entry->dstProfile);
+    }
+}
+
+// Returns the index of the least recently used entry that nobody is holding, or -1
+static int findEvictable(clTransformCache * cache)
+{
+    int victim = -1;
+    for (int i = 0; i < cache->count; ++i) {
+        clTransformCacheEntry * entry = &cache->entries[i];
+        if ((entry->refCount == 0) && ((victim < 0) || (entry->lastUsed < cache->entries[victim].lastUsed))) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+clTransform * clTransformAcquire(struct clContext * C, struct clProfile * srcProfile, clTransformFormat srcFormat, int srcDepth, struct clProfile * dstProfile, clTransformFormat dstFormat, int dstDepth, clTonemap tonemap)
+{
+    clTransformCache * cache = C->transformCache;
+    clTransformCacheKey key;
+    clTransformCacheEntry * entry;
+    clTransform * transform;
+    int i;
+
+    if ((srcProfile && !profileHasSignature(srcProfile)) || (dstProfile && !profileHasSignature(dstProfile))) {
+        // Can't tell this profile apart from any other; build a private transform
+        transform = clTransformCreate(C, srcProfile, srcFormat, srcDepth, dstProfile, dstFormat, dstDepth, tonemap);
+        clTransformPrepare(C, transform);
+        return transform;
+    }
+
+    if (!cache) {
+        cache = clAllocateStruct(clTransformCache);
+        cache->count = 0;
+        cache->clock = 0;
+        cache->hits = 0;
+        cache->misses = 0;
+        C->transformCache = cache;
+    }
+
+    memset(&key, 0, sizeof(key));
+    if (srcProfile) {
+        memcpy(key.srcSignature, srcProfile->signature, 16);
+    }
+    if (dstProfile) {
+        memcpy(key.dstSignature, dstProfile->signature, 16);
+    }
+    key.srcIsXYZ = srcProfile ? clFalse : clTrue;
+    key.dstIsXYZ = dstProfile ? clFalse : clTrue;
+    key.srcFormat = srcFormat;
+    key.dstFormat = dstFormat;
+    key.srcDepth = srcDepth;
+    key.dstDepth = dstDepth;
+    key.tonemap = tonemap;
+    key.defaultLuminance = C->defaultLuminance;
+    key.ccmmAllowed = C->ccmmAllowed;
+
+    for (i = 0; i < cache->count; ++i) {
+        entry = &cache->entries[i];
+        if (keysMatch(&entry->key, &key)) {
+            ++entry->refCount;
+            entry->lastUsed = ++cache->clock;
+            ++cache->hits;
+            if (C->verbose) {
+                clContextLog(C, "transform", 1, "Transform cache hit (%d hits, %d misses)", cache->hits, cache->misses);
+            }
+            return entry->transform;
+        }
+    }
+
+    ++cache->misses;
+    if (C->verbose) {
+        clContextLog(C, "transform", 1, "Transform cache miss (%d hits, %d misses)", cache->hits, cache->misses);
+    }
+
+    clProfile * srcCopy = srcProfile ? clProfileClone(C, srcProfile) : NULL;
+    clProfile * dstCopy = dstProfile ? clProfileClone(C, dstProfile) : NULL;
+    int slot = cache->count;
+    if (slot == CL_TRANSFORM_CACHE_SIZE) {
+        slot = findEvictable(cache); // -1 if every cached transform is in use
+    }
+    if ((srcProfile && !srcCopy) || (dstProfile && !dstCopy) || (slot < 0)) {
+        if (srcCopy) {
+            clProfileDestroy(C, srcCopy);
+        }
+        if (dstCopy) {
+            clProfileDestroy(C, dstCopy);
+        }
+        transform = clTransformCreate(C, srcProfile, srcFormat, srcDepth, dstProfile, dstFormat, dstDepth, tonemap);
+        clTransformPrepare(C, transform);
+        return transform;
+    }
+
+    entry = &cache->entries[slot];
+    if (slot == cache->count) {
+        ++cache->count;
+    } else {
+        destroyEntry(C, entry);
+    }
+    entry->key = key;
+    entry->srcProfile = srcCopy;
+    entry->dstProfile = dstCopy;
+    entry->transform = clTransformCreate(C, srcCopy, srcFormat, srcDepth, dstCopy, dstFormat, dstDepth, tonemap);
+    entry->refCount = 1;
+    entry->lastUsed = ++cache->clock;
+    clTransformPrepare(C, entry->transform);
+    return entry->transform;
+}
+
+void clTransformRelease(struct clContext * C, clTransform * transform)
+{
+    clTransformCache * cache = C->transformCache;
+    if (cache) {
+        for (int i = 0; i < cache->count; ++i) {
+            clTransformCacheEntry * entry = &cache->entries[i];
+            if (entry->transform == transform) {
+                COLORIST_ASSERT(entry->refCount > 0);
+                --entry->refCount;
+                return;
+            }
+        }
+    }
+
+    // Never made it into the cache
+    clTransformDestroy(C, transform);
+}
+
+void clTransformCacheDestroy(struct clContext * C, clTransformCache * cache)
+{
+    for (int i = 0; i < cache->count; ++i) {
+        COLORIST_ASSERT(cache->entries[i].refCount == 0);
+        destroyEntry(C, &cache->entries[i]);
+    }
+    clFree(cache);
+}
@@ -0,0 +1,522 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "colorist/transform.h"
+
+#include "colorist/pixelmath.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLORIST_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define CL_TARGET_SSE41
+#define CL_TARGET_AVX2
+#else
+#define CL_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define CL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// ----------------------------------------------------------------------------
+// Scalar kernels (also used for the tail end of every SIMD span)
+
+static void unpackFloatPixels(clTransformSpan * span, const float * src, int srcChannels, int start, int count)
+{
+    for (int i = start; i < count; ++i) {
+        const float * srcPixel = &src[i * srcChannels];
+        span->ch[0][i] = srcPixel[0];
+        span->ch[1][i] = srcPixel[1];
+        span->ch[2][i] = srcPixel[2];
+        span->ch[3][i] = (srcChannels > 3) ? srcPixel[3] : 1.0f; // RGB -> RGBA, set full opacity
+    }
+}
+
+static void unpackUNormPixels(clTransformSpan * span, const uint16_t * src, int srcChannels, float srcRescale, int start, int count)
+{
+    for (int i = start; i < count; ++i) {
+        const uint16_t * srcPixel = &src[i * srcChannels];
+        span->ch[0][i] = (float)srcPixel[0] * srcRescale;
+        span->ch[1][i] = (float)srcPixel[1] * srcRescale;
+        span->ch[2][i] = (float)srcPixel[2] * srcRescale;
+        span->ch[3][i] = (srcChannels > 3) ? (float)srcPixel[3] * srcRescale : 1.0f; // RGB -> RGBA, set full opacity
+    }
+}
+
+static void packFloatPixels(float * dst, int dstChannels, const clTransformSpan * span, int start, int count)
+{
+    for (int i = start; i < count; ++i) {
+        float * dstPixel = &dst[i * dstChannels];
+        dstPixel[0] = span->ch[0][i];
+        dstPixel[1] = span->ch[1][i];
+        dstPixel[2] = span->ch[2][i];
+        if (dstChannels > 3) {
+            dstPixel[3] = span->ch[3][i];
+        }
+    }
+}
+
+static void packUNormPixels(uint16_t * dst, int dstChannels, const clTransformSpan * span, float dstRescale, int start, int count)
+{
+    for (int i = start; i < count; ++i) {
+        uint16_t * dstPixel = &dst[i * dstChannels];
+        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(span->ch[0][i], dstRescale);
+        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(span->ch[1][i], dstRescale);
+        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(span->ch[2][i], dstRescale);
+        if (dstChannels > 3) {
+            dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(span->ch[3][i], dstRescale);
+        }
+    }
+}
+
+// Matches gb_mat3_mul_vec3() exactly, including the order of the additions
+static void matrixPixels(clTransformSpan * span, const gbMat3 * m, clBool clamp, int start, int count)
+{
+    const float * e = m->e;
+    float * c0 = span->ch[0];
+    float * c1 = span->ch[1];
+    float * c2 = span->ch[2];
+    for (int i = start; i < count; ++i) {
+        float x = c0[i];
+        float y = c1[i];
+        float z = c2[i];
+        float o0 = e[0] * x + e[1] * y + e[2] * z;
+        float o1 = e[3] * x + e[4] * y + e[5] * z;
+        float o2 = e[6] * x + e[7] * y + e[8] * z;
+        if (clamp) {
+            o0 = CL_CLAMP(o0, 0.0f, 1.0f);
+            o1 = CL_CLAMP(o1, 0.0f, 1.0f);
+            o2 = CL_CLAMP(o2, 0.0f, 1.0f);
+        }
+        c0[i] = o0;
+        c1[i] = o1;
+        c2[i] = o2;
+    }
+}
+
+// v must already be clamped to [0, 1]. Linear interpolation between lutSize + 1 evenly spaced samples.
+static float gammaLUTLookup(const float * lut, int lutSize, float v)
+{
+    float pos = v * (float)lutSize;
+    int index = (int)pos;
+    if (index >= lutSize) {
+        return lut[lutSize];
+    }
+    float t = pos - (float)index;
+    return lut[index] + ((lut[index + 1] - lut[index]) * t);
+}
+
+static void signalErrorsValues(float * src, float * dst, float * squaredLinear, float * squaredG22, const float * gammaLUT, int gammaLUTSize, float scale, int start, int count)
+{
+    for (int i = start; i < count; ++i) {
+        float s = src[i] * scale;
+        float d = dst[i] * scale;
+        s = CL_CLAMP(s, 0.0f, 1.0f);
+        d = CL_CLAMP(d, 0.0f, 1.0f);
+        float diffLinear = d - s;
+        src[i] = gammaLUTLookup(gammaLUT, gammaLUTSize, s);
+        dst[i] = gammaLUTLookup(gammaLUT, gammaLUTSize, d);
+        float diffG22 = dst[i] - src[i];
+        squaredLinear[i] = diffLinear * diffLinear;
+        squaredG22[i] = diffG22 * diffG22;
+    }
+}
+
+static void unpackFloatScalar(clTransformSpan * span, const float * src, int srcChannels, int count)
+{
+    unpackFloatPixels(span, src, srcChannels, 0, count);
+}
+
+static void unpackUNormScalar(clTransformSpan * span, const uint16_t * src, int srcChannels, float srcRescale, int count)
+{
+    unpackUNormPixels(span, src, srcChannels, srcRescale, 0, count);
+}
+
+static void packFloatScalar(float * dst, int dstChannels, const clTransformSpan * span, int count)
+{
+    packFloatPixels(dst, dstChannels, span, 0, count);
+}
+
+static void packUNormScalar(uint16_t * dst, int dstChannels, const clTransformSpan * span, float dstRescale, int count)
+{
+    packUNormPixels(dst, dstChannels, span, dstRescale, 0, count);
+}
+
+static void matrixScalar(clTransformSpan * span, const gbMat3 * m, clBool clamp, int count)
+{
+    matrixPixels(span, m, clamp, 0, count);
+}
+
+static void signalErrorsScalar(float * src, float * dst, float * squaredLinear, float * squaredG22, const float * gammaLUT, int gammaLUTSize, float scale, int count)
+{
+    signalErrorsValues(src, dst, squaredLinear, squaredG22, gammaLUT, gammaLUTSize, scale, 0, count);
+}
+
+static const clTransformKernels scalarKernels = {
+    "scalar",
+    unpackFloatScalar,
+    unpackUNormScalar,
+    packFloatScalar,
+    packUNormScalar,
+    matrixScalar,
+    signalErrorsScalar
+};
+
+#if defined(COLORIST_X86)
+
+// ----------------------------------------------------------------------------
+// SSE4.1 kernels
+//
+// Only RGBA (4 channel) pixels are vectorized; RGB/XYZ spans take the scalar path.
+// The clamp is written as min(1, max(0, v)) so that NaNs pass through exactly like CL_CLAMP().
+
+CL_TARGET_SSE41 static void unpackFloatSSE41(clTransformSpan * span, const float * src, int srcChannels, int count)
+{
+    int i = 0;
+    if (srcChannels == 4) {
+        for (; i + 4 <= count; i += 4) {
+            __m128 p0 = _mm_loadu_ps(&src[(i + 0) * 4]);
+            __m128 p1 = _mm_loadu_ps(&src[(i + 1) * 4]);
+            __m128 p2 = _mm_loadu_ps(&src[(i + 2) * 4]);
+            __m128 p3 = _mm_loadu_ps(&src[(i + 3) * 4]);
+            _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+            _mm_storeu_ps(&span->ch[0][i], p0);
+            _mm_storeu_ps(&span->ch[1][i], p1);
+            _mm_storeu_ps(&span->ch[2][i], p2);
+            _mm_storeu_ps(&span->ch[3][i], p3);
+        }
+    }
+    unpackFloatPixels(span, src, srcChannels, i, count);
+}
+
+CL_TARGET_SSE41 static void unpackUNormSSE41(clTransformSpan * span, const uint16_t * src, int srcChannels, float srcRescale, int count)
+{
+    int i = 0;
+    if (srcChannels == 4) {
+        const __m128 rescale = _mm_set1_ps(srcRescale);
+        for (; i + 4 <= count; i += 4) {
+            __m128i p01 = _mm_loadu_si128((const __m128i *)&src[(i + 0) * 4]);
+            __m128i p23 = _mm_loadu_si128((const __m128i *)&src[(i + 2) * 4]);
+            __m128 p0 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(p01)), rescale);
+            __m128 p1 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(p01, 8))), rescale);
+            __m128 p2 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(p23)), rescale);
+            __m128 p3 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(p23, 8))), rescale);
+            _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+            _mm_storeu_ps(&span->ch[0][i], p0);
+            _mm_storeu_ps(&span->ch[1][i], p1);
+            _mm_storeu_ps(&span->ch[2][i], p2);
+            _mm_storeu_ps(&span->ch[3][i], p3);
+        }
+    }
+    unpackUNormPixels(span, src, srcChannels, srcRescale, i, count);
+}
+
+CL_TARGET_SSE41 static void packFloatSSE41(float * dst, int dstChannels, const clTransformSpan * span, int count)
+{
+    int i = 0;
+    if (dstChannels == 4) {
+        for (; i + 4 <= count; i += 4) {
+            __m128 p0 = _mm_loadu_ps(&span->ch[0][i]);
+            __m128 p1 = _mm_loadu_ps(&span->ch[1][i]);
+            __m128 p2 = _mm_loadu_ps(&span->ch[2][i]);
+            __m128 p3 = _mm_loadu_ps(&span->ch[3][i]);
+            _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+            _mm_storeu_ps(&dst[(i + 0) * 4], p0);
+            _mm_storeu_ps(&dst[(i + 1) * 4], p1);
+            _mm_storeu_ps(&dst[(i + 2) * 4], p2);
+            _mm_storeu_ps(&dst[(i + 3) * 4], p3);
+        }
+    }
+    packFloatPixels(dst, dstChannels, span, i, count);
+}
+
+CL_TARGET_SSE41 static __m128 roundNormalizedSSE41(__m128 v, __m128 rescale)
+{
+    // Same as clPixelMathRoundNormalized(): clamp, scale, floor(v + 0.5)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    v = _mm_min_ps(one, _mm_max_ps(zero, v));
+    return _mm_floor_ps(_mm_add_ps(_mm_mul_ps(v, rescale), half));
+}
+
+CL_TARGET_SSE41 static void packUNormSSE41(uint16_t * dst, int dstChannels, const clTransformSpan * span, float dstRescale, int count)
+{
+    int i = 0;
+    if (dstChannels == 4) {
+        const __m128 rescale = _mm_set1_ps(dstRescale);
+        for (; i + 4 <= count; i += 4) {
+            __m128 p0 = roundNormalizedSSE41(_mm_loadu_ps(&span->ch[0][i]), rescale);
+            __m128 p1 = roundNormalizedSSE41(_mm_loadu_ps(&span->ch[1][i]), rescale);
+            __m128 p2 = roundNormalizedSSE41(_mm_loadu_ps(&span->ch[2][i]), rescale);
+            __m128 p3 = roundNormalizedSSE41(_mm_loadu_ps(&span->ch[3][i]), rescale);
+            _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+            __m128i p01 = _mm_packus_epi32(_mm_cvttps_epi32(p0), _mm_cvttps_epi32(p1));
+            __m128i p23 = _mm_packus_epi32(_mm_cvttps_epi32(p2), _mm_cvttps_epi32(p3));
+            _mm_storeu_si128((__m128i *)&dst[(i + 0) * 4], p01);
+            _mm_storeu_si128((__m128i *)&dst[(i + 2) * 4], p23);
+        }
+    }
+    packUNormPixels(dst, dstChannels, span, dstRescale, i, count);
+}
+
+CL_TARGET_SSE41 static void matrixSSE41(clTransformSpan * span, const gbMat3 * m, clBool clamp, int count)
+{
+    const __m128 e0 = _mm_set1_ps(m->e[0]);
+    const __m128 e1 = _mm_set1_ps(m->e[1]);
+    const __m128 e2 = _mm_set1_ps(m->e[2]);
+    const __m128 e3 = _mm_set1_ps(m->e[3]);
+    const __m128 e4 = _mm_set1_ps(m->e[4]);
+    const __m128 e5 = _mm_set1_ps(m->e[5]);
+    const __m128 e6 = _mm_set1_ps(m->e[6]);
+    const __m128 e7 = _mm_set1_ps(m->e[7]);
+    const __m128 e8 = _mm_set1_ps(m->e[8]);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    float * c0 = span->ch[0];
+    float * c1 = span->ch[1];
+    float * c2 = span->ch[2];
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(&c0[i]);
+        __m128 y = _mm_loadu_ps(&c1[i]);
+        __m128 z = _mm_loadu_ps(&c2[i]);
+        __m128 o0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, x), _mm_mul_ps(e1, y)), _mm_mul_ps(e2, z));
+        __m128 o1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e3, x), _mm_mul_ps(e4, y)), _mm_mul_ps(e5, z));
+        __m128 o2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e6, x), _mm_mul_ps(e7, y)), _mm_mul_ps(e8, z));
+        if (clamp) {
+            o0 = _mm_min_ps(one, _mm_max_ps(zero, o0));
+            o1 = _mm_min_ps(one, _mm_max_ps(zero, o1));
+            o2 = _mm_min_ps(one, _mm_max_ps(zero, o2));
+        }
+        _mm_storeu_ps(&c0[i], o0);
+        _mm_storeu_ps(&c1[i], o1);
+        _mm_storeu_ps(&c2[i], o2);
+    }
+    matrixPixels(span, m, clamp, i, count);
+}
+
+CL_TARGET_SSE41 static __m128 gammaLUTLookupSSE41(const float * lut, int lutSize, __m128 v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lastIndex = _mm_set1_epi32(lutSize - 1);
+    __m128 pos = _mm_mul_ps(v, _mm_set1_ps((float)lutSize));
+    __m128i index = _mm_cvttps_epi32(pos);
+    __m128 pastEnd = _mm_castsi128_ps(_mm_cmpgt_epi32(index, lastIndex));
+    index = _mm_max_epi32(zero, _mm_min_epi32(index, lastIndex)); // a NaN converts to INT_MIN; keep the loads in bounds
+    __m128 t = _mm_sub_ps(pos, _mm_cvtepi32_ps(index));
+
+    // No gather before AVX2
+    int indices[4];
+    _mm_storeu_si128((__m128i *)indices, index);
+    __m128 a = _mm_setr_ps(lut[indices[0]], lut[indices[1]], lut[indices[2]], lut[indices[3]]);
+    __m128 b = _mm_setr_ps(lut[indices[0] + 1], lut[indices[1] + 1], lut[indices[2] + 1], lut[indices[3] + 1]);
+    __m128 result = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+    return _mm_blendv_ps(result, _mm_set1_ps(lut[lutSize]), pastEnd);
+}
+
+CL_TARGET_SSE41 static void signalErrorsSSE41(float * src, float * dst, float * squaredLinear, float * squaredG22, const float * gammaLUT, int gammaLUTSize, float scale, int count)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scaleV = _mm_set1_ps(scale);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 s = _mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(_mm_loadu_ps(&src[i]), scaleV)));
+        __m128 d = _mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(_mm_loadu_ps(&dst[i]), scaleV)));
+        __m128 diffLinear = _mm_sub_ps(d, s);
+        __m128 sG22 = gammaLUTLookupSSE41(gammaLUT, gammaLUTSize, s);
+        __m128 dG22 = gammaLUTLookupSSE41(gammaLUT, gammaLUTSize, d);
+        __m128 diffG22 = _mm_sub_ps(dG22, sG22);
+        _mm_storeu_ps(&src[i], sG22);
+        _mm_storeu_ps(&dst[i], dG22);
+        _mm_storeu_ps(&squaredLinear[i], _mm_mul_ps(diffLinear, diffLinear));
+        _mm_storeu_ps(&squaredG22[i], _mm_mul_ps(diffG22, diffG22));
+    }
+    signalErrorsValues(src, dst, squaredLinear, squaredG22, gammaLUT, gammaLUTSize, scale, i, count);
+}
+
+static const clTransformKernels sse41Kernels = {
+    "sse4.1",
+    unpackFloatSSE41,
+    unpackUNormSSE41,
+    packFloatSSE41,
+    packUNormSSE41,
+    matrixSSE41,
+    signalErrorsSSE41
+};
+
+// ----------------------------------------------------------------------------
+// AVX2 kernels
+//
+// The (un)pack kernels are memory bound and the 4x4 transposes don't widen cleanly, so they
+// reuse the SSE4.1 versions; only the matrix math and the signal errors (which get a real LUT
+// gather) are widened to 8 values.
+
+CL_TARGET_AVX2 static void matrixAVX2(clTransformSpan * span, const gbMat3 * m, clBool clamp, int count)
+{
+    const __m256 e0 = _mm256_set1_ps(m->e[0]);
+    const __m256 e1 = _mm256_set1_ps(m->e[1]);
+    const __m256 e2 = _mm256_set1_ps(m->e[2]);
+    const __m256 e3 = _mm256_set1_ps(m->e[3]);
+    const __m256 e4 = _mm256_set1_ps(m->e[4]);
+    const __m256 e5 = _mm256_set1_ps(m->e[5]);
+    const __m256 e6 = _mm256_set1_ps(m->e[6]);
+    const __m256 e7 = _mm256_set1_ps(m->e[7]);
+    const __m256 e8 = _mm256_set1_ps(m->e[8]);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    float * c0 = span->ch[0];
+    float * c1 = span->ch[1];
+    float * c2 = span->ch[2];
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_loadu_ps(&c0[i]);
+        __m256 y = _mm256_loadu_ps(&c1[i]);
+        __m256 z = _mm256_loadu_ps(&c2[i]);
+        __m256 o0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, x), _mm256_mul_ps(e1, y)), _mm256_mul_ps(e2, z));
+        __m256 o1 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e3, x), _mm256_mul_ps(e4, y)), _mm256_mul_ps(e5, z));
+        __m256 o2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e6, x), _mm256_mul_ps(e7, y)), _mm256_mul_ps(e8, z));
+        if (clamp) {
+            o0 = _mm256_min_ps(one, _mm256_max_ps(zero, o0));
+            o1 = _mm256_min_ps(one, _mm256_max_ps(zero, o1));
+            o2 = _mm256_min_ps(one, _mm256_max_ps(zero, o2));
+        }
+        _mm256_storeu_ps(&c0[i], o0);
+        _mm256_storeu_ps(&c1[i], o1);
+        _mm256_storeu_ps(&c2[i], o2);
+    }
+    matrixPixels(span, m, clamp, i, count);
+}
+
+CL_TARGET_AVX2 static __m256 gammaLUTLookupAVX2(const float * lut, int lutSize, __m256 v)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lastIndex = _mm256_set1_epi32(lutSize - 1);
+    __m256 pos = _mm256_mul_ps(v, _mm256_set1_ps((float)lutSize));
+    __m256i index = _mm256_cvttps_epi32(pos);
+    __m256 pastEnd = _mm256_castsi256_ps(_mm256_cmpgt_epi32(index, lastIndex));
+    index = _mm256_max_epi32(zero, _mm256_min_epi32(index, lastIndex)); // a NaN converts to INT_MIN; keep the gathers in bounds
+    __m256 t = _mm256_sub_ps(pos, _mm256_cvtepi32_ps(index));
+    __m256 a = _mm256_i32gather_ps(lut, index, 4);
+    __m256 b = _mm256_i32gather_ps(lut + 1, index, 4);
+    __m256 result = _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t));
+    return _mm256_blendv_ps(result, _mm256_set1_ps(lut[lutSize]), pastEnd);
+}
+
+CL_TARGET_AVX2 static void signalErrorsAVX2(float * src, float * dst, float * squaredLinear, float * squaredG22, const float * gammaLUT, int gammaLUTSize, float scale, int count)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scaleV = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 s = _mm256_min_ps(one, _mm256_max_ps(zero, _mm256_mul_ps(_mm256_loadu_ps(&src[i]), scaleV)));
+        __m256 d = _mm256_min_ps(one, _mm256_max_ps(zero, _mm256_mul_ps(_mm256_loadu_ps(&dst[i]), scaleV)));
+        __m256 diffLinear = _mm256_sub_ps(d, s);
+        __m256 sG22 = gammaLUTLookupAVX2(gammaLUT, gammaLUTSize, s);
+        __m256 dG22 = gammaLUTLookupAVX2(gammaLUT, gammaLUTSize, d);
+        __m256 diffG22 = _mm256_sub_ps(dG22, sG22);
+        _mm256_storeu_ps(&src[i], sG22);
+        _mm256_storeu_ps(&dst[i], dG22);
+        _mm256_storeu_ps(&squaredLinear[i], _mm256_mul_ps(diffLinear, diffLinear));
+        _mm256_storeu_ps(&squaredG22[i], _mm256_mul_ps(diffG22, diffG22));
+    }
+    signalErrorsValues(src, dst, squaredLinear, squaredG22, gammaLUT, gammaLUTSize, scale, i, count);
+}
+
+static const clTransformKernels avx2Kernels = {
+    "avx2",
+    unpackFloatSSE41,
+    unpackUNormSSE41,
+    packFloatSSE41,
+    packUNormSSE41,
+    matrixAVX2,
+    signalErrorsAVX2
+};
+
+// ----------------------------------------------------------------------------
+// CPU detection
+
+#if defined(_MSC_VER) && !defined(__clang__)
+static clBool cpuSupports(clTransformSIMD simd)
+{
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    clBool sse41 = (info[2] & (1 << 19)) ? clTrue : clFalse;
+    clBool osxsave = (info[2] & (1 << 27)) ? clTrue : clFalse;
+    switch (simd) {
+        case CL_XSIMD_SSE41:
+            return sse41;
+        case CL_XSIMD_AVX2:
+            if (!sse41 || !osxsave || (maxLeaf < 7) || ((_xgetbv(0) & 6) != 6)) {
+                return clFalse; // the OS must preserve the YMM registers
+            }
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) ? clTrue : clFalse;
+        default:
+            break;
+    }
+    return clFalse;
+}
+#else
+static clBool cpuSupports(clTransformSIMD simd)
+{
+    __builtin_cpu_init();
+    switch (simd) {
+        case CL_XSIMD_SSE41:
+            return __builtin_cpu_supports("sse4.1") ? clTrue : clFalse;
+        case CL_XSIMD_AVX2:
+            return (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("avx2")) ? clTrue : clFalse;
+        default:
+            break;
+    }
+    return clFalse;
+}
+#endif
+
+#endif /* if defined(COLORIST_X86) */
+
+// ----------------------------------------------------------------------------
+// Dispatch
+
+const clTransformKernels * clTransformKernelsGet(clTransformSIMD simd)
+{
+    switch (simd) {
+        case CL_XSIMD_NONE:
+            return &scalarKernels;
+#if defined(COLORIST_X86)
+        case CL_XSIMD_SSE41:
+            return cpuSupports(CL_XSIMD_SSE41) ? &sse41Kernels : NULL;
+        case CL_XSIMD_AVX2:
+            return cpuSupports(CL_XSIMD_AVX2) ? &avx2Kernels : NULL;
+#endif
+        default:
+            break;
+    }
+    return NULL;
+}
+
+const clTransformKernels * clTransformKernelsBest(void)
+{
+    static const clTransformKernels * bestKernels = NULL;
+    if (!bestKernels) {
+        const clTransformKernels * kernels = &scalarKernels;
+        for (int simd = CL_XSIMD_NONE + 1; simd < CL_XSIMD_COUNT; ++simd) {
+            const clTransformKernels * supported = clTransformKernelsGet((clTransformSIMD)simd);
+            if (supported) {
+                kernels = supported;
+            }
+        }
+        bestKernels = kernels;
+    }
+    return bestKernels;
+}